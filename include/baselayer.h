@@ -30,9 +30,10 @@ extern int startwin_idle(void *);
 extern int startwin_run(struct startwin_settings *);
 
 // video
-extern int xres, yres, bpp, fullscreen, bytesperline, imageSize;
+extern int xres, yres, bpp, fullscreen, imageSize;
+extern RENDERTLS int bytesperline;
 extern char offscreenrendering;
-extern intptr_t frameplace;
+extern RENDERTLS intptr_t frameplace;
 
 extern void (*baselayer_onvideomodechange)(int);
 
@@ -183,19 +183,46 @@ typedef struct {
 #define SPREXT_NOTMD 1
 #define SPREXT_NOMDANIM 2
 
+	// Scratch space for the collision functions. clipmove(), pushmove(),
+	// getzrange(), hitscan(), neartag() and cansee() share one of these;
+	// their ...ctx() versions use the one they are given, so threads each
+	// holding their own can make those queries at the same time, provided
+	// no thread is changing the map meanwhile.
+#define MAXCLIPNUM 1024
+typedef struct {
+	struct { int x1, y1, x2, y2; } clipit[MAXCLIPNUM];
+	short clipobjectval[MAXCLIPNUM];
+	short clipsectorlist[MAXCLIPNUM];
+	short clipnum, clipsectnum;
+	short hitwalls[4];
+} clipcontexttype;
+
+	// One ray for hitscanbatch(): the arguments hitscan() takes, and
+	// what it returns through its pointers
+typedef struct {
+	int xs, ys, zs;
+	int vx, vy, vz;
+	unsigned int cliptype;
+	short sectnum;
+	short hitsect, hitwall, hitsprite;
+	int hitx, hity, hitz;
+} hitscanraytype;
+
 EXTERN sectortype sector[MAXSECTORS];
 EXTERN walltype wall[MAXWALLS];
 EXTERN spritetype sprite[MAXSPRITES];
 EXTERN spriteexttype spriteext[MAXSPRITES+MAXUNIQHUDID];
 EXTERN int guniqhudid;
 
-EXTERN int spritesortcnt;
-EXTERN spritetype tsprite[MAXSPRITESONSCREEN];
+EXTERN RENDERTLS int spritesortcnt;
+EXTERN RENDERTLS spritetype tsprite[MAXSPRITESONSCREEN];
 
 //numpages==127 means no persistence. Permanent rotatesprites will be retained until flushed.
 //The initial frame contents will be invalid after each swap.
-EXTERN int xdim, ydim, ylookup[MAXYDIM+1], numpages;
-EXTERN int yxaspect, xyaspect, pixelaspect, widescreen, tallscreen, viewingrange;
+EXTERN RENDERTLS int xdim, ydim, ylookup[MAXYDIM+1];
+EXTERN int numpages;
+EXTERN RENDERTLS int yxaspect, xyaspect, viewingrange;
+EXTERN int pixelaspect, widescreen, tallscreen;
 
 #define MAXVALIDMODES 256
 EXTERN int validmodecnt;
@@ -219,8 +246,8 @@ EXTERN unsigned char parallaxtype, showinvisibility;
 EXTERN int parallaxyoffs, parallaxyscale;
 EXTERN int visibility, parallaxvisibility;
 
-EXTERN int windowx1, windowy1, windowx2, windowy2;
-EXTERN short startumost[MAXXDIM], startdmost[MAXXDIM];
+EXTERN RENDERTLS int windowx1, windowy1, windowx2, windowy2;
+EXTERN RENDERTLS short startumost[MAXXDIM], startdmost[MAXXDIM];
 
 EXTERN short pskyoff[MAXPSKYTILES], pskybits;
 
@@ -253,7 +280,7 @@ EXTERN unsigned char show2dsprite[(MAXSPRITES+7)>>3];
 EXTERN unsigned char automapping;
 
 EXTERN unsigned char gotpic[(MAXTILES+7)>>3];
-EXTERN unsigned char gotsector[(MAXSECTORS+7)>>3];
+EXTERN RENDERTLS unsigned char gotsector[(MAXSECTORS+7)>>3];
 
 EXTERN int captureformat;
 extern unsigned char vgapalette[5*256];
@@ -268,6 +295,13 @@ extern palette_t curpalette[256], curpalettefaded[256], palfadergb;
 extern unsigned char palfadedelta;
 
 extern int dommxoverlay, novoxmips;
+extern int drawthreads;	// classic renderer: 0 = single thread, <0 = one per processor, >1 = thread count
+extern int tilestreaming;	// classic renderer: read tiles missing from the 3D view on another thread, drawing placeholders meanwhile
+extern int mapartfiles;	// loadpics() maps plain ART files into memory and points tiles into them; loadtile() undoes writes to one
+extern int hitscanthreads;	// hitscanbatch(): 0 = single thread, else use drawthreads' threads (one per processor if that is 0 or 1)
+extern int useslopecache;	// the slope functions and hitscan() use a table of each sector's first wall; see updatesectorgeometry()
+extern int usesectorgrid;	// updatesector[z] finds sectors through a grid over their bounding boxes rather than testing them all
+extern int usepvs;	// cansee() and drawrooms() pass over sectors the map's .pvs file says can't be seen
 
 extern int tiletovox[MAXTILES];
 extern int usevoxels, voxscale[MAXVOXELS];
@@ -417,6 +451,22 @@ void   drawmasks(void);
 void   clearview(int dacol);
 void   clearallviews(int dacol);
 void   drawmapview(int dax, int day, int zoome, short ang);
+
+	// A render context is a view drawn into an 8-bit buffer of the caller's,
+	// independent of the screen and of other contexts. setrendercontext()
+	// binds one to the calling thread for drawrooms(), drawmasks(),
+	// drawmapview(), rotatesprite() and the like, so several threads can
+	// each draw their own at the same time. A context stays bound until the
+	// thread binds another or NULL, and must be released that way before
+	// another thread takes it. Threads other than the one that started the
+	// engine only draw tiles which are already in the cache.
+typedef struct rendercontext rendercontext;
+rendercontext *newrendercontext(void *frame, int xdim, int ydim, int bytesperline);
+void   freerendercontext(rendercontext *rc);
+void   setrendercontext(rendercontext *rc);	// NULL selects the screen, or releases off the engine's thread
+void   drawroomsto(rendercontext *rc, int daposx, int daposy, int daposz, short daang, int dahoriz, short dacursectnum);
+void   drawmasksto(rendercontext *rc);
+void   drawmapviewto(rendercontext *rc, int dax, int day, int zoome, short ang);
 void   rotatesprite(int sx, int sy, int z, short a, short picnum, signed char dashade, unsigned char dapalnum, unsigned char dastat, int cx1, int cy1, int cx2, int cy2);
 void   drawline256(int x1, int y1, int x2, int y2, unsigned char col);
 void   printext16(int xpos, int ypos, short col, short backcol, const char *name, char fontsize);
@@ -428,12 +478,28 @@ int   clipinsideboxline(int x, int y, int x1, int y1, int x2, int y2, int walldi
 int   pushmove(int *x, int *y, int *z, short *sectnum, int walldist, int ceildist, int flordist, unsigned int cliptype);
 void   getzrange(int x, int y, int z, short sectnum, int *ceilz, int *ceilhit, int *florz, int *florhit, int walldist, unsigned int cliptype);
 int    hitscan(int xs, int ys, int zs, short sectnum, int vx, int vy, int vz, short *hitsect, short *hitwall, short *hitsprite, int *hitx, int *hity, int *hitz, unsigned int cliptype);
+int    hitscanbatch(hitscanraytype *rays, int numrays);
+void   benchhitscan(int numrays);
 int   neartag(int xs, int ys, int zs, short sectnum, short ange, short *neartagsector, short *neartagwall, short *neartagsprite, int *neartaghitdist, int neartagrange, unsigned char tagsearch);
 int   cansee(int x1, int y1, int z1, short sect1, int x2, int y2, int z2, short sect2);
+int   clipmovectx(int *x, int *y, int *z, short *sectnum, int xvect, int yvect, int walldist, int ceildist, int flordist, unsigned int cliptype, clipcontexttype *ctx);
+int   pushmovectx(int *x, int *y, int *z, short *sectnum, int walldist, int ceildist, int flordist, unsigned int cliptype, clipcontexttype *ctx);
+void   getzrangectx(int x, int y, int z, short sectnum, int *ceilz, int *ceilhit, int *florz, int *florhit, int walldist, unsigned int cliptype, clipcontexttype *ctx);
+int    hitscanctx(int xs, int ys, int zs, short sectnum, int vx, int vy, int vz, short *hitsect, short *hitwall, short *hitsprite, int *hitx, int *hity, int *hitz, unsigned int cliptype, clipcontexttype *ctx);
+int   neartagctx(int xs, int ys, int zs, short sectnum, short ange, short *neartagsector, short *neartagwall, short *neartagsprite, int *neartaghitdist, int neartagrange, unsigned char tagsearch, clipcontexttype *ctx);
+int   canseectx(int x1, int y1, int z1, short sect1, int x2, int y2, int z2, short sect2, clipcontexttype *ctx);
 void   updatesector(int x, int y, short *sectnum);
 void   updatesectorz(int x, int y, int z, short *sectnum);
 int   inside(int x, int y, short sectnum);
 void   dragpoint(short pointhighlight, int dax, int day);
+	// With usesectorgrid or useslopecache, anything moving walls other than
+	// through dragpoint() must pass each sector it changed to
+	// updatesectorgeometry(), or call invalidatemapgeometry() after bulk
+	// changes. Otherwise updatesector[z]() and the slope functions below
+	// work from where the walls were, without warning.
+void   updatesectorgeometry(short sectnum);
+void   invalidatemapgeometry(void);
+void   benchsectorgrid(int lookups);
 void   setfirstwall(short sectnum, short newfirstwall);
 
 void   getmousevalues(int *mousx, int *mousy, int *bstatus);
@@ -443,6 +509,7 @@ int   getangle(int xvect, int yvect);
 void   rotatepoint(int xpivot, int ypivot, int x, int y, short daang, int *x2, int *y2);
 int   lastwall(short point);
 int   nextsectorneighborz(short sectnum, int thez, short topbottom, short direction);
+	// See updatesectorgeometry() when useslopecache is on.
 int   getceilzofslope(short sectnum, int dax, int day);
 int   getflorzofslope(short sectnum, int dax, int day);
 void   getzsofslope(short sectnum, int dax, int day, int *ceilz, int *florz);
@@ -505,12 +572,15 @@ void polymost_glreset(void);
 void polymost_precache_begin(void);
 void polymost_precache(int dapicnum, int dapalnum, int datype);
 int  polymost_precache_run(int* done, int* total);
+int  polymost_texcache_fill(void);	// compresses every hightile replacement into the texture cache, no GL needed
 
 extern int glanisotropy;
 extern int glusetexcompr;
 extern int gltexfiltermode;
 extern int glredbluemode;
 extern int glusetexcache;
+extern int gltexcachesize;
+extern int glusepalettelookup;
 extern int glmultisample, glnvmultisamplehint;
 void gltexapplyprops (void);
 
@@ -11,6 +11,13 @@ void	initcache(void *dacachestart, int dacachesize);
 void	allocache(void **newhandle, int newbytes, unsigned char *newlockptr);
 void	suckcache(void *suckptr);
 void	agecache(void);
+void	benchcache(int allocs);
+
+enum {
+	CACHE1D_CLASSIC = 0,	// scan every block for the cheapest place
+	CACHE1D_SEGREGATED = 1,	// free lists by size, one pass to evict
+};
+extern int cache1dbackend;	// takes effect at the next initcache()
 
 enum {
 	PATHSEARCH_GAME  = 0, 	// default
@@ -37,6 +44,8 @@ int 	klseek(int handle, int offset, int whence);
 int 	kfilelength(int handle);
 int 	ktell(int handle);
 void	kclose(int handle);
+void	benchgroupfiles(int opens);
+void	benchloadfile(const char *filename, int times);
 
 enum {
 	CACHE1D_FIND_FILE = 1,
@@ -262,6 +262,23 @@ static inline float B_SWAPFLOAT(float f) {
 # define PRINTF_FORMAT(stringindex, firstargindex)
 #endif
 
+// Storage class for variables given a separate instance in each thread.
+// Left undefined where the compiler offers no such thing.
+#if defined(_MSC_VER) || defined(__WATCOMC__)
+# define BTHREADLOCAL __declspec(thread)
+#elif defined(__GNUC__)
+# define BTHREADLOCAL __thread
+#endif
+
+// Storage class for the renderer's per-view state, so that each thread
+// drawing a view has its own. The x86 assembly routines address some of
+// that state directly, so it stays shared when they are in use.
+#if defined(BTHREADLOCAL) && !(USE_ASM && (defined(__WATCOMC__) || defined(__i386__) || defined(_M_IX86)))
+# define RENDERTLS BTHREADLOCAL
+#else
+# define RENDERTLS
+#endif
+
 #ifndef min
 # define min(a,b) ( ((a) < (b)) ? (a) : (b) )
 #endif
@@ -433,10 +450,14 @@ char *Bgethomedir(void);
 char *Bgetappdir(void);
 char *Bgetsupportdir(int global);
 size_t Bgetsysmemsize(void);
+int Bgetsyscpucount(void);
 int Bcorrectfilename(char *filename, int removefn);
 int Bcanonicalisefilename(char *filename, int removefn);
 char *Bgetsystemdrives(void);
 boff_t Bfilelength(int fd);
+bssize_t Bpread(int fd, void *buf, bsize_t count, boff_t offset);
+void *Bmapfile(int fd, bsize_t len, bsize_t slack);
+void Bunmapfile(void *addr, bsize_t len, bsize_t slack);
 char *Bstrtoken(char *s, char *delim, char **ptrptr, int chop);
 int Bwildmatch (const char *i, const char *j);
 
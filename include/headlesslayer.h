@@ -0,0 +1,38 @@
+// Headless interface layer
+// for the Build Engine
+// by Jonathon Fowler (jf@jonof.id.au)
+
+#ifndef __build_interface_layer__
+#define __build_interface_layer__ HEADLESS
+
+#include "baselayer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Returns the frame most recently passed to showframe(), which stays
+ * untouched while the next one is drawn.
+ * @param width receives the frame's width, if not NULL
+ * @param height receives the frame's height, if not NULL
+ * @param pitch receives the number of bytes between rows, if not NULL
+ * @param palette receives the frame's 256 RGB palette entries (768 bytes), if not NULL
+ * @return the 8-bit pixels, or NULL if no frame has been shown in the current video mode
+ */
+const unsigned char *headless_getframe(int *width, int *height, int *pitch, unsigned char *palette);
+
+/**
+ * @return the number of frames shown since the video mode was set
+ */
+unsigned int headless_getframecount(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#else
+#if (__build_interface_layer__ != HEADLESS)
+#error "Already using the " __build_interface_layer__ ". Can't now use the headless layer."
+#endif
+#endif // __build_interface_layer__
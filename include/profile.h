@@ -0,0 +1,123 @@
+// Frame stage profiler
+// for the Build Engine
+// by Jonathon Fowler (jf@jonof.id.au)
+
+#ifndef __profile_h__
+#define __profile_h__
+
+#ifndef USE_PROFILER
+#  define USE_PROFILER 0
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The stages the engine times for itself. Games add their own with
+// profile_addstage(). Times are inclusive: scansector() calls made from
+// drawalls() count towards both, as does drawsprite() within drawmasks().
+enum {
+	PROFILE_SCANSECTOR,
+	PROFILE_DRAWALLS,
+	PROFILE_DRAWMASKS,
+	PROFILE_DRAWSPRITE,
+	PROFILE_ROTATESPRITE,
+	PROFILE_SHOWFRAME,
+	PROFILE_ENGINESTAGES
+};
+
+#define PROFILE_MAXSTAGES 16	// including the frame total, which is stage 0 to the queries
+#define PROFILE_FRAMES 256	// frames of history kept
+#define PROFILE_BUCKETS 96	// histogram buckets, four to each doubling of time
+
+typedef struct {
+	const char *name;
+	unsigned int last;	// microseconds in the last frame
+	unsigned int avg;	// average over the history
+	unsigned int p50, p95;	// from the histogram
+	unsigned int max;
+	unsigned int calls;	// times timed in the last frame
+} profilestat;
+
+#if USE_PROFILER
+
+extern volatile int profileactive;
+
+/**
+ * Adds a stage for the application to time.
+ * @param name the name to show and write in the CSV header
+ * @return the stage number, or -1 if there is no more room
+ */
+int profile_addstage(const char *name);
+
+/**
+ * Adds time to a stage's total for the current frame. Safe to call
+ * from any thread.
+ */
+void profile_add(int stage, unsigned int usecs);
+
+/**
+ * Closes the current frame, moving its totals into the history.
+ * nextpage() calls this.
+ */
+void profile_endframe(void);
+
+/**
+ * Starts or stops collecting times. Stopping keeps the history.
+ */
+void profile_setactive(int on);
+
+/**
+ * Forgets the history.
+ */
+void profile_reset(void);
+
+/**
+ * @return the number of stages, counting the frame time as stage 0
+ */
+int profile_numstages(void);
+
+/**
+ * Works out the figures for a stage from the history.
+ * @param stage 0 for the whole frame, otherwise 1 + a stage number
+ * @return 0 on success, -1 for an unknown stage or no history
+ */
+int profile_getstat(int stage, profilestat *st);
+
+/**
+ * Writes the history to a CSV file, one row per frame, oldest first.
+ * @return the number of frames written, or -1 on error
+ */
+int profile_dumpcsv(const char *filename);
+
+	// Times one statement.
+#define PROFILE_TIME(stage, stmt) do { \
+		if (profileactive) { \
+			unsigned int profile_t0_ = getusecticks(); \
+			stmt; \
+			profile_add((stage), getusecticks() - profile_t0_); \
+		} else { stmt; } \
+	} while (0)
+
+	// Times a function body: PROFILE_BEGIN goes last among its declarations
+	// and PROFILE_END before it returns.
+#define PROFILE_BEGIN(t) unsigned int t = profileactive ? getusecticks() : 0
+#define PROFILE_END(stage, t) do { \
+		if (profileactive && (t)) profile_add((stage), getusecticks() - (t)); \
+	} while (0)
+
+#else
+
+#define profile_addstage(name) (-1)
+#define profile_endframe()
+#define PROFILE_TIME(stage, stmt) do { stmt; } while (0)
+#define PROFILE_BEGIN(t) const int t = 0
+#define PROFILE_END(stage, t)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __profile_h__
@@ -0,0 +1,49 @@
+// Worker thread pool
+// for the Build Engine
+// by Jonathon Fowler (jf@jonof.id.au)
+
+#ifndef __threadpool_h__
+#define __threadpool_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*threadpool_func)(void *arg, int index);
+
+/**
+ * Starts the pool's worker threads, restarting them if the pool is
+ * already running with a different number. Waits for any job running.
+ * @param numthreads the number of workers, or <= 0 for one per processor
+ * @return the number of workers running
+ */
+int threadpool_init(int numthreads);
+
+/**
+ * Stops and joins all worker threads.
+ */
+void threadpool_uninit(void);
+
+/**
+ * @return the number of workers running, 0 if the pool is not started
+ */
+int threadpool_size(void);
+
+/**
+ * Calls func(arg, i) for every i from 0 to count-1 on the worker threads
+ * and waits until all calls have returned. The calling thread does no
+ * work of its own, so thread-local state it holds is left untouched.
+ * Jobs started from several threads at once run one after another; a job
+ * must not start another.
+ * @param func the function to run
+ * @param arg passed through to func
+ * @param count the number of calls to make
+ * @return 0 on success, -1 if the pool is not running
+ */
+int threadpool_run(threadpool_func func, void *arg, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __threadpool_h__
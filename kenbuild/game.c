@@ -14,6 +14,7 @@
 #include "kdmsound.h"
 
 #include "baselayer.h"
+#include "profile.h"
 
 #define TIMERINTSPERSECOND 140 //280
 #define MOVESPERSECOND 40
@@ -211,6 +212,7 @@ short brightness = 0;
 static short screensize, screensizeflag = 0;
 static short neartagsector, neartagwall, neartagsprite;
 static int lockclock, neartagdist, neartaghitdist;
+static int profanalyzesprites = -1, profstatuslistcode = -1;
 extern int pageoffset, ydim16;
 static int globhiz, globloz, globhihit, globlohit;
 
@@ -382,6 +384,7 @@ static int osdcmd_map(const osdfuncparm_t *parm) {
     }
 
     prepareboard(namebuf);
+    Bstrcpy(boardfilename, namebuf);
 
     screenpeek = myconnectindex;
 	reccnt = 0;
@@ -396,10 +399,34 @@ static int osdcmd_map(const osdfuncparm_t *parm) {
     return OSDCMD_OK;
 }
 
+static int osdcmd_savedemo(const osdfuncparm_t *parm) {
+    const char *name = "demo.kdm";
+
+    if (parm->numparms > 1) return OSDCMD_SHOWHELP;
+    if (parm->numparms == 1) name = parm->parms[0];
+
+    if (savedemo(name)) {
+        buildprintf("Could not save a demo to %s (nothing recorded?)\n", name);
+        return OSDCMD_OK;
+    }
+    buildprintf("Saved %d moves of %s to %s\n", reccnt, boardfilename, name);
+    return OSDCMD_OK;
+}
+
+static int osdcmd_timedemo(const osdfuncparm_t *parm) {
+    if (parm->numparms < 1 || parm->numparms > 2) return OSDCMD_SHOWHELP;
+
+    if (runtimedemo(parm->parms[0], parm->numparms > 1 ? parm->parms[1] : NULL) == 0)
+        drawscreen(screenpeek,65536L);
+    return OSDCMD_OK;
+}
+
 int app_main(int argc, char const * const argv[])
 {
 	int cmdsetup = 0, i, j, k, l, fil, waitplayers, x1, y1, x2, y2;
 	int other, packleng, netparm = 0, netsuccess = 0;
+	const char *timedemoname = NULL;
+	int cmdtexcache = 0;
     int startretval = STARTWIN_RUN;
     struct startwin_settings settings;
 
@@ -472,6 +499,11 @@ int app_main(int argc, char const * const argv[])
 	OSD_RegisterFunction("restartvid","restartvid: reinitialise the video mode",osdcmd_restartvid);
 	OSD_RegisterFunction("vidmode","vidmode [xdim ydim] [bpp] [fullscreen]: immediately change the video mode",osdcmd_vidmode);
 	OSD_RegisterFunction("map", "map [filename]: load a map", osdcmd_map);
+	OSD_RegisterFunction("savedemo", "savedemo [filename]: save the moves recorded since the map started", osdcmd_savedemo);
+	OSD_RegisterFunction("timedemo", "timedemo filename [csvfile]: replay a demo as fast as possible and report the frame times", osdcmd_timedemo);
+
+	profanalyzesprites = profile_addstage("analyzesprites");
+	profstatuslistcode = profile_addstage("statuslistcode");
 
 	wm_setapptitle("KenBuild by Ken Silverman");
 
@@ -479,6 +511,8 @@ int app_main(int argc, char const * const argv[])
 	for (i=1;i<argc;i++) {
 		if ((!Bstrcasecmp("-net",argv[i])) || (!Bstrcasecmp("/net",argv[i]))) { netparm = i+1; break; }
 		if (!Bstrcasecmp(argv[i], "-setup")) cmdsetup = 1;
+		else if (!Bstrcasecmp(argv[i], "-timedemo") && i+1 < argc) timedemoname = argv[++i];
+		else if (!Bstrcasecmp(argv[i], "-texcache")) cmdtexcache = 1;
 		else {
 			Bstrcpy(boardfilename, argv[i]);
 			if (!Bstrrchr(boardfilename,'.')) Bstrcat(boardfilename,".map");
@@ -494,6 +528,19 @@ int app_main(int argc, char const * const argv[])
 	if ((i = loadsetup("game.cfg")) < 0)
 		buildputs("Configuration file not found, using defaults.\n");
 
+	if (cmdtexcache) {
+			//Compress the hightile replacements into the texture cache, then quit
+#if USE_POLYMOST && USE_OPENGL
+		if (!loaddefinitionsfile("kenbuild.def")) buildputs("Definitions file loaded.\n");
+		polymost_texcache_fill();
+#else
+		buildputs("This build has no OpenGL texture cache to fill.\n");
+#endif
+		uninitengine();
+		uninitgroupfile();
+		return 0;
+	}
+
     memset(&settings, 0, sizeof(settings));
     settings.fullscreen = fullscreen;
     settings.xdim3d = xdimgame;
@@ -688,6 +735,11 @@ int app_main(int argc, char const * const argv[])
 	ready2send = 1;
 	drawscreen(screenpeek,65536L);
 
+	if (timedemoname) {
+		runtimedemo(timedemoname, NULL);
+		keystatus[1] = 1;
+	}
+
 	while (!keystatus[1])       //Main loop starts here
 	{
 		if (handleevents()) {
@@ -2151,6 +2203,7 @@ void tagcode(void)
 			}
 			for(k=1;k<=3;k++)
 				rotatepoint(swingx[i][0],swingy[i][0],swingx[i][k],swingy[i][k],swingang[i],&wall[swingwall[i][k]].x,&wall[swingwall[i][k]].y);
+			updatesectorgeometry(swingsector[i]);
 
 			if (swinganginc[i] != 0)
 			{
@@ -2183,6 +2236,7 @@ void tagcode(void)
 								}
 								for(k=1;k<=3;k++)
 									rotatepoint(swingx[i][0],swingy[i][0],swingx[i][k],swingy[i][k],swingang[i],&wall[swingwall[i][k]].x,&wall[swingwall[i][k]].y);
+								updatesectorgeometry(swingsector[i]);
 								if (swingang[i] == swingangclosed[i])
 								{
 									wsayfollow("closdoor.wav",4096L+(krand()&511)-256,256L,&swingx[i][0],&swingy[i][0],0);
@@ -2234,6 +2288,7 @@ void tagcode(void)
 						if (wall[k].x < subwaytrackx2[i])
 							if (wall[k].y < subwaytracky2[i])
 								wall[k].x += subwayvel[i];
+			updatesectorgeometry(dasector);
 
 			for(j=1;j<subwaynumsectors[i];j++)
 			{
@@ -2243,6 +2298,7 @@ void tagcode(void)
 				endwall = startwall+sector[dasector].wallnum;
 				for(k=startwall;k<endwall;k++)
 					wall[k].x += subwayvel[i];
+				updatesectorgeometry(dasector);
 
 				for(s=headspritesect[dasector];s>=0;s=nextspritesect[s])
 					sprite[s].x += subwayvel[i];
@@ -3821,14 +3877,14 @@ void drawscreen(short snum, int dasmoothratio)
 						sprite[playersprite[snum]].cstat |= 0x8000;
 						drawrooms(cposx,cposy,cposz,cang,choriz,cursectnum[i]);
 						sprite[playersprite[snum]].cstat &= ~0x8000;
-						analyzesprites(cposx,cposy);
+						PROFILE_TIME(profanalyzesprites, analyzesprites(cposx,cposy));
 					}
 					else
 					{
 						sprite[playersprite[i]].cstat |= 0x8000;
 						drawrooms(posx[i],posy[i],posz[i],ang[i],horiz[i],cursectnum[i]);
 						sprite[playersprite[i]].cstat &= ~0x8000;
-						analyzesprites(posx[i],posy[i]);
+						PROFILE_TIME(profanalyzesprites, analyzesprites(posx[i],posy[i]));
 					}
 					drawmasks();
 					if ((numgrabbers[i] > 0) || (nummissiles[i] > 0) || (numbombs[i] > 0))
@@ -3903,7 +3959,7 @@ void drawscreen(short snum, int dasmoothratio)
 				drawrooms(cposx,cposy,(sector[j].floorz<<1)-cposz,cang,201-choriz,j); //SOS
 				//drawrooms(cposx,cposy,cposz,cang,choriz,j+MAXSECTORS); //SOS
 				sprite[playersprite[snum]].cstat &= ~0x8000;
-				analyzesprites(cposx,cposy);
+				PROFILE_TIME(profanalyzesprites, analyzesprites(cposx,cposy));
 				drawmasks();
 
 					//Temp horizon
@@ -3992,7 +4048,7 @@ void drawscreen(short snum, int dasmoothratio)
 						drawrooms(tposx,tposy,cposz,tang,choriz,mirrorsector[i]|MAXSECTORS);
 						for(j=0,tspr=&tsprite[0];j<spritesortcnt;j++,tspr++)
 							if ((tspr->cstat&48) == 0) tspr->cstat |= 4;
-						analyzesprites(tposx,tposy);
+						PROFILE_TIME(profanalyzesprites, analyzesprites(tposx,tposy));
 						drawmasks();
 
 						ptr = palookup[0]; palookup[0] = palookup[17]; palookup[17] = ptr;
@@ -4007,7 +4063,7 @@ void drawscreen(short snum, int dasmoothratio)
 			if (cameradist < 0) sprite[playersprite[snum]].cstat |= 0x8000;
 			drawrooms(cposx,cposy,cposz,cang,choriz,csect);
 			sprite[playersprite[snum]].cstat &= ~0x8000;
-			analyzesprites(cposx,cposy);
+			PROFILE_TIME(profanalyzesprites, analyzesprites(cposx,cposy));
 			drawmasks();
 
 				//Finish for screen rotation
@@ -4506,7 +4562,7 @@ void domovethings(void)
 
 	doanimations();
 	tagcode();            //Door code, moving sector code, other stuff
-	statuslistcode();     //Monster / bullet code / explosions
+	PROFILE_TIME(profstatuslistcode, statuslistcode());     //Monster / bullet code / explosions
 
 	fakedomovethingscorrect();
 
@@ -4808,6 +4864,221 @@ void playback(void)
 	exit(0);
 }
 
+	//Demo files hold the recorded input of a level in recsync[] so that
+	//timedemo() can replay it later.
+#define DEMOVERSION 1
+
+int savedemo(const char *filename)
+{
+	int i, j, k;
+	unsigned char hdr[16], rec[5];
+	char daboardfilename[80];
+	BFILE *fil;
+
+	if (reccnt <= 0) return(-1);
+	if ((fil = Bfopen(filename,"wb")) == 0) return(-1);
+
+	k = min(numplayers,2);
+	memcpy(hdr,"KBDM",4);
+	*(int *)&hdr[4] = B_LITTLE32(DEMOVERSION);
+	*(int *)&hdr[8] = B_LITTLE32(k);
+	*(int *)&hdr[12] = B_LITTLE32(reccnt);
+	Bfwrite(hdr,16,1,fil);
+	Bstrncpy(daboardfilename,boardfilename,80);
+	daboardfilename[79] = 0;
+	Bfwrite(daboardfilename,1,80,fil);
+	for(i=0;i<reccnt;i++)
+		for(j=0;j<k;j++)
+		{
+			rec[0] = recsync[i][j].fvel;
+			rec[1] = recsync[i][j].svel;
+			rec[2] = recsync[i][j].avel;
+			rec[3] = recsync[i][j].bits&255;
+			rec[4] = (recsync[i][j].bits>>8)&255;
+			Bfwrite(rec,5,1,fil);
+		}
+	Bfclose(fil);
+	return(0);
+}
+
+int loaddemo(const char *filename)
+{
+	int i, j, k, n;
+	unsigned char hdr[16], rec[5];
+	char daboardfilename[80];
+	int fil;
+
+	if ((fil = kopen4load((char *)filename,0)) == -1) return(-1);
+
+	if (kread(fil,hdr,16) != 16 || memcmp(hdr,"KBDM",4) ||
+		B_LITTLE32(*(int *)&hdr[4]) != DEMOVERSION ||
+		kread(fil,daboardfilename,80) != 80)
+	{
+		kclose(fil);
+		return(-4);
+	}
+	k = B_LITTLE32(*(int *)&hdr[8]);
+	n = B_LITTLE32(*(int *)&hdr[12]);
+	if (n <= 0 || n > 16384)
+	{
+		kclose(fil);
+		return(-4);
+	}
+	if (k != min(numplayers,2))
+	{
+		kclose(fil);
+		return(-2);
+	}
+	daboardfilename[79] = 0;
+	if ((i = kopen4load(daboardfilename,0)) == -1)
+	{
+		kclose(fil);
+		return(-3);
+	}
+	kclose(i);
+
+	for(i=0;i<n;i++)
+		for(j=0;j<k;j++)
+		{
+			if (kread(fil,rec,5) != 5) { kclose(fil); return(-4); }
+			recsync[i][j].fvel = (signed char)rec[0];
+			recsync[i][j].svel = (signed char)rec[1];
+			recsync[i][j].avel = (signed char)rec[2];
+			recsync[i][j].bits = (short)(rec[3]+(rec[4]<<8));
+		}
+	kclose(fil);
+
+	reccnt = n;
+	Bstrcpy(boardfilename,daboardfilename);
+	return(0);
+}
+
+static int cmpuint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+	return (x > y) - (x < y);
+}
+
+static void timedemostat(const char *name, unsigned int *t, int n)
+{
+	double sum = 0.0;
+	int i;
+
+	for(i=0;i<n;i++) sum += t[i];
+	qsort(t,n,sizeof(unsigned int),cmpuint);
+	buildprintf("  %-6s %8.3f %8.3f %8.3f %8.3f %8.3f\n", name, sum/n/1000.0,
+		t[n/2]/1000.0, t[n*9/10]/1000.0, t[n*99/100]/1000.0, t[n-1]/1000.0);
+}
+
+	//Replays the demo in recsync[] as fast as the machine allows, drawing
+	//one frame for every recorded move, and reports the time taken by the
+	//renderer (drawscreen) and the game simulation (movethings and
+	//domovethings) for each frame. Writes the per-frame times to csvname
+	//if one is given.
+void timedemo(const char *csvname)
+{
+	unsigned int *rendtime, *simtime, *frametime, t0, t1, t2, total;
+	int i, j, k;
+	const char *renderer = "classic";
+	BFILE *fil;
+
+	if (reccnt <= 0) return;
+	rendtime = (unsigned int *)Bmalloc(reccnt*3*sizeof(unsigned int));
+	if (!rendtime) return;
+	simtime = rendtime + reccnt;
+	frametime = simtime + reccnt;
+
+#if USE_POLYMOST
+	if (getrendermode() == 3) renderer = "Polymost OpenGL";
+	else if (getrendermode() > 0) renderer = "Polymost software";
+#endif
+
+	ready2send = 0;
+	recstat = 0;
+	prepareboard(boardfilename);
+	for(i=connecthead;i>=0;i=connectpoint2[i])
+		initplayersprite((short)i);
+	totalclock = ototalclock = lockclock = 0; gotlastpacketclock = 0; nummoves = 0;
+	movefifoplc = fakemovefifoplc = 0;
+	for(i=connecthead;i>=0;i=connectpoint2[i]) movefifoend[i] = 0;
+
+	total = getusecticks();
+	for(i=0;i<reccnt;i++)
+	{
+		if (handleevents()) {
+			if (quitevent) {
+				keystatus[1] = 1;
+				quitevent = 0;
+			}
+		}
+		if (keystatus[1]) break;
+
+		t0 = getusecticks();
+		k = 0;
+		for(j=connecthead;j>=0;j=connectpoint2[j])
+		{
+			copybufbyte(&recsync[i][k],&ffsync[j],sizeof(input));
+			k++;
+		}
+		movethings(); domovethings();
+
+			//The clock follows the moves rather than real time so that
+			//every run draws the same frames.
+		totalclock = ototalclock = lockclock;
+		t1 = getusecticks();
+		drawscreen(screenpeek,65536L);
+		t2 = getusecticks();
+
+		simtime[i] = t1-t0;
+		rendtime[i] = t2-t1;
+		frametime[i] = t2-t0;
+	}
+	total = getusecticks()-total;
+
+	if (csvname && csvname[0] && (fil = Bfopen(csvname,"w")) != 0)
+	{
+		Bfprintf(fil,"frame,render_us,sim_us\n");
+		for(j=0;j<i;j++) Bfprintf(fil,"%d,%u,%u\n",j,rendtime[j],simtime[j]);
+		Bfclose(fil);
+	}
+
+	if (i > 0)
+	{
+		buildprintf("timedemo: %d frames of %s at %dx%d, %s renderer\n",i,boardfilename,xdim,ydim,renderer);
+		buildprintf("  %.3f seconds, %.1f frames per second\n",total/1000000.0,i*1000000.0/max(total,1u));
+		buildprintf("  (ms)        avg      p50      p90      p99      max\n");
+		timedemostat("render",rendtime,i);
+		timedemostat("sim",simtime,i);
+		timedemostat("frame",frametime,i);
+	}
+	if (i < reccnt) buildputs("timedemo: interrupted\n");
+	Bfree(rendtime);
+
+		//Back to a fresh start of the level, recording again.
+	prepareboard(boardfilename);
+	for(i=connecthead;i>=0;i=connectpoint2[i])
+		initplayersprite((short)i);
+	reccnt = 0;
+	recstat = 1;
+	totalclock = ototalclock = lockclock = 0; gotlastpacketclock = 0; nummoves = 0;
+	ready2send = 1;
+}
+
+	//Loads and runs a demo, reporting why if it can't.
+int runtimedemo(const char *filename, const char *csvname)
+{
+	switch (loaddemo(filename))
+	{
+		case 0: break;
+		case -2: buildprintf("%s was recorded with a different number of players\n",filename); return(-1);
+		case -3: buildprintf("The map for %s could not be found\n",filename); return(-1);
+		case -4: buildprintf("%s is not a demo file\n",filename); return(-1);
+		default: buildprintf("Could not open %s\n",filename); return(-1);
+	}
+	timedemo(csvname);
+	return(0);
+}
+
 void setup3dscreen(void)
 {
 	int i, dax, day, dax2, day2;
@@ -35,6 +35,10 @@ void	domovethings(void);
 void	getinput(void);
 void	initplayersprite(short snum);
 void	playback(void);
+int	savedemo(const char *filename);
+int	loaddemo(const char *filename);
+void	timedemo(const char *csvname);
+int	runtimedemo(const char *filename, const char *csvname);
 void	setup3dscreen(void);
 void	findrandomspot(int *x, int *y, short *sectnum);
 void	warp(int *x, int *y, int *z, short *daang, short *dasector);
@@ -8,6 +8,20 @@
 
 #include "compat.h"
 #include "a.h"
+#include "baselayer.h"
+#include "build.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+# define A_C_USING_X64SIMD
+# include <emmintrin.h>
+# include <immintrin.h>
+# ifdef _MSC_VER
+#  include <intrin.h>
+#  define TARGET_AVX2
+# else
+#  define TARGET_AVX2 __attribute__((target("avx2")))
+# endif
+#endif
 
 #ifdef ENGINE_USING_A_C
 
@@ -16,13 +30,63 @@ int krecip(int num);	// from engine.c
 #define BITSOFPRECISION 3
 #define BITSOFPRECISIONPOW 8
 
-extern int asm1, asm2, asm4, fpuasm, globalx3, globaly3;
-extern intptr_t asm3;
-extern void *reciptable;
+extern int fpuasm;
+extern RENDERTLS int asm1, asm2, asm4, globalx3, globaly3;
+extern RENDERTLS intptr_t asm3;
+extern int reciptable[2048];
+extern RENDERTLS int vplce[4], vince[4];
+extern RENDERTLS intptr_t palookupoffse[4], bufplce[4];
+
+static RENDERTLS int bpl;
+static unsigned char *gtrans;
+static RENDERTLS int transmode = 0;
+static RENDERTLS int glogx, glogy, gbxinc, gbyinc, gpinc;
+static RENDERTLS unsigned char *gbuf, *gpal, *ghlinepal;
+static const char *kernelname = "C";	// the set mmxoverlay() picked
+
+#ifdef A_C_USING_X64SIMD
+
+	//A gather reads whole dwords, so each byte is fetched from the aligned
+	//dword holding it, which never touches a page the byte isn't on, and
+	//shifted down. The offsets are from base, and the bytes come back one
+	//to a lane.
+TARGET_AVX2 static __m256i gatherbytes_avx2(const unsigned char *base, __m256i offs)
+{
+	__m256i aoffs;
+
+	aoffs = _mm256_add_epi32(offs, _mm256_set1_epi32((int)((intptr_t)base & 3)));
+	base -= (intptr_t)base & 3;
+	return _mm256_and_si256(_mm256_srlv_epi32(
+		_mm256_i32gather_epi32((int const *)base, _mm256_andnot_si256(_mm256_set1_epi32(3), aoffs), 1),
+		_mm256_slli_epi32(_mm256_and_si256(aoffs, _mm256_set1_epi32(3)), 3)),
+		_mm256_set1_epi32(255));
+}
 
-static int bpl, transmode = 0;
-static int glogx, glogy, gbxinc, gbyinc, gpinc;
-static unsigned char *gbuf, *gpal, *ghlinepal, *gtrans;
+	//Packs the low bytes of the eight lanes into the low quadword.
+TARGET_AVX2 static __m128i packbytes_avx2(__m256i v)
+{
+	v = _mm256_shuffle_epi8(v, _mm256_broadcastsi128_si256(
+		_mm_setr_epi8(0,4,8,12, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1)));
+	return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0,4,0,0,0,0,0,0)));
+}
+
+static int cpuhasavx2(void)
+{
+#ifdef _MSC_VER
+	int regs[4];
+
+	__cpuid(regs, 1);
+	if ((regs[2] & 0x18000000) != 0x18000000) return 0;	// OSXSAVE and AVX
+	if ((_xgetbv(0) & 6) != 6) return 0;	// OS saves the YMM state
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & 0x20) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif	//A_C_USING_X64SIMD
 
 	//Global variable functions
 void setvlinebpl(int dabpl) { bpl = dabpl; }
@@ -36,13 +100,9 @@ void sethlinesizes(int logx, int logy, void *bufplc)
 	{ glogx = logx; glogy = logy; gbuf = (unsigned char *)bufplc; }
 void setpalookupaddress(void *paladdr) { ghlinepal = (unsigned char *)paladdr; }
 void setuphlineasm4(int bxinc, int byinc) { gbxinc = bxinc; gbyinc = byinc; }
-void hlineasm4(int cnt, int skiploadincs, int paloffs, unsigned int by, unsigned int bx, void *p)
-{
-	unsigned char *palptr, *pp;
 
-	palptr = &ghlinepal[paloffs];
-	pp = (unsigned char *)p;
-	if (!skiploadincs) { gbxinc = asm1; gbyinc = asm2; }
+static void hlineasm4_c(int cnt, unsigned char *palptr, unsigned int by, unsigned int bx, unsigned char *pp)
+{
 	for(;cnt>=0;cnt--)
 	{
 		*pp = palptr[gbuf[((bx>>(32-glogx))<<glogy)+(by>>(32-glogy))]];
@@ -52,6 +112,88 @@ void hlineasm4(int cnt, int skiploadincs, int paloffs, unsigned int by, unsigned
 	}
 }
 
+#ifdef A_C_USING_X64SIMD
+
+	//SSE2 works out the texel offsets for four pixels at a time, and
+	//writes them with one store. The span runs right to left, so the
+	//lowest lane holds the leftmost pixel, three steps on from bx.
+static void hlineasm4_sse2(int cnt, unsigned char *palptr, unsigned int by, unsigned int bx, unsigned char *pp)
+{
+	__m128i vbx, vby, xinc, yinc, xshift, yshift, ylog;
+	int idx[4];
+	unsigned int pix;
+
+	if (cnt >= 3)
+	{
+		vbx = _mm_setr_epi32(bx-gbxinc*3, bx-gbxinc*2, bx-gbxinc, bx);
+		vby = _mm_setr_epi32(by-gbyinc*3, by-gbyinc*2, by-gbyinc, by);
+		xinc = _mm_set1_epi32(gbxinc*4);
+		yinc = _mm_set1_epi32(gbyinc*4);
+		xshift = _mm_cvtsi32_si128(32-glogx);
+		yshift = _mm_cvtsi32_si128(32-glogy);
+		ylog = _mm_cvtsi32_si128(glogy);
+		for(;cnt>=3;cnt-=4)
+		{
+			_mm_storeu_si128((__m128i *)idx, _mm_add_epi32(_mm_sll_epi32(_mm_srl_epi32(vbx, xshift), ylog),
+				_mm_srl_epi32(vby, yshift)));
+			pix  = (unsigned int)palptr[gbuf[idx[0]]];
+			pix |= (unsigned int)palptr[gbuf[idx[1]]] << 8;
+			pix |= (unsigned int)palptr[gbuf[idx[2]]] << 16;
+			pix |= (unsigned int)palptr[gbuf[idx[3]]] << 24;
+			Bmemcpy(pp-3, &pix, 4);
+			vbx = _mm_sub_epi32(vbx, xinc);
+			vby = _mm_sub_epi32(vby, yinc);
+			pp -= 4;
+		}
+		bx = (unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(vbx, 12));
+		by = (unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(vby, 12));
+	}
+	hlineasm4_c(cnt, palptr, by, bx, pp);
+}
+
+	//AVX2 does eight pixels at a time, gathering the texels and the
+	//palette entries.
+TARGET_AVX2 static void hlineasm4_avx2(int cnt, unsigned char *palptr, unsigned int by, unsigned int bx, unsigned char *pp)
+{
+	__m256i vbx, vby, steps, xinc, yinc, pix;
+	__m128i xshift, yshift, ylog;
+
+	if (cnt >= 7)
+	{
+		steps = _mm256_setr_epi32(7,6,5,4,3,2,1,0);
+		vbx = _mm256_sub_epi32(_mm256_set1_epi32(bx), _mm256_mullo_epi32(steps, _mm256_set1_epi32(gbxinc)));
+		vby = _mm256_sub_epi32(_mm256_set1_epi32(by), _mm256_mullo_epi32(steps, _mm256_set1_epi32(gbyinc)));
+		xinc = _mm256_set1_epi32(gbxinc*8);
+		yinc = _mm256_set1_epi32(gbyinc*8);
+		xshift = _mm_cvtsi32_si128(32-glogx);
+		yshift = _mm_cvtsi32_si128(32-glogy);
+		ylog = _mm_cvtsi32_si128(glogy);
+		for(;cnt>=7;cnt-=8)
+		{
+			pix = gatherbytes_avx2(gbuf, _mm256_add_epi32(_mm256_sll_epi32(_mm256_srl_epi32(vbx, xshift), ylog),
+				_mm256_srl_epi32(vby, yshift)));
+			pix = gatherbytes_avx2(palptr, pix);
+			_mm_storel_epi64((__m128i *)(pp-7), packbytes_avx2(pix));
+			vbx = _mm256_sub_epi32(vbx, xinc);
+			vby = _mm256_sub_epi32(vby, yinc);
+			pp -= 8;
+		}
+		bx = (unsigned int)_mm256_extract_epi32(vbx, 7);
+		by = (unsigned int)_mm256_extract_epi32(vby, 7);
+	}
+	hlineasm4_c(cnt, palptr, by, bx, pp);
+}
+
+#endif	//A_C_USING_X64SIMD
+
+static void (*hlineasm4func)(int, unsigned char *, unsigned int, unsigned int, unsigned char *) = hlineasm4_c;
+
+void hlineasm4(int cnt, int skiploadincs, int paloffs, unsigned int by, unsigned int bx, void *p)
+{
+	if (!skiploadincs) { gbxinc = asm1; gbyinc = asm2; }
+	hlineasm4func(cnt, &ghlinepal[paloffs], by, bx, (unsigned char *)p);
+}
+
 
 	//Sloped ceiling/floor vertical line functions
 void setupslopevlin(int logylogx, void *bufplc, int pinc)
@@ -59,16 +201,12 @@ void setupslopevlin(int logylogx, void *bufplc, int pinc)
 	glogx = (logylogx&255); glogy = (logylogx>>8);
 	gbuf = (unsigned char *)bufplc; gpinc = pinc;
 }
-void slopevlin(void *p, int i, void *slopaloffs, int cnt, int bx, int by)
+
+static void slopevlin_c(unsigned char *pp, intptr_t *slopalptr, int cnt, int bx, int by, int bz, int bzinc)
 {
-	intptr_t *slopalptr;
-	int bz, bzinc;
+	int i;
 	unsigned int u, v;
-	unsigned char *pp;
 
-	bz = asm3; bzinc = (asm1>>3);
-	slopalptr = (intptr_t *)slopaloffs;
-	pp = (unsigned char *)p;
 	for(;cnt>0;cnt--)
 	{
 		i = krecip(bz>>6); bz += bzinc;
@@ -80,6 +218,67 @@ void slopevlin(void *p, int i, void *slopaloffs, int cnt, int bx, int by)
 	}
 }
 
+#ifdef A_C_USING_X64SIMD
+
+	//krecip() for eight lanes.
+TARGET_AVX2 static __m256i krecip_avx2(__m256i num)
+{
+	__m256i f, r;
+
+	f = _mm256_castps_si256(_mm256_cvtepi32_ps(num));
+	r = _mm256_i32gather_epi32(reciptable, _mm256_and_si256(_mm256_srli_epi32(f, 12), _mm256_set1_epi32(2047)), 4);
+	r = _mm256_srav_epi32(r, _mm256_and_si256(_mm256_srli_epi32(_mm256_sub_epi32(f, _mm256_set1_epi32(0x3f800000)), 23),
+		_mm256_set1_epi32(31)));
+	return _mm256_xor_si256(r, _mm256_srai_epi32(f, 31));
+}
+
+	//Sloped surfaces need a reciprocal per pixel, and that needs shifts
+	//that differ between lanes, so only AVX2 gets a version. It works
+	//out eight texels at a time; each pixel's palette comes from its own
+	//slopalookup entry and the pixels run down a column, so those lookups
+	//and stores stay one at a time.
+TARGET_AVX2 static void slopevlin_avx2(unsigned char *pp, intptr_t *slopalptr, int cnt, int bx, int by, int bz, int bzinc)
+{
+	__m256i vbz, zinc, ri, u, v;
+	__m128i xshift, yshift, ylog;
+	int ch[8], k;
+
+	if (cnt >= 8)
+	{
+		vbz = _mm256_add_epi32(_mm256_set1_epi32(bz), _mm256_mullo_epi32(_mm256_setr_epi32(0,1,2,3,4,5,6,7), _mm256_set1_epi32(bzinc)));
+		zinc = _mm256_set1_epi32(bzinc*8);
+		xshift = _mm_cvtsi32_si128(32-glogx);
+		yshift = _mm_cvtsi32_si128(32-glogy);
+		ylog = _mm_cvtsi32_si128(glogy);
+		for(;cnt>=8;cnt-=8)
+		{
+			ri = krecip_avx2(_mm256_srai_epi32(vbz, 6));
+			u = _mm256_add_epi32(_mm256_set1_epi32(bx), _mm256_mullo_epi32(_mm256_set1_epi32(globalx3), ri));
+			v = _mm256_add_epi32(_mm256_set1_epi32(by), _mm256_mullo_epi32(_mm256_set1_epi32(globaly3), ri));
+			_mm256_storeu_si256((__m256i *)ch, gatherbytes_avx2(gbuf,
+				_mm256_add_epi32(_mm256_sll_epi32(_mm256_srl_epi32(u, xshift), ylog), _mm256_srl_epi32(v, yshift))));
+			for(k=0;k<8;k++)
+			{
+				*pp = *(unsigned char *)(slopalptr[-k]+ch[k]);
+				pp += gpinc;
+			}
+			slopalptr -= 8;
+			vbz = _mm256_add_epi32(vbz, zinc);
+		}
+		bz = _mm_cvtsi128_si32(_mm256_castsi256_si128(vbz));
+	}
+	slopevlin_c(pp, slopalptr, cnt, bx, by, bz, bzinc);
+}
+
+#endif	//A_C_USING_X64SIMD
+
+static void (*slopevlinfunc)(unsigned char *, intptr_t *, int, int, int, int, int) = slopevlin_c;
+
+void slopevlin(void *p, int UNUSED(i), void *slopaloffs, int cnt, int bx, int by)
+{
+	slopevlinfunc((unsigned char *)p, (intptr_t *)slopaloffs, cnt, bx, by, asm3, asm1>>3);
+}
+
 
 	//Wall,face sprite/wall sprite vertical line functions
 void setupvlineasm(int neglogy) { glogy = neglogy; }
@@ -98,8 +297,14 @@ void vlineasm1(int vinc, void *paloffs, int cnt, unsigned int vplc, void *bufplc
 	}
 }
 
+int prevlineasm1(int vinc, void *paloffs, int cnt, unsigned int vplc, void *bufplc, void *p)
+{
+	vlineasm1(vinc, paloffs, cnt, vplc, bufplc, p);
+	return vplc + vinc*(cnt+1);
+}
+
 void setupmvlineasm(int neglogy) { glogy = neglogy; }
-void mvlineasm1(int vinc, void *paloffs, int cnt, unsigned int vplc, void *bufplc, void *p)
+int mvlineasm1(int vinc, void *paloffs, int cnt, unsigned int vplc, void *bufplc, void *p)
 {
 	unsigned char ch, *pp;
 
@@ -112,6 +317,305 @@ void mvlineasm1(int vinc, void *paloffs, int cnt, unsigned int vplc, void *bufpl
 		pp += bpl;
 		vplc += vinc;
 	}
+	return vplc;
+}
+
+
+	//Four adjacent wall columns at a time. The column states come from
+	//vplce[], vince[], palookupoffse[] and bufplce[], and vplce[] is left
+	//pointing past the last row drawn, like the A.ASM versions.
+static void vlineasm4_c(int cnt, void *p)
+{
+	unsigned char *pp, *buf0, *buf1, *buf2, *buf3, *pal0, *pal1, *pal2, *pal3;
+	unsigned int v0, v1, v2, v3;
+
+	buf0 = (unsigned char *)bufplce[0]; pal0 = (unsigned char *)palookupoffse[0]; v0 = vplce[0];
+	buf1 = (unsigned char *)bufplce[1]; pal1 = (unsigned char *)palookupoffse[1]; v1 = vplce[1];
+	buf2 = (unsigned char *)bufplce[2]; pal2 = (unsigned char *)palookupoffse[2]; v2 = vplce[2];
+	buf3 = (unsigned char *)bufplce[3]; pal3 = (unsigned char *)palookupoffse[3]; v3 = vplce[3];
+	pp = (unsigned char *)p;
+	for(;cnt>0;cnt--)
+	{
+		pp[0] = pal0[buf0[v0>>glogy]]; v0 += vince[0];
+		pp[1] = pal1[buf1[v1>>glogy]]; v1 += vince[1];
+		pp[2] = pal2[buf2[v2>>glogy]]; v2 += vince[2];
+		pp[3] = pal3[buf3[v3>>glogy]]; v3 += vince[3];
+		pp += bpl;
+	}
+	vplce[0] = v0; vplce[1] = v1; vplce[2] = v2; vplce[3] = v3;
+}
+
+static void mvlineasm4_c(int cnt, void *p)
+{
+	unsigned char ch, *pp, *buf0, *buf1, *buf2, *buf3, *pal0, *pal1, *pal2, *pal3;
+	unsigned int v0, v1, v2, v3;
+
+	buf0 = (unsigned char *)bufplce[0]; pal0 = (unsigned char *)palookupoffse[0]; v0 = vplce[0];
+	buf1 = (unsigned char *)bufplce[1]; pal1 = (unsigned char *)palookupoffse[1]; v1 = vplce[1];
+	buf2 = (unsigned char *)bufplce[2]; pal2 = (unsigned char *)palookupoffse[2]; v2 = vplce[2];
+	buf3 = (unsigned char *)bufplce[3]; pal3 = (unsigned char *)palookupoffse[3]; v3 = vplce[3];
+	pp = (unsigned char *)p;
+	for(;cnt>0;cnt--)
+	{
+		ch = buf0[v0>>glogy]; if (ch != 255) pp[0] = pal0[ch]; v0 += vince[0];
+		ch = buf1[v1>>glogy]; if (ch != 255) pp[1] = pal1[ch]; v1 += vince[1];
+		ch = buf2[v2>>glogy]; if (ch != 255) pp[2] = pal2[ch]; v2 += vince[2];
+		ch = buf3[v3>>glogy]; if (ch != 255) pp[3] = pal3[ch]; v3 += vince[3];
+		pp += bpl;
+	}
+	vplce[0] = v0; vplce[1] = v1; vplce[2] = v2; vplce[3] = v3;
+}
+
+#ifdef A_C_USING_X64SIMD
+
+	//SSE2 is always there on x86-64: step the four texture coordinates
+	//in one register and write each row of four pixels with one store.
+static void vlineasm4_sse2(int cnt, void *p)
+{
+	unsigned char *pp, *buf0, *buf1, *buf2, *buf3, *pal0, *pal1, *pal2, *pal3;
+	__m128i vplc, vinc, shift, idx;
+	unsigned int pix;
+
+	buf0 = (unsigned char *)bufplce[0]; pal0 = (unsigned char *)palookupoffse[0];
+	buf1 = (unsigned char *)bufplce[1]; pal1 = (unsigned char *)palookupoffse[1];
+	buf2 = (unsigned char *)bufplce[2]; pal2 = (unsigned char *)palookupoffse[2];
+	buf3 = (unsigned char *)bufplce[3]; pal3 = (unsigned char *)palookupoffse[3];
+	vplc = _mm_loadu_si128((__m128i const *)vplce);
+	vinc = _mm_loadu_si128((__m128i const *)vince);
+	shift = _mm_cvtsi32_si128(glogy);
+	pp = (unsigned char *)p;
+	for(;cnt>0;cnt--)
+	{
+		idx = _mm_srl_epi32(vplc, shift);
+		pix  = (unsigned int)pal0[buf0[_mm_cvtsi128_si32(idx)]];
+		pix |= (unsigned int)pal1[buf1[_mm_cvtsi128_si32(_mm_srli_si128(idx, 4))]] << 8;
+		pix |= (unsigned int)pal2[buf2[_mm_cvtsi128_si32(_mm_srli_si128(idx, 8))]] << 16;
+		pix |= (unsigned int)pal3[buf3[_mm_cvtsi128_si32(_mm_srli_si128(idx, 12))]] << 24;
+		Bmemcpy(pp, &pix, 4);
+		vplc = _mm_add_epi32(vplc, vinc);
+		pp += bpl;
+	}
+	_mm_storeu_si128((__m128i *)vplce, vplc);
+}
+
+static void mvlineasm4_sse2(int cnt, void *p)
+{
+	unsigned char *pp, *buf0, *buf1, *buf2, *buf3, *pal0, *pal1, *pal2, *pal3;
+	__m128i vplc, vinc, shift, idx;
+	unsigned int ch, pix, mask;
+
+	buf0 = (unsigned char *)bufplce[0]; pal0 = (unsigned char *)palookupoffse[0];
+	buf1 = (unsigned char *)bufplce[1]; pal1 = (unsigned char *)palookupoffse[1];
+	buf2 = (unsigned char *)bufplce[2]; pal2 = (unsigned char *)palookupoffse[2];
+	buf3 = (unsigned char *)bufplce[3]; pal3 = (unsigned char *)palookupoffse[3];
+	vplc = _mm_loadu_si128((__m128i const *)vplce);
+	vinc = _mm_loadu_si128((__m128i const *)vince);
+	shift = _mm_cvtsi32_si128(glogy);
+	pp = (unsigned char *)p;
+	for(;cnt>0;cnt--)
+	{
+		idx = _mm_srl_epi32(vplc, shift);
+		pix = mask = 0;
+		ch = buf0[_mm_cvtsi128_si32(idx)];
+		if (ch != 255) { pix |= (unsigned int)pal0[ch]; mask |= 0xffu; }
+		ch = buf1[_mm_cvtsi128_si32(_mm_srli_si128(idx, 4))];
+		if (ch != 255) { pix |= (unsigned int)pal1[ch] << 8; mask |= 0xff00u; }
+		ch = buf2[_mm_cvtsi128_si32(_mm_srli_si128(idx, 8))];
+		if (ch != 255) { pix |= (unsigned int)pal2[ch] << 16; mask |= 0xff0000u; }
+		ch = buf3[_mm_cvtsi128_si32(_mm_srli_si128(idx, 12))];
+		if (ch != 255) { pix |= (unsigned int)pal3[ch] << 24; mask |= 0xff000000u; }
+		if (mask == 0xffffffffu) Bmemcpy(pp, &pix, 4);
+		else if (mask)
+		{
+			unsigned int old;
+			Bmemcpy(&old, pp, 4);
+			pix |= old & ~mask;
+			Bmemcpy(pp, &pix, 4);
+		}
+		vplc = _mm_add_epi32(vplc, vinc);
+		pp += bpl;
+	}
+	_mm_storeu_si128((__m128i *)vplce, vplc);
+}
+
+	//AVX2 fetches the texels and palette entries for two rows of all four
+	//columns with one gather each. The columns of a wall all come from the
+	//same tile and palette table, so 32-bit offsets from the first column's
+	//pointers reach every one of them.
+	//Sets up the lane offsets for the gathers: the four columns of a row in
+	//the low half of the register and those of the next row in the high.
+	//Returns 0 when the columns are too far apart for 32-bit offsets.
+TARGET_AVX2 static int setupgathers_avx2(__m256i *boffs, __m256i *poffs, __m256i *vplc, __m256i *vinc)
+{
+	intptr_t b[4], q[4];
+	int z;
+
+	for (z=0; z<4; z++) {
+		b[z] = bufplce[z] - bufplce[0];
+		q[z] = palookupoffse[z] - palookupoffse[0];
+		if (b[z] != (int)b[z] || q[z] != (int)q[z]) return 0;
+	}
+	*boffs = _mm256_setr_epi32((int)b[0], (int)b[1], (int)b[2], (int)b[3], (int)b[0], (int)b[1], (int)b[2], (int)b[3]);
+	*poffs = _mm256_setr_epi32((int)q[0], (int)q[1], (int)q[2], (int)q[3], (int)q[0], (int)q[1], (int)q[2], (int)q[3]);
+	*vinc = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)vince));
+	*vplc = _mm256_add_epi32(_mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)vplce)),
+		_mm256_blend_epi32(_mm256_setzero_si256(), *vinc, 0xf0));
+	*vinc = _mm256_add_epi32(*vinc, *vinc);
+	return 1;
+}
+
+TARGET_AVX2 static void vlineasm4_avx2(int cnt, void *p)
+{
+	unsigned char *pp, *buf, *pal;
+	__m256i boffs, poffs, vplc, vinc, ch, pix, pack;
+	__m128i shift;
+	int out;
+
+	if (!setupgathers_avx2(&boffs, &poffs, &vplc, &vinc)) { vlineasm4_sse2(cnt, p); return; }
+	buf = (unsigned char *)bufplce[0];
+	pal = (unsigned char *)palookupoffse[0];
+	shift = _mm_cvtsi32_si128(glogy);
+	pack = _mm256_broadcastsi128_si256(_mm_setr_epi8(0,4,8,12, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1));
+	pp = (unsigned char *)p;
+	for(;cnt>1;cnt-=2)
+	{
+		ch = gatherbytes_avx2(buf, _mm256_add_epi32(boffs, _mm256_srl_epi32(vplc, shift)));
+		pix = _mm256_shuffle_epi8(gatherbytes_avx2(pal, _mm256_add_epi32(poffs, ch)), pack);
+		out = _mm256_extract_epi32(pix, 0); Bmemcpy(pp, &out, 4);
+		out = _mm256_extract_epi32(pix, 4); Bmemcpy(pp+bpl, &out, 4);
+		vplc = _mm256_add_epi32(vplc, vinc);
+		pp += bpl*2;
+	}
+	_mm_storeu_si128((__m128i *)vplce, _mm256_castsi256_si128(vplc));
+	if (cnt > 0) vlineasm4_sse2(cnt, pp);
+}
+
+TARGET_AVX2 static void mvlineasm4_avx2(int cnt, void *p)
+{
+	unsigned char *pp, *buf, *pal;
+	__m256i boffs, poffs, vplc, vinc, ch, pix, keep, pack;
+	__m128i shift;
+	int out, old;
+
+	if (!setupgathers_avx2(&boffs, &poffs, &vplc, &vinc)) { mvlineasm4_sse2(cnt, p); return; }
+	buf = (unsigned char *)bufplce[0];
+	pal = (unsigned char *)palookupoffse[0];
+	shift = _mm_cvtsi32_si128(glogy);
+	pack = _mm256_broadcastsi128_si256(_mm_setr_epi8(0,4,8,12, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1));
+	pp = (unsigned char *)p;
+	for(;cnt>1;cnt-=2)
+	{
+		ch = gatherbytes_avx2(buf, _mm256_add_epi32(boffs, _mm256_srl_epi32(vplc, shift)));
+		keep = _mm256_cmpeq_epi32(ch, _mm256_set1_epi32(255));
+		if (_mm256_movemask_epi8(keep) != -1)
+		{
+			pix = gatherbytes_avx2(pal, _mm256_add_epi32(poffs, ch));
+			Bmemcpy(&out, pp, 4); Bmemcpy(&old, pp+bpl, 4);
+			pix = _mm256_blendv_epi8(pix, _mm256_cvtepu8_epi32(_mm_setr_epi32(out, old, 0, 0)), keep);
+			pix = _mm256_shuffle_epi8(pix, pack);
+			out = _mm256_extract_epi32(pix, 0); Bmemcpy(pp, &out, 4);
+			out = _mm256_extract_epi32(pix, 4); Bmemcpy(pp+bpl, &out, 4);
+		}
+		vplc = _mm256_add_epi32(vplc, vinc);
+		pp += bpl*2;
+	}
+	_mm_storeu_si128((__m128i *)vplce, _mm256_castsi256_si128(vplc));
+	if (cnt > 0) mvlineasm4_sse2(cnt, pp);
+}
+
+#endif	//A_C_USING_X64SIMD
+
+static void (*vlineasm4func)(int, void *) = vlineasm4_c;
+static void (*mvlineasm4func)(int, void *) = mvlineasm4_c;
+
+void vlineasm4(int cnt, void *p) { vlineasm4func(cnt, p); }
+void mvlineasm4(int cnt, void *p) { mvlineasm4func(cnt, p); }
+
+	//The four columns one at a time, as walls were drawn before vlineasm4.
+static void vlineasm4_x1(int cnt, void *p)
+{
+	int z;
+
+	for (z=0; z<4; z++) {
+		vlineasm1(vince[z], (void *)palookupoffse[z], cnt-1, vplce[z], (void *)bufplce[z], (char *)p + z);
+		vplce[z] += vince[z]*cnt;
+	}
+}
+
+static void mvlineasm4_x1(int cnt, void *p)
+{
+	int z;
+
+	for (z=0; z<4; z++)
+		vplce[z] = mvlineasm1(vince[z], (void *)palookupoffse[z], cnt-1, vplce[z], (void *)bufplce[z], (char *)p + z);
+}
+
+	//Times the column kernels this processor can run against drawing the
+	//columns one at a time, on a 640x480 wall of 256x256 texture, and
+	//checks that they all draw the same pixels.
+void benchvlineasm4(int passes)
+{
+	struct { const char *name; void (*v)(int, void *); void (*mv)(int, void *); } kern[4];
+	unsigned char *tex, *pal, *frame, *ref;
+	unsigned int t, tv[4], tmv[4];
+	int numkern, k, n, x, z, i, sbpl, slogy, same;
+	const int fw = 640, fh = 480;
+
+	kern[0].name = "x1"; kern[0].v = vlineasm4_x1; kern[0].mv = mvlineasm4_x1;
+	kern[1].name = "C"; kern[1].v = vlineasm4_c; kern[1].mv = mvlineasm4_c;
+	numkern = 2;
+#ifdef A_C_USING_X64SIMD
+	kern[numkern].name = "SSE2"; kern[numkern].v = vlineasm4_sse2; kern[numkern].mv = mvlineasm4_sse2;
+	numkern++;
+	if (cpuhasavx2()) {
+		kern[numkern].name = "AVX2"; kern[numkern].v = vlineasm4_avx2; kern[numkern].mv = mvlineasm4_avx2;
+		numkern++;
+	}
+#endif
+
+	tex = (unsigned char *)Bmalloc(256*256 + 32*256 + 3*fw*fh);
+	if (!tex) return;
+	pal = tex + 256*256;
+	frame = pal + 32*256;
+	ref = frame + fw*fh;
+	for (i=0; i<256*256; i++) tex[i] = (unsigned char)(((i>>3)^(i>>9))*37);	// includes some 255s
+	for (i=0; i<32*256; i++) pal[i] = (unsigned char)((i&255)*(32-(i>>8))/32);
+
+	sbpl = bpl; slogy = glogy;
+	bpl = fw; glogy = 24;
+	same = 1;
+	for (k=0; k<numkern; k++) {
+		for (z=0; z<2; z++) {
+			Bmemset(frame, 0, fw*fh);
+			t = getusecticks();
+			for (n=0; n<passes; n++) {
+				for (x=0; x<fw; x+=4) {
+					for (i=0; i<4; i++) {
+						bufplce[i] = (intptr_t)tex + (((x+i)*3)&255)*256;
+						palookupoffse[i] = (intptr_t)pal + (((x+i)>>5)&31)*256;
+						vince[i] = 0x00900000 + (x+i)*0x100;
+						vplce[i] = (int)((unsigned int)(x+i)*0x01234567u);
+					}
+					if (z) kern[k].mv(fh, frame+x); else kern[k].v(fh, frame+x);
+				}
+			}
+			t = getusecticks() - t;
+			if (z) tmv[k] = t; else tv[k] = t;
+
+			if (k == 0) Bmemcpy(ref + z*fw*fh, frame, fw*fh);
+			else if (Bmemcmp(ref + z*fw*fh, frame, fw*fh)) same = 0;
+		}
+	}
+	bpl = sbpl; glogy = slogy;
+	Bfree(tex);
+
+	buildprintf("vlineasm4 over %d passes of %dx%d (in use: %s):\n", passes, fw, fh, kernelname);
+	for (k=0; k<numkern; k++) {
+		buildprintf("  %-4s  vlineasm4 %6u us (%.2fx)  mvlineasm4 %6u us (%.2fx)\n", kern[k].name,
+			tv[k], (double)tv[0]/(double)max(1u,tv[k]),
+			tmv[k], (double)tmv[0]/(double)max(1u,tmv[k]));
+	}
+	if (!same) buildputs("  WARNING: the kernels drew different pixels\n");
 }
 
 void setuptvlineasm(int neglogy) { glogy = neglogy; }
@@ -146,14 +650,12 @@ void tvlineasm1(int vinc, void *paloffs, int cnt, unsigned int vplc, void *bufpl
 
 	//Floor sprite horizontal line functions
 void msethlineshift(int logx, int logy) { glogx = logx; glogy = logy; }
-void mhline(void *bufplc, unsigned int bx, int cntup16, int UNUSED(junk), unsigned int by, void *p)
+
+static void mhline_c(int cnt, unsigned int bx, unsigned int by, unsigned char *pp)
 {
-	unsigned char ch, *pp;
+	unsigned char ch;
 
-	gbuf = (unsigned char *)bufplc;
-	gpal = (unsigned char *)asm3;
-	pp = (unsigned char *)p;
-	for(cntup16>>=16;cntup16>0;cntup16--)
+	for(;cnt>0;cnt--)
 	{
 		ch = gbuf[((bx>>(32-glogx))<<glogy)+(by>>(32-glogy))];
 		if (ch != 255) *pp = gpal[ch];
@@ -164,16 +666,14 @@ void mhline(void *bufplc, unsigned int bx, int cntup16, int UNUSED(junk), unsign
 }
 
 void tsethlineshift(int logx, int logy) { glogx = logx; glogy = logy; }
-void thline(void *bufplc, unsigned int bx, int cntup16, int UNUSED(junk), unsigned int by, void *p)
+
+static void thline_c(int cnt, unsigned int bx, unsigned int by, unsigned char *pp)
 {
-	unsigned char ch, *pp;
+	unsigned char ch;
 
-	gbuf = (unsigned char *)bufplc;
-	gpal = (unsigned char *)asm3;
-	pp = (unsigned char *)p;
 	if (transmode)
 	{
-		for(cntup16>>=16;cntup16>0;cntup16--)
+		for(;cnt>0;cnt--)
 		{
 			ch = gbuf[((bx>>(32-glogx))<<glogy)+(by>>(32-glogy))];
 			if (ch != 255) *pp = gtrans[(*pp)+(gpal[ch]<<8)];
@@ -184,7 +684,7 @@ void thline(void *bufplc, unsigned int bx, int cntup16, int UNUSED(junk), unsign
 	}
 	else
 	{
-		for(cntup16>>=16;cntup16>0;cntup16--)
+		for(;cnt>0;cnt--)
 		{
 			ch = gbuf[((bx>>(32-glogx))<<glogy)+(by>>(32-glogy))];
 			if (ch != 255) *pp = gtrans[((*pp)<<8)+gpal[ch]];
@@ -195,6 +695,245 @@ void thline(void *bufplc, unsigned int bx, int cntup16, int UNUSED(junk), unsign
 	}
 }
 
+#ifdef A_C_USING_X64SIMD
+
+	//Four pixels at a time, like hlineasm4_sse2() but left to right, and
+	//only storing the pixels that aren't see-through.
+static void mhline_sse2(int cnt, unsigned int bx, unsigned int by, unsigned char *pp)
+{
+	__m128i vbx, vby, xinc, yinc, xshift, yshift, ylog;
+	int idx[4], z;
+	unsigned int ch, pix, mask, old;
+
+	if (cnt >= 4)
+	{
+		vbx = _mm_setr_epi32(bx, bx+asm1, bx+asm1*2, bx+asm1*3);
+		vby = _mm_setr_epi32(by, by+asm2, by+asm2*2, by+asm2*3);
+		xinc = _mm_set1_epi32(asm1*4);
+		yinc = _mm_set1_epi32(asm2*4);
+		xshift = _mm_cvtsi32_si128(32-glogx);
+		yshift = _mm_cvtsi32_si128(32-glogy);
+		ylog = _mm_cvtsi32_si128(glogy);
+		for(;cnt>=4;cnt-=4)
+		{
+			_mm_storeu_si128((__m128i *)idx, _mm_add_epi32(_mm_sll_epi32(_mm_srl_epi32(vbx, xshift), ylog),
+				_mm_srl_epi32(vby, yshift)));
+			pix = mask = 0;
+			for(z=0;z<4;z++)
+			{
+				ch = gbuf[idx[z]];
+				if (ch != 255) { pix |= (unsigned int)gpal[ch] << (z*8); mask |= 0xffu << (z*8); }
+			}
+			if (mask == 0xffffffffu) Bmemcpy(pp, &pix, 4);
+			else if (mask)
+			{
+				Bmemcpy(&old, pp, 4);
+				pix |= old & ~mask;
+				Bmemcpy(pp, &pix, 4);
+			}
+			vbx = _mm_add_epi32(vbx, xinc);
+			vby = _mm_add_epi32(vby, yinc);
+			pp += 4;
+		}
+		bx = (unsigned int)_mm_cvtsi128_si32(vbx);
+		by = (unsigned int)_mm_cvtsi128_si32(vby);
+	}
+	mhline_c(cnt, bx, by, pp);
+}
+
+	//AVX2 does eight pixels at a time with gathers. The translucent
+	//version also gathers from the translucency table.
+TARGET_AVX2 static void mhline_avx2(int cnt, unsigned int bx, unsigned int by, unsigned char *pp)
+{
+	__m256i vbx, vby, steps, xinc, yinc, ch, pix, keep;
+	__m128i xshift, yshift, ylog;
+
+	if (cnt >= 8)
+	{
+		steps = _mm256_setr_epi32(0,1,2,3,4,5,6,7);
+		vbx = _mm256_add_epi32(_mm256_set1_epi32(bx), _mm256_mullo_epi32(steps, _mm256_set1_epi32(asm1)));
+		vby = _mm256_add_epi32(_mm256_set1_epi32(by), _mm256_mullo_epi32(steps, _mm256_set1_epi32(asm2)));
+		xinc = _mm256_set1_epi32(asm1*8);
+		yinc = _mm256_set1_epi32(asm2*8);
+		xshift = _mm_cvtsi32_si128(32-glogx);
+		yshift = _mm_cvtsi32_si128(32-glogy);
+		ylog = _mm_cvtsi32_si128(glogy);
+		for(;cnt>=8;cnt-=8)
+		{
+			ch = gatherbytes_avx2(gbuf, _mm256_add_epi32(_mm256_sll_epi32(_mm256_srl_epi32(vbx, xshift), ylog),
+				_mm256_srl_epi32(vby, yshift)));
+			keep = _mm256_cmpeq_epi32(ch, _mm256_set1_epi32(255));
+			if (_mm256_movemask_epi8(keep) != -1)
+			{
+				pix = gatherbytes_avx2(gpal, ch);
+				pix = _mm256_blendv_epi8(pix, _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *)pp)), keep);
+				_mm_storel_epi64((__m128i *)pp, packbytes_avx2(pix));
+			}
+			vbx = _mm256_add_epi32(vbx, xinc);
+			vby = _mm256_add_epi32(vby, yinc);
+			pp += 8;
+		}
+		bx = (unsigned int)_mm_cvtsi128_si32(_mm256_castsi256_si128(vbx));
+		by = (unsigned int)_mm_cvtsi128_si32(_mm256_castsi256_si128(vby));
+	}
+	mhline_c(cnt, bx, by, pp);
+}
+
+TARGET_AVX2 static void thline_avx2(int cnt, unsigned int bx, unsigned int by, unsigned char *pp)
+{
+	__m256i vbx, vby, steps, xinc, yinc, ch, pix, dst, keep;
+	__m128i xshift, yshift, ylog;
+
+	if (cnt >= 8)
+	{
+		steps = _mm256_setr_epi32(0,1,2,3,4,5,6,7);
+		vbx = _mm256_add_epi32(_mm256_set1_epi32(bx), _mm256_mullo_epi32(steps, _mm256_set1_epi32(asm1)));
+		vby = _mm256_add_epi32(_mm256_set1_epi32(by), _mm256_mullo_epi32(steps, _mm256_set1_epi32(asm2)));
+		xinc = _mm256_set1_epi32(asm1*8);
+		yinc = _mm256_set1_epi32(asm2*8);
+		xshift = _mm_cvtsi32_si128(32-glogx);
+		yshift = _mm_cvtsi32_si128(32-glogy);
+		ylog = _mm_cvtsi32_si128(glogy);
+		for(;cnt>=8;cnt-=8)
+		{
+			ch = gatherbytes_avx2(gbuf, _mm256_add_epi32(_mm256_sll_epi32(_mm256_srl_epi32(vbx, xshift), ylog),
+				_mm256_srl_epi32(vby, yshift)));
+			keep = _mm256_cmpeq_epi32(ch, _mm256_set1_epi32(255));
+			if (_mm256_movemask_epi8(keep) != -1)
+			{
+				pix = gatherbytes_avx2(gpal, ch);
+				dst = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *)pp));
+				if (transmode) pix = _mm256_add_epi32(dst, _mm256_slli_epi32(pix, 8));
+				else pix = _mm256_add_epi32(_mm256_slli_epi32(dst, 8), pix);
+				pix = _mm256_blendv_epi8(gatherbytes_avx2(gtrans, pix), dst, keep);
+				_mm_storel_epi64((__m128i *)pp, packbytes_avx2(pix));
+			}
+			vbx = _mm256_add_epi32(vbx, xinc);
+			vby = _mm256_add_epi32(vby, yinc);
+			pp += 8;
+		}
+		bx = (unsigned int)_mm_cvtsi128_si32(_mm256_castsi256_si128(vbx));
+		by = (unsigned int)_mm_cvtsi128_si32(_mm256_castsi256_si128(vby));
+	}
+	thline_c(cnt, bx, by, pp);
+}
+
+#endif	//A_C_USING_X64SIMD
+
+static void (*mhlinefunc)(int, unsigned int, unsigned int, unsigned char *) = mhline_c;
+static void (*thlinefunc)(int, unsigned int, unsigned int, unsigned char *) = thline_c;
+
+void mhline(void *bufplc, unsigned int bx, int cntup16, int UNUSED(junk), unsigned int by, void *p)
+{
+	gbuf = (unsigned char *)bufplc;
+	gpal = (unsigned char *)asm3;
+	mhlinefunc(cntup16>>16, bx, by, (unsigned char *)p);
+}
+
+void thline(void *bufplc, unsigned int bx, int cntup16, int UNUSED(junk), unsigned int by, void *p)
+{
+	gbuf = (unsigned char *)bufplc;
+	gpal = (unsigned char *)asm3;
+	thlinefunc(cntup16>>16, bx, by, (unsigned char *)p);
+}
+
+
+	//Times the span kernels this processor can run against the C ones on a
+	//640x480 surface of 256x256 texture, and checks that they all draw the
+	//same pixels. Kernel sets without a version of a span use the C one.
+void benchhlineasm4(int passes)
+{
+	struct {
+		const char *name;
+		void (*h)(int, unsigned char *, unsigned int, unsigned int, unsigned char *);
+		void (*mh)(int, unsigned int, unsigned int, unsigned char *);
+		void (*th)(int, unsigned int, unsigned int, unsigned char *);
+		void (*sv)(unsigned char *, intptr_t *, int, int, int, int, int);
+	} kern[4];
+	unsigned char *tex, *pal, *trans, *frame, *ref, *sgbuf, *sgpal, *sghlinepal, *sgtrans;
+	intptr_t *slopal;
+	unsigned int t, tk[4][4];
+	int numkern, k, n, x, y, z, i, same;
+	int sglogx, sglogy, sgbxinc, sgbyinc, sgpinc, stransmode, sasm1, sasm2, sx3, sy3;
+	const int fw = 640, fh = 480;
+	static const char *spans[4] = { "hlineasm4", "mhline", "thline", "slopevlin" };
+
+	kern[0].name = "C"; kern[0].h = hlineasm4_c; kern[0].mh = mhline_c; kern[0].th = thline_c; kern[0].sv = slopevlin_c;
+	numkern = 1;
+#ifdef A_C_USING_X64SIMD
+	kern[numkern] = kern[0];
+	kern[numkern].name = "SSE2"; kern[numkern].h = hlineasm4_sse2; kern[numkern].mh = mhline_sse2;
+	numkern++;
+	if (cpuhasavx2()) {
+		kern[numkern].name = "AVX2"; kern[numkern].h = hlineasm4_avx2; kern[numkern].mh = mhline_avx2;
+		kern[numkern].th = thline_avx2; kern[numkern].sv = slopevlin_avx2;
+		numkern++;
+	}
+#endif
+
+	tex = (unsigned char *)Bmalloc(256*256 + 32*256 + 65536 + 5*fw*fh + fh*sizeof(intptr_t));
+	if (!tex) return;
+	pal = tex + 256*256;
+	trans = pal + 32*256;
+	frame = trans + 65536;
+	ref = frame + fw*fh;
+	slopal = (intptr_t *)(ref + 4*fw*fh);
+	for (i=0; i<256*256; i++) tex[i] = (unsigned char)(((i>>3)^(i>>9))*37);	// includes some 255s
+	for (i=0; i<32*256; i++) pal[i] = (unsigned char)((i&255)*(32-(i>>8))/32);
+	for (i=0; i<65536; i++) trans[i] = (unsigned char)(((i>>8)+(i&255)*3)>>2);
+	for (i=0; i<fh; i++) slopal[i] = (intptr_t)pal + ((i>>4)&31)*256;
+
+	sgbuf = gbuf; sgpal = gpal; sghlinepal = ghlinepal; sgtrans = gtrans;
+	sglogx = glogx; sglogy = glogy; sgbxinc = gbxinc; sgbyinc = gbyinc; sgpinc = gpinc; stransmode = transmode;
+	sasm1 = asm1; sasm2 = asm2; sx3 = globalx3; sy3 = globaly3;
+
+	gbuf = tex; gpal = pal; gtrans = trans; transmode = 0;
+	glogx = glogy = 8; gpinc = fw;
+	same = 1;
+	for (k=0; k<numkern; k++) {
+		for (z=0; z<4; z++) {
+			for (i=0; i<fw*fh; i++) frame[i] = (unsigned char)(i*7);
+			t = getusecticks();
+			for (n=0; n<passes; n++) {
+				if (z == 3) {
+					globalx3 = 0x1234; globaly3 = -0x2345;
+					for (x=0; x<fw; x++)
+						kern[k].sv(frame+x, &slopal[fh-1], fh, (int)(x*0x00712345u), (int)(x*0x00234567u),
+							0x40000+x*0x200, 0x123+x);
+					continue;
+				}
+				for (y=0; y<fh; y++) {
+					asm1 = gbxinc = 0x00900000 + y*0x1000;
+					asm2 = gbyinc = -0x00300000 + y*0x800;
+					switch (z) {
+						case 0: kern[k].h(fw-1, pal + ((y>>4)&31)*256, y*0x01234567u, y*0x00765432u, frame+y*fw+fw-1); break;
+						case 1: kern[k].mh(fw-(y&7), y*0x01234567u, y*0x00765432u, frame+y*fw); break;
+						case 2: transmode = y&1; kern[k].th(fw-(y&7), y*0x01234567u, y*0x00765432u, frame+y*fw); break;
+					}
+				}
+			}
+			tk[k][z] = getusecticks() - t;
+
+			if (k == 0) Bmemcpy(ref + z*fw*fh, frame, fw*fh);
+			else if (Bmemcmp(ref + z*fw*fh, frame, fw*fh)) same = 0;
+		}
+	}
+	Bfree(tex);
+
+	gbuf = sgbuf; gpal = sgpal; ghlinepal = sghlinepal; gtrans = sgtrans;
+	glogx = sglogx; glogy = sglogy; gbxinc = sgbxinc; gbyinc = sgbyinc; gpinc = sgpinc; transmode = stransmode;
+	asm1 = sasm1; asm2 = sasm2; globalx3 = sx3; globaly3 = sy3;
+
+	buildprintf("span kernels over %d passes of %dx%d (in use: %s):\n", passes, fw, fh, kernelname);
+	for (z=0; z<4; z++) {
+		buildprintf("  %-9s", spans[z]);
+		for (k=0; k<numkern; k++)
+			buildprintf("  %s %6u us (%.2fx)", kern[k].name, tk[k][z], (double)tk[0][z]/(double)max(1u,tk[k][z]));
+		buildputs("\n");
+	}
+	if (!same) buildputs("  WARNING: the kernels drew different pixels\n");
+}
+
 
 	//Rotatesprite vertical line functions
 void setupspritevline(void *paloffs, int bxinc, int byinc, int ysiz)
@@ -285,14 +1024,22 @@ void setupdrawslab (int dabpl, void *pal)
 
 void drawslab (int dx, int v, int dy, int vi, void *vptr, void *p)
 {
-	int x;
 	unsigned char *pp, *vpptr;
-	
+
 	pp = (unsigned char *)p;
 	vpptr = (unsigned char *)vptr;
+	if (dx == 1)
+	{
+		while (dy > 0)
+		{
+			*pp = gpal[(int)(*(vpptr+(v>>16)))];
+			pp += bpl; v += vi; dy--;
+		}
+		return;
+	}
 	while (dy > 0)
 	{
-		for(x=0;x<dx;x++) *(pp+x) = gpal[(int)(*(vpptr+(v>>16)))];
+		Bmemset(pp, gpal[(int)(*(vpptr+(v>>16)))], dx);
 		pp += bpl; v += vi; dy--;
 	}
 }
@@ -312,7 +1059,28 @@ void stretchhline (void * UNUSED(p0), int u, int cnt, int uinc, void *rptr, void
 }
 
 
-void mmxoverlay() { }
+	//Picks the fastest column and span kernels the processor can run.
+	//Not called when BUILD_NOP6 is set, leaving the plain C ones.
+void mmxoverlay()
+{
+#ifdef A_C_USING_X64SIMD
+	if (cpuhasavx2()) {
+		vlineasm4func = vlineasm4_avx2;
+		mvlineasm4func = mvlineasm4_avx2;
+		hlineasm4func = hlineasm4_avx2;
+		mhlinefunc = mhline_avx2;
+		thlinefunc = thline_avx2;
+		slopevlinfunc = slopevlin_avx2;
+		kernelname = "AVX2";
+	} else {
+		vlineasm4func = vlineasm4_sse2;
+		mvlineasm4func = mvlineasm4_sse2;
+		hlineasm4func = hlineasm4_sse2;
+		mhlinefunc = mhline_sse2;
+		kernelname = "SSE2";
+	}
+#endif
+}
 
 #endif
 /*
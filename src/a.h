@@ -162,9 +162,12 @@ void slopevlin(void *p, int i, void *slopaloffs, int cnt, int bx, int by);
 
 void setupvlineasm(int neglogy);
 void vlineasm1(int vinc, void *paloffs, int cnt, unsigned int vplc, void *bufplc, void *p);
+int prevlineasm1(int vinc, void *paloffs, int cnt, unsigned int vplc, void *bufplc, void *p);
+void vlineasm4(int cnt, void *p);
 
 void setupmvlineasm(int neglogy);
-void mvlineasm1(int vinc, void *paloffs, int cnt, unsigned int vplc, void *bufplc, void *p);
+int mvlineasm1(int vinc, void *paloffs, int cnt, unsigned int vplc, void *bufplc, void *p);
+void mvlineasm4(int cnt, void *p);
 
 void setuptvlineasm(int neglogy);
 void tvlineasm1(int vinc, void *paloffs, int cnt, unsigned int vplc, void *bufplc, void *p);
@@ -189,7 +192,15 @@ void drawslab (int dx, int v, int dy, int vi, void *vptr, void *p);
 void stretchhline (void *p0, int u, int cnt, int uinc, void *rptr, void *p);
 
 void mmxoverlay(void);
+void benchvlineasm4(int passes);
+void benchhlineasm4(int passes);
 
 #endif	// else
 
+// Strip rendering needs every thread to have its own renderer state,
+// which is only the case with the C versions of the routines (see RENDERTLS).
+#if defined(ENGINE_USING_A_C) && defined(BTHREADLOCAL)
+# define ENGINE_USING_STRIPTHREADS
+#endif
+
 #endif // __a_h__
@@ -8,6 +8,8 @@
 #include "build.h"
 #include "osd.h"
 #include "baselayer.h"
+#include "a.h"
+#include "cache1d.h"
 
 #ifdef RENDERTYPEWIN
 #include "winlayer.h"
@@ -83,6 +85,75 @@ static int osdcmd_glinfo(const osdfuncparm_t *parm)
 }
 #endif //USE_OPENGL
 
+#ifdef ENGINE_USING_A_C
+static int osdcmd_vlinebench(const osdfuncparm_t *parm)
+{
+	int passes = 50;
+
+	if (parm->numparms > 1) return OSDCMD_SHOWHELP;
+	if (parm->numparms == 1) passes = max(1, atoi(parm->parms[0]));
+
+	if (!Bstrcasecmp(parm->name, "hlinebench")) benchhlineasm4(passes);
+	else benchvlineasm4(passes);
+	return OSDCMD_OK;
+}
+#endif
+
+static int osdcmd_cachebench(const osdfuncparm_t *parm)
+{
+	int uses = 200000;
+
+	if (parm->numparms > 1) return OSDCMD_SHOWHELP;
+	if (parm->numparms == 1) uses = max(1, atoi(parm->parms[0]));
+
+	benchcache(uses);
+	return OSDCMD_OK;
+}
+
+static int osdcmd_grpbench(const osdfuncparm_t *parm)
+{
+	int opens = 20000;
+
+	if (parm->numparms > 1) return OSDCMD_SHOWHELP;
+	if (parm->numparms == 1) opens = max(1, atoi(parm->parms[0]));
+
+	benchgroupfiles(opens);
+	return OSDCMD_OK;
+}
+
+static int osdcmd_sectorbench(const osdfuncparm_t *parm)
+{
+	int lookups = 100000;
+
+	if (parm->numparms > 1) return OSDCMD_SHOWHELP;
+	if (parm->numparms == 1) lookups = max(1, atoi(parm->parms[0]));
+
+	benchsectorgrid(lookups);
+	return OSDCMD_OK;
+}
+
+static int osdcmd_hitscanbench(const osdfuncparm_t *parm)
+{
+	int rays = 20000;
+
+	if (parm->numparms > 1) return OSDCMD_SHOWHELP;
+	if (parm->numparms == 1) rays = max(1, atoi(parm->parms[0]));
+
+	benchhitscan(rays);
+	return OSDCMD_OK;
+}
+
+static int osdcmd_loadbench(const osdfuncparm_t *parm)
+{
+	int times = 10;
+
+	if (parm->numparms < 1 || parm->numparms > 2) return OSDCMD_SHOWHELP;
+	if (parm->numparms == 2) times = max(1, atoi(parm->parms[1]));
+
+	benchloadfile(parm->parms[0], times);
+	return OSDCMD_OK;
+}
+
 static int osdcmd_vars(const osdfuncparm_t *parm)
 {
 	int showval = (parm->numparms < 1);
@@ -110,6 +181,41 @@ static int osdcmd_vars(const osdfuncparm_t *parm)
 		else { usevoxels = (atoi(parm->parms[0]) != 0); }
 		return OSDCMD_OK;
 	}
+	else if (!Bstrcasecmp(parm->name, "drawthreads")) {
+		if (showval) { buildprintf("drawthreads is %d\n", drawthreads); }
+		else { drawthreads = max(-1, atoi(parm->parms[0])); }
+		return OSDCMD_OK;
+	}
+	else if (!Bstrcasecmp(parm->name, "mapartfiles")) {
+		if (showval) { buildprintf("mapartfiles is %d\n", mapartfiles); }
+		else { mapartfiles = (atoi(parm->parms[0]) != 0); }
+		return OSDCMD_OK;
+	}
+	else if (!Bstrcasecmp(parm->name, "tilestreaming")) {
+		if (showval) { buildprintf("tilestreaming is %d\n", tilestreaming); }
+		else { tilestreaming = (atoi(parm->parms[0]) != 0); }
+		return OSDCMD_OK;
+	}
+	else if (!Bstrcasecmp(parm->name, "hitscanthreads")) {
+		if (showval) { buildprintf("hitscanthreads is %d\n", hitscanthreads); }
+		else { hitscanthreads = (atoi(parm->parms[0]) != 0); }
+		return OSDCMD_OK;
+	}
+	else if (!Bstrcasecmp(parm->name, "useslopecache")) {
+		if (showval) { buildprintf("useslopecache is %d\n", useslopecache); }
+		else { useslopecache = (atoi(parm->parms[0]) != 0); }
+		return OSDCMD_OK;
+	}
+	else if (!Bstrcasecmp(parm->name, "usesectorgrid")) {
+		if (showval) { buildprintf("usesectorgrid is %d\n", usesectorgrid); }
+		else { usesectorgrid = (atoi(parm->parms[0]) != 0); }
+		return OSDCMD_OK;
+	}
+	else if (!Bstrcasecmp(parm->name, "usepvs")) {
+		if (showval) { buildprintf("usepvs is %d\n", usepvs); }
+		else { usepvs = (atoi(parm->parms[0]) != 0); }
+		return OSDCMD_OK;
+	}
 #if defined(DEBUGGINGAIDS) && USE_OPENGL
 	else if (!Bstrcasecmp(parm->name, "debuggllogseverity")) {
 		const char *levels[] = {"none", "notification", "low", "medium", "high"};
@@ -133,6 +239,22 @@ int baselayer_init(void)
 
 	OSD_RegisterFunction("novoxmips","novoxmips: turn off/on the use of mipmaps when rendering 8-bit voxels",osdcmd_vars);
 	OSD_RegisterFunction("usevoxels","usevoxels: enable/disable automatic sprite->voxel rendering",osdcmd_vars);
+	OSD_RegisterFunction("drawthreads","drawthreads: number of threads the classic renderer draws with (0 = off, -1 = one per processor)",osdcmd_vars);
+	OSD_RegisterFunction("mapartfiles","mapartfiles: draw tiles straight from memory-mapped ART files rather than copying them into the cache (from the next loadpics)",osdcmd_vars);
+	OSD_RegisterFunction("tilestreaming","tilestreaming: load tiles on another thread, drawing a placeholder until they arrive",osdcmd_vars);
+	OSD_RegisterFunction("hitscanthreads","hitscanthreads: whether hitscanbatch traces rays on the drawthreads thread pool (0 = off)",osdcmd_vars);
+	OSD_RegisterFunction("useslopecache","useslopecache: keep each sector's slope plane in a table (games moving walls directly must call updatesectorgeometry)",osdcmd_vars);
+	OSD_RegisterFunction("usesectorgrid","usesectorgrid: find which sector a point is in through a grid over the map rather than testing every sector",osdcmd_vars);
+	OSD_RegisterFunction("usepvs","usepvs: skip sectors that the map's .pvs file says can't be seen from the viewer's",osdcmd_vars);
+#ifdef ENGINE_USING_A_C
+	OSD_RegisterFunction("vlinebench","vlinebench [passes]: times the wall column drawing routines against the plain C ones",osdcmd_vlinebench);
+	OSD_RegisterFunction("hlinebench","hlinebench [passes]: times the floor and ceiling span drawing routines against the plain C ones",osdcmd_vlinebench);
+#endif
+	OSD_RegisterFunction("cachebench","cachebench [uses]: times the tile cache's two allocators against each other",osdcmd_cachebench);
+	OSD_RegisterFunction("grpbench","grpbench [opens]: times finding files in the mounted group files, hashed and by the old search",osdcmd_grpbench);
+	OSD_RegisterFunction("sectorbench","sectorbench [lookups]: times finding the sectors of points across the map, through the sector grid and by testing every sector",osdcmd_sectorbench);
+	OSD_RegisterFunction("hitscanbench","hitscanbench [rays]: times tracing rays about the map one at a time and with hitscanbatch",osdcmd_hitscanbench);
+	OSD_RegisterFunction("loadbench","loadbench <file> [times]: times reading a file, and decoding it if it is a picture",osdcmd_loadbench);
 
 #if USE_POLYMOST
 	OSD_RegisterFunction("setrendermode","setrendermode <number>: sets the engine's rendering mode.\n"
@@ -47,7 +47,7 @@ static int synctics = 0, lockclock = 0;
 extern unsigned char picsiz[MAXTILES];
 extern int startposx, startposy, startposz;
 extern short startang, startsectnum;
-extern intptr_t frameplace;
+extern RENDERTLS intptr_t frameplace;
 extern int ydim16, halfxdim16, midydim16;
 int xdim2d = 640, ydim2d = 480, xdimgame = 640, ydimgame = 480, bppgame = 8;
 int forcesetup = 1;
@@ -382,6 +382,7 @@ int app_main(int argc, char const * const argv[])
 		numwalls = 0;
 		cursectnum = -1;
 		overheadeditor();
+		invalidatemapgeometry();
 		keystatus[buildkeys[14]] = 0;
 	}
 	else
@@ -2325,6 +2326,7 @@ void editinput(void)
 	if (keystatus[buildkeys[14]] > 0)  // Enter
 	{
 		overheadeditor();
+		invalidatemapgeometry();
 		keystatus[buildkeys[14]] = 0;
 	}
 }
@@ -3131,6 +3133,7 @@ void overheadeditor(void)
 						j = nextspritesect[j];
 					}
 				}
+				invalidatemapgeometry();
 				if (k == 0) keystatus[0x33] = 0;
 				asksave = 1;
 			}
@@ -3226,6 +3229,7 @@ void overheadeditor(void)
 						j = nextspritesect[j];
 					}
 				}
+				invalidatemapgeometry();
 				if (k == 0) keystatus[0x34] = 0;
 				asksave = 1;
 			}
@@ -3811,6 +3815,7 @@ void overheadeditor(void)
 						for(j=headspritesect[highlightsector[i]];j>=0;j=nextspritesect[j])
 							{ sprite[j].x += dax; sprite[j].y += day; }
 					}
+					invalidatemapgeometry();
 
 					//for(i=0;i<highlightsectorcnt;i++)
 					//{
@@ -3873,6 +3878,7 @@ void overheadeditor(void)
 								sprite[highlight[i]&16383].y += day;
 							}
 						}
+						invalidatemapgeometry();
 					}
 					else
 					{
@@ -5937,6 +5943,7 @@ int movewalls(int start, int offs)
 		if (wall[i].nextwall >= start) wall[i].nextwall += offs;
 		if (wall[i].point2 >= start) wall[i].point2 += offs;
 	}
+	invalidatemapgeometry();
 	return(0);
 }
 
@@ -7,16 +7,18 @@
 
 #define WITHKPLIB
 
+#include "thread_priv.h"
 #include "build.h"
 #include "cache1d.h"
 #include "pragmas.h"
+#include "baselayer.h"
 
 #ifdef WITHKPLIB
 #include "kplib.h"
 
 	//Insert '|' in front of filename
 	//Doing this tells kzopen to load the file only if inside a .ZIP file
-static int kzipopen(const char *filnam)
+static kzfile *kzipopen(const char *filnam)
 {
 	unsigned int i;
 	char newst[BMAX_PATH+4];
@@ -24,7 +26,7 @@ static int kzipopen(const char *filnam)
 	newst[0] = '|';
 	for(i=0;filnam[i] && (i < sizeof(newst)-2);i++) newst[i+1] = filnam[i];
 	newst[i+1] = 0;
-	return(kzopen(newst));
+	return(kzhopen(newst));
 }
 
 #endif
@@ -57,6 +59,10 @@ static int kzipopen(const char *filnam)
 //              Call uninitcache(1) to remove everything.
 //           After calling uninitcache, it is still ok to call allocache
 //           without first calling initcache.
+//
+//   There are two ways of finding room for allocache(), chosen by setting
+//   cache1dbackend before initcache(): Ken's original scan of every block
+//   (CACHE1D_CLASSIC), or free lists by size (CACHE1D_SEGREGATED).
 
 #define MAXCACHEOBJECTS 9216
 
@@ -68,6 +74,8 @@ int cacnum = 0, agecount = 0;
 typedef struct { void **hand; int leng; unsigned char *lock; } cactype;
 cactype cac[MAXCACHEOBJECTS];
 static int lockrecip[200];
+int cache1dbackend = CACHE1D_CLASSIC;
+static int cachebackend = CACHE1D_CLASSIC;	// cache1dbackend as of the last initcache()
 
 static char toupperlookup[256];
 
@@ -75,6 +83,13 @@ extern void *kmalloc(size_t);
 extern void kfree(void *);
 
 static void reportandexit(char *errormessage);
+static void initcache_seg(void);
+static void allocache_classic(void **newhandle, int newbytes, unsigned char *newlockptr);
+static void allocache_seg(void **newhandle, int newbytes, unsigned char *newlockptr);
+static void suckcache_classic(void *suckptr);
+static void suckcache_seg(void *suckptr);
+static void agecache_classic(void);
+static void agecache_seg(void);
 
 extern char pow2char[8];
 
@@ -92,13 +107,14 @@ void initcache(void *dacachestart, int dacachesize)
 	cac[0].lock = &zerochar;
 	cacnum = 1;
 
+	cachebackend = cache1dbackend;
+	if (cachebackend == CACHE1D_SEGREGATED) initcache_seg();
+
 	buildprintf("initcache(): Initialised with %d bytes\n", cachesize);
 }
 
 void allocache(void **newhandle, int newbytes, unsigned char *newlockptr)
 {
-	int i, z, zz, bestz=0, daval, bestval, besto=0, o1, o2, sucklen, suckz;
-
 	newbytes = ((newbytes+15)& ~15);
 
 	if ((unsigned)newbytes > (unsigned)cachesize)
@@ -113,6 +129,26 @@ void allocache(void **newhandle, int newbytes, unsigned char *newlockptr)
 		reportandexit("ALLOCACHE CALLED WITH LOCK OF 0!");
 	}
 
+	if (cachebackend == CACHE1D_SEGREGATED) allocache_seg(newhandle,newbytes,newlockptr);
+	else allocache_classic(newhandle,newbytes,newlockptr);
+}
+
+void suckcache(void *suckptr)
+{
+	if (cachebackend == CACHE1D_SEGREGATED) suckcache_seg(suckptr);
+	else suckcache_classic(suckptr);
+}
+
+void agecache(void)
+{
+	if (cachebackend == CACHE1D_SEGREGATED) agecache_seg();
+	else agecache_classic();
+}
+
+static void allocache_classic(void **newhandle, int newbytes, unsigned char *newlockptr)
+{
+	int i, z, zz, bestz=0, daval, bestval, besto=0, o1, o2, sucklen, suckz;
+
 		//Find best place
 	bestval = INT_MAX; o1 = cachesize;
 	for(z=cacnum-1;z>=0;z--)
@@ -172,7 +208,7 @@ void allocache(void **newhandle, int newbytes, unsigned char *newlockptr)
 	cac[bestz].lock = &zerochar;
 }
 
-void suckcache(void *suckptr)
+static void suckcache_classic(void *suckptr)
 {
 	int i;
 
@@ -198,7 +234,7 @@ void suckcache(void *suckptr)
 		}
 }
 
-void agecache(void)
+static void agecache_classic(void)
 {
 	int cnt;
 	unsigned char ch;
@@ -215,11 +251,358 @@ void agecache(void)
 	}
 }
 
+	//The segregated backend keeps a record for each block of the cache,
+	//linked in address order. Free blocks are also kept in lists by size
+	//class, so an allocation that fits in free space looks at only a few
+	//blocks. When nothing fits, the cheapest run of blocks to throw out
+	//is found with the same cost as above (locks weighted by lockrecip[],
+	//so blocks agecache() has aged go first), but in one pass with a
+	//sliding window rather than a scan per starting block. There is no
+	//limit on the number of blocks.
+#define SEGCLASSES 24
+
+typedef struct
+{
+	int offs, leng;
+	void **hand;
+	unsigned char *lock;	//0 if the block is free
+	int prev, next;	//neighbours in address order
+	int fprev, fnext;	//free list of the size class, or the next spare record
+} segblock;
+
+typedef struct
+{
+	segblock *blk;
+	int numblk, spare, head;
+	int freelist[SEGCLASSES];
+	int agepos;
+} segcache;
+
+static segcache seg = { NULL, 0, -1, -1, { 0 }, 0 };
+
+static int segclass(int leng)
+{
+	int c;
+
+	for(c=0;(leng>>(c+5)) && (c < SEGCLASSES-1);c++);
+	return(c);
+}
+
+static int segnewblock(void)
+{
+	int i, n;
+	segblock *blk;
+
+	if (seg.spare < 0)
+	{
+		n = max(1024, seg.numblk*2);
+		blk = (segblock *)Brealloc(seg.blk, n*sizeof(segblock));
+		if (!blk) reportandexit("OUT OF MEMORY FOR CACHE BLOCKS!");
+		seg.blk = blk;
+		for(i=n-1;i>=seg.numblk;i--)
+		{
+			seg.blk[i].lock = 0;
+			seg.blk[i].hand = 0;
+			seg.blk[i].fnext = seg.spare;
+			seg.spare = i;
+		}
+		seg.numblk = n;
+	}
+	i = seg.spare;
+	seg.spare = seg.blk[i].fnext;
+	return(i);
+}
+
+static void segfreeblock(int i)
+{
+	seg.blk[i].lock = 0;
+	seg.blk[i].hand = 0;
+	seg.blk[i].leng = 0;
+	seg.blk[i].fnext = seg.spare;
+	seg.spare = i;
+}
+
+static void seglinkfree(int i)
+{
+	int c = segclass(seg.blk[i].leng);
+
+	seg.blk[i].lock = 0;
+	seg.blk[i].fprev = -1;
+	seg.blk[i].fnext = seg.freelist[c];
+	if (seg.freelist[c] >= 0) seg.blk[seg.freelist[c]].fprev = i;
+	seg.freelist[c] = i;
+}
+
+static void segunlinkfree(int i)
+{
+	segblock *b = &seg.blk[i];
+
+	if (b->fprev >= 0) seg.blk[b->fprev].fnext = b->fnext;
+	else seg.freelist[segclass(b->leng)] = b->fnext;
+	if (b->fnext >= 0) seg.blk[b->fnext].fprev = b->fprev;
+}
+
+	//Joins block i onto the end of block p, which is before it.
+static void segmerge(int p, int i)
+{
+	seg.blk[p].leng += seg.blk[i].leng;
+	seg.blk[p].next = seg.blk[i].next;
+	if (seg.blk[i].next >= 0) seg.blk[seg.blk[i].next].prev = p;
+	segfreeblock(i);
+}
+
+	//Makes block i free, joining it with free neighbours.
+static void segrelease(int i)
+{
+	int j;
+
+	j = seg.blk[i].next;
+	if ((j >= 0) && (!seg.blk[j].lock)) { segunlinkfree(j); segmerge(i,j); }
+	j = seg.blk[i].prev;
+	if ((j >= 0) && (!seg.blk[j].lock)) { segunlinkfree(j); segmerge(j,i); i = j; }
+	seglinkfree(i);
+}
+
+	//Gives the first newbytes of free block i to the caller.
+static void segtake(int i, void **newhandle, int newbytes, unsigned char *newlockptr)
+{
+	int j;
+
+	seg.blk[i].hand = newhandle;
+	seg.blk[i].lock = newlockptr;
+	*newhandle = (void*)(cachestart+seg.blk[i].offs);
+	cachecount++;
+
+	if (seg.blk[i].leng > newbytes)
+	{
+		j = segnewblock();
+		seg.blk[j].offs = seg.blk[i].offs+newbytes;
+		seg.blk[j].leng = seg.blk[i].leng-newbytes;
+		seg.blk[j].prev = i;
+		seg.blk[j].next = seg.blk[i].next;
+		if (seg.blk[i].next >= 0) seg.blk[seg.blk[i].next].prev = j;
+		seg.blk[i].next = j;
+		seg.blk[i].leng = newbytes;
+		segrelease(j);
+	}
+}
+
+static void initcache_seg(void)
+{
+	int c;
+
+	for(c=0;c<SEGCLASSES;c++) seg.freelist[c] = -1;
+	while (seg.head >= 0)
+	{
+		c = seg.blk[seg.head].next;
+		segfreeblock(seg.head);
+		seg.head = c;
+	}
+
+	seg.head = segnewblock();
+	seg.blk[seg.head].offs = 0;
+	seg.blk[seg.head].leng = cachesize;
+	seg.blk[seg.head].prev = seg.blk[seg.head].next = -1;
+	seglinkfree(seg.head);
+	seg.agepos = 0;
+}
+
+	//What throwing out block i would cost, or -1 if it can't be.
+static int segcost(int i)
+{
+	unsigned char *lock = seg.blk[i].lock;
+
+	if ((!lock) || (*lock == 0)) return(0);
+	if (*lock >= 200) return(-1);
+	return(mulscale32(seg.blk[i].leng+65536,lockrecip[*lock]));
+}
+
+static void allocache_seg(void **newhandle, int newbytes, unsigned char *newlockptr)
+{
+	int c, i, j, k, len, cost, bestcost, besti;
+
+		//Free space first: any block from a larger class fits
+	for(c=segclass(newbytes);c<SEGCLASSES;c++)
+		for(i=seg.freelist[c];i>=0;i=seg.blk[i].fnext)
+			if (seg.blk[i].leng >= newbytes)
+			{
+				segunlinkfree(i);
+				segtake(i,newhandle,newbytes,newlockptr);
+				return;
+			}
+
+		//Slide a window over the blocks: j is past the last block in it
+	bestcost = INT_MAX; besti = -1;
+	i = j = seg.head; len = cost = 0;
+	while (i >= 0)
+	{
+		while ((len < newbytes) && (j >= 0))
+		{
+			if ((k = segcost(j)) < 0) break;
+			len += seg.blk[j].leng; cost += k;
+			j = seg.blk[j].next;
+		}
+		if (len < newbytes)
+		{
+			if (j < 0) break;
+				//A locked block: start again after it
+			i = j = seg.blk[j].next; len = cost = 0;
+			continue;
+		}
+		if (cost < bestcost)
+		{
+			bestcost = cost; besti = i;
+			if (cost == 0) break;
+		}
+		len -= seg.blk[i].leng; cost -= segcost(i);
+		i = seg.blk[i].next;
+	}
+
+	if (besti < 0)
+		reportandexit("CACHE SPACE ALL LOCKED UP!");
+
+		//Suck things out, and join them into one block
+	i = besti;
+	for(;;)
+	{
+		if (!seg.blk[i].lock) segunlinkfree(i);
+		else if (*seg.blk[i].lock) *seg.blk[i].hand = 0;
+		if (i != besti) segmerge(besti,i);
+		if (seg.blk[besti].leng >= newbytes) break;
+		i = seg.blk[besti].next;
+	}
+	segtake(besti,newhandle,newbytes,newlockptr);
+}
+
+static void suckcache_seg(void *suckptr)
+{
+	int i, j;
+
+		//Can't exit early, because invalid pointer might be same even though lock = 0
+	for(i=seg.head;i>=0;i=j)
+	{
+		j = seg.blk[i].next;
+		if ((!seg.blk[i].lock) || (*seg.blk[i].hand != suckptr)) continue;
+
+			//Free blocks next to i get joined to it, so step past them
+		if ((j >= 0) && (!seg.blk[j].lock)) j = seg.blk[j].next;
+
+		if (*seg.blk[i].lock) *seg.blk[i].hand = 0;
+		segrelease(i);
+	}
+}
+
+static void agecache_seg(void)
+{
+	int cnt;
+	unsigned char ch, *lock;
+
+	if (seg.numblk <= 0) return;
+	for(cnt=(seg.numblk>>4);cnt>=0;cnt--)
+	{
+		if (seg.agepos >= seg.numblk) seg.agepos = 0;
+		lock = seg.blk[seg.agepos++].lock;
+		if (!lock) continue;
+		ch = *lock;
+		if (((ch-2)&255) < 198)
+			*lock = ch-1;
+	}
+}
+
+	//Loads and throws out tiles in a cache of its own, the same way with
+	//each backend, and reports how long allocache() took. The tiles are
+	//picked at random with a bias towards a busy few, like a level's art.
+void benchcache(int allocs)
+{
+	struct { int leng; void *ptr; unsigned char lock; } *tile;
+	const int numtiles = 6000, cachebytes = 8<<20;
+	intptr_t scachestart;
+	int scachesize, scachecount, scacnum, sagecount, sbackend, scurbackend;
+	cactype *scac;
+	segcache sseg;
+	void *arena;
+	unsigned int seed, t, tt, total[2], worst[2];
+	int b, i, n, x, y, misses[2];
+
+	tile = Bmalloc(numtiles*sizeof(*tile));
+	arena = Bmalloc(cachebytes);
+	scac = (cactype *)Bmalloc(max(1,cacnum)*sizeof(cactype));
+	if (!tile || !arena || !scac) { Bfree(tile); Bfree(arena); Bfree(scac); return; }
+
+	scachestart = cachestart; scachesize = cachesize; scachecount = cachecount;
+	scacnum = cacnum; sagecount = agecount; sbackend = cache1dbackend; scurbackend = cachebackend;
+	copybufbyte(cac,scac,cacnum*sizeof(cactype));
+	sseg = seg;
+	seg.blk = NULL; seg.numblk = 0; seg.spare = -1; seg.head = -1;
+
+	for(b=0;b<2;b++)
+	{
+		seed = 1;
+		for(i=0;i<numtiles;i++)
+		{
+			seed = seed*1103515245+12345; x = 8<<((seed>>16)%5);
+			seed = seed*1103515245+12345; y = 8<<((seed>>16)%5);
+			tile[i].leng = x*y; tile[i].ptr = 0; tile[i].lock = 0;
+		}
+
+		cache1dbackend = b ? CACHE1D_SEGREGATED : CACHE1D_CLASSIC;
+		initcache(arena,cachebytes);
+		for(i=0;i<16;i++)
+		{
+			tile[i].lock = 255;
+			allocache(&tile[i].ptr,tile[i].leng,&tile[i].lock);
+		}
+
+		total[b] = worst[b] = 0; misses[b] = 0;
+		for(n=0;n<allocs;n++)
+		{
+			seed = seed*1103515245+12345;
+			i = (seed>>8)%numtiles;
+			if (seed&0x80000000) i %= 400;
+			if (!tile[i].ptr)
+			{
+				tile[i].lock = 199;
+				t = getusecticks();
+				allocache(&tile[i].ptr,tile[i].leng,&tile[i].lock);
+				tt = getusecticks()-t;
+				total[b] += tt; worst[b] = max(worst[b],tt);
+				misses[b]++;
+			}
+			if (!(n&7)) agecache();
+		}
+	}
+
+	Bfree(seg.blk);
+	seg = sseg;
+	cachestart = scachestart; cachesize = scachesize; cachecount = scachecount;
+	cacnum = scacnum; agecount = sagecount; cache1dbackend = sbackend; cachebackend = scurbackend;
+	copybufbyte(scac,cac,cacnum*sizeof(cactype));
+	Bfree(scac); Bfree(arena); Bfree(tile);
+
+	buildprintf("allocache over %d tile uses in a %d byte cache:\n", allocs, cachebytes);
+	for(b=0;b<2;b++)
+		buildprintf("  %-10s %6d loads %8u us (%.2f us each, worst %u us)\n", b ? "segregated" : "classic",
+			misses[b], total[b], (double)total[b]/(double)max(1,misses[b]), worst[b]);
+}
+
 static void reportandexit(char *errormessage)
 {
     int i, j;
 
     j = 0;
+    if (cachebackend == CACHE1D_SEGREGATED) {
+        for(i=seg.head;i>=0;i=seg.blk[i].next)
+        {
+            buildprintf("%d- offs: %d, leng: %d, ",i,seg.blk[i].offs,seg.blk[i].leng);
+            if (seg.blk[i].lock) {
+                buildprintf("ptr: 0x%p, lock: %d\n",*seg.blk[i].hand,*seg.blk[i].lock);
+            } else {
+                buildprintf("free\n");
+            }
+            j += seg.blk[i].leng;
+        }
+        cacnum = 0;
+    }
     for(i=0;i<cacnum;i++)
     {
         buildprintf("%d- ",i);
@@ -406,7 +789,6 @@ static char toupperlookup[256] =
 static int numgroupfiles = 0;
 static int gnumfiles[MAXGROUPFILES];
 static int groupfil[MAXGROUPFILES] = {-1,-1,-1,-1};
-static int groupfilpos[MAXGROUPFILES];
 static char *gfilelist[MAXGROUPFILES];
 static int *gfileoffs[MAXGROUPFILES];
 
@@ -420,11 +802,118 @@ static int filehan[MAXOPENFILES] =
 	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
 };
 #ifdef WITHKPLIB
-static char filenamsav[MAXOPENFILES][260];
-static int kzcurhand = -1;
+static kzfile *filezip[MAXOPENFILES];
 #endif
 
-int initgroupfile(const char *filename)
+	//Every name in the mounted groups, hashed by its upper case form. Each
+	//chain runs from the last group mounted to the first, and from the
+	//end of each group to the start, which is the order kopen4load()
+	//has always searched in.
+typedef struct { int next, idx; short grp; } grphashent;
+static int *grphash = NULL, grphashmask = -1;
+static grphashent *grphashents = NULL;
+static mutex_type kfilelock = MUTEX_INITIALIZER;
+static cond_type kreadcond = COND_INITIALIZER;	// signalled when kreadsbusy drops to 0
+static int kreadsbusy = 0;	// kread()s into a group file made outside kfilelock
+
+static unsigned int grphashname(const char *name)
+{
+	unsigned int h = 2166136261u;
+	int j;
+
+	for(j=0;(j<12) && name[j];j++)
+		h = (h^(unsigned char)toupperlookup[(int)(unsigned char)name[j]])*16777619u;
+	return(h);
+}
+
+	//Does a group entry (12 characters, zero padded) hold this name?
+static int grpnamematch(const char *filename, const char *gfileptr)
+{
+	int j;
+
+	for(j=0;j<13;j++)
+	{
+		if (!filename[j]) break;
+		if (toupperlookup[(int)(unsigned char)filename[j]] != toupperlookup[(int)(unsigned char)gfileptr[j]])
+			return(0);
+	}
+	if (j<13 && gfileptr[j]) return(0);	// JBF: because e1l1.map might exist before e1l1
+	if (j==13 && filename[j]) return(0);	// JBF: long file name
+	return(1);
+}
+
+static void buildgrphash(void)
+{
+	int i, k, n, size;
+	unsigned int h;
+
+	if (grphash) { kfree(grphash); grphash = NULL; }
+	if (grphashents) { kfree(grphashents); grphashents = NULL; }
+	grphashmask = -1;
+
+	for(n=0,k=0;k<numgroupfiles;k++)
+		if (groupfil[k] != -1) n += gnumfiles[k];
+	if (n == 0) return;
+
+	for(size=256;size<(n<<1);size<<=1);
+	grphash = (int *)kmalloc(size*sizeof(int));
+	grphashents = (grphashent *)kmalloc(n*sizeof(grphashent));
+	if (!grphash || !grphashents)
+		{ buildprintf("Not enough memory for file grouping system\n"); exit(0); }
+	grphashmask = size-1;
+	for(i=0;i<size;i++) grphash[i] = -1;
+
+		//Adding the lowest priority entries first leaves them last in the chains
+	for(n=0,k=0;k<numgroupfiles;k++)
+	{
+		if (groupfil[k] == -1) continue;
+		for(i=0;i<gnumfiles[k];i++,n++)
+		{
+			h = grphashname(&gfilelist[k][i<<4])&grphashmask;
+			grphashents[n].grp = (short)k;
+			grphashents[n].idx = i;
+			grphashents[n].next = grphash[h];
+			grphash[h] = n;
+		}
+	}
+}
+
+	//Finds a file in the groups, searching only the first group if
+	//searchfirst is 1. Returns the index in the group, or -1.
+static int findgroupfile(const char *filename, char searchfirst, int *grp)
+{
+	int n;
+
+	if (grphashmask < 0) return(-1);
+	for(n=grphash[grphashname(filename)&grphashmask];n>=0;n=grphashents[n].next)
+	{
+		if ((searchfirst == 1) && (grphashents[n].grp != 0)) continue;
+		if (!grpnamematch(filename,&gfilelist[grphashents[n].grp][grphashents[n].idx<<4])) continue;
+		*grp = grphashents[n].grp;
+		return(grphashents[n].idx);
+	}
+	return(-1);
+}
+
+	//The search findgroupfile() replaced, kept to measure it against.
+static int findgroupfile_linear(const char *filename, char searchfirst, int *grp)
+{
+	int i, k;
+
+	for(k=numgroupfiles-1;k>=0;k--)
+	{
+		if (searchfirst == 1) k = 0;
+		if (groupfil[k] >= 0)
+		{
+			for(i=gnumfiles[k]-1;i>=0;i--)
+				if (grpnamematch(filename,&gfilelist[k][i<<4]))
+					{ *grp = k; return(i); }
+		}
+	}
+	return(-1);
+}
+
+static int initgroupfile_nolock(const char *filename)
 {
 	char buf[16];
 	int i, j, k;
@@ -463,7 +952,6 @@ int initgroupfile(const char *filename)
 	if (groupfil[numgroupfiles] != -1)
 #endif
 	{
-		groupfilpos[numgroupfiles] = 0;
 		Bread(groupfil[numgroupfiles],buf,16);
 		if ((buf[0] != 'K') || (buf[1] != 'e') || (buf[2] != 'n') ||
 			 (buf[3] != 'S') || (buf[4] != 'i') || (buf[5] != 'l') ||
@@ -494,10 +982,11 @@ int initgroupfile(const char *filename)
 		gfileoffs[numgroupfiles][gnumfiles[numgroupfiles]] = j;
 	}
 	numgroupfiles++;
+	buildgrphash();
 	return(groupfil[numgroupfiles-1]);
 }
 
-void uninitsinglegroupfile(int grphandle)
+static void uninitsinglegroupfile_nolock(int grphandle)
 {
 	int i, grpnum = -1;
 
@@ -522,7 +1011,6 @@ void uninitsinglegroupfile(int grphandle)
 		if (groupfil[i] != -1) {
 			groupfil[i-1]    = groupfil[i];
 			gnumfiles[i-1]   = gnumfiles[i];
-			groupfilpos[i-1] = groupfilpos[i];
 			gfilelist[i-1]   = gfilelist[i];
 			gfileoffs[i-1]   = gfileoffs[i];
 			groupfil[i] = -1;
@@ -537,9 +1025,11 @@ void uninitsinglegroupfile(int grphandle)
 		else if (filegrp[i] > grpnum)   // move back a file in a group after the one we closed
 			filegrp[i]--;
 	}
+
+	buildgrphash();
 }
 
-void uninitgroupfile(void)
+static void uninitgroupfile_nolock(void)
 {
 	int i;
 
@@ -558,12 +1048,13 @@ void uninitgroupfile(void)
 		if (filegrp[i] < 254)   // JBF 20040130: not external or ZIPped
 			filehan[i] = -1;
 	}
+
+	buildgrphash();
 }
 
-int kopen4load(const char *filename, char searchfirst)
+static int kopen4load_nolock(const char *filename, char searchfirst)
 {
-	int i, j, k, fil, newhandle;
-	char bad, *gfileptr;
+	int i, k, fil, newhandle;
 
 	newhandle = MAXOPENFILES-1;
 	while (filehan[newhandle] != -1)
@@ -588,88 +1079,65 @@ int kopen4load(const char *filename, char searchfirst)
 	for (; toupperlookup[(int)(unsigned char)*filename] == '/'; filename++);
 	
 #ifdef WITHKPLIB
-	if ((kzcurhand != newhandle) && (kztell() >= 0))
-	{
-		if (kzcurhand >= 0) filepos[kzcurhand] = kztell();
-		kzclose();
-	}
-	if (searchfirst != 1 && (i = kzipopen(filename)) != 0) {
-		kzcurhand = newhandle;
+	if (searchfirst != 1 && (filezip[newhandle] = kzipopen(filename)) != NULL) {
 		filegrp[newhandle] = 254;
-		filehan[newhandle] = i;
+		filehan[newhandle] = 1;
 		filepos[newhandle] = 0;
-		strcpy(filenamsav[newhandle],filename);
 		return newhandle;
 	}
 #endif
 
-	for(k=numgroupfiles-1;k>=0;k--)
+	if ((i = findgroupfile(filename,searchfirst,&k)) >= 0)
 	{
-		if (searchfirst == 1) k = 0;
-		if (groupfil[k] >= 0)
-		{
-			for(i=gnumfiles[k]-1;i>=0;i--)
-			{
-				gfileptr = (char *)&gfilelist[k][i<<4];
-
-				bad = 0;
-				for(j=0;j<13;j++)
-				{
-					if (!filename[j]) break;
-					if (toupperlookup[(int)(unsigned char)filename[j]] != toupperlookup[(int)(unsigned char)gfileptr[j]])
-						{ bad = 1; break; }
-				}
-				if (bad) continue;
-				if (j<13 && gfileptr[j]) continue;   // JBF: because e1l1.map might exist before e1l1
-				if (j==13 && filename[j]) continue;   // JBF: long file name
-
-				filegrp[newhandle] = k;
-				filehan[newhandle] = i;
-				filepos[newhandle] = 0;
-				return(newhandle);
-			}
-		}
+		filegrp[newhandle] = k;
+		filehan[newhandle] = i;
+		filepos[newhandle] = 0;
+		return(newhandle);
 	}
 	return(-1);
 }
 
+	//Group files are read with Bpread() at the handle's own position, so
+	//handles into one group don't move each other around and the lock is
+	//only held while working out where to read. uninitgroupfile() and
+	//uninitsinglegroupfile() wait for reads under way before closing
+	//groups. Only one thread may use a handle at a time.
 int kread(int handle, void *buffer, int leng)
 {
-	int i, filenum, groupnum;
+	int fil, filenum, groupnum, ofs;
 
+	mutex_lock(&kfilelock);
 	filenum = filehan[handle];
 	groupnum = filegrp[handle];
-	if (groupnum == 255) return(Bread(filenum,buffer,leng));
-#ifdef WITHKPLIB
-	else if (groupnum == 254)
+	if (groupnum == 255)
 	{
-		if (kzcurhand != handle)
-		{
-			if (kztell() >= 0) { filepos[kzcurhand] = kztell(); kzclose(); }
-			kzcurhand = handle;
-			kzipopen(filenamsav[handle]);
-			kzseek(filepos[handle],SEEK_SET);
-		}
-		return(kzread(buffer,leng));
+		mutex_unlock(&kfilelock);
+		return(Bread(filenum,buffer,leng));
 	}
-#endif
-
-	if (groupfil[groupnum] != -1)
+#ifdef WITHKPLIB
+	else if (groupnum == 254)
 	{
-		i = gfileoffs[groupnum][filenum]+filepos[handle];
-		if (i != groupfilpos[groupnum])
-		{
-			Blseek(groupfil[groupnum],i+((gnumfiles[groupnum]+1)<<4),BSEEK_SET);
-			groupfilpos[groupnum] = i;
-		}
-		leng = min(leng,(gfileoffs[groupnum][filenum+1]-gfileoffs[groupnum][filenum])-filepos[handle]);
-		leng = Bread(groupfil[groupnum],buffer,leng);
-		filepos[handle] += leng;
-		groupfilpos[groupnum] += leng;
+		leng = kzhread(filezip[handle],buffer,leng);
+		mutex_unlock(&kfilelock);
 		return(leng);
 	}
+#endif
 
-	return(0);
+	fil = groupfil[groupnum];
+	if (fil == -1) { mutex_unlock(&kfilelock); return(0); }
+	ofs = gfileoffs[groupnum][filenum]+filepos[handle]+((gnumfiles[groupnum]+1)<<4);
+	leng = min(leng,(gfileoffs[groupnum][filenum+1]-gfileoffs[groupnum][filenum])-filepos[handle]);
+	if (leng <= 0) { mutex_unlock(&kfilelock); return(0); }
+	kreadsbusy++;
+	mutex_unlock(&kfilelock);
+
+	leng = (int)Bpread(fil,buffer,leng,ofs);
+
+	mutex_lock(&kfilelock);
+	if (leng > 0) filepos[handle] += leng;
+	if (--kreadsbusy == 0) cond_broadcast(&kreadcond);
+	mutex_unlock(&kfilelock);
+	return(leng);
 }
 
 int kgetc(int handle)
@@ -682,7 +1150,7 @@ int kgetc(int handle)
 	return (int)ch;
 }
 
-int klseek(int handle, int offset, int whence)
+static int klseek_nolock(int handle, int offset, int whence)
 {
 	int i, groupnum;
 
@@ -692,14 +1160,7 @@ int klseek(int handle, int offset, int whence)
 #ifdef WITHKPLIB
 	else if (groupnum == 254)
 	{
-		if (kzcurhand != handle)
-		{
-			if (kztell() >= 0) { filepos[kzcurhand] = kztell(); kzclose(); }
-			kzcurhand = handle;
-			kzipopen(filenamsav[handle]);
-			kzseek(filepos[handle],SEEK_SET);
-		}
-		return(kzseek(offset,whence));
+		return(kzhseek(filezip[handle],offset,whence));
 	}
 #endif
 
@@ -718,7 +1179,7 @@ int klseek(int handle, int offset, int whence)
 	return(-1);
 }
 
-int kfilelength(int handle)
+static int kfilelength_nolock(int handle)
 {
 	int i, groupnum;
 
@@ -730,21 +1191,14 @@ int kfilelength(int handle)
 #ifdef WITHKPLIB
 	else if (groupnum == 254)
 	{
-		if (kzcurhand != handle)
-		{
-			if (kztell() >= 0) { filepos[kzcurhand] = kztell(); kzclose(); }
-			kzcurhand = handle;
-			kzipopen(filenamsav[handle]);
-			kzseek(filepos[handle],SEEK_SET);
-		}
-		return kzfilelength();
+		return kzhfilelength(filezip[handle]);
 	}
 #endif
 	i = filehan[handle];
 	return(gfileoffs[groupnum][i+1]-gfileoffs[groupnum][i]);
 }
 
-int ktell(int handle)
+static int ktell_nolock(int handle)
 {
 	int i, groupnum;
 
@@ -754,14 +1208,7 @@ int ktell(int handle)
 #ifdef WITHKPLIB
 	else if (groupnum == 254)
 	{
-		if (kzcurhand != handle)
-		{
-			if (kztell() >= 0) { filepos[kzcurhand] = kztell(); kzclose(); }
-			kzcurhand = handle;
-			kzipopen(filenamsav[handle]);
-			kzseek(filepos[handle],SEEK_SET);
-		}
-		return kztell();
+		return kzhtell(filezip[handle]);
 	}
 #endif
 	if (groupfil[groupnum] != -1)
@@ -769,15 +1216,15 @@ int ktell(int handle)
 	return(-1);
 }
 
-void kclose(int handle)
+static void kclose_nolock(int handle)
 {
 	if (handle < 0) return;
 	if (filegrp[handle] == 255) Bclose(filehan[handle]);
 #ifdef WITHKPLIB
 	else if (filegrp[handle] == 254)
 	{
-		kzclose();
-		kzcurhand = -1;
+		kzhclose(filezip[handle]);
+		filezip[handle] = NULL;
 	}
 #endif
 	filehan[handle] = -1;
@@ -863,7 +1310,7 @@ void klistfree(CACHE1D_FIND_REC *rec)
 	}
 }
 
-CACHE1D_FIND_REC *klistpath(const char *_path, const char *mask, int type)
+static CACHE1D_FIND_REC *klistpath_nolock(const char *_path, const char *mask, int type)
 {
 	CACHE1D_FIND_REC *rec = NULL;
 	char *path;
@@ -1039,6 +1486,190 @@ failure:
 	return NULL;
 }
 
+	//The file functions can be used from more than one thread, so each
+	//takes kfilelock around the unlocked version above. kread() does its
+	//own locking.
+
+int initgroupfile(const char *filename)
+{
+	int r;
+
+	mutex_lock(&kfilelock);
+	r = initgroupfile_nolock(filename);
+	mutex_unlock(&kfilelock);
+	return r;
+}
+
+void uninitsinglegroupfile(int grphandle)
+{
+	mutex_lock(&kfilelock);
+	while (kreadsbusy > 0) cond_wait(&kreadcond,&kfilelock);
+	uninitsinglegroupfile_nolock(grphandle);
+	mutex_unlock(&kfilelock);
+}
+
+void uninitgroupfile(void)
+{
+	mutex_lock(&kfilelock);
+	while (kreadsbusy > 0) cond_wait(&kreadcond,&kfilelock);
+	uninitgroupfile_nolock();
+	mutex_unlock(&kfilelock);
+}
+
+int kopen4load(const char *filename, char searchfirst)
+{
+	int r;
+
+	mutex_lock(&kfilelock);
+	r = kopen4load_nolock(filename,searchfirst);
+	mutex_unlock(&kfilelock);
+	return r;
+}
+
+int klseek(int handle, int offset, int whence)
+{
+	int r;
+
+	mutex_lock(&kfilelock);
+	r = klseek_nolock(handle,offset,whence);
+	mutex_unlock(&kfilelock);
+	return r;
+}
+
+int kfilelength(int handle)
+{
+	int r;
+
+	mutex_lock(&kfilelock);
+	r = kfilelength_nolock(handle);
+	mutex_unlock(&kfilelock);
+	return r;
+}
+
+int ktell(int handle)
+{
+	int r;
+
+	mutex_lock(&kfilelock);
+	r = ktell_nolock(handle);
+	mutex_unlock(&kfilelock);
+	return r;
+}
+
+void kclose(int handle)
+{
+	mutex_lock(&kfilelock);
+	kclose_nolock(handle);
+	mutex_unlock(&kfilelock);
+}
+
+CACHE1D_FIND_REC *klistpath(const char *_path, const char *mask, int type)
+{
+	CACHE1D_FIND_REC *r;
+
+	mutex_lock(&kfilelock);
+	r = klistpath_nolock(_path,mask,type);
+	mutex_unlock(&kfilelock);
+	return r;
+}
+
+	//Looks up names from the mounted groups, and some that aren't there,
+	//with the hash and with the old search, then opens them all.
+void benchgroupfiles(int opens)
+{
+	char (*names)[13];
+	int i, k, n, total, grp1, grp2, bad = 0;
+	unsigned int seed = 1, t, tlin, thash, topen;
+
+	for(total=0,k=0;k<numgroupfiles;k++)
+		if (groupfil[k] != -1) total += gnumfiles[k];
+	if (total == 0) { buildprintf("No group files are mounted\n"); return; }
+
+	names = (char (*)[13])Bmalloc(opens*13);
+	if (!names) return;
+	for(n=0;n<opens;n++)
+	{
+		seed = seed*1103515245+12345;
+		if ((seed>>16)%8 == 0)
+		{
+			Bsprintf(names[n],"NOFILE%d.DAT",n%10000);
+			continue;
+		}
+		i = (seed>>8)%total;
+		for(k=0;(groupfil[k] == -1) || (i >= gnumfiles[k]);k++)
+			if (groupfil[k] != -1) i -= gnumfiles[k];
+		Bmemcpy(names[n],&gfilelist[k][i<<4],12);
+		names[n][12] = 0;
+		if (n&1) Bstrlwr(names[n]);
+	}
+
+	mutex_lock(&kfilelock);
+	t = getusecticks();
+	for(n=0;n<opens;n++) findgroupfile_linear(names[n],0,&grp1);
+	tlin = getusecticks()-t;
+	t = getusecticks();
+	for(n=0;n<opens;n++) findgroupfile(names[n],0,&grp2);
+	thash = getusecticks()-t;
+	for(n=0;n<opens;n++)
+	{
+		grp1 = grp2 = -1;
+		if ((findgroupfile_linear(names[n],0,&grp1) != findgroupfile(names[n],0,&grp2)) || (grp1 != grp2)) bad++;
+	}
+	mutex_unlock(&kfilelock);
+
+	t = getusecticks();
+	for(n=0;n<opens;n++)
+		if ((i = kopen4load(names[n],2)) >= 0) kclose(i);
+	topen = getusecticks()-t;
+
+	buildprintf("%d lookups in %d group entries:\n", opens, total);
+	buildprintf("  linear %8u us (%.3f us each)\n", tlin, (double)tlin/(double)opens);
+	buildprintf("  hashed %8u us (%.3f us each)\n", thash, (double)thash/(double)opens);
+	buildprintf("  kopen4load+kclose %8u us (%.3f us each)\n", topen, (double)topen/(double)opens);
+	if (bad) buildprintf("  %d lookups found different files!\n", bad);
+
+	Bfree(names);
+}
+
+void benchloadfile(const char *filename, int times)
+{
+	char *buf;
+	int fil, leng, n, xsiz = 0, ysiz = 0;
+	unsigned int t, tread, trend;
+	void *pic;
+
+	if ((fil = kopen4load(filename,0)) < 0) { buildprintf("Could not open %s\n", filename); return; }
+	leng = kfilelength(fil);
+	buf = (char *)Bmalloc(max(1,leng));
+	if (!buf) { kclose(fil); return; }
+
+		//Seeking back to the start makes a compressed file be inflated again.
+	t = getusecticks();
+	for(n=0;n<times;n++)
+	{
+		klseek(fil,0,BSEEK_SET);
+		if (kread(fil,buf,leng) != leng) { buildprintf("Could not read %s\n", filename); break; }
+	}
+	tread = getusecticks()-t;
+	kclose(fil);
+	buildprintf("%s: %d bytes\n", filename, leng);
+	buildprintf("  kread      %8u us (%.3f MB/s)\n", tread/times, (double)leng*times/max(1,tread));
+
+#ifdef WITHKPLIB
+	kpgetdim(buf,leng,&xsiz,&ysiz);
+	if ((xsiz > 0) && (ysiz > 0) && (pic = Bmalloc(xsiz*ysiz*4)))
+	{
+		t = getusecticks();
+		for(n=0;n<times;n++) kprender(buf,leng,pic,xsiz*4,xsiz,ysiz,0,0);
+		trend = getusecticks()-t;
+		buildprintf("  kprender   %8u us (%.3f Mpixels/s, %dx%d)\n", trend/times, (double)xsiz*ysiz*times/max(1,trend), xsiz, ysiz);
+		Bfree(pic);
+	}
+#endif
+
+	Bfree(buf);
+}
+
 	//Internal LZW variables
 #define LZWSIZE 16384           //Watch out for shorts!
 static unsigned char *lzwbuf1, *lzwbuf4, *lzwbuf5, lzwbuflock[5];
@@ -18,6 +18,7 @@
 #define _WIN32_WINNT 0x0600
 #include <windows.h>
 #include <shlobj.h>
+#include <io.h>	// for _get_osfhandle
 #endif
 
 #include <stdio.h>
@@ -49,6 +50,10 @@
 #  include <sys/sysctl.h> // for sysctl() to get path to executable
 #endif
 
+#if !defined(_WIN32) && !defined(__WATCOMC__)
+#  include <sys/mman.h>
+#endif
+
 #include "compat.h"
 
 
@@ -589,6 +594,88 @@ boff_t Bfilelength(int fd)
 }
 
 
+//
+// Bpread() -- reads from a given place in an open file without going
+//   through the file's own position, so any number of threads can read
+//   from one file at once. On Windows the position is left just past
+//   what was read, so don't mix this with Bread() and Blseek().
+//
+bssize_t Bpread(int fd, void *buf, bsize_t count, boff_t offset)
+{
+#ifdef _WIN32
+	OVERLAPPED ov;
+	HANDLE fh;
+	DWORD got;
+
+	fh = (HANDLE)_get_osfhandle(fd);
+	if (fh == INVALID_HANDLE_VALUE) return -1;
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)((int64_t)offset >> 32);
+	if (!ReadFile(fh, buf, (DWORD)count, &got, &ov)) {
+		return (GetLastError() == ERROR_HANDLE_EOF) ? 0 : -1;
+	}
+	return (bssize_t)got;
+#else
+	return pread(fd, buf, count, offset);
+#endif
+}
+
+
+//
+// Bmapfile() -- maps the first len bytes of an open file into memory,
+//   followed by at least slack bytes of zeroes. The pages are copied on
+//   write and changes never reach the file. Returns NULL if the file can't
+//   be mapped, which on Windows includes when the slack would not fit in
+//   the last page.
+//
+void *Bmapfile(int fd, bsize_t len, bsize_t slack)
+{
+#ifdef _WIN32
+	SYSTEM_INFO sysinfo;
+	HANDLE fh, mh;
+	void *p;
+
+	GetSystemInfo(&sysinfo);
+	if (len == 0) return NULL;
+	if ((len + slack - 1) / sysinfo.dwPageSize != (len - 1) / sysinfo.dwPageSize) return NULL;
+
+	fh = (HANDLE)_get_osfhandle(fd);
+	if (fh == INVALID_HANDLE_VALUE) return NULL;
+	mh = CreateFileMapping(fh, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (!mh) return NULL;
+	p = MapViewOfFile(mh, FILE_MAP_COPY, 0, 0, len);
+	CloseHandle(mh);	// the view keeps the mapping open
+	return p;
+#elif defined(MAP_PRIVATE)
+	char *p;
+
+	if (len == 0) return NULL;
+
+		// Reserve room for the slack, then lay the file over the start.
+	p = (char *)mmap(NULL, len + slack, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) return NULL;
+	if (mmap(p, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(p, len + slack);
+		return NULL;
+	}
+	return p;
+#else
+	return NULL;
+#endif
+}
+
+void Bunmapfile(void *addr, bsize_t len, bsize_t slack)
+{
+	if (!addr) return;
+#ifdef _WIN32
+	UnmapViewOfFile(addr);
+#elif defined(MAP_PRIVATE)
+	munmap(addr, len + slack);
+#endif
+}
+
+
 typedef struct {
 #ifdef _MSC_VER
 	HANDLE hfind;
@@ -872,4 +959,21 @@ size_t Bgetsysmemsize(void)
 }
 
 
+//
+// getsyscpucount() -- gets the number of processors available to the process
+//
+int Bgetsyscpucount(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO sysinfo;
 
+	GetSystemInfo(&sysinfo);
+	return max(1, (int)sysinfo.dwNumberOfProcessors);
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (ncpu > 0) ? (int)ncpu : 1;
+#else
+	return 1;
+#endif
+}
@@ -111,6 +111,12 @@ static struct {
 	{ "glusetexcache", type_bool, &glusetexcache,
 		"; OpenGL mode options\n"
 	},
+	{ "gltexcachesize", type_int, &gltexcachesize,
+		"; Compressed texture cache size limit in megabytes, 0 for none\n"
+	},
+	{ "glusepalettelookup", type_bool, &glusepalettelookup,
+		"; Keep ART tiles as palette indices and colour them in the shader\n"
+	},
 #endif
 #ifdef RENDERTYPEWIN
 	{ "maxrefreshfreq", type_int, &maxrefreshfreq,
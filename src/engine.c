@@ -14,6 +14,10 @@
 #include "a.h"
 #include "osd.h"
 #include "crc32.h"
+#include "threadpool.h"
+#include "thread_priv.h"
+#include "tilestream.h"
+#include "profile.h"
 
 #include "baselayer.h"
 
@@ -44,6 +48,13 @@ int usevoxels = 1;
 #define kloadvoxel loadvoxel
 
 int novoxmips = 0;
+int drawthreads = 0;
+int tilestreaming = 0;
+int mapartfiles = 0;
+int usesectorgrid = 1;
+int useslopecache = 0;
+int usepvs = 1;
+int hitscanthreads = 1;
 
 	//These variables need to be copied into BUILD
 #define MAXXSIZ 256
@@ -54,27 +65,29 @@ intptr_t voxoff[MAXVOXELS][MAXVOXMIPS];
 unsigned char voxlock[MAXVOXELS][MAXVOXMIPS];
 int voxscale[MAXVOXELS];
 
-static int ggxinc[MAXXSIZ+1], ggyinc[MAXXSIZ+1];
-static int lowrecip[1024], nytooclose, nytoofar;
-static unsigned int distrecip[65536];
+static RENDERTLS int ggxinc[MAXXSIZ+1], ggyinc[MAXXSIZ+1];
+static int lowrecip[1024];
+static RENDERTLS int nytooclose, nytoofar;
+static RENDERTLS unsigned int *distrecip;
+static unsigned int screendistrecip[65536];
 
 static int *lookups = NULL;
 int dommxoverlay = 1, beforedrawrooms = 1;
 
-static int oxdimen = -1, oviewingrange = -1, oxyaspect = -1;
+static RENDERTLS int oxdimen = -1, oviewingrange = -1, oxyaspect = -1;
 
 int curbrightness = 0, gammabrightness = 0;
 float curgamma = 1.0;
 
 	//Textured Map variables
-static unsigned char globalpolytype;
-static short *dotp1[MAXYDIM], *dotp2[MAXYDIM];
+static RENDERTLS unsigned char globalpolytype;
+static RENDERTLS short *dotp1[MAXYDIM], *dotp2[MAXYDIM];
 
 static unsigned char tempbuf[MAXWALLS];
 
 int ebpbak, espbak;
 #define SLOPALOOKUPSIZ (MAXXDIM<<1)
-intptr_t slopalookup[SLOPALOOKUPSIZ];
+RENDERTLS intptr_t slopalookup[SLOPALOOKUPSIZ];
 #if USE_POLYMOST && USE_OPENGL
 palette_t palookupfog[MAXPALOOKUPS];
 #endif
@@ -88,7 +101,8 @@ int tilefileoffs[MAXTILES];
 int artsize = 0, cachesize = 0;
 int editorgridextent = 131072;
 
-static short radarang[1280], radarang2[MAXXDIM];
+static short radarang[1280], screenradarang2[MAXXDIM];
+static RENDERTLS short *radarang2;
 static unsigned short sqrtable[4096], shlookup[4096+256];
 unsigned char pow2char[8] = {1,2,4,8,16,32,64,128};
 int pow2long[32] =
@@ -426,70 +440,76 @@ static inline int getclipmask(int a, int b, int c, int d)
 #endif
 
 
-int xb1[MAXWALLSB];
-static int yb1[MAXWALLSB], xb2[MAXWALLSB], yb2[MAXWALLSB];
-int rx1[MAXWALLSB], ry1[MAXWALLSB];
-static int rx2[MAXWALLSB], ry2[MAXWALLSB];
-short p2[MAXWALLSB];
-short thesector[MAXWALLSB], thewall[MAXWALLSB];
+RENDERTLS int xb1[MAXWALLSB];
+static RENDERTLS int yb1[MAXWALLSB], xb2[MAXWALLSB], yb2[MAXWALLSB];
+RENDERTLS int rx1[MAXWALLSB], ry1[MAXWALLSB];
+static RENDERTLS int rx2[MAXWALLSB], ry2[MAXWALLSB];
+RENDERTLS short p2[MAXWALLSB];
+RENDERTLS short thesector[MAXWALLSB], thewall[MAXWALLSB];
 
-short bunchfirst[MAXWALLSB], bunchlast[MAXWALLSB];
+RENDERTLS short bunchfirst[MAXWALLSB], bunchlast[MAXWALLSB];
+static RENDERTLS unsigned char bunchseen[MAXWALLSB];
 
-static short smost[MAXYSAVES], smostcnt;
-static short smoststart[MAXWALLSB];
-static unsigned char smostwalltype[MAXWALLSB];
-static int smostwall[MAXWALLSB], smostwallcnt = -1L;
+static RENDERTLS short *smost;
+static short screensmost[MAXYSAVES];
+static RENDERTLS short smostcnt;
+static RENDERTLS short smoststart[MAXWALLSB];
+static RENDERTLS unsigned char smostwalltype[MAXWALLSB];
+static RENDERTLS int smostwall[MAXWALLSB], smostwallcnt = -1L;
 
-short maskwall[MAXWALLSB], maskwallcnt;
-static int spritesx[MAXSPRITESONSCREEN];
-static int spritesy[MAXSPRITESONSCREEN+1];
-static int spritesz[MAXSPRITESONSCREEN];
-spritetype *tspriteptr[MAXSPRITESONSCREEN];
+RENDERTLS short maskwall[MAXWALLSB], maskwallcnt;
+static RENDERTLS int spritesx[MAXSPRITESONSCREEN];
+static RENDERTLS int spritesy[MAXSPRITESONSCREEN+1];
+static RENDERTLS int spritesz[MAXSPRITESONSCREEN];
+RENDERTLS spritetype *tspriteptr[MAXSPRITESONSCREEN];
 
-short umost[MAXXDIM], dmost[MAXXDIM];
+RENDERTLS short umost[MAXXDIM], dmost[MAXXDIM];
 static short bakumost[MAXXDIM], bakdmost[MAXXDIM];
-short uplc[MAXXDIM], dplc[MAXXDIM];
-static short uwall[MAXXDIM], dwall[MAXXDIM];
-static int swplc[MAXXDIM], lplc[MAXXDIM];
-static int swall[MAXXDIM], lwall[MAXXDIM+4];
-int xdimen = -1, xdimenrecip, halfxdimen, xdimenscale, xdimscale;
-int wx1, wy1, wx2, wy2, ydimen, ydimenscale;
-intptr_t frameoffset;
-
-static int nrx1[8], nry1[8], nrx2[8], nry2[8];	// JBF 20031206: Thanks Ken
-
-static int rxi[8], ryi[8], rzi[8], rxi2[8], ryi2[8], rzi2[8];
-static int xsi[8], ysi[8], *horizlookup=0, *horizlookup2=0, horizycent;
-
-int globalposx, globalposy, globalposz, globalhoriz;
-short globalang, globalcursectnum;
-int globalpal, cosglobalang, singlobalang;
-int cosviewingrangeglobalang, sinviewingrangeglobalang;
-unsigned char *globalpalwritten;
-int globaluclip, globaldclip, globvis;
-int globalvisibility, globalhisibility, globalpisibility, globalcisibility;
-unsigned char globparaceilclip, globparaflorclip;
-
-int viewingrangerecip;
-
-int asm1, asm2, asm4;
-intptr_t asm3;
-int vplce[4], vince[4];
-intptr_t palookupoffse[4], bufplce[4];
-unsigned char globalxshift, globalyshift;
-int globalxpanning, globalypanning, globalshade;
-short globalpicnum, globalshiftval;
-int globalzd, globalyscale, globalorientation;
-intptr_t globalbufplc;
-int globalx1, globaly1, globalx2, globaly2, globalx3, globaly3, globalzx;
-int globalx, globaly, globalz;
-
-short sectorborder[256], sectorbordercnt;
+RENDERTLS short uplc[MAXXDIM], dplc[MAXXDIM];
+static RENDERTLS short uwall[MAXXDIM], dwall[MAXXDIM];
+static RENDERTLS int swplc[MAXXDIM], lplc[MAXXDIM];
+static RENDERTLS int swall[MAXXDIM], lwall[MAXXDIM+4];
+RENDERTLS int xdimen = -1, xdimenrecip, halfxdimen, xdimenscale, xdimscale;
+RENDERTLS int wx1, wy1, wx2, wy2, ydimen, ydimenscale;
+RENDERTLS intptr_t frameoffset;
+
+static RENDERTLS int nrx1[8], nry1[8], nrx2[8], nry2[8];	// JBF 20031206: Thanks Ken
+
+static RENDERTLS int rxi[8], ryi[8], rzi[8], rxi2[8], ryi2[8], rzi2[8];
+static RENDERTLS int xsi[8], ysi[8], *horizlookup=0, *horizlookup2=0, horizycent;
+
+RENDERTLS int globalposx, globalposy, globalposz;
+RENDERTLS int globalhoriz;
+RENDERTLS short globalang, globalcursectnum;
+RENDERTLS int globalpal;
+RENDERTLS int cosglobalang, singlobalang;
+RENDERTLS int cosviewingrangeglobalang, sinviewingrangeglobalang;
+RENDERTLS unsigned char *globalpalwritten;
+RENDERTLS int globaluclip, globaldclip;
+RENDERTLS int globvis;
+RENDERTLS int globalvisibility, globalhisibility, globalpisibility, globalcisibility;
+RENDERTLS unsigned char globparaceilclip, globparaflorclip;
+
+RENDERTLS int viewingrangerecip;
+
+RENDERTLS int asm1, asm2, asm4;
+RENDERTLS intptr_t asm3;
+RENDERTLS int vplce[4], vince[4];
+RENDERTLS intptr_t palookupoffse[4], bufplce[4];
+RENDERTLS unsigned char globalxshift, globalyshift;
+RENDERTLS int globalxpanning, globalypanning, globalshade;
+RENDERTLS short globalpicnum, globalshiftval;
+RENDERTLS int globalzd, globalyscale, globalorientation;
+RENDERTLS intptr_t globalbufplc;
+RENDERTLS int globalx1, globaly1, globalx2, globaly2, globalx3, globaly3, globalzx;
+RENDERTLS int globalx, globaly, globalz;
+
+RENDERTLS short sectorborder[256], sectorbordercnt;
 int pageoffset, ydim16, qsetmode = 0;
 int startposx, startposy, startposz;
 short startang, startsectnum;
 short pointhighlight, linehighlight, highlightcnt;
-int lastx[MAXYDIM];
+RENDERTLS int lastx[MAXYDIM];
 unsigned char *transluc = NULL;
 
 int halfxdim16, midydim16;
@@ -502,16 +522,36 @@ static int colnext[256];
 static unsigned char coldist[8] = {0,1,2,3,4,3,2,1};
 static int colscan[27];
 
-static short clipnum, hitwalls[4];
 int hitscangoalx = (1<<29)-1, hitscangoaly = (1<<29)-1;
 #if USE_POLYMOST
 int hitallsprites = 0;
 #endif
 
-typedef struct { int x1, y1, x2, y2; } linetype;
-static linetype clipit[MAXCLIPNUM];
-static short clipsectorlist[MAXCLIPNUM], clipsectnum;
-static short clipobjectval[MAXCLIPNUM];
+	// The scratch space clipmove() and the others use when they aren't
+	// given their own
+static clipcontexttype clipctx;
+
+	// What each sector's slope plane is measured from, so the slope
+	// functions and hitscan() needn't chase wall[].point2 and take a square
+	// root every call. See updatesectorgeometry().
+static struct {
+	int x[MAXSECTORS], y[MAXSECTORS];	// the first wall's point,
+	int dx[MAXSECTORS], dy[MAXSECTORS];	// its edge vector,
+	int len[MAXSECTORS];			// and nsqrtasm(dx*dx+dy*dy)
+} sectorgeom;
+static int mapgeomnumsectors = -1, mapgeomnumwalls = -1, mapgeomdirty = 1;
+#define mapgeomvalid() (!mapgeomdirty && (mapgeomnumsectors == numsectors) && (mapgeomnumwalls == numwalls))
+#define mapgeomcurrent() (useslopecache && mapgeomvalid())
+
+	// Potentially visible sets from the .pvs file pvsbuild made for the map,
+	// if there was one. Bit b of row a is set if sector b might be seen from
+	// anywhere in sector a. Set aside for good as soon as any wall moves.
+#define PVSVERSION 1
+static unsigned char *pvsdata = NULL;
+static int pvsrowbytes = 0, pvsnumsectors = -1, pvsnumwalls = -1;
+#define pvscurrent() (usepvs && pvsdata && (pvsnumsectors == numsectors) && (pvsnumwalls == numwalls))
+#define pvsvisible(a,b) (pvsdata[(a)*pvsrowbytes+((b)>>3)]&pow2char[(b)&7])
+RENDERTLS const unsigned char *pvsview = NULL;
 
 typedef struct
 {
@@ -525,7 +565,7 @@ typedef struct
 static permfifotype permfifo[MAXPERMS];
 static int permhead = 0, permtail = 0;
 
-short numscans, numhits, numbunches;
+RENDERTLS short numscans, numhits, numbunches;
 
 static short capturecount = 0;
 static char capturename[20], captureatnextpage = 0;
@@ -549,7 +589,81 @@ double msens = 1.0;
 static char artfilename[20];
 static int numtilefiles, artfil = -1, artfilnum, artfilplc;
 
+	// Tiles being read by the loading thread point at this until
+	// committiles() puts them in the cache. It is big enough for any tile
+	// loadpics() found.
+static unsigned char *tileplaceholder = NULL;
+static int tileplaceholdersiz = 0;
+static int streamtile(short tilenume);
+static void committiles(void);
+static void stopstreaming(void);
+static void buildsectorgrid(void);
+static void freesectorgrid(void);
+static void buildmapgeometry(void);
+static void loadmapgeometry(void);
+static void loadpvs(const char *filename, char fromwhere);
+static void freepvs(void);
+
+	// ART files mapped into memory by loadpics(). Their tiles point
+	// straight at the mapped pixels and never enter the cache.
+#define ARTMAPSLACK 16	// tiles in the cache are rounded up to 16 bytes, so may be read past
+static unsigned char *artmap[MAXTILEFILES];
+static int artmaplen[MAXTILEFILES];
+static void unmapartfiles(void);
+static void unmaptile(short tilenume, int siz);
+	//Does tile i point into the mapping of its ART file?
+#define tilemapped(i) (artmap[tilefilenum[i]] && (waloff[i] >= (intptr_t)artmap[tilefilenum[i]]) && \
+	(waloff[i] < (intptr_t)(artmap[tilefilenum[i]]+artmaplen[tilefilenum[i]])))
+
 char inpreparemirror = 0;
+
+	// Everything a view is drawn from: the target buffer and window, the
+	// tables derived from them, and what drawrooms() was last given. While
+	// a context is bound to a thread, its state lives in that thread's
+	// RENDERTLS variables and this copy is stale.
+struct rendercontext {
+	intptr_t frameplace;
+	int bytesperline, xdim, ydim, ylookup[MAXYDIM+1];
+	int windowx1, windowy1, windowx2, windowy2, wx1, wy1, wx2, wy2;
+	short startumost[MAXXDIM], startdmost[MAXXDIM];
+	int xdimen, xdimenrecip, halfxdimen, xdimenscale, xdimscale, ydimen, ydimenscale;
+	int viewingrange, viewingrangerecip, yxaspect, xyaspect;
+#if USE_POLYMOST
+	int rendmode;
+#endif
+
+	int *horizlookup, *horizlookup2, horizycent;
+	unsigned int *distrecip;
+	short *radarang2, *smost;
+	int oxdimen, oviewingrange, oxyaspect, nytooclose, nytoofar;
+
+	int globalposx, globalposy, globalposz, globalhoriz;
+	short globalang, globalcursectnum;
+	int cosglobalang, singlobalang, cosviewingrangeglobalang, sinviewingrangeglobalang;
+	int globaluclip, globaldclip;
+	int globalvisibility, globalhisibility, globalpisibility, globalcisibility;
+	unsigned char globparaceilclip, globparaflorclip;
+	intptr_t frameoffset;
+	int totalclocklock;
+
+	void *tables;	// what horizlookup, distrecip, radarang2 and smost point into
+};
+static rendercontext screencontext;
+static RENDERTLS rendercontext *currendercontext = NULL;
+
+	// The tile cache and the game's callbacks are only ever used from the
+	// thread that started the engine. Others draw what is already loaded.
+static RENDERTLS char enginethread = 0;
+
+	// Strip rendering: each worker thread draws the columns stripx1..stripx2
+	// of the view, while the main thread keeps what drawmasks() relies on.
+static RENDERTLS char instripthread = 0;
+static RENDERTLS int stripx1, stripx2;
+static RENDERTLS unsigned char *drawgotsector;
+static RENDERTLS char drawnopixels = 0;
+#ifdef ENGINE_USING_STRIPTHREADS
+static RENDERTLS unsigned char stripgotsector[(MAXSECTORS+7)>>3];
+#endif
 static int mirrorsx1, mirrorsy1, mirrorsx2, mirrorsy2;
 
 static int setviewcnt = 0;	// interface layers use this now
@@ -561,7 +675,7 @@ static int bakwindowx2[4], bakwindowy2[4];
 static int bakrendmode,baktile;
 #endif
 
-int totalclocklock;
+RENDERTLS int totalclocklock;
 
 palette_t curpalette[256];			// the current palette, unadjusted for brightness or tint
 palette_t curpalettefaded[256];		// the current palette, adjusted for brightness and tint (ie. what gets sent to the card)
@@ -584,6 +698,61 @@ static inline int getpalookup(int davis, int dashade)
 }
 
 
+//
+// needtile (internal)
+//   Makes sure a tile is in the cache before drawing it. Returns 0 if it
+//   isn't there and this thread may not load it. With tilestreaming on,
+//   a missing tile is queued for the loading thread and drawn as a
+//   placeholder until it arrives.
+//
+static inline int needtile(short tilenume)
+{
+	if (waloff[tilenume] == 0)
+	{
+		if (!enginethread) return 0;
+		if (!tilestreaming || !streamtile(tilenume)) loadtile(tilenume);
+	}
+	return(waloff[tilenume] != 0);
+}
+
+
+//
+// needtilenow (internal)
+//   Like needtile(), but never settles for the placeholder. For
+//   rotatesprite(), whose permanent sprites are drawn only once.
+//
+static inline int needtilenow(short tilenume)
+{
+	if (tileplaceholder && (waloff[tilenume] == (intptr_t)tileplaceholder))
+	{
+		if (!enginethread) return 0;
+		waloff[tilenume] = 0;	// committiles() will drop the streamed copy
+	}
+	if (waloff[tilenume] == 0)
+	{
+		if (!enginethread) return 0;
+		loadtile(tilenume);
+	}
+	return(waloff[tilenume] != 0);
+}
+
+
+//
+// beginviewdrawing/endviewdrawing (internal)
+//   Only the screen needs locking by the video layer. A render context's
+//   buffer can be drawn to at any time.
+//
+static inline void beginviewdrawing(void)
+{
+	if (currendercontext == &screencontext) begindrawing();
+}
+
+static inline void endviewdrawing(void)
+{
+	if (currendercontext == &screencontext) enddrawing();
+}
+
+
 //
 // scansector (internal)
 //
@@ -596,31 +765,33 @@ static void scansector(short sectnum)
 	short nextsectnum;
 
 	if (sectnum < 0) return;
+	if (!pvsviewsees(sectnum)) return;
 
-	if (automapping) show2dsector[sectnum>>3] |= pow2char[sectnum&7];
+	if (automapping && enginethread) show2dsector[sectnum>>3] |= pow2char[sectnum&7];
 
 	sectorborder[0] = sectnum, sectorbordercnt = 1;
 	do
 	{
 		sectnum = sectorborder[--sectorbordercnt];
 
-		for(z=headspritesect[sectnum];z>=0;z=nextspritesect[z])
-		{
-			spr = &sprite[z];
-			if ((((spr->cstat&0x8000) == 0) || (showinvisibility)) &&
-				  (spr->xrepeat > 0) && (spr->yrepeat > 0) &&
-				  (spritesortcnt < MAXSPRITESONSCREEN))
+		if (!instripthread)
+			for(z=headspritesect[sectnum];z>=0;z=nextspritesect[z])
 			{
-				xs = spr->x-globalposx; ys = spr->y-globalposy;
-				if ((spr->cstat&48) || (xs*cosglobalang+ys*singlobalang > 0))
+				spr = &sprite[z];
+				if ((((spr->cstat&0x8000) == 0) || (showinvisibility)) &&
+					  (spr->xrepeat > 0) && (spr->yrepeat > 0) &&
+					  (spritesortcnt < MAXSPRITESONSCREEN))
 				{
-					copybufbyte(spr,&tsprite[spritesortcnt],sizeof(spritetype));
-					tsprite[spritesortcnt++].owner = z;
+					xs = spr->x-globalposx; ys = spr->y-globalposy;
+					if ((spr->cstat&48) || (xs*cosglobalang+ys*singlobalang > 0))
+					{
+						copybufbyte(spr,&tsprite[spritesortcnt],sizeof(spritetype));
+						tsprite[spritesortcnt++].owner = z;
+					}
 				}
 			}
-		}
 
-		gotsector[sectnum>>3] |= pow2char[sectnum&7];
+		drawgotsector[sectnum>>3] |= pow2char[sectnum&7];
 
 		bunchfrst = numbunches;
 		numscansbefore = numscans;
@@ -637,7 +808,7 @@ static void scansector(short sectnum)
 			x2 = wal2->x-globalposx; y2 = wal2->y-globalposy;
 
 			if ((nextsectnum >= 0) && ((wal->cstat&32) == 0))
-				if ((gotsector[nextsectnum>>3]&pow2char[nextsectnum&7]) == 0)
+				if ((drawgotsector[nextsectnum>>3]&pow2char[nextsectnum&7]) == 0)
 				{
 					templong = x1*y2-x2*y1;
 					if (((unsigned)templong+262144) < 524288)
@@ -697,6 +868,7 @@ static void scansector(short sectnum)
 				yb2[numscans] = yp1 + scale(yp2-yp1,yp1-xp1,templong);
 			}
 			if ((yb2[numscans] < 256) || (xb1[numscans] > xb2[numscans])) goto skipitaddwall;
+			if (instripthread && ((xb2[numscans] < stripx1) || (xb1[numscans] > stripx2))) goto skipitaddwall;
 
 				//Made it all the way!
 			thesector[numscans] = sectnum; thewall[numscans] = z;
@@ -735,12 +907,12 @@ static void maskwallscan(int x1, int x2, short *uwal, short *dwal, int *swal, in
 
 	tsizx = tilesizx[globalpicnum];
 	tsizy = tilesizy[globalpicnum];
-	setgotpic(globalpicnum);
+	if (enginethread) setgotpic(globalpicnum);
 	if ((tsizx <= 0) || (tsizy <= 0)) return;
 	if ((uwal[x1] > ydimen) && (uwal[x2] > ydimen)) return;
 	if ((dwal[x1] < 0) && (dwal[x2] < 0)) return;
 
-	if (waloff[globalpicnum] == 0) loadtile(globalpicnum);
+	if (!needtile(globalpicnum)) return;
 
 	startx = x1;
 
@@ -753,8 +925,6 @@ static void maskwallscan(int x1, int x2, short *uwal, short *dwal, int *swal, in
 
 	setupmvlineasm(globalshiftval);
 
-#ifndef ENGINE_USING_A_C
-
 	x = startx;
 	while ((startumost[x+windowx1] > startdmost[x+windowx1]) && (x <= x2)) x++;
 
@@ -853,30 +1023,7 @@ static void maskwallscan(int x1, int x2, short *uwal, short *dwal, int *swal, in
 		mvlineasm1(vince[0],(void *)palookupoffse[0],y2ve[0]-y1ve[0]-1,vplce[0],(void *)(bufplce[0]+waloff[globalpicnum]),(void *)(p+ylookup[y1ve[0]]));
 	}
 
-#else	// ENGINE_USING_A_C
-
-	p = startx+frameoffset;
-	for(x=startx;x<=x2;x++,p++)
-	{
-		y1ve[0] = max(uwal[x],startumost[x+windowx1]-windowy1);
-		y2ve[0] = min(dwal[x],startdmost[x+windowx1]-windowy1);
-		if (y2ve[0] <= y1ve[0]) continue;
-
-		palookupoffse[0] = fpalookup+(getpalookup((int)mulscale16(swal[x],globvis),globalshade)<<8);
-
-		bufplce[0] = lwal[x] + globalxpanning;
-		if (bufplce[0] >= tsizx) { if (xnice == 0) bufplce[0] %= tsizx; else bufplce[0] &= tsizx; }
-		if (ynice == 0) bufplce[0] *= tsizy; else bufplce[0] <<= tsizy;
-
-		vince[0] = swal[x]*globalyscale;
-		vplce[0] = globalzd + vince[0]*(y1ve[0]-globalhoriz+1);
-
-		mvlineasm1(vince[0],(void *)palookupoffse[0],y2ve[0]-y1ve[0]-1,vplce[0],(void *)(bufplce[0]+waloff[globalpicnum]),(void *)(p+ylookup[y1ve[0]]));
-	}
-
-#endif
-
-	faketimerhandler();
+	if (enginethread) faketimerhandler();
 }
 
 
@@ -1369,11 +1516,12 @@ static void ceilscan(int x1, int x2, int sectnum)
 	if (globalzd > 0) return;
 	globalpicnum = sec->ceilingpicnum;
 	if ((unsigned)globalpicnum >= (unsigned)MAXTILES) globalpicnum = 0;
-	setgotpic(globalpicnum);
+	if (enginethread) setgotpic(globalpicnum);
 	if ((tilesizx[globalpicnum] <= 0) || (tilesizy[globalpicnum] <= 0)) return;
 	if (picanm[globalpicnum]&192) globalpicnum += animateoffs((short)globalpicnum,(short)sectnum);
 
-	if (waloff[globalpicnum] == 0) loadtile(globalpicnum);
+	if (!needtile(globalpicnum)) return;
+	if (drawnopixels) return;
 	globalbufplc = waloff[globalpicnum];
 
 	globalshade = (int)sec->ceilingshade;
@@ -1469,7 +1617,7 @@ static void ceilscan(int x1, int x2, int sectnum)
 			globalx2 += globaly2; globaly1 += globalx1;
 		}
 		while (y1 < y2-1) hline(x2,++y1);
-		faketimerhandler();
+		if (enginethread) faketimerhandler();
 		return;
 	}
 
@@ -1516,7 +1664,7 @@ static void ceilscan(int x1, int x2, int sectnum)
 		globalx2 += globaly2; globaly1 += globalx1;
 	}
 	while (y1 < y2-1) slowhline(x2,++y1);
-	faketimerhandler();
+	if (enginethread) faketimerhandler();
 }
 
 
@@ -1540,11 +1688,12 @@ static void florscan(int x1, int x2, int sectnum)
 	if (globalzd > 0) return;
 	globalpicnum = sec->floorpicnum;
 	if ((unsigned)globalpicnum >= (unsigned)MAXTILES) globalpicnum = 0;
-	setgotpic(globalpicnum);
+	if (enginethread) setgotpic(globalpicnum);
 	if ((tilesizx[globalpicnum] <= 0) || (tilesizy[globalpicnum] <= 0)) return;
 	if (picanm[globalpicnum]&192) globalpicnum += animateoffs((short)globalpicnum,(short)sectnum);
 
-	if (waloff[globalpicnum] == 0) loadtile(globalpicnum);
+	if (!needtile(globalpicnum)) return;
+	if (drawnopixels) return;
 	globalbufplc = waloff[globalpicnum];
 
 	globalshade = (int)sec->floorshade;
@@ -1640,7 +1789,7 @@ static void florscan(int x1, int x2, int sectnum)
 			globalx2 += globaly2; globaly1 += globalx1;
 		}
 		while (y1 < y2-1) hline(x2,++y1);
-		faketimerhandler();
+		if (enginethread) faketimerhandler();
 		return;
 	}
 
@@ -1687,7 +1836,7 @@ static void florscan(int x1, int x2, int sectnum)
 		globalx2 += globaly2; globaly1 += globalx1;
 	}
 	while (y1 < y2-1) slowhline(x2,++y1);
-	faketimerhandler();
+	if (enginethread) faketimerhandler();
 }
 
 
@@ -1705,12 +1854,13 @@ static void wallscan(int x1, int x2, short *uwal, short *dwal, int *swal, int *l
 
 	tsizx = tilesizx[globalpicnum];
 	tsizy = tilesizy[globalpicnum];
-	setgotpic(globalpicnum);
+	if (enginethread) setgotpic(globalpicnum);
 	if ((tsizx <= 0) || (tsizy <= 0)) return;
 	if ((uwal[x1] > ydimen) && (uwal[x2] > ydimen)) return;
 	if ((dwal[x1] < 0) && (dwal[x2] < 0)) return;
 
-	if (waloff[globalpicnum] == 0) loadtile(globalpicnum);
+	if (!needtile(globalpicnum)) return;
+	if (drawnopixels) return;
 
 	xnice = (pow2long[picsiz[globalpicnum]&15] == tsizx);
 	if (xnice) tsizx--;
@@ -1721,8 +1871,6 @@ static void wallscan(int x1, int x2, short *uwal, short *dwal, int *swal, int *l
 
 	setupvlineasm(globalshiftval);
 
-#ifndef ENGINE_USING_A_C
-
 	x = x1;
 	while ((umost[x] > dmost[x]) && (x <= x2)) x++;
 
@@ -1819,29 +1967,7 @@ static void wallscan(int x1, int x2, short *uwal, short *dwal, int *swal, int *l
 		vlineasm1(vince[0],(void *)palookupoffse[0],y2ve[0]-y1ve[0]-1,vplce[0],(void *)(bufplce[0]+waloff[globalpicnum]),(void *)(x+frameoffset+ylookup[y1ve[0]]));
 	}
 
-#else	// ENGINE_USING_A_C
-
-	for(x=x1;x<=x2;x++)
-	{
-		y1ve[0] = max(uwal[x],umost[x]);
-		y2ve[0] = min(dwal[x],dmost[x]);
-		if (y2ve[0] <= y1ve[0]) continue;
-
-		palookupoffse[0] = fpalookup+(getpalookup((int)mulscale16(swal[x],globvis),globalshade)<<8);
-
-		bufplce[0] = lwal[x] + globalxpanning;
-		if (bufplce[0] >= tsizx) { if (xnice == 0) bufplce[0] %= tsizx; else bufplce[0] &= tsizx; }
-		if (ynice == 0) bufplce[0] *= tsizy; else bufplce[0] <<= tsizy;
-
-		vince[0] = swal[x]*globalyscale;
-		vplce[0] = globalzd + vince[0]*(y1ve[0]-globalhoriz+1);
-
-		vlineasm1(vince[0],(void *)palookupoffse[0],y2ve[0]-y1ve[0]-1,vplce[0],(void *)(bufplce[0]+waloff[globalpicnum]),(void *)(x+frameoffset+ylookup[y1ve[0]]));
-	}
-
-#endif
-
-	faketimerhandler();
+	if (enginethread) faketimerhandler();
 }
 
 
@@ -1946,7 +2072,7 @@ static void transmaskvline2(int x)
 	else if (y2ve[0] < y2ve[1])
 		tvlineasm1(vince[1],(void *)palookupoffse[1],y2ve[1]-y2-1,asm2,(void *)bufplce[1],(void *)(ylookup[y2+1]+i+1));
 
-	faketimerhandler();
+	if (enginethread) faketimerhandler();
 }
 #endif
 
@@ -1957,10 +2083,10 @@ static void transmaskwallscan(int x1, int x2)
 {
 	int x;
 
-	setgotpic(globalpicnum);
+	if (enginethread) setgotpic(globalpicnum);
 	if ((tilesizx[globalpicnum] <= 0) || (tilesizy[globalpicnum] <= 0)) return;
 
-	if (waloff[globalpicnum] == 0) loadtile(globalpicnum);
+	if (!needtile(globalpicnum)) return;
 
 	setuptvlineasm(globalshiftval);
 
@@ -1971,7 +2097,7 @@ static void transmaskwallscan(int x1, int x2)
 	while (x < x2) transmaskvline2(x), x += 2;
 #endif
 	while (x <= x2) transmaskvline(x), x++;
-	faketimerhandler();
+	if (enginethread) faketimerhandler();
 }
 
 
@@ -2039,7 +2165,7 @@ static void ceilspritescan(int x1, int x2)
 		}
 	}
 	while (y1 < y2-1) ceilspritehline(x2,++y1);
-	faketimerhandler();
+	if (enginethread) faketimerhandler();
 }
 
 
@@ -2083,9 +2209,10 @@ static void grouscan(int dax1, int dax2, int sectnum, unsigned char dastat)
 
 	if (palookup[globalpal] == 0) globalpal = 0;
 	if ((picanm[globalpicnum]&192) != 0) globalpicnum += animateoffs(globalpicnum,sectnum);
-	setgotpic(globalpicnum);
+	if (enginethread) setgotpic(globalpicnum);
 	if ((tilesizx[globalpicnum] <= 0) || (tilesizy[globalpicnum] <= 0)) return;
-	if (waloff[globalpicnum] == 0) loadtile(globalpicnum);
+	if (!needtile(globalpicnum)) return;
+	if (drawnopixels) return;
 
 	wal = &wall[sec->wallptr];
 	wx = wall[wal->point2].x - wal->x;
@@ -2207,7 +2334,7 @@ static void grouscan(int dax1, int dax2, int sectnum, unsigned char dastat)
 			asm3 = mulscale16(y2,globalzd) + (globalzx>>6);
 			slopevlin((void *)(ylookup[y2]+x+frameoffset),krecipasm(asm3>>3),nptr2,y2-y1+1,globalx1,globaly1);
 
-			if ((x&15) == 0) faketimerhandler();
+			if (((x&15) == 0) && enginethread) faketimerhandler();
 		}
 		globalx2 += globalx;
 		globaly2 += globaly;
@@ -2528,7 +2655,7 @@ static void drawalls(int bunch)
 				if ((cz[2] < cz[0]) || (cz[3] < cz[1]) || (globalposz < cz[4]))
 				{
 					i = x2-x1+1;
-					if (smostcnt+i < MAXYSAVES)
+					if ((smostcnt+i < MAXYSAVES) && !instripthread)
 					{
 						smoststart[smostwallcnt] = smostcnt;
 						smostwall[smostwallcnt] = z;
@@ -2634,7 +2761,7 @@ static void drawalls(int bunch)
 				if ((fz[2] > fz[0]) || (fz[3] > fz[1]) || (globalposz > fz[4]))
 				{
 					i = x2-x1+1;
-					if (smostcnt+i < MAXYSAVES)
+					if ((smostcnt+i < MAXYSAVES) && !instripthread)
 					{
 						smoststart[smostwallcnt] = smostcnt;
 						smostwall[smostwallcnt] = z;
@@ -2646,15 +2773,15 @@ static void drawalls(int bunch)
 				}
 			}
 			if (numhits < 0) return;
-			if ((!(wal->cstat&32)) && ((gotsector[nextsectnum>>3]&pow2char[nextsectnum&7]) == 0))
+			if ((!(wal->cstat&32)) && ((drawgotsector[nextsectnum>>3]&pow2char[nextsectnum&7]) == 0))
 			{
 				if (umost[x2] < dmost[x2])
-					scansector(nextsectnum);
+					PROFILE_TIME(PROFILE_SCANSECTOR, scansector(nextsectnum));
 				else
 				{
 					for(x=x1;x<x2;x++)
 						if (umost[x] < dmost[x])
-							{ scansector(nextsectnum); break; }
+							{ PROFILE_TIME(PROFILE_SCANSECTOR, scansector(nextsectnum)); break; }
 
 						//If can't see sector beyond, then cancel smost array and just
 						//store wall!
@@ -2815,7 +2942,7 @@ static void drawvox(int dasprx, int daspry, int dasprz, int dasprang,
 	longptr = (int *)davoxptr;
 	xyvoxoffs = ((daxsiz+1)<<2);
 
-	begindrawing();	//{{{
+	beginviewdrawing();	//{{{
 
 	for(cnt=0;cnt<8;cnt++)
 	{
@@ -2944,7 +3071,7 @@ static void drawvox(int dasprx, int daspry, int dasprz, int dasprang,
 		}
 	}
 
-	enddrawing();	//}}}
+	endviewdrawing();	//}}}
 }
 
 
@@ -3700,8 +3827,8 @@ static void drawsprite(int snum)
 		if ((unsigned)globalpicnum >= (unsigned)MAXTILES) globalpicnum = 0;
 		//if (picanm[globalpicnum]&192) globalpicnum += animateoffs((short)globalpicnum,spritenum+32768);
 
-		if (waloff[globalpicnum] == 0) loadtile(globalpicnum);
-		setgotpic(globalpicnum);
+		if (!needtile(globalpicnum)) return;
+		if (enginethread) setgotpic(globalpicnum);
 		globalbufplc = waloff[globalpicnum];
 
 		globvis = mulscale16(globalhisibility,viewingrange);
@@ -3865,7 +3992,7 @@ static void drawsprite(int snum)
 		drawvox(tspr->x,tspr->y,tspr->z,i,(int)tspr->xrepeat,(int)tspr->yrepeat,vtilenum,tspr->shade,tspr->pal,lwall,swall);
 	}
 
-	if (automapping == 1) show2dsprite[spritenum>>3] |= pow2char[spritenum&7];
+	if ((automapping == 1) && enginethread) show2dsprite[spritenum>>3] |= pow2char[spritenum&7];
 }
 
 
@@ -4077,7 +4204,7 @@ static void fillpolygon(int npoints)
 		globalposy += globaly2;
 		ptr += MAXNODESPERLINE;
 	}
-	faketimerhandler();
+	if (enginethread) faketimerhandler();
 }
 
 
@@ -4469,8 +4596,8 @@ static void dorotatesprite(int sx, int sy, int z, short a, short picnum, signed
 		nextv = v;
 	}
 
-	if (waloff[picnum] == 0) loadtile(picnum);
-	setgotpic(picnum);
+	if (!needtilenow(picnum)) return;
+	if (enginethread) setgotpic(picnum);
 	bufplc = waloff[picnum];
 
 	palookupoffs = (intptr_t)palookup[dapalnum] + (getpalookup(0L,(int)dashade)<<8);
@@ -4599,7 +4726,7 @@ static void dorotatesprite(int sx, int sy, int z, short a, short picnum, signed
 					if (y2ve[3] > d4) mvlineasm1(vince[3],(void *)palookupoffse[3],y2ve[3]-d4-1,vplce[3],(void *)bufplce[3],(void *)(i+3));
 				}
 
-				faketimerhandler();
+				if (enginethread) faketimerhandler();
 			}
 		}
 		else
@@ -4638,7 +4765,7 @@ static void dorotatesprite(int sx, int sy, int z, short a, short picnum, signed
 					{
 						while (y1 < y2-1)
 						{
-							y1++; if ((y1&31) == 0) faketimerhandler();
+							y1++; if (((y1&31) == 0) && enginethread) faketimerhandler();
 
 								//x,y1
 							bx += xv*(y1-oy); by += yv*(y1-oy); oy = y1;
@@ -4653,7 +4780,7 @@ static void dorotatesprite(int sx, int sy, int z, short a, short picnum, signed
 					{
 						while (y1 < ny1)
 						{
-							y1++; if ((y1&31) == 0) faketimerhandler();
+							y1++; if (((y1&31) == 0) && enginethread) faketimerhandler();
 
 								//x,y1
 							bx += xv*(y1-oy); by += yv*(y1-oy); oy = y1;
@@ -4666,7 +4793,7 @@ static void dorotatesprite(int sx, int sy, int z, short a, short picnum, signed
 					}
 					while (y2 > ny2)
 					{
-						y2--; if ((y2&31) == 0) faketimerhandler();
+						y2--; if (((y2&31) == 0) && enginethread) faketimerhandler();
 
 							//x,y2
 						bx += xv*(y2-oy); by += yv*(y2-oy); oy = y2;
@@ -4681,7 +4808,7 @@ static void dorotatesprite(int sx, int sy, int z, short a, short picnum, signed
 				{
 					while (y1 < y2-1)
 					{
-						y1++; if ((y1&31) == 0) faketimerhandler();
+						y1++; if (((y1&31) == 0) && enginethread) faketimerhandler();
 
 							//x,y1
 						bx += xv*(y1-oy); by += yv*(y1-oy); oy = y1;
@@ -4699,7 +4826,7 @@ static void dorotatesprite(int sx, int sy, int z, short a, short picnum, signed
 			}
 			while (y1 < y2-1)
 			{
-				y1++; if ((y1&31) == 0) faketimerhandler();
+				y1++; if (((y1&31) == 0) && enginethread) faketimerhandler();
 
 					//x2,y1
 				bx += xv*(y1-oy); by += yv*(y1-oy); oy = y1;
@@ -4757,7 +4884,7 @@ static void dorotatesprite(int sx, int sy, int z, short a, short picnum, signed
 			{
 				tspritevline(0L,by<<16,y2-y1+1,bx<<16,(void *)((bx>>16)*ysiz+(by>>16)+bufplc),(void *)p);
 			}
-			faketimerhandler();
+			if (enginethread) faketimerhandler();
 		}
 	}
 
@@ -4809,7 +4936,7 @@ static void dorotatesprite(int sx, int sy, int z, short a, short picnum, signed
 			tspritevline(bx&65535,by&65535,y2-y1+1,(void *)((bx>>16)*ysiz+(by>>16)+bufplc),(void *)p);
 			//transarea += (y2-y1);
 		}
-		faketimerhandler();
+		if (enginethread) faketimerhandler();
 	}
 
 #endif
@@ -5247,13 +5374,13 @@ static int rintersect(int x1, int y1, int z1, int vx, int vy, int vz, int x3,
 //
 // keepaway (internal)
 //
-static void keepaway (int *x, int *y, int w)
+static void keepaway (int *x, int *y, int w, clipcontexttype *ctx)
 {
 	int dx, dy, ox, oy, x1, y1;
 	char first;
 
-	x1 = clipit[w].x1; dx = clipit[w].x2-x1;
-	y1 = clipit[w].y1; dy = clipit[w].y2-y1;
+	x1 = ctx->clipit[w].x1; dx = ctx->clipit[w].x2-x1;
+	y1 = ctx->clipit[w].y1; dy = ctx->clipit[w].y2-y1;
 	ox = ksgn(-dy); oy = ksgn(dx);
 	first = (klabs(dx) <= klabs(dy));
 	while (1)
@@ -5268,16 +5395,16 @@ static void keepaway (int *x, int *y, int w)
 //
 // raytrace (internal)
 //
-static int raytrace(int x3, int y3, int *x4, int *y4)
+static int raytrace(int x3, int y3, int *x4, int *y4, clipcontexttype *ctx)
 {
 	int x1, y1, x2, y2, bot, topu, nintx, ninty, cnt, z, hitwall;
 	int x21, y21, x43, y43;
 
 	hitwall = -1;
-	for(z=clipnum-1;z>=0;z--)
+	for(z=ctx->clipnum-1;z>=0;z--)
 	{
-		x1 = clipit[z].x1; x2 = clipit[z].x2; x21 = x2-x1;
-		y1 = clipit[z].y1; y2 = clipit[z].y2; y21 = y2-y1;
+		x1 = ctx->clipit[z].x1; x2 = ctx->clipit[z].x2; x21 = x2-x1;
+		y1 = ctx->clipit[z].y1; y2 = ctx->clipit[z].y2; y21 = y2-y1;
 
 		topu = x21*(y3-y1) - (x3-x1)*y21; if (topu <= 0) continue;
 		if (x21*(*y4-y1) > (*x4-x1)*y21) continue;
@@ -5406,6 +5533,12 @@ int initengine(void)
 		if (i) return i;
 	}
 
+	enginethread = 1;
+	currendercontext = &screencontext;
+	distrecip = screendistrecip;
+	radarang2 = screenradarang2;
+	smost = screensmost;
+
 	xyaspect = -1;
 
 	pskyoff[0] = 0; pskybits = 0;
@@ -5479,6 +5612,15 @@ void uninitengine(void)
 	freeallmodels();
 #endif
 
+#ifdef ENGINE_USING_STRIPTHREADS
+	threadpool_uninit();
+#endif
+	stopstreaming();
+	if (tileplaceholder) { kfree(tileplaceholder); tileplaceholder = NULL; }
+	unmapartfiles();
+	freesectorgrid();
+	freepvs();
+
 	uninitsystem();
 
 	if (logfile) Bfclose(logfile);
@@ -5528,16 +5670,197 @@ void initspritelists(void)
 }
 
 
+//
+// closestbunch (internal)
+//
+static int closestbunch(void)
+{
+	int i, j, closest;
+
+	clearbuf(&bunchseen[0],(int)((numbunches+3)>>2),0L);
+	bunchseen[0] = 1;
+
+	closest = 0;              //Almost works, but not quite :(
+	for(i=1;i<numbunches;i++)
+	{
+		if ((j = bunchfront(i,closest)) < 0) continue;
+		bunchseen[i] = 1;
+		if (j == 0) bunchseen[closest] = 1, closest = i;
+	}
+	for(i=0;i<numbunches;i++) //Double-check
+	{
+		if (bunchseen[i]) continue;
+		if ((j = bunchfront(i,closest)) < 0) continue;
+		bunchseen[i] = 1;
+		if (j == 0) bunchseen[closest] = 1, closest = i, i = 0;
+	}
+
+	return closest;
+}
+
+
+//
+// saveviewstate/loadviewstate (internal)
+//
+static void saveviewstate(rendercontext *rc)
+{
+	rc->frameplace = frameplace; rc->bytesperline = bytesperline;
+	rc->xdim = xdim; rc->ydim = ydim;
+	Bmemcpy(rc->ylookup, ylookup, sizeof(ylookup));
+	rc->windowx1 = windowx1; rc->windowy1 = windowy1;
+	rc->windowx2 = windowx2; rc->windowy2 = windowy2;
+	rc->wx1 = wx1; rc->wy1 = wy1; rc->wx2 = wx2; rc->wy2 = wy2;
+	Bmemcpy(rc->startumost, startumost, sizeof(startumost));
+	Bmemcpy(rc->startdmost, startdmost, sizeof(startdmost));
+	rc->xdimen = xdimen; rc->xdimenrecip = xdimenrecip; rc->halfxdimen = halfxdimen;
+	rc->xdimenscale = xdimenscale; rc->xdimscale = xdimscale;
+	rc->ydimen = ydimen; rc->ydimenscale = ydimenscale;
+	rc->viewingrange = viewingrange; rc->viewingrangerecip = viewingrangerecip;
+	rc->yxaspect = yxaspect; rc->xyaspect = xyaspect;
+#if USE_POLYMOST
+	rc->rendmode = rendmode;
+#endif
+
+	rc->horizlookup = horizlookup; rc->horizlookup2 = horizlookup2;
+	rc->horizycent = horizycent;
+	rc->distrecip = distrecip; rc->radarang2 = radarang2; rc->smost = smost;
+	rc->oxdimen = oxdimen; rc->oviewingrange = oviewingrange; rc->oxyaspect = oxyaspect;
+	rc->nytooclose = nytooclose; rc->nytoofar = nytoofar;
+
+	rc->globalposx = globalposx; rc->globalposy = globalposy; rc->globalposz = globalposz;
+	rc->globalhoriz = globalhoriz;
+	rc->globalang = globalang; rc->globalcursectnum = globalcursectnum;
+	rc->cosglobalang = cosglobalang; rc->singlobalang = singlobalang;
+	rc->cosviewingrangeglobalang = cosviewingrangeglobalang;
+	rc->sinviewingrangeglobalang = sinviewingrangeglobalang;
+	rc->globaluclip = globaluclip; rc->globaldclip = globaldclip;
+	rc->globalvisibility = globalvisibility; rc->globalhisibility = globalhisibility;
+	rc->globalpisibility = globalpisibility; rc->globalcisibility = globalcisibility;
+	rc->globparaceilclip = globparaceilclip; rc->globparaflorclip = globparaflorclip;
+	rc->frameoffset = frameoffset;
+	rc->totalclocklock = totalclocklock;
+}
+
+static void loadviewstate(const rendercontext *rc)
+{
+	frameplace = rc->frameplace; bytesperline = rc->bytesperline;
+	xdim = rc->xdim; ydim = rc->ydim;
+	Bmemcpy(ylookup, rc->ylookup, sizeof(ylookup));
+	setvlinebpl(ylookup[1]);	// not always bytesperline, see setviewtotile()
+	windowx1 = rc->windowx1; windowy1 = rc->windowy1;
+	windowx2 = rc->windowx2; windowy2 = rc->windowy2;
+	wx1 = rc->wx1; wy1 = rc->wy1; wx2 = rc->wx2; wy2 = rc->wy2;
+	Bmemcpy(startumost, rc->startumost, sizeof(startumost));
+	Bmemcpy(startdmost, rc->startdmost, sizeof(startdmost));
+	xdimen = rc->xdimen; xdimenrecip = rc->xdimenrecip; halfxdimen = rc->halfxdimen;
+	xdimenscale = rc->xdimenscale; xdimscale = rc->xdimscale;
+	ydimen = rc->ydimen; ydimenscale = rc->ydimenscale;
+	viewingrange = rc->viewingrange; viewingrangerecip = rc->viewingrangerecip;
+	yxaspect = rc->yxaspect; xyaspect = rc->xyaspect;
+#if USE_POLYMOST
+	rendmode = rc->rendmode;
+#endif
+
+	horizlookup = rc->horizlookup; horizlookup2 = rc->horizlookup2;
+	horizycent = rc->horizycent;
+	distrecip = rc->distrecip; radarang2 = rc->radarang2; smost = rc->smost;
+	oxdimen = rc->oxdimen; oviewingrange = rc->oviewingrange; oxyaspect = rc->oxyaspect;
+	nytooclose = rc->nytooclose; nytoofar = rc->nytoofar;
+
+	globalposx = rc->globalposx; globalposy = rc->globalposy; globalposz = rc->globalposz;
+	globalhoriz = rc->globalhoriz;
+	globalang = rc->globalang; globalcursectnum = rc->globalcursectnum;
+	cosglobalang = rc->cosglobalang; singlobalang = rc->singlobalang;
+	cosviewingrangeglobalang = rc->cosviewingrangeglobalang;
+	sinviewingrangeglobalang = rc->sinviewingrangeglobalang;
+	globaluclip = rc->globaluclip; globaldclip = rc->globaldclip;
+	globalvisibility = rc->globalvisibility; globalhisibility = rc->globalhisibility;
+	globalpisibility = rc->globalpisibility; globalcisibility = rc->globalcisibility;
+	globparaceilclip = rc->globparaceilclip; globparaflorclip = rc->globparaflorclip;
+	frameoffset = rc->frameoffset;
+	totalclocklock = rc->totalclocklock;
+
+		// A thread's span palette starts out unset, and ceilscan/florscan
+		// only call setpalookupaddress() when the sector's palookup differs
+		// from the one last written, so a sector with no palookup of its
+		// own would be drawn through a null pointer.
+	globalpalwritten = palookup[0];
+	setpalookupaddress(globalpalwritten);
+}
+
+
+#ifdef ENGINE_USING_STRIPTHREADS
+typedef struct {
+	int numstrips;
+	const rendercontext *view;
+} stripjob;
+
+//
+// drawroomsstrip (internal)
+//
+static void drawroomsstrip(void *arg, int strip)
+{
+	int i, closest, numstrips;
+	short *shortptr1, *shortptr2;
+
+	numstrips = ((stripjob *)arg)->numstrips;
+	loadviewstate(((stripjob *)arg)->view);
+
+	instripthread = 1;
+	stripx1 = scale(strip,xdimen,numstrips);
+	stripx2 = scale(strip+1,xdimen,numstrips)-1;
+	drawgotsector = stripgotsector;
+	Bmemset(&stripgotsector[0],0,(int)((numsectors+7)>>3));
+	pvsview = pvsforview();
+
+		//Close off every column outside this strip
+	shortptr1 = (short *)&startumost[windowx1];
+	shortptr2 = (short *)&startdmost[windowx1];
+	for(i=0;i<xdimen;i++)
+	{
+		if ((i < stripx1) || (i > stripx2)) { umost[i] = 1; dmost[i] = 0; continue; }
+		umost[i] = shortptr1[i]-windowy1;
+		dmost[i] = shortptr2[i]-windowy1;
+	}
+
+	numhits = stripx2-stripx1+1; numscans = 0; numbunches = 0;
+	maskwallcnt = 0; smostwallcnt = 0; smostcnt = 0;
+
+	PROFILE_TIME(PROFILE_SCANSECTOR, scansector(globalcursectnum));
+
+	while ((numbunches > 0) && (numhits > 0))
+	{
+		closest = closestbunch();
+
+		PROFILE_TIME(PROFILE_DRAWALLS, drawalls(closest));
+
+		numbunches--;
+		bunchfirst[closest] = bunchfirst[numbunches];
+		bunchlast[closest] = bunchlast[numbunches];
+	}
+
+	instripthread = 0;	// the thread may go on to draw a whole view
+}
+#endif
+
+
 //
 // drawrooms
 //
 void drawrooms(int daposx, int daposy, int daposz,
 		 short daang, int dahoriz, short dacursectnum)
 {
-	int i, j, z, cz, fz, closest;
+	int i, z, cz, fz, closest;
 	short *shortptr1, *shortptr2;
+#ifdef ENGINE_USING_STRIPTHREADS
+	stripjob job;
+	int numstrips = 0;
+	short searchitbak;
+#endif
 
-	beforedrawrooms = 0;
+	if (currendercontext == &screencontext) beforedrawrooms = 0;
+	if (enginethread) committiles();
+	if (enginethread && useslopecache && !mapgeomvalid()) buildmapgeometry();
 
 	globalposx = daposx; globalposy = daposy; globalposz = daposz;
 	globalang = (daang&2047);
@@ -5565,6 +5888,7 @@ void drawrooms(int daposx, int daposy, int daposz,
 
 	//clearbufbyte(&gotsector[0],(int)((numsectors+7)>>3),0L);
 	Bmemset(&gotsector[0],0,(int)((numsectors+7)>>3));
+	drawgotsector = gotsector;
 
 	shortptr1 = (short *)&startumost[windowx1];
 	shortptr2 = (short *)&startdmost[windowx1];
@@ -5584,7 +5908,7 @@ void drawrooms(int daposx, int daposy, int daposz,
 #endif
 	//============================================================================= //POLYMOST ENDS
 
-	begindrawing();	//{{{
+	beginviewdrawing();	//{{{
 
 	frameoffset = frameplace + windowy1*bytesperline + windowx1;
 
@@ -5599,6 +5923,7 @@ void drawrooms(int daposx, int daposy, int daposz,
 		updatesector(globalposx,globalposy,&globalcursectnum);
 		if (globalcursectnum < 0) globalcursectnum = i;
 	}
+	pvsview = pvsforview();
 
 	globparaceilclip = 1;
 	globparaflorclip = 1;
@@ -5606,7 +5931,18 @@ void drawrooms(int daposx, int daposy, int daposz,
 	if (globalposz < cz) globparaceilclip = 0;
 	if (globalposz > fz) globparaflorclip = 0;
 
-	scansector(globalcursectnum);
+#ifdef ENGINE_USING_STRIPTHREADS
+		//With strips, this thread only walks the view to load tiles and
+		//collect what drawmasks() needs, then the workers do the drawing
+	if ((drawthreads < 0 || drawthreads > 1) && !inpreparemirror && enginethread)
+	{
+		i = threadpool_init(drawthreads);
+		if (i > 1) numstrips = min(i*2, xdimen>>4);
+	}
+	if (enginethread) drawnopixels = (numstrips > 1);
+#endif
+
+	PROFILE_TIME(PROFILE_SCANSECTOR, scansector(globalcursectnum));
 
 	if (inpreparemirror)
 	{
@@ -5626,7 +5962,7 @@ void drawrooms(int daposx, int daposy, int daposz,
 			if (umost[i] <= dmost[i])
 				{ umost[i] = 1; dmost[i] = 0; numhits--; }
 
-		drawalls(0L);
+		PROFILE_TIME(PROFILE_DRAWALLS, drawalls(0L));
 		numbunches--;
 		bunchfirst[0] = bunchfirst[numbunches];
 		bunchlast[0] = bunchlast[numbunches];
@@ -5637,27 +5973,11 @@ void drawrooms(int daposx, int daposy, int daposz,
 
 	while ((numbunches > 0) && (numhits > 0))
 	{
-		clearbuf(&tempbuf[0],(int)((numbunches+3)>>2),0L);
-		tempbuf[0] = 1;
-
-		closest = 0;              //Almost works, but not quite :(
-		for(i=1;i<numbunches;i++)
-		{
-			if ((j = bunchfront(i,closest)) < 0) continue;
-			tempbuf[i] = 1;
-			if (j == 0) tempbuf[closest] = 1, closest = i;
-		}
-		for(i=0;i<numbunches;i++) //Double-check
-		{
-			if (tempbuf[i]) continue;
-			if ((j = bunchfront(i,closest)) < 0) continue;
-			tempbuf[i] = 1;
-			if (j == 0) tempbuf[closest] = 1, closest = i, i = 0;
-		}
+		closest = closestbunch();
 
-		drawalls(closest);
+		PROFILE_TIME(PROFILE_DRAWALLS, drawalls(closest));
 
-		if (automapping)
+		if (automapping && enginethread)
 		{
 			for(z=bunchfirst[closest];z>=0;z=p2[z])
 				show2dwall[thewall[z]>>3] |= pow2char[thewall[z]&7];
@@ -5668,7 +5988,20 @@ void drawrooms(int daposx, int daposy, int daposz,
 		bunchlast[closest] = bunchlast[numbunches];
 	}
 
-	enddrawing();	//}}}
+#ifdef ENGINE_USING_STRIPTHREADS
+	if (drawnopixels)
+	{
+		drawnopixels = 0;
+		saveviewstate(currendercontext);
+		job.numstrips = numstrips;
+		job.view = currendercontext;
+		searchitbak = searchit; searchit = 0;
+		threadpool_run(drawroomsstrip, &job, numstrips);
+		searchit = searchitbak;
+	}
+#endif
+
+	endviewdrawing();	//}}}
 }
 
 
@@ -5678,6 +6011,7 @@ void drawrooms(int daposx, int daposy, int daposz,
 void drawmasks(void)
 {
 	int i, j, k, l, gap, xs, ys, xp, yp, yoff, yspan;
+	PROFILE_BEGIN(proft);
 
 	for(i=spritesortcnt-1;i>=0;i--) tspriteptr[i] = &tsprite[i];
 	for(i=spritesortcnt-1;i>=0;i--)
@@ -5759,7 +6093,7 @@ killsprite:
 		i = j;
 	}
 
-	begindrawing();	//{{{
+	beginviewdrawing();	//{{{
 
 	/*for(i=spritesortcnt-1;i>=0;i--)
 	{
@@ -5792,7 +6126,7 @@ killsprite:
 			    && (!polymost_texmayhavealpha(tspriteptr[i]->picnum,tspriteptr[i]->pal))
 #endif
 			   )
-				{ drawsprite(i); tspriteptr[i] = 0; } //draw only if it is fully opaque
+				{ PROFILE_TIME(PROFILE_DRAWSPRITE, drawsprite(i)); tspriteptr[i] = 0; } //draw only if it is fully opaque
 		for(i=j=0;i<spritesortcnt;i++)
 		{
 			if (!tspriteptr[i]) continue;
@@ -5826,7 +6160,7 @@ killsprite:
 	{
 		j = maskwall[maskwallcnt-1];
 		if (spritewallfront(tspriteptr[spritesortcnt-1],(int)thewall[j]) == 0)
-			drawsprite(--spritesortcnt);
+			PROFILE_TIME(PROFILE_DRAWSPRITE, drawsprite(--spritesortcnt));
 		else
 		{
 				//Check to see if any sprites behind the masked wall...
@@ -5842,7 +6176,7 @@ killsprite:
 					l = xb1[j] <= (spritesx[i]>>8) && (spritesx[i]>>8) <= xb2[j];
 				if (l && spritewallfront(tspriteptr[i],(int)thewall[j]) == 0)
 				{
-					drawsprite(i);
+					PROFILE_TIME(PROFILE_DRAWSPRITE, drawsprite(i));
 					tspriteptr[i]->owner = -1;
 					k = i;
 					gap++;
@@ -5868,10 +6202,11 @@ killsprite:
 			drawmaskwall(--maskwallcnt);
 		}
 	}
-	while (spritesortcnt > 0) drawsprite(--spritesortcnt);
+	while (spritesortcnt > 0) PROFILE_TIME(PROFILE_DRAWSPRITE, drawsprite(--spritesortcnt));
 	while (maskwallcnt > 0) drawmaskwall(--maskwallcnt);
 
-	enddrawing();	//}}}
+	endviewdrawing();	//}}}
+	PROFILE_END(PROFILE_DRAWMASKS, proft);
 }
 
 
@@ -5889,7 +6224,7 @@ void drawmapview(int dax, int day, int zoome, short ang)
 	int bakgxvect, bakgyvect, sortnum, gap, npoints;
 	int xvect, yvect, xvect2, yvect2, daslope;
 
-	beforedrawrooms = 0;
+	if (currendercontext == &screencontext) beforedrawrooms = 0;
 
 	clearbuf(&gotsector[0],(int)((numsectors+31)>>5),0L);
 
@@ -5905,7 +6240,7 @@ void drawmapview(int dax, int day, int zoome, short ang)
 
 	sortnum = 0;
 
-	begindrawing();	//{{{
+	beginviewdrawing();	//{{{
 
 	for(s=0,sec=&sector[s];s<numsectors;s++,sec++)
 		if (show2dsector[s>>3]&pow2char[s&7])
@@ -5974,10 +6309,10 @@ void drawmapview(int dax, int day, int zoome, short ang)
 			}
 			globalpicnum = sec->floorpicnum;
 			if ((unsigned)globalpicnum >= (unsigned)MAXTILES) globalpicnum = 0;
-			setgotpic(globalpicnum);
+			if (enginethread) setgotpic(globalpicnum);
 			if ((tilesizx[globalpicnum] <= 0) || (tilesizy[globalpicnum] <= 0)) continue;
 			if ((picanm[globalpicnum]&192) != 0) globalpicnum += animateoffs((short)globalpicnum,s);
-			if (waloff[globalpicnum] == 0) loadtile(globalpicnum);
+			if (!needtile(globalpicnum)) continue;
 			globalbufplc = waloff[globalpicnum];
 			globalshade = max(min(sec->floorshade,numpalookups-1),0);
 			globvis = globalhisibility;
@@ -6108,10 +6443,10 @@ void drawmapview(int dax, int day, int zoome, short ang)
 
 			globalpicnum = spr->picnum;
 			if ((unsigned)globalpicnum >= (unsigned)MAXTILES) globalpicnum = 0;
-			setgotpic(globalpicnum);
+			if (enginethread) setgotpic(globalpicnum);
 			if ((tilesizx[globalpicnum] <= 0) || (tilesizy[globalpicnum] <= 0)) continue;
 			if ((picanm[globalpicnum]&192) != 0) globalpicnum += animateoffs((short)globalpicnum,s);
-			if (waloff[globalpicnum] == 0) loadtile(globalpicnum);
+			if (!needtile(globalpicnum)) continue;
 			globalbufplc = waloff[globalpicnum];
 			if ((sector[spr->sectnum].ceilingstat&1) > 0)
 				globalshade = ((int)sector[spr->sectnum].ceilingshade);
@@ -6161,7 +6496,7 @@ void drawmapview(int dax, int day, int zoome, short ang)
 		}
 	}
 
-	enddrawing();	//}}}
+	endviewdrawing();	//}}}
 }
 
 
@@ -6266,11 +6601,15 @@ int loadboard(char *filename, char fromwhere, int *daposx, int *daposy, int *dap
 		insertsprite(sprite[i].sectnum,sprite[i].statnum);
 	}
 
+	loadmapgeometry();
+
 		//Must be after loading sectors, etc!
 	updatesector(*daposx,*daposy,dacursectnum);
 
 	kclose(fil);
 
+	loadpvs(filename,fromwhere);
+
 #if USE_POLYMOST && USE_OPENGL
 	memset(spriteext, 0, sizeof(spriteext));
 #endif
@@ -7199,6 +7538,8 @@ int loadoldboard(char *filename, char fromwhere, int *daposx, int *daposy, int *
 		insertsprite(sprite[i].sectnum,sprite[i].statnum);
 	}
 
+	loadmapgeometry();
+
 		//Must be after loading sectors, etc!
 	updatesector(*daposx,*daposy,dacursectnum);
 
@@ -7551,6 +7892,8 @@ int setgamemode(char davidoption, int daxdim, int daydim, int dabpp)
 {
 	int i, j, oldbpp;
 
+	setrendercontext(NULL);
+
 	if ((qsetmode == 200) && (videomodereset == 0) &&
 	    (davidoption == fullscreen) && (xdim == daxdim) && (ydim == daydim) && (bpp == dabpp))
 		return(0);
@@ -7668,9 +8011,9 @@ void nextpage(void)
 			{
 				per = &permfifo[i];
 				if ((per->pagesleft > 0) && (per->pagesleft <= numpages))
-					dorotatesprite(per->sx,per->sy,per->z,per->a,per->picnum,
+					PROFILE_TIME(PROFILE_ROTATESPRITE, dorotatesprite(per->sx,per->sy,per->z,per->a,per->picnum,
 							per->dashade,per->dapalnum,per->dastat,
-							per->cx1,per->cy1,per->cx2,per->cy2,per->uniqid);
+							per->cx1,per->cy1,per->cx2,per->cy2,per->uniqid));
 			}
 			enddrawing();	//}}}
 
@@ -7685,7 +8028,7 @@ void nextpage(void)
 				captureatnextpage = 0;
 			}
 
-			showframe();
+			PROFILE_TIME(PROFILE_SHOWFRAME, showframe());
 #if USE_POLYMOST && USE_OPENGL
 			polymost_aftershowframe();
 #endif
@@ -7717,15 +8060,17 @@ void nextpage(void)
 			{
 				per = &permfifo[i];
 				if (per->pagesleft >= 130)
-					dorotatesprite(per->sx,per->sy,per->z,per->a,per->picnum,
+					PROFILE_TIME(PROFILE_ROTATESPRITE, dorotatesprite(per->sx,per->sy,per->z,per->a,per->picnum,
 										per->dashade,per->dapalnum,per->dastat,
-										per->cx1,per->cy1,per->cx2,per->cy2,per->uniqid);
+										per->cx1,per->cy1,per->cx2,per->cy2,per->uniqid));
 
 				if ((per->pagesleft&127) && (numpages < 127)) per->pagesleft--;
 				if (((per->pagesleft&127) == 0) && (i == permtail))
 					permtail = ((permtail+1)&(MAXPERMS-1));
 			}
 			enddrawing();	//}}}
+
+			profile_endframe();
 			break;
 
 		case 350:
@@ -7736,6 +8081,7 @@ void nextpage(void)
 
 	if ((totalclock >= lastageclock+8) || (totalclock < lastageclock))
 		{ lastageclock = totalclock; agecache(); }
+	committiles();
 
 #if USE_POLYMOST && USE_OPENGL
 	omdtims = mdtims; mdtims = getticks();
@@ -7755,6 +8101,10 @@ int loadpics(char *filename, int askedsize)
 	int offscount, localtilestart, localtileend, dasiz;
 	short fil, i, j, k;
 
+	stopstreaming();
+	if (tileplaceholder) { kfree(tileplaceholder); tileplaceholder = NULL; }
+	unmapartfiles();
+
 	Bstrcpy(artfilename,filename);
 
 	for(i=0;i<MAXTILES;i++)
@@ -7765,6 +8115,7 @@ int loadpics(char *filename, int askedsize)
 	}
 
 	artsize = 0L;
+	tileplaceholdersiz = 0;
 
 	numtilefiles = 0;
 	do
@@ -7800,10 +8151,27 @@ int loadpics(char *filename, int askedsize)
 				tilefileoffs[i] = offscount;
 				dasiz = (int)(tilesizx[i]*tilesizy[i]);
 				offscount += dasiz;
+				tileplaceholdersiz = max(tileplaceholdersiz, dasiz);
 				artsize += ((dasiz+15)&0xfffffff0);
 			}
 			kclose(fil);
 
+				//Only a plain file can be mapped. kopen4load() looks for one of
+				//those before searching the groups, so it is the file just read.
+			if (mapartfiles && ((fil = openfrompath(artfilename,BO_BINARY|BO_RDONLY,BS_IREAD)) >= 0))
+			{
+				if (Bfilelength(fil) >= offscount)
+					artmap[k] = (unsigned char *)Bmapfile(fil,offscount,ARTMAPSLACK);
+				if (artmap[k])
+				{
+					artmaplen[k] = offscount;
+					for(i=localtilestart;i<=localtileend;i++)
+						if (tilesizx[i]*tilesizy[i] > 0)
+							waloff[i] = (intptr_t)(artmap[k]+tilefileoffs[i]);
+				}
+				Bclose(fil);
+			}
+
 			numtilefiles++;
 		}
 	}
@@ -7856,7 +8224,16 @@ void loadtile(short tilenume)
 	dasiz = tilesizx[tilenume]*tilesizy[tilenume];
 	if (dasiz <= 0) return;
 
+		//Don't wait for the loading thread: committiles() drops what it reads
+	if (tileplaceholder && (waloff[tilenume] == (intptr_t)tileplaceholder))
+		waloff[tilenume] = 0;
+
 	i = tilefilenum[tilenume];
+	if (artmap[i] && (waloff[tilenume] == 0))
+	{
+		waloff[tilenume] = (intptr_t)(artmap[i]+tilefileoffs[tilenume]);
+		return;
+	}
 	if (i != artfilnum)
 	{
 		if (artfil != -1) kclose(artfil);
@@ -7890,83 +8267,217 @@ void loadtile(short tilenume)
 }
 
 
+
 //
-// allocatepermanenttile
+// streamtile (internal)
+//   Queues a tile for the loading thread and points it at the placeholder.
+//   Returns 0 if it can't be queued, and it must be loaded the slow way.
 //
-int allocatepermanenttile(short tilenume, int xsiz, int ysiz)
+static int streamtile(short tilenume)
 {
-	int j, dasiz;
-
-	if ((xsiz <= 0) || (ysiz <= 0) || ((unsigned)tilenume >= (unsigned)MAXTILES))
-		return(0);
-
-	dasiz = xsiz*ysiz;
+	char filename[20];
+	int i, dasiz;
 
-	walock[tilenume] = 255;
-	allocache((void **)&waloff[tilenume],dasiz,&walock[tilenume]);
+	if ((unsigned)tilenume >= (unsigned)MAXTILES) return 0;
+	dasiz = tilesizx[tilenume]*tilesizy[tilenume];
+	if ((dasiz <= 0) || (dasiz > tileplaceholdersiz)) return 0;
+	if (artmap[tilefilenum[tilenume]]) return 0;	// loadtile() only has to point at it
 
-	tilesizx[tilenume] = xsiz;
-	tilesizy[tilenume] = ysiz;
-	picanm[tilenume] = 0;
+	if (!tileplaceholder)
+	{
+		tileplaceholder = (unsigned char *)kmalloc(tileplaceholdersiz);
+		if (!tileplaceholder) return 0;
+		Bmemset(tileplaceholder, getclosestcol(16,16,16), tileplaceholdersiz);
+	}
+	if (tilestream_start()) { tilestreaming = 0; return 0; }
 
-	j = 15; while ((j > 1) && (pow2long[j] > xsiz)) j--;
-	picsiz[tilenume] = ((unsigned char)j);
-	j = 15; while ((j > 1) && (pow2long[j] > ysiz)) j--;
-	picsiz[tilenume] += ((unsigned char)(j<<4));
+	i = tilefilenum[tilenume];
+	Bstrcpy(filename,artfilename);
+	filename[7] = (i%10)+48;
+	filename[6] = ((i/10)%10)+48;
+	filename[5] = ((i/100)%10)+48;
+	if (tilestream_request(tilenume,filename,tilefileoffs[tilenume],dasiz)) return 0;
 
-	return(waloff[tilenume]);
+	waloff[tilenume] = (intptr_t)tileplaceholder;
+	return 1;
 }
 
 
 //
-// copytilepiece
+// committiles (internal)
+//   Moves the tiles the loading thread has finished into the cache. Only
+//   called from the engine's thread while nothing is being drawn.
 //
-void copytilepiece(int tilenume1, int sx1, int sy1, int xsiz, int ysiz,
-		  int tilenume2, int sx2, int sy2)
+static void committiles(void)
 {
-	unsigned char *ptr1, *ptr2, dat;
-	int xsiz1, ysiz1, xsiz2, ysiz2, i, j, x1, y1, x2, y2;
+	void *data;
+	int tilenume, leng;
 
-	xsiz1 = tilesizx[tilenume1]; ysiz1 = tilesizy[tilenume1];
-	xsiz2 = tilesizx[tilenume2]; ysiz2 = tilesizy[tilenume2];
-	if ((xsiz1 > 0) && (ysiz1 > 0) && (xsiz2 > 0) && (ysiz2 > 0))
+	while ((tilenume = tilestream_collect(&data,&leng)) >= 0)
 	{
-		if (waloff[tilenume1] == 0) loadtile(tilenume1);
-		if (waloff[tilenume2] == 0) loadtile(tilenume2);
+			//Loaded the slow way since, or replaced by the game
+		if (waloff[tilenume] != (intptr_t)tileplaceholder) { Bfree(data); continue; }
 
-		x1 = sx1;
-		for(i=0;i<xsiz;i++)
+		waloff[tilenume] = 0;
+		if (!data || (leng != tilesizx[tilenume]*tilesizy[tilenume]))
+			loadtile(tilenume);
+		else
 		{
-			y1 = sy1;
-			for(j=0;j<ysiz;j++)
-			{
-				x2 = sx2+i;
-				y2 = sy2+j;
-				if ((x2 >= 0) && (y2 >= 0) && (x2 < xsiz2) && (y2 < ysiz2))
-				{
-					ptr1 = (unsigned char *)(waloff[tilenume1] + x1*ysiz1 + y1);
-					ptr2 = (unsigned char *)(waloff[tilenume2] + x2*ysiz2 + y2);
-					dat = *ptr1;
-					if (dat != 255)
-						*ptr2 = *ptr1;
-				}
-
-				y1++; if (y1 >= ysiz1) y1 = 0;
-			}
-			x1++; if (x1 >= xsiz1) x1 = 0;
+			walock[tilenume] = 199;
+			allocache((void **)&waloff[tilenume],leng,&walock[tilenume]);
+			copybufbyte(data,(void *)waloff[tilenume],leng);
 		}
+		Bfree(data);
 	}
 }
 
 
+#if USE_POLYMOST
 //
-// qloadkvx
+// finishtiles (internal)
+//   Waits for the loading thread, so no tile is left as a placeholder.
 //
-int qloadkvx(int voxindex, char *filename)
+static void finishtiles(void)
 {
-	int i, fil, dasiz, lengcnt, lengtot;
-	unsigned char *ptr;
-
+	tilestream_wait();
+	committiles();
+}
+#endif
+
+
+//
+// stopstreaming (internal)
+//   Stops the loading thread and forgets the tiles it had.
+//
+static void stopstreaming(void)
+{
+	int i;
+
+	tilestream_stop();
+	if (!tileplaceholder) return;
+	for(i=0;i<MAXTILES;i++)
+		if (waloff[i] == (intptr_t)tileplaceholder) waloff[i] = 0;
+}
+
+
+//
+// unmapartfiles (internal)
+//   Unmaps the ART files loadpics() mapped, unhooking their tiles.
+//
+static void unmapartfiles(void)
+{
+	int i, k;
+
+	for(i=0;i<MAXTILES;i++)
+		if (tilemapped(i)) waloff[i] = 0;
+	for(k=0;k<MAXTILEFILES;k++)
+	{
+		Bunmapfile(artmap[k],artmaplen[k],ARTMAPSLACK);
+		artmap[k] = NULL;
+		artmaplen[k] = 0;
+	}
+}
+
+
+//
+// unmaptile (internal)
+//   Moves a tile that points into its ART file's mapping into the cache,
+//   so that drawing to it leaves the mapping as the file has it and the
+//   tile goes back to the file's picture once the cache drops it. The
+//   copy holds at least siz bytes.
+//
+static void unmaptile(short tilenume, int siz)
+{
+	intptr_t mapped;
+	int dasiz;
+
+	if (((unsigned)tilenume >= (unsigned)MAXTILES) || !tilemapped(tilenume)) return;
+	dasiz = tilesizx[tilenume]*tilesizy[tilenume];
+
+	mapped = waloff[tilenume];
+	waloff[tilenume] = 0;
+	walock[tilenume] = 199;
+	allocache((void **)&waloff[tilenume],max(dasiz,siz),&walock[tilenume]);
+	copybufbyte((void *)mapped,(void *)waloff[tilenume],dasiz);
+}
+
+//
+// allocatepermanenttile
+//
+int allocatepermanenttile(short tilenume, int xsiz, int ysiz)
+{
+	int j, dasiz;
+
+	if ((xsiz <= 0) || (ysiz <= 0) || ((unsigned)tilenume >= (unsigned)MAXTILES))
+		return(0);
+
+	dasiz = xsiz*ysiz;
+
+	walock[tilenume] = 255;
+	allocache((void **)&waloff[tilenume],dasiz,&walock[tilenume]);
+
+	tilesizx[tilenume] = xsiz;
+	tilesizy[tilenume] = ysiz;
+	picanm[tilenume] = 0;
+
+	j = 15; while ((j > 1) && (pow2long[j] > xsiz)) j--;
+	picsiz[tilenume] = ((unsigned char)j);
+	j = 15; while ((j > 1) && (pow2long[j] > ysiz)) j--;
+	picsiz[tilenume] += ((unsigned char)(j<<4));
+
+	return(waloff[tilenume]);
+}
+
+
+//
+// copytilepiece
+//
+void copytilepiece(int tilenume1, int sx1, int sy1, int xsiz, int ysiz,
+		  int tilenume2, int sx2, int sy2)
+{
+	unsigned char *ptr1, *ptr2, dat;
+	int xsiz1, ysiz1, xsiz2, ysiz2, i, j, x1, y1, x2, y2;
+
+	xsiz1 = tilesizx[tilenume1]; ysiz1 = tilesizy[tilenume1];
+	xsiz2 = tilesizx[tilenume2]; ysiz2 = tilesizy[tilenume2];
+	if ((xsiz1 > 0) && (ysiz1 > 0) && (xsiz2 > 0) && (ysiz2 > 0))
+	{
+		if (waloff[tilenume1] == 0) loadtile(tilenume1);
+		if (waloff[tilenume2] == 0) loadtile(tilenume2);
+
+		x1 = sx1;
+		for(i=0;i<xsiz;i++)
+		{
+			y1 = sy1;
+			for(j=0;j<ysiz;j++)
+			{
+				x2 = sx2+i;
+				y2 = sy2+j;
+				if ((x2 >= 0) && (y2 >= 0) && (x2 < xsiz2) && (y2 < ysiz2))
+				{
+					ptr1 = (unsigned char *)(waloff[tilenume1] + x1*ysiz1 + y1);
+					ptr2 = (unsigned char *)(waloff[tilenume2] + x2*ysiz2 + y2);
+					dat = *ptr1;
+					if (dat != 255)
+						*ptr2 = *ptr1;
+				}
+
+				y1++; if (y1 >= ysiz1) y1 = 0;
+			}
+			x1++; if (x1 >= xsiz1) x1 = 0;
+		}
+	}
+}
+
+
+//
+// qloadkvx
+//
+int qloadkvx(int voxindex, char *filename)
+{
+	int i, fil, dasiz, lengcnt, lengtot;
+	unsigned char *ptr;
+
 	if ((fil = kopen4load(filename,0)) == -1) return -1;
 
 	lengcnt = 0;
@@ -8281,7 +8792,8 @@ int nextsectorneighborz(short sectnum, int thez, short topbottom, short directio
 //
 // cansee
 //
-int cansee(int x1, int y1, int z1, short sect1, int x2, int y2, int z2, short sect2)
+int canseectx(int x1, int y1, int z1, short sect1, int x2, int y2, int z2, short sect2,
+	clipcontexttype *ctx)
 {
 	sectortype *sec;
 	walltype *wal, *wal2;
@@ -8289,13 +8801,17 @@ int cansee(int x1, int y1, int z1, short sect1, int x2, int y2, int z2, short se
 	int x21, y21, z21, x31, y31, x34, y34, bot, t;
 
 	if ((x1 == x2) && (y1 == y2)) return(sect1 == sect2);
+		// The PVS only holds for points that really lie in their sectors
+	if (pvscurrent() && ((unsigned)sect1 < (unsigned)numsectors) &&
+		((unsigned)sect2 < (unsigned)numsectors) && !pvsvisible(sect1,sect2) &&
+		(inside(x1,y1,sect1) == 1) && (inside(x2,y2,sect2) == 1)) return(0);
 
 	x21 = x2-x1; y21 = y2-y1; z21 = z2-z1;
 
-	clipsectorlist[0] = sect1; danum = 1;
+	ctx->clipsectorlist[0] = sect1; danum = 1;
 	for(dacnt=0;dacnt<danum;dacnt++)
 	{
-		dasectnum = clipsectorlist[dacnt]; sec = &sector[dasectnum];
+		dasectnum = ctx->clipsectorlist[dacnt]; sec = &sector[dasectnum];
 		for(cnt=sec->wallnum,wal=&wall[sec->wallptr];cnt>0;cnt--,wal++)
 		{
 			wal2 = &wall[wal->point2];
@@ -8319,21 +8835,29 @@ int cansee(int x1, int y1, int z1, short sect1, int x2, int y2, int z2, short se
 			getzsofslope((short)nexts,x,y,&cz,&fz);
 			if ((z <= cz) || (z >= fz)) return(0);
 
-			for(i=danum-1;i>=0;i--) if (clipsectorlist[i] == nexts) break;
-			if (i < 0) clipsectorlist[danum++] = nexts;
+			for(i=danum-1;i>=0;i--) if (ctx->clipsectorlist[i] == nexts) break;
+			if (i < 0) ctx->clipsectorlist[danum++] = nexts;
 		}
 	}
-	for(i=danum-1;i>=0;i--) if (clipsectorlist[i] == sect2) return(1);
+	for(i=danum-1;i>=0;i--) if (ctx->clipsectorlist[i] == sect2) return(1);
 	return(0);
 }
 
+int cansee(int x1, int y1, int z1, short sect1, int x2, int y2, int z2, short sect2)
+{
+	return canseectx(x1,y1,z1,sect1,x2,y2,z2,sect2,&clipctx);
+}
+
 
 //
 // hitscan
 //
-int hitscan(int xs, int ys, int zs, short sectnum, int vx, int vy, int vz,
+	// The sectors the ray passes through are collected in sectlist, which
+	// must hold MAXCLIPNUM entries, so that hitscanbatch can trace rays on
+	// several threads at once.
+static int dohitscan(int xs, int ys, int zs, short sectnum, int vx, int vy, int vz,
 	short *hitsect, short *hitwall, short *hitsprite,
-	int *hitx, int *hity, int *hitz, unsigned int cliptype)
+	int *hitx, int *hity, int *hitz, unsigned int cliptype, short *sectlist)
 {
 	sectortype *sec;
 	walltype *wal, *wal2;
@@ -8342,7 +8866,7 @@ int hitscan(int xs, int ys, int zs, short sectnum, int vx, int vy, int vz,
 	int topt, topu, bot, dist, offx, offy, cstat;
 	int i, j, k, l, tilenum, xoff, yoff, dax, day, daz, daz2;
 	int ang, cosang, sinang, xspan, yspan, xrepeat, yrepeat;
-	int dawalclipmask, dasprclipmask;
+	int dawalclipmask, dasprclipmask, geom;
 	short tempshortcnt, tempshortnum, dasector, startwall, endwall;
 	short nextsector;
 	unsigned char clipyou;
@@ -8355,18 +8879,29 @@ int hitscan(int xs, int ys, int zs, short sectnum, int vx, int vy, int vz,
 	dawalclipmask = (cliptype&65535);
 	dasprclipmask = (cliptype>>16);
 
-	clipsectorlist[0] = sectnum;
+	geom = mapgeomcurrent();
+	sectlist[0] = sectnum;
 	tempshortcnt = 0; tempshortnum = 1;
 	do
 	{
-		dasector = clipsectorlist[tempshortcnt]; sec = &sector[dasector];
+		dasector = sectlist[tempshortcnt]; sec = &sector[dasector];
 
 		x1 = 0x7fffffff;
 		if (sec->ceilingstat&2)
 		{
-			wal = &wall[sec->wallptr]; wal2 = &wall[wal->point2];
-			dax = wal2->x-wal->x; day = wal2->y-wal->y;
-			i = nsqrtasm(dax*dax+day*day); if (i == 0) continue;
+			wal = &wall[sec->wallptr];
+			if (geom)
+			{
+				dax = sectorgeom.dx[dasector]; day = sectorgeom.dy[dasector];
+				i = sectorgeom.len[dasector];
+			}
+			else
+			{
+				wal2 = &wall[wal->point2];
+				dax = wal2->x-wal->x; day = wal2->y-wal->y;
+				i = nsqrtasm(dax*dax+day*day);
+			}
+			if (i == 0) continue;
 			i = divscale15(sec->ceilingheinum,i);
 			dax *= i; day *= i;
 
@@ -8403,9 +8938,19 @@ int hitscan(int xs, int ys, int zs, short sectnum, int vx, int vy, int vz,
 		x1 = 0x7fffffff;
 		if (sec->floorstat&2)
 		{
-			wal = &wall[sec->wallptr]; wal2 = &wall[wal->point2];
-			dax = wal2->x-wal->x; day = wal2->y-wal->y;
-			i = nsqrtasm(dax*dax+day*day); if (i == 0) continue;
+			wal = &wall[sec->wallptr];
+			if (geom)
+			{
+				dax = sectorgeom.dx[dasector]; day = sectorgeom.dy[dasector];
+				i = sectorgeom.len[dasector];
+			}
+			else
+			{
+				wal2 = &wall[wal->point2];
+				dax = wal2->x-wal->x; day = wal2->y-wal->y;
+				i = nsqrtasm(dax*dax+day*day);
+			}
+			if (i == 0) continue;
 			i = divscale15(sec->floorheinum,i);
 			dax *= i; day *= i;
 
@@ -8466,8 +9011,8 @@ int hitscan(int xs, int ys, int zs, short sectnum, int vx, int vy, int vz,
 			}
 
 			for(zz=tempshortnum-1;zz>=0;zz--)
-				if (clipsectorlist[zz] == nextsector) break;
-			if (zz < 0) clipsectorlist[tempshortnum++] = nextsector;
+				if (sectlist[zz] == nextsector) break;
+			if (zz < 0) sectlist[tempshortnum++] = nextsector;
 		}
 
 		for(z=headspritesect[dasector];z>=0;z=nextspritesect[z])
@@ -8603,12 +9148,196 @@ int hitscan(int xs, int ys, int zs, short sectnum, int vx, int vy, int vz,
 	return(0);
 }
 
+int hitscanctx(int xs, int ys, int zs, short sectnum, int vx, int vy, int vz,
+	short *hitsect, short *hitwall, short *hitsprite,
+	int *hitx, int *hity, int *hitz, unsigned int cliptype, clipcontexttype *ctx)
+{
+	return dohitscan(xs,ys,zs,sectnum,vx,vy,vz,hitsect,hitwall,hitsprite,
+		hitx,hity,hitz,cliptype,ctx->clipsectorlist);
+}
+
+int hitscan(int xs, int ys, int zs, short sectnum, int vx, int vy, int vz,
+	short *hitsect, short *hitwall, short *hitsprite,
+	int *hitx, int *hity, int *hitz, unsigned int cliptype)
+{
+	return dohitscan(xs,ys,zs,sectnum,vx,vy,vz,hitsect,hitwall,hitsprite,
+		hitx,hity,hitz,cliptype,clipctx.clipsectorlist);
+}
+
+
+//
+// hitscanbatch
+//
+// Traces many rays, giving each the same result hitscan would. Rays are
+// ordered by the sector they start in and handed out in runs, so rays
+// starting together walk the same sectors, walls and sprites one after the
+// other on the same thread while that data is still in its cache.
+//
+#define HITSCANBATCHRUN 32	// rays to a job
+
+typedef struct {
+	hitscanraytype *rays;
+	int *order;
+	int numrays;
+} hitscanbatchjob;
+
+static void hitscanbatchrun(void *arg, int index)
+{
+	hitscanbatchjob *job = (hitscanbatchjob *)arg;
+	hitscanraytype *ray;
+	short sectlist[MAXCLIPNUM];
+	int i, end;
+
+	end = min(job->numrays, (index+1)*HITSCANBATCHRUN);
+	for (i=index*HITSCANBATCHRUN; i<end; i++)
+	{
+		ray = &job->rays[job->order[i]];
+		dohitscan(ray->xs,ray->ys,ray->zs,ray->sectnum,ray->vx,ray->vy,ray->vz,
+			&ray->hitsect,&ray->hitwall,&ray->hitsprite,
+			&ray->hitx,&ray->hity,&ray->hitz,ray->cliptype,sectlist);
+	}
+}
+
+int hitscanbatch(hitscanraytype *rays, int numrays)
+{
+	hitscanbatchjob job;
+	int *order, *first, i, s, numjobs;
+
+	if (numrays <= 0) return(0);
+
+	order = (int *)Bmalloc(numrays*sizeof(int));
+	first = (int *)Bcalloc(MAXSECTORS+2, sizeof(int));
+	if (!order || !first)
+	{
+		Bfree(order); Bfree(first);
+		for (i=0; i<numrays; i++)
+			hitscan(rays[i].xs,rays[i].ys,rays[i].zs,rays[i].sectnum,rays[i].vx,rays[i].vy,rays[i].vz,
+				&rays[i].hitsect,&rays[i].hitwall,&rays[i].hitsprite,
+				&rays[i].hitx,&rays[i].hity,&rays[i].hitz,rays[i].cliptype);
+		return(0);
+	}
+
+		// Counting sort by starting sector, rays outside the map first
+	for (i=0; i<numrays; i++)
+	{
+		s = rays[i].sectnum;
+		first[((s < 0) || (s >= MAXSECTORS)) ? 1 : s+2]++;
+	}
+	for (s=2; s<MAXSECTORS+2; s++) first[s] += first[s-1];
+	for (i=0; i<numrays; i++)
+	{
+		s = rays[i].sectnum;
+		order[first[((s < 0) || (s >= MAXSECTORS)) ? 0 : s+1]++] = i;
+	}
+	Bfree(first);
+
+	job.rays = rays;
+	job.order = order;
+	job.numrays = numrays;
+	numjobs = (numrays+HITSCANBATCHRUN-1)/HITSCANBATCHRUN;
+
+		// The pool is shared with drawrooms(), so size it the same way
+		// to avoid restarting it between the two
+	i = ((drawthreads < 0) || (drawthreads > 1)) ? drawthreads : -1;
+	if (numjobs < 2 || !hitscanthreads ||
+			threadpool_init(i) < 2 || threadpool_run(hitscanbatchrun, &job, numjobs))
+	{
+		for (i=0; i<numjobs; i++) hitscanbatchrun(&job, i);
+	}
+
+	Bfree(order);
+	return(0);
+}
+
+
+//
+// benchhitscan
+//
+// Times tracing rays from points about the map one hitscan at a time and
+// all together with hitscanbatch, and checks they agree.
+//
+void benchhitscan(int numrays)
+{
+	hitscanraytype *rays, *batch;
+	int x1, y1, x2, y2, cz, fz, i, tries, mismatches;
+	unsigned int seed, t, total[2];
+	short sectnum;
+
+	if (numsectors <= 0) { buildputs("No map is loaded.\n"); return; }
+
+	rays = (hitscanraytype *)Bcalloc(numrays, sizeof(hitscanraytype));
+	batch = (hitscanraytype *)Bmalloc(numrays*sizeof(hitscanraytype));
+	if (!rays || !batch) { Bfree(rays); Bfree(batch); return; }
+
+	x1 = y1 = 0x7fffffff;
+	x2 = y2 = 0x80000000;
+	for (i=numwalls-1; i>=0; i--)
+	{
+		x1 = min(x1, wall[i].x); x2 = max(x2, wall[i].x);
+		y1 = min(y1, wall[i].y); y2 = max(y2, wall[i].y);
+	}
+
+		// Rays leave in bursts of eight from the same spot, as a shotgun's would
+	seed = 1; sectnum = -1;
+	for (i=0; i<numrays; i++)
+	{
+		if (!(i&7) || sectnum < 0)
+		{
+			for (tries=0; tries<1000; tries++)
+			{
+				seed = seed*1103515245+12345;
+				rays[i].xs = x1 + (int)(((unsigned int)x2-(unsigned int)x1+1) * ((seed>>8)/16777216.0));
+				seed = seed*1103515245+12345;
+				rays[i].ys = y1 + (int)(((unsigned int)y2-(unsigned int)y1+1) * ((seed>>8)/16777216.0));
+				sectnum = -1;
+				updatesector(rays[i].xs, rays[i].ys, &sectnum);
+				if (sectnum >= 0) break;
+			}
+			getzsofslope(sectnum, rays[i].xs, rays[i].ys, &cz, &fz);
+			rays[i].zs = (cz>>1)+(fz>>1);
+		}
+		else
+		{
+			rays[i].xs = rays[i-1].xs; rays[i].ys = rays[i-1].ys; rays[i].zs = rays[i-1].zs;
+		}
+		rays[i].sectnum = sectnum;
+		seed = seed*1103515245+12345;
+		rays[i].vx = sintable[((seed>>16)+512)&2047];
+		rays[i].vy = sintable[(seed>>16)&2047];
+		rays[i].vz = (int)((seed>>4)&4095)-2048;
+		rays[i].cliptype = CLIPMASK1;
+	}
+	memcpy(batch, rays, numrays*sizeof(hitscanraytype));
+
+	t = getusecticks();
+	for (i=0; i<numrays; i++)
+		hitscan(rays[i].xs,rays[i].ys,rays[i].zs,rays[i].sectnum,rays[i].vx,rays[i].vy,rays[i].vz,
+			&rays[i].hitsect,&rays[i].hitwall,&rays[i].hitsprite,
+			&rays[i].hitx,&rays[i].hity,&rays[i].hitz,rays[i].cliptype);
+	total[0] = getusecticks()-t;
+
+	t = getusecticks();
+	hitscanbatch(batch, numrays);
+	total[1] = getusecticks()-t;
+
+	mismatches = 0;
+	for (i=0; i<numrays; i++)
+		if (memcmp(&rays[i], &batch[i], sizeof(hitscanraytype))) mismatches++;
+
+	Bfree(rays); Bfree(batch);
+
+	buildprintf("hitscan over %d rays (hitscanthreads %d):\n", numrays, hitscanthreads);
+	buildprintf("  %-10s %8u us (%.3f us each)\n", "one by one", total[0], (double)total[0]/(double)numrays);
+	buildprintf("  %-10s %8u us (%.3f us each)\n", "batched", total[1], (double)total[1]/(double)numrays);
+	if (mismatches) buildprintf("  %d rays hit something different!\n", mismatches);
+}
+
 
 //
 // neartag
 //
-int neartag(int xs, int ys, int zs, short sectnum, short ange, short *neartagsector, short *neartagwall,
-	short *neartagsprite, int *neartaghitdist, int neartagrange, unsigned char tagsearch)
+int neartagctx(int xs, int ys, int zs, short sectnum, short ange, short *neartagsector, short *neartagwall,
+	short *neartagsprite, int *neartaghitdist, int neartagrange, unsigned char tagsearch, clipcontexttype *ctx)
 {
 	walltype *wal, *wal2;
 	spritetype *spr;
@@ -8627,12 +9356,12 @@ int neartag(int xs, int ys, int zs, short sectnum, short ange, short *neartagsec
 	vy = mulscale14(sintable[(ange+2048)&2047],neartagrange); ye = ys+vy;
 	vz = 0; ze = 0;
 
-	clipsectorlist[0] = sectnum;
+	ctx->clipsectorlist[0] = sectnum;
 	tempshortcnt = 0; tempshortnum = 1;
 
 	do
 	{
-		dasector = clipsectorlist[tempshortcnt];
+		dasector = ctx->clipsectorlist[tempshortcnt];
 
 		startwall = sector[dasector].wallptr;
 		endwall = startwall + sector[dasector].wallnum - 1;
@@ -8667,8 +9396,8 @@ int neartag(int xs, int ys, int zs, short sectnum, short ange, short *neartagsec
 				if (nextsector >= 0)
 				{
 					for(zz=tempshortnum-1;zz>=0;zz--)
-						if (clipsectorlist[zz] == nextsector) break;
-					if (zz < 0) clipsectorlist[tempshortnum++] = nextsector;
+						if (ctx->clipsectorlist[zz] == nextsector) break;
+					if (zz < 0) ctx->clipsectorlist[tempshortnum++] = nextsector;
 				}
 			}
 		}
@@ -8726,6 +9455,13 @@ int neartag(int xs, int ys, int zs, short sectnum, short ange, short *neartagsec
 	return(0);
 }
 
+int neartag(int xs, int ys, int zs, short sectnum, short ange, short *neartagsector, short *neartagwall,
+	short *neartagsprite, int *neartaghitdist, int neartagrange, unsigned char tagsearch)
+{
+	return neartagctx(xs,ys,zs,sectnum,ange,neartagsector,neartagwall,
+		neartagsprite,neartaghitdist,neartagrange,tagsearch,&clipctx);
+}
+
 
 //
 // dragpoint
@@ -8736,6 +9472,7 @@ void dragpoint(short pointhighlight, int dax, int day)
 
 	wall[pointhighlight].x = dax;
 	wall[pointhighlight].y = day;
+	updatesectorgeometry(sectorofwall(pointhighlight));
 
 	cnt = MAXWALLS;
 	tempshort = pointhighlight;    //search points CCW
@@ -8746,6 +9483,7 @@ void dragpoint(short pointhighlight, int dax, int day)
 			tempshort = wall[wall[tempshort].nextwall].point2;
 			wall[tempshort].x = dax;
 			wall[tempshort].y = day;
+			updatesectorgeometry(sectorofwall(tempshort));
 		}
 		else
 		{
@@ -8757,6 +9495,7 @@ void dragpoint(short pointhighlight, int dax, int day)
 					tempshort = wall[lastwall(tempshort)].nextwall;
 					wall[tempshort].x = dax;
 					wall[tempshort].y = day;
+					updatesectorgeometry(sectorofwall(tempshort));
 				}
 				else
 				{
@@ -8797,11 +9536,11 @@ int lastwall(short point)
 
 #define addclipline(dax1, day1, dax2, day2, daoval)      \
 {                                                        \
-	if (clipnum < MAXCLIPNUM) { \
-	clipit[clipnum].x1 = dax1; clipit[clipnum].y1 = day1; \
-	clipit[clipnum].x2 = dax2; clipit[clipnum].y2 = day2; \
-	clipobjectval[clipnum] = daoval;                      \
-	clipnum++;                                            \
+	if (ctx->clipnum < MAXCLIPNUM) { \
+	ctx->clipit[ctx->clipnum].x1 = dax1; ctx->clipit[ctx->clipnum].y1 = day1; \
+	ctx->clipit[ctx->clipnum].x2 = dax2; ctx->clipit[ctx->clipnum].y2 = day2; \
+	ctx->clipobjectval[ctx->clipnum] = daoval;                      \
+	ctx->clipnum++;                                            \
 	}                           \
 }                                                        \
 
@@ -8810,9 +9549,9 @@ int clipmoveboxtracenum = 3;
 //
 // clipmove
 //
-int clipmove (int *x, int *y, int *z, short *sectnum,
+int clipmovectx(int *x, int *y, int *z, short *sectnum,
 		 int xvect, int yvect,
-		 int walldist, int ceildist, int flordist, unsigned int cliptype)
+		 int walldist, int ceildist, int flordist, unsigned int cliptype, clipcontexttype *ctx)
 {
 	walltype *wal, *wal2;
 	spritetype *spr;
@@ -8824,6 +9563,7 @@ int clipmove (int *x, int *y, int *z, short *sectnum,
 	int bsz, dax, day, xoff, yoff, xspan, yspan, cosang, sinang, tilenum;
 	int xrepeat, yrepeat, gx, gy, dx, dy, dasprclipmask, dawalclipmask;
 	int hitwall, cnt, clipyou;
+	int rxi[4], ryi[4];
 
 	if (((xvect|yvect) == 0) || (*sectnum < 0)) return(0);
 	retval = 0;
@@ -8835,7 +9575,7 @@ int clipmove (int *x, int *y, int *z, short *sectnum,
 	goaly = (*y) + (yvect>>14);
 
 
-	clipnum = 0;
+	ctx->clipnum = 0;
 
 	cx = (((*x)+goalx)>>1);
 	cy = (((*y)+goaly)>>1);
@@ -8848,11 +9588,11 @@ int clipmove (int *x, int *y, int *z, short *sectnum,
 	dawalclipmask = (cliptype&65535);        //CLIPMASK0 = 0x00010001
 	dasprclipmask = (cliptype>>16);          //CLIPMASK1 = 0x01000040
 
-	clipsectorlist[0] = (*sectnum);
-	clipsectcnt = 0; clipsectnum = 1;
+	ctx->clipsectorlist[0] = (*sectnum);
+	clipsectcnt = 0; ctx->clipsectnum = 1;
 	do
 	{
-		dasect = clipsectorlist[clipsectcnt++];
+		dasect = ctx->clipsectorlist[clipsectcnt++];
 		sec = &sector[dasect];
 		startwall = sec->wallptr; endwall = startwall + sec->wallnum;
 		for(j=startwall,wal=&wall[startwall];j<endwall;j++,wal++)
@@ -8911,9 +9651,9 @@ int clipmove (int *x, int *y, int *z, short *sectnum,
 			}
 			else
 			{
-				for(i=clipsectnum-1;i>=0;i--)
-					if (wal->nextsector == clipsectorlist[i]) break;
-				if (i < 0) clipsectorlist[clipsectnum++] = wal->nextsector;
+				for(i=ctx->clipsectnum-1;i>=0;i--)
+					if (wal->nextsector == ctx->clipsectorlist[i]) break;
+				if (i < 0) ctx->clipsectorlist[ctx->clipsectnum++] = wal->nextsector;
 			}
 		}
 
@@ -9038,7 +9778,7 @@ int clipmove (int *x, int *y, int *z, short *sectnum,
 					break;
 			}
 		}
-	} while (clipsectcnt < clipsectnum);
+	} while (clipsectcnt < ctx->clipsectnum);
 
 
 	hitwall = 0;
@@ -9046,10 +9786,10 @@ int clipmove (int *x, int *y, int *z, short *sectnum,
 	do
 	{
 		intx = goalx; inty = goaly;
-		if ((hitwall = raytrace(*x, *y, &intx, &inty)) >= 0)
+		if ((hitwall = raytrace(*x, *y, &intx, &inty, ctx)) >= 0)
 		{
-			lx = clipit[hitwall].x2-clipit[hitwall].x1;
-			ly = clipit[hitwall].y2-clipit[hitwall].y1;
+			lx = ctx->clipit[hitwall].x2-ctx->clipit[hitwall].x1;
+			ly = ctx->clipit[hitwall].y2-ctx->clipit[hitwall].y1;
 			templong2 = lx*lx + ly*ly;
 			if (templong2 > 0)
 			{
@@ -9066,8 +9806,8 @@ int clipmove (int *x, int *y, int *z, short *sectnum,
 			templong1 = dmulscale6(lx,oxvect,ly,oyvect);
 			for(i=cnt+1;i<=clipmoveboxtracenum;i++)
 			{
-				j = hitwalls[i];
-				templong2 = dmulscale6(clipit[j].x2-clipit[j].x1,oxvect,clipit[j].y2-clipit[j].y1,oyvect);
+				j = ctx->hitwalls[i];
+				templong2 = dmulscale6(ctx->clipit[j].x2-ctx->clipit[j].x1,oxvect,ctx->clipit[j].y2-ctx->clipit[j].y1,oyvect);
 				if ((templong1^templong2) < 0)
 				{
 					updatesector(*x,*y,sectnum);
@@ -9075,12 +9815,12 @@ int clipmove (int *x, int *y, int *z, short *sectnum,
 				}
 			}
 
-			keepaway(&goalx, &goaly, hitwall);
+			keepaway(&goalx, &goaly, hitwall, ctx);
 			xvect = ((goalx-intx)<<14);
 			yvect = ((goaly-inty)<<14);
 
-			if (cnt == clipmoveboxtracenum) retval = clipobjectval[hitwall];
-			hitwalls[cnt] = hitwall;
+			if (cnt == clipmoveboxtracenum) retval = ctx->clipobjectval[hitwall];
+			ctx->hitwalls[cnt] = hitwall;
 		}
 		cnt--;
 
@@ -9088,10 +9828,10 @@ int clipmove (int *x, int *y, int *z, short *sectnum,
 		*y = inty;
 	} while (((xvect|yvect) != 0) && (hitwall >= 0) && (cnt > 0));
 
-	for(j=0;j<clipsectnum;j++)
-		if (inside(*x,*y,clipsectorlist[j]) == 1)
+	for(j=0;j<ctx->clipsectnum;j++)
+		if (inside(*x,*y,ctx->clipsectorlist[j]) == 1)
 		{
-			*sectnum = clipsectorlist[j];
+			*sectnum = ctx->clipsectorlist[j];
 			return(retval);
 		}
 
@@ -9129,12 +9869,19 @@ int clipmove (int *x, int *y, int *z, short *sectnum,
 	return(retval);
 }
 
+int clipmove (int *x, int *y, int *z, short *sectnum,
+		 int xvect, int yvect,
+		 int walldist, int ceildist, int flordist, unsigned int cliptype)
+{
+	return clipmovectx(x,y,z,sectnum,xvect,yvect,walldist,ceildist,flordist,cliptype,&clipctx);
+}
+
 
 //
 // pushmove
 //
-int pushmove (int *x, int *y, int *z, short *sectnum,
-		 int walldist, int ceildist, int flordist, unsigned int cliptype)
+int pushmovectx(int *x, int *y, int *z, short *sectnum,
+		 int walldist, int ceildist, int flordist, unsigned int cliptype, clipcontexttype *ctx)
 {
 	sectortype *sec, *sec2;
 	walltype *wal, *wal2;
@@ -9155,12 +9902,12 @@ int pushmove (int *x, int *y, int *z, short *sectnum,
 	{
 		bad = 0;
 
-		clipsectorlist[0] = *sectnum;
-		clipsectcnt = 0; clipsectnum = 1;
+		ctx->clipsectorlist[0] = *sectnum;
+		clipsectcnt = 0; ctx->clipsectnum = 1;
 		do
 		{
 			/*Push FACE sprites
-			for(i=headspritesect[clipsectorlist[clipsectcnt]];i>=0;i=nextspritesect[i])
+			for(i=headspritesect[ctx->clipsectorlist[clipsectcnt]];i>=0;i=nextspritesect[i])
 			{
 				spr = &sprite[i];
 				if (((spr->cstat&48) != 0) && ((spr->cstat&48) != 48)) continue;
@@ -9193,7 +9940,7 @@ int pushmove (int *x, int *y, int *z, short *sectnum,
 				}
 			}*/
 
-			sec = &sector[clipsectorlist[clipsectcnt]];
+			sec = &sector[ctx->clipsectorlist[clipsectcnt]];
 			if (dir > 0)
 				startwall = sec->wallptr, endwall = startwall + sec->wallnum;
 			else
@@ -9225,12 +9972,12 @@ int pushmove (int *x, int *y, int *z, short *sectnum,
 						day = wal->y + mulscale30(day,t);
 
 
-						daz = getflorzofslope(clipsectorlist[clipsectcnt],dax,day);
+						daz = getflorzofslope(ctx->clipsectorlist[clipsectcnt],dax,day);
 						daz2 = getflorzofslope(wal->nextsector,dax,day);
 						if ((daz2 < daz-(1<<8)) && ((sec2->floorstat&1) == 0))
 							if (*z >= daz2-(flordist-1)) j = 1;
 
-						daz = getceilzofslope(clipsectorlist[clipsectcnt],dax,day);
+						daz = getceilzofslope(ctx->clipsectorlist[clipsectcnt],dax,day);
 						daz2 = getceilzofslope(wal->nextsector,dax,day);
 						if ((daz2 > daz+(1<<8)) && ((sec2->ceilingstat&1) == 0))
 							if (*z <= daz2+(ceildist-1)) j = 1;
@@ -9252,20 +9999,378 @@ int pushmove (int *x, int *y, int *z, short *sectnum,
 					}
 					else
 					{
-						for(j=clipsectnum-1;j>=0;j--)
-							if (wal->nextsector == clipsectorlist[j]) break;
-						if (j < 0) clipsectorlist[clipsectnum++] = wal->nextsector;
+						for(j=ctx->clipsectnum-1;j>=0;j--)
+							if (wal->nextsector == ctx->clipsectorlist[j]) break;
+						if (j < 0) ctx->clipsectorlist[ctx->clipsectnum++] = wal->nextsector;
 					}
 				}
 
 			clipsectcnt++;
-		} while (clipsectcnt < clipsectnum);
+		} while (clipsectcnt < ctx->clipsectnum);
 		dir = -dir;
 	} while (bad != 0);
 
 	return(bad);
 }
 
+int pushmove (int *x, int *y, int *z, short *sectnum,
+		 int walldist, int ceildist, int flordist, unsigned int cliptype)
+{
+	return pushmovectx(x,y,z,sectnum,walldist,ceildist,flordist,cliptype,&clipctx);
+}
+
+
+//
+// sector grid
+//
+// When a point isn't in the sector given to updatesector[z] or one of its
+// neighbours, every sector used to be tested in turn. Instead the map is cut
+// into square cells, each listing the sectors whose bounding boxes overlap
+// it, highest sector number first so the same sector is found as by testing
+// them all from the top down. Points and sectors past the edge of the grid
+// fall into the cells along it.
+//
+#define SECTORGRIDMAXDIM 128
+
+typedef struct {
+	short *sect;
+	short num, cap;
+} sectorgridcell_t;
+
+static sectorgridcell_t *sectorgrid = NULL;
+static int sectorgridx, sectorgridy, sectorgridshift, sectorgriddimx, sectorgriddimy;
+static int sectorgridnumsectors, sectorgridnumwalls, sectorgriddirty = 1;
+static mutex_type sectorgridlock = MUTEX_INITIALIZER;	// held while checking whether to rebuild
+static int sectorbbox[MAXSECTORS][4];			// x1,y1,x2,y2 of the walls, inclusive
+static unsigned char sectorgridcells[MAXSECTORS][4];	// cells the sector is listed in, inclusive
+
+static void sectorgridbounds(short sectnum)
+{
+	walltype *wal;
+	int i, x1, y1, x2, y2;
+	unsigned int cx1, cy1, cx2, cy2;
+
+	x1 = y1 = 0x7fffffff;
+	x2 = y2 = 0x80000000;
+	wal = &wall[sector[sectnum].wallptr];
+	for (i=sector[sectnum].wallnum; i>0; i--,wal++)
+	{
+		if (wal->x < x1) x1 = wal->x;
+		if (wal->x > x2) x2 = wal->x;
+		if (wal->y < y1) y1 = wal->y;
+		if (wal->y > y2) y2 = wal->y;
+	}
+	sectorbbox[sectnum][0] = x1; sectorbbox[sectnum][1] = y1;
+	sectorbbox[sectnum][2] = x2; sectorbbox[sectnum][3] = y2;
+
+	if (x1 > x2)
+	{	// no walls, so never inside
+		sectorgridcells[sectnum][0] = sectorgridcells[sectnum][1] = 1;
+		sectorgridcells[sectnum][2] = sectorgridcells[sectnum][3] = 0;
+		return;
+	}
+
+	cx1 = (x1 <= sectorgridx) ? 0 : ((unsigned int)x1-(unsigned int)sectorgridx)>>sectorgridshift;
+	cy1 = (y1 <= sectorgridy) ? 0 : ((unsigned int)y1-(unsigned int)sectorgridy)>>sectorgridshift;
+	cx2 = (x2 <= sectorgridx) ? 0 : ((unsigned int)x2-(unsigned int)sectorgridx)>>sectorgridshift;
+	cy2 = (y2 <= sectorgridy) ? 0 : ((unsigned int)y2-(unsigned int)sectorgridy)>>sectorgridshift;
+	sectorgridcells[sectnum][0] = (unsigned char)min(cx1, (unsigned int)sectorgriddimx-1);
+	sectorgridcells[sectnum][1] = (unsigned char)min(cy1, (unsigned int)sectorgriddimy-1);
+	sectorgridcells[sectnum][2] = (unsigned char)min(cx2, (unsigned int)sectorgriddimx-1);
+	sectorgridcells[sectnum][3] = (unsigned char)min(cy2, (unsigned int)sectorgriddimy-1);
+}
+
+static void sectorgridinsert(short sectnum)
+{
+	sectorgridcell_t *cell;
+	short *sect;
+	int x, y, i;
+
+	for (y=sectorgridcells[sectnum][1]; y<=sectorgridcells[sectnum][3]; y++)
+		for (x=sectorgridcells[sectnum][0]; x<=sectorgridcells[sectnum][2]; x++)
+		{
+			cell = &sectorgrid[y*sectorgriddimx+x];
+			if (cell->num == cell->cap)
+			{
+				sect = (short *)Brealloc(cell->sect, (cell->cap ? cell->cap*2 : 4)*sizeof(short));
+				if (!sect) { sectorgriddirty = 1; return; }
+				cell->sect = sect;
+				cell->cap = cell->cap ? cell->cap*2 : 4;
+			}
+			for (i=cell->num; i>0 && cell->sect[i-1] < sectnum; i--)
+				cell->sect[i] = cell->sect[i-1];
+			cell->sect[i] = sectnum;
+			cell->num++;
+		}
+}
+
+static void sectorgridremove(short sectnum)
+{
+	sectorgridcell_t *cell;
+	int x, y, i;
+
+	for (y=sectorgridcells[sectnum][1]; y<=sectorgridcells[sectnum][3]; y++)
+		for (x=sectorgridcells[sectnum][0]; x<=sectorgridcells[sectnum][2]; x++)
+		{
+			cell = &sectorgrid[y*sectorgriddimx+x];
+			for (i=0; i<cell->num && cell->sect[i] != sectnum; i++) ;
+			if (i == cell->num) continue;
+			cell->num--;
+			memmove(&cell->sect[i], &cell->sect[i+1], (cell->num-i)*sizeof(short));
+		}
+}
+
+static void freesectorgrid(void)
+{
+	int i;
+
+	if (sectorgrid)
+	{
+		for (i=sectorgriddimx*sectorgriddimy-1; i>=0; i--)
+			if (sectorgrid[i].sect) Bfree(sectorgrid[i].sect);
+		Bfree(sectorgrid);
+		sectorgrid = NULL;
+	}
+	sectorgriddirty = 1;
+}
+
+static void buildsectorgrid(void)
+{
+	int i, x1, y1, x2, y2, maxcells;
+	unsigned int w, h;
+
+	freesectorgrid();
+
+	x1 = y1 = 0x7fffffff;
+	x2 = y2 = 0x80000000;
+	for (i=numwalls-1; i>=0; i--)
+	{
+		if (wall[i].x < x1) x1 = wall[i].x;
+		if (wall[i].x > x2) x2 = wall[i].x;
+		if (wall[i].y < y1) y1 = wall[i].y;
+		if (wall[i].y > y2) y2 = wall[i].y;
+	}
+	if (x1 > x2) x1 = x2 = y1 = y2 = 0;
+	w = (unsigned int)x2-(unsigned int)x1;
+	h = (unsigned int)y2-(unsigned int)y1;
+
+		// About two cells per sector, but none smaller than a 1024 unit square
+	maxcells = max(64, numsectors*2);
+	for (sectorgridshift=10; sectorgridshift<31; sectorgridshift++)
+	{
+		if ((w>>sectorgridshift) >= SECTORGRIDMAXDIM || (h>>sectorgridshift) >= SECTORGRIDMAXDIM) continue;
+		if ((int)((w>>sectorgridshift)+1)*(int)((h>>sectorgridshift)+1) <= maxcells) break;
+	}
+	sectorgridx = x1;
+	sectorgridy = y1;
+	sectorgriddimx = (w>>sectorgridshift)+1;
+	sectorgriddimy = (h>>sectorgridshift)+1;
+
+	sectorgrid = (sectorgridcell_t *)Bcalloc(sectorgriddimx*sectorgriddimy, sizeof(sectorgridcell_t));
+	if (!sectorgrid) return;
+
+	sectorgriddirty = 0;
+	sectorgridnumsectors = numsectors;
+	sectorgridnumwalls = numwalls;
+	for (i=numsectors-1; i>=0; i--)
+	{
+		sectorgridbounds((short)i);
+		sectorgridinsert((short)i);
+	}
+	if (sectorgriddirty) freesectorgrid();
+}
+
+	// Files one sector again after some of its walls have moved.
+static void updatesectorgrid(short sectnum)
+{
+	unsigned char oldcells[4];
+
+	if (sectorgriddirty || !sectorgrid) return;
+	if ((sectnum < 0) || (sectnum >= sectorgridnumsectors)) return;
+
+	memcpy(oldcells, sectorgridcells[sectnum], 4);
+	sectorgridbounds(sectnum);
+	if (!memcmp(oldcells, sectorgridcells[sectnum], 4)) return;
+
+	memcpy(sectorgridcells[sectnum], oldcells, 4);
+	sectorgridremove(sectnum);
+	sectorgridbounds(sectnum);
+	sectorgridinsert(sectnum);
+}
+
+static void buildsectorgeometry(short sectnum)
+{
+	walltype *wal;
+	int dx, dy;
+
+	wal = &wall[sector[sectnum].wallptr];
+	dx = wall[wal->point2].x-wal->x; dy = wall[wal->point2].y-wal->y;
+	sectorgeom.x[sectnum] = wal->x;
+	sectorgeom.y[sectnum] = wal->y;
+	sectorgeom.dx[sectnum] = dx;
+	sectorgeom.dy[sectnum] = dy;
+	sectorgeom.len[sectnum] = nsqrtasm(dx*dx+dy*dy);
+}
+
+static void buildmapgeometry(void)
+{
+	int i;
+
+	for (i=numsectors-1; i>=0; i--) buildsectorgeometry((short)i);
+	mapgeomnumsectors = numsectors;
+	mapgeomnumwalls = numwalls;
+	mapgeomdirty = 0;
+}
+
+	// For a freshly loaded map.
+static void loadmapgeometry(void)
+{
+	freepvs();
+	buildmapgeometry();
+	if (usesectorgrid) buildsectorgrid(); else sectorgriddirty = 1;
+}
+
+	// Anything that moves walls other than through dragpoint() must call
+	// this for each sector with a wall that moved, or the sector grid and
+	// the slope functions go on using where they were.
+void updatesectorgeometry(short sectnum)
+{
+	if ((sectnum < 0) || (sectnum >= numsectors)) return;
+	if (mapgeomvalid()) buildsectorgeometry(sectnum);
+	updatesectorgrid(sectnum);
+	pvsnumsectors = -1;
+}
+
+	// After walls have been moved about in bulk, or added or taken away, as
+	// the editor does. The sector grid is rebuilt the next time it is needed
+	// and the rest the next time drawrooms() is called, with the functions
+	// using it working from wall[] directly until then.
+void invalidatemapgeometry(void)
+{
+	mapgeomdirty = 1;
+	sectorgriddirty = 1;
+	pvsnumsectors = -1;
+}
+
+static void freepvs(void)
+{
+	if (pvsdata) Bfree(pvsdata);
+	pvsdata = NULL;
+	pvsnumsectors = pvsnumwalls = -1;
+}
+
+	// Takes the map's name with .pvs for its extension, if there is such a
+	// file and it was made from this very map.
+static void loadpvs(const char *filename, char fromwhere)
+{
+	char pvsname[BMAX_PATH], *dot;
+	unsigned char header[24], buf[4096];
+	int fil, i, len, rowbytes, mapcrc;
+	unsigned int crc;
+
+	freepvs();
+
+	Bstrncpy(pvsname, filename, BMAX_PATH-5);
+	pvsname[BMAX_PATH-5] = 0;
+	dot = Bstrrchr(pvsname, '.');
+	if (!dot || Bstrchr(dot, '/') || Bstrchr(dot, '\\')) dot = pvsname + strlen(pvsname);
+	strcpy(dot, ".pvs");
+
+	if ((fil = kopen4load(pvsname,fromwhere)) == -1) return;
+
+	rowbytes = (numsectors+7)>>3;
+	if (kread(fil,header,sizeof(header)) != sizeof(header) || Bmemcmp(header, "BuildPVS", 8)) {
+		kclose(fil);
+		buildprintf("%s: bad signature\n", pvsname);
+		return;
+	}
+	Bmemcpy(&i, &header[8], 4);
+	if (B_LITTLE32(i) != PVSVERSION) {
+		kclose(fil);
+		buildprintf("%s: version %d, but version %d was expected\n", pvsname, B_LITTLE32(i), PVSVERSION);
+		return;
+	}
+	Bmemcpy(&i, &header[12], 4);
+	Bmemcpy(&len, &header[16], 4);
+	Bmemcpy(&mapcrc, &header[20], 4);
+	if (B_LITTLE32(i) != numsectors || B_LITTLE32(len) != numwalls) {
+		kclose(fil);
+		buildprintf("%s: made for a different map, ignoring it\n", pvsname);
+		return;
+	}
+
+	pvsdata = (unsigned char *)Bmalloc(numsectors * rowbytes);
+	if (!pvsdata || kread(fil,pvsdata,numsectors * rowbytes) != numsectors * rowbytes) {
+		kclose(fil);
+		freepvs();
+		buildprintf("%s: failed to read\n", pvsname);
+		return;
+	}
+	kclose(fil);
+
+		// Saving the map over makes its .pvs out of date.
+	if ((fil = kopen4load((char *)filename,fromwhere)) == -1) { freepvs(); return; }
+	crc32init(&crc);
+	while ((len = kread(fil,buf,sizeof(buf))) > 0) crc32block(&crc,buf,len);
+	crc32finish(&crc);
+	kclose(fil);
+	if (crc != (unsigned int)B_LITTLE32(mapcrc)) {
+		freepvs();
+		buildprintf("%s: out of date, ignoring it\n", pvsname);
+		return;
+	}
+
+	pvsrowbytes = rowbytes;
+	pvsnumsectors = numsectors;
+	pvsnumwalls = numwalls;
+}
+
+	// The sectors drawrooms() need consider for the current view, or NULL for
+	// all of them. The view must be inside its sector, which mirrors aren't.
+const unsigned char *pvsforview(void)
+{
+	if (!pvscurrent()) return NULL;
+	if ((unsigned)globalcursectnum >= (unsigned)numsectors) return NULL;
+	if (inside(globalposx,globalposy,globalcursectnum) != 1) return NULL;
+	return &pvsdata[globalcursectnum*pvsrowbytes];
+}
+
+	// Finds the highest numbered sector containing the point, and with z
+	// between its ceiling and floor if usez is set. Returns -2 if the grid
+	// can't be used. Threads making collision queries together may all
+	// arrive here with the grid out of date, so only one rebuilds it.
+static int sectorgridfind(int x, int y, int z, int usez)
+{
+	sectorgridcell_t *cell;
+	unsigned int cx, cy;
+	int i, s, cz, fz;
+
+	mutex_lock(&sectorgridlock);
+	if (sectorgriddirty || !sectorgrid ||
+			sectorgridnumsectors != numsectors || sectorgridnumwalls != numwalls)
+		buildsectorgrid();
+	mutex_unlock(&sectorgridlock);
+	if (!sectorgrid) return -2;
+
+	cx = (x <= sectorgridx) ? 0 : ((unsigned int)x-(unsigned int)sectorgridx)>>sectorgridshift;
+	cy = (y <= sectorgridy) ? 0 : ((unsigned int)y-(unsigned int)sectorgridy)>>sectorgridshift;
+	cell = &sectorgrid[min(cy, (unsigned int)sectorgriddimy-1)*sectorgriddimx + min(cx, (unsigned int)sectorgriddimx-1)];
+
+	for (i=0; i<cell->num; i++)
+	{
+		s = cell->sect[i];
+		if ((x < sectorbbox[s][0]) || (x > sectorbbox[s][2]) ||
+			(y < sectorbbox[s][1]) || (y > sectorbbox[s][3])) continue;
+		if (usez)
+		{
+			getzsofslope((short)s, x, y, &cz, &fz);
+			if ((z < cz) || (z > fz)) continue;
+		}
+		if (inside(x,y,(short)s) == 1) return s;
+	}
+	return -1;
+}
+
 
 //
 // updatesector[z]
@@ -9295,6 +10400,12 @@ void updatesector(int x, int y, short *sectnum)
 		} while (j != 0);
 	}
 
+	if (usesectorgrid && (i = sectorgridfind(x,y,0,0)) != -2)
+	{
+		*sectnum = i;
+		return;
+	}
+
 	for(i=numsectors-1;i>=0;i--)
 		if (inside(x,y,(short)i) == 1)
 		{
@@ -9332,6 +10443,9 @@ void updatesectorz(int x, int y, int z, short *sectnum)
 		} while (j != 0);
 	}
 
+	if (usesectorgrid && (i = sectorgridfind(x,y,z,1)) != -2)
+		{ *sectnum = i; return; }
+
 	for (i=numsectors-1;i>=0;i--)
 	{
 		getzsofslope(i, x, y, &cz, &fz);
@@ -9344,6 +10458,68 @@ void updatesectorz(int x, int y, int z, short *sectnum)
 }
 
 
+//
+// benchsectorgrid
+//
+// Times the search updatesector makes when a point has left the sector and
+// its neighbours, through the grid and by testing every sector.
+//
+void benchsectorgrid(int lookups)
+{
+	int *pts, x1, y1, x2, y2, b, i, mismatches, susesectorgrid;
+	unsigned int seed, t, total[2];
+	short *found, sectnum;
+
+	if (numsectors <= 0) { buildputs("No map is loaded.\n"); return; }
+
+	pts = (int *)Bmalloc(lookups*2*sizeof(int));
+	found = (short *)Bmalloc(lookups*sizeof(short));
+	if (!pts || !found) { Bfree(pts); Bfree(found); return; }
+
+	x1 = y1 = 0x7fffffff;
+	x2 = y2 = 0x80000000;
+	for (i=numwalls-1; i>=0; i--)
+	{
+		x1 = min(x1, wall[i].x); x2 = max(x2, wall[i].x);
+		y1 = min(y1, wall[i].y); y2 = max(y2, wall[i].y);
+	}
+	seed = 1;
+	for (i=0; i<lookups; i++)
+	{
+		seed = seed*1103515245+12345;
+		pts[i*2] = x1 + (int)(((unsigned int)x2-(unsigned int)x1+1) * ((seed>>8)/16777216.0));
+		seed = seed*1103515245+12345;
+		pts[i*2+1] = y1 + (int)(((unsigned int)y2-(unsigned int)y1+1) * ((seed>>8)/16777216.0));
+	}
+
+	susesectorgrid = usesectorgrid;
+	mismatches = 0;
+	for (b=0; b<2; b++)
+	{
+		usesectorgrid = b;
+		if (b) buildsectorgrid();
+		t = getusecticks();
+		for (i=0; i<lookups; i++)
+		{
+			sectnum = -1;
+			updatesector(pts[i*2], pts[i*2+1], &sectnum);
+			if (!b) found[i] = sectnum;
+			else if (found[i] != sectnum) mismatches++;
+		}
+		total[b] = getusecticks()-t;
+	}
+	usesectorgrid = susesectorgrid;
+
+	Bfree(pts); Bfree(found);
+
+	buildprintf("updatesector over %d points in %d sectors (grid %dx%d cells of %d units):\n",
+		lookups, numsectors, sectorgriddimx, sectorgriddimy, 1<<sectorgridshift);
+	for (b=0; b<2; b++)
+		buildprintf("  %-10s %8u us (%.3f us each)\n", b ? "grid" : "every", total[b], (double)total[b]/(double)lookups);
+	if (mismatches) buildprintf("  %d points found a different sector!\n", mismatches);
+}
+
+
 //
 // rotatepoint
 //
@@ -9383,9 +10559,9 @@ int krand(void)
 //
 // getzrange
 //
-void getzrange(int x, int y, int z, short sectnum,
+void getzrangectx(int x, int y, int z, short sectnum,
 		 int *ceilz, int *ceilhit, int *florz, int *florhit,
-		 int walldist, unsigned int cliptype)
+		 int walldist, unsigned int cliptype, clipcontexttype *ctx)
 {
 	sectortype *sec;
 	walltype *wal, *wal2;
@@ -9415,12 +10591,12 @@ void getzrange(int x, int y, int z, short sectnum,
 	dawalclipmask = (cliptype&65535);
 	dasprclipmask = (cliptype>>16);
 
-	clipsectorlist[0] = sectnum;
-	clipsectcnt = 0; clipsectnum = 1;
+	ctx->clipsectorlist[0] = sectnum;
+	clipsectcnt = 0; ctx->clipsectnum = 1;
 
 	do  //Collect sectors inside your square first
 	{
-		sec = &sector[clipsectorlist[clipsectcnt]];
+		sec = &sector[ctx->clipsectorlist[clipsectcnt]];
 		startwall = sec->wallptr; endwall = startwall + sec->wallnum;
 		for(j=startwall,wal=&wall[startwall];j<endwall;j++,wal++)
 		{
@@ -9449,8 +10625,8 @@ void getzrange(int x, int y, int z, short sectnum,
 					if (((sec->floorstat&1) == 0) && (z >= sec->floorz-(3<<8))) continue;
 				}
 
-				for(i=clipsectnum-1;i>=0;i--) if (clipsectorlist[i] == k) break;
-				if (i < 0) clipsectorlist[clipsectnum++] = k;
+				for(i=ctx->clipsectnum-1;i>=0;i--) if (ctx->clipsectorlist[i] == k) break;
+				if (i < 0) ctx->clipsectorlist[ctx->clipsectnum++] = k;
 
 				if ((x1 < xmin+MAXCLIPDIST) && (x2 < xmin+MAXCLIPDIST)) continue;
 				if ((x1 > xmax-MAXCLIPDIST) && (x2 > xmax-MAXCLIPDIST)) continue;
@@ -9467,11 +10643,11 @@ void getzrange(int x, int y, int z, short sectnum,
 			}
 		}
 		clipsectcnt++;
-	} while (clipsectcnt < clipsectnum);
+	} while (clipsectcnt < ctx->clipsectnum);
 
-	for(i=0;i<clipsectnum;i++)
+	for(i=0;i<ctx->clipsectnum;i++)
 	{
-		for(j=headspritesect[clipsectorlist[i]];j>=0;j=nextspritesect[j])
+		for(j=headspritesect[ctx->clipsectorlist[i]];j>=0;j=nextspritesect[j])
 		{
 			spr = &sprite[j];
 			cstat = spr->cstat;
@@ -9577,6 +10753,13 @@ void getzrange(int x, int y, int z, short sectnum,
 	}
 }
 
+void getzrange(int x, int y, int z, short sectnum,
+		 int *ceilz, int *ceilhit, int *florz, int *florhit,
+		 int walldist, unsigned int cliptype)
+{
+	getzrangectx(x,y,z,sectnum,ceilz,ceilhit,florz,florhit,walldist,cliptype,&clipctx);
+}
+
 
 //
 // setview
@@ -9605,7 +10788,7 @@ void setview(int x1, int y1, int x2, int y2)
 	for(i=windowx2+1;i<xdim;i++) { startumost[i] = 1, startdmost[i] = 0; }
 
 #if USE_POLYMOST && USE_OPENGL
-	polymost_setview();
+	if (currendercontext == &screencontext) polymost_setview();
 #endif
 }
 
@@ -9652,10 +10835,16 @@ void rotatesprite(int sx, int sy, int z, short a, short picnum, signed char dash
 	if (picanm[picnum]&192) picnum += animateoffs(picnum,(short)0xc000);
 	if ((tilesizx[picnum] <= 0) || (tilesizy[picnum] <= 0)) return;
 
+	if (currendercontext != &screencontext) {
+			//Permanent sprites only apply to the screen's pages
+		PROFILE_TIME(PROFILE_ROTATESPRITE, dorotatesprite(sx,sy,z,a,picnum,dashade,dapalnum,dastat,cx1,cy1,cx2,cy2,guniqhudid));
+		return;
+	}
+
 	if (((dastat&128) == 0) || (numpages < 2) || (beforedrawrooms != 0)) {
-		begindrawing();	//{{{
-		dorotatesprite(sx,sy,z,a,picnum,dashade,dapalnum,dastat,cx1,cy1,cx2,cy2,guniqhudid);
-		enddrawing();	//}}}
+		beginviewdrawing();	//{{{
+		PROFILE_TIME(PROFILE_ROTATESPRITE, dorotatesprite(sx,sy,z,a,picnum,dashade,dapalnum,dastat,cx1,cy1,cx2,cy2,guniqhudid));
+		endviewdrawing();	//}}}
 	}
 
 	if ((dastat&64) && (cx1 <= 0) && (cy1 <= 0) && (cx2 >= xdim-1) && (cy2 >= ydim-1) &&
@@ -9792,6 +10981,10 @@ int makepalookup(int palnum, unsigned char *remapbuf, signed char r, signed char
 #endif
 	}
 
+#if USE_POLYMOST && USE_OPENGL
+	polymost_palookupinvalidate(palnum);
+#endif
+
 	return 0;
 }
 
@@ -9922,6 +11115,7 @@ void clearview(int dacol)
 					  ((float)p.g)/255.0,
 					  ((float)p.b)/255.0,
 					  0);
+		polymost_flushbatch();
 		glfunc.glScissor(windowx1,yres-(windowy2+1),windowx2-windowx1+1,windowy2-windowy1+1);
 		glfunc.glEnable(GL_SCISSOR_TEST);
 		glfunc.glClear(GL_COLOR_BUFFER_BIT);
@@ -9930,7 +11124,7 @@ void clearview(int dacol)
 	}
 #endif
 
-	begindrawing();	//{{{
+	beginviewdrawing();	//{{{
 	dx = windowx2-windowx1+1;
 	//dacol += (dacol<<8); dacol += (dacol<<16);
 	p = frameplace+ylookup[windowy1]+windowx1;
@@ -9939,9 +11133,9 @@ void clearview(int dacol)
 		Bmemset((void*)p,dacol,dx);
 		p += ylookup[1];
 	}
-	enddrawing();	//}}}
+	endviewdrawing();	//}}}
 
-	faketimerhandler();
+	if (enginethread) faketimerhandler();
 }
 
 
@@ -9962,6 +11156,7 @@ void clearallviews(int dacol)
 			p.g = britable[curbrightness][ curpalette[dacol].g ];
 			p.b = britable[curbrightness][ curpalette[dacol].b ];
 		}
+		polymost_flushbatch();
 		glfunc.glViewport(0,0,xdim,ydim); glox1 = -1;
 		glfunc.glClearColor(((float)p.r)/255.0,
 					  ((float)p.g)/255.0,
@@ -9991,9 +11186,9 @@ void plotpixel(int x, int y, unsigned char col)
 	if (!polymost_plotpixel(x,y,col)) return;
 #endif
 
-	begindrawing();	//{{{
+	beginviewdrawing();	//{{{
 	drawpixel((void*)(ylookup[y]+x+frameplace),(int)col);
-	enddrawing();	//}}}
+	endviewdrawing();	//}}}
 }
 
 
@@ -10008,9 +11203,9 @@ unsigned char getpixel(int x, int y)
 	if (rendmode == 3 && qsetmode == 200) return 0;
 #endif
 
-	begindrawing();	//{{{
+	beginviewdrawing();	//{{{
 	r = readpixel((void*)(ylookup[y]+x+frameplace));
-	enddrawing();	//}}}
+	endviewdrawing();	//}}}
 	return(r);
 }
 
@@ -10024,6 +11219,8 @@ void setviewtotile(short tilenume, int xsiz, int ysiz)
 {
 	int i, j;
 
+	unmaptile(tilenume, xsiz*ysiz);
+
 		//DRAWROOMS TO TILE BACKUP&SET CODE
 	tilesizx[tilenume] = xsiz; tilesizy[tilenume] = ysiz;
 	bakxsiz[setviewcnt] = xsiz; bakysiz[setviewcnt] = ysiz;
@@ -10085,6 +11282,97 @@ void setviewback(void)
 }
 
 
+//
+// newrendercontext
+//
+rendercontext *newrendercontext(void *frame, int daxdim, int daydim, int dabytesperline)
+{
+	rendercontext *rc;
+	int i, j;
+
+	if ((daxdim <= 0) || (daxdim > MAXXDIM) || (daydim <= 0) || (daydim > MAXYDIM)) return NULL;
+
+	rc = (rendercontext *)Bcalloc(1, sizeof(rendercontext));
+	if (!rc) return NULL;
+
+	j = daydim*4*sizeof(int);  //Leave room for horizlookup&horizlookup2
+	rc->tables = kmalloc((j<<1) + 65536*sizeof(rc->distrecip[0]) +
+		(MAXXDIM+MAXYSAVES)*sizeof(short));
+	if (!rc->tables) { Bfree(rc); return NULL; }
+
+	rc->horizlookup = (int *)(rc->tables);
+	rc->horizlookup2 = (int *)((intptr_t)rc->tables+j);
+	rc->horizycent = ((daydim*4)>>1);
+	rc->distrecip = (unsigned int *)((intptr_t)rc->tables+(j<<1));
+	rc->radarang2 = (short *)&rc->distrecip[65536];
+	rc->smost = &rc->radarang2[MAXXDIM];
+	rc->oxyaspect = rc->oxdimen = rc->oviewingrange = -1;
+
+	rc->frameplace = (intptr_t)frame; rc->bytesperline = dabytesperline;
+	rc->xdim = daxdim; rc->ydim = daydim;
+	j = 0;
+	for(i=0;i<=daydim;i++) rc->ylookup[i] = j, j += dabytesperline;
+
+		//setrendercontext() sets the window up on first use
+	rc->xdimen = -1;
+
+	return rc;
+}
+
+
+//
+// freerendercontext
+//
+void freerendercontext(rendercontext *rc)
+{
+	if (!rc || rc == &screencontext) return;
+	if (rc == currendercontext) setrendercontext(NULL);
+
+	kfree(rc->tables);
+	Bfree(rc);
+}
+
+
+//
+// setrendercontext
+//
+void setrendercontext(rendercontext *rc)
+{
+	if (!rc && enginethread) rc = &screencontext;
+	if (rc == currendercontext) return;
+
+	if (currendercontext) saveviewstate(currendercontext);
+	currendercontext = rc;
+	if (!rc) return;
+
+	loadviewstate(rc);
+	if (xdimen < 0) setview(0,0,xdim-1,ydim-1);
+}
+
+
+//
+// drawroomsto/drawmasksto/drawmapviewto
+//
+void drawroomsto(rendercontext *rc, int daposx, int daposy, int daposz,
+		 short daang, int dahoriz, short dacursectnum)
+{
+	setrendercontext(rc);
+	drawrooms(daposx,daposy,daposz,daang,dahoriz,dacursectnum);
+}
+
+void drawmasksto(rendercontext *rc)
+{
+	setrendercontext(rc);
+	drawmasks();
+}
+
+void drawmapviewto(rendercontext *rc, int dax, int day, int zoome, short ang)
+{
+	setrendercontext(rc);
+	drawmapview(dax,day,zoome,ang);
+}
+
+
 //
 // squarerotatetile
 //
@@ -10193,6 +11481,13 @@ int getceilzofslope(short sectnum, int dax, int day)
 	walltype *wal;
 
 	if (!(sector[sectnum].ceilingstat&2)) return(sector[sectnum].ceilingz);
+	if (mapgeomcurrent())
+	{
+		dx = sectorgeom.dx[sectnum]; dy = sectorgeom.dy[sectnum];
+		i = (sectorgeom.len[sectnum]<<5); if (i == 0) return(sector[sectnum].ceilingz);
+		j = dmulscale3(dx,day-sectorgeom.y[sectnum],-dy,dax-sectorgeom.x[sectnum]);
+		return(sector[sectnum].ceilingz+scale(sector[sectnum].ceilingheinum,j,i));
+	}
 	wal = &wall[sector[sectnum].wallptr];
 	dx = wall[wal->point2].x-wal->x; dy = wall[wal->point2].y-wal->y;
 	i = (nsqrtasm(dx*dx+dy*dy)<<5); if (i == 0) return(sector[sectnum].ceilingz);
@@ -10210,6 +11505,13 @@ int getflorzofslope(short sectnum, int dax, int day)
 	walltype *wal;
 
 	if (!(sector[sectnum].floorstat&2)) return(sector[sectnum].floorz);
+	if (mapgeomcurrent())
+	{
+		dx = sectorgeom.dx[sectnum]; dy = sectorgeom.dy[sectnum];
+		i = (sectorgeom.len[sectnum]<<5); if (i == 0) return(sector[sectnum].floorz);
+		j = dmulscale3(dx,day-sectorgeom.y[sectnum],-dy,dax-sectorgeom.x[sectnum]);
+		return(sector[sectnum].floorz+scale(sector[sectnum].floorheinum,j,i));
+	}
 	wal = &wall[sector[sectnum].wallptr];
 	dx = wall[wal->point2].x-wal->x; dy = wall[wal->point2].y-wal->y;
 	i = (nsqrtasm(dx*dx+dy*dy)<<5); if (i == 0) return(sector[sectnum].floorz);
@@ -10231,10 +11533,19 @@ void getzsofslope(short sectnum, int dax, int day, int *ceilz, int *florz)
 	*ceilz = sec->ceilingz; *florz = sec->floorz;
 	if ((sec->ceilingstat|sec->floorstat)&2)
 	{
-		wal = &wall[sec->wallptr]; wal2 = &wall[wal->point2];
-		dx = wal2->x-wal->x; dy = wal2->y-wal->y;
-		i = (nsqrtasm(dx*dx+dy*dy)<<5); if (i == 0) return;
-		j = dmulscale3(dx,day-wal->y,-dy,dax-wal->x);
+		if (mapgeomcurrent())
+		{
+			dx = sectorgeom.dx[sectnum]; dy = sectorgeom.dy[sectnum];
+			i = (sectorgeom.len[sectnum]<<5); if (i == 0) return;
+			j = dmulscale3(dx,day-sectorgeom.y[sectnum],-dy,dax-sectorgeom.x[sectnum]);
+		}
+		else
+		{
+			wal = &wall[sec->wallptr]; wal2 = &wall[wal->point2];
+			dx = wal2->x-wal->x; dy = wal2->y-wal->y;
+			i = (nsqrtasm(dx*dx+dy*dy)<<5); if (i == 0) return;
+			j = dmulscale3(dx,day-wal->y,-dy,dax-wal->x);
+		}
 		if (sec->ceilingstat&2) *ceilz = (*ceilz)+scale(sec->ceilingheinum,j,i);
 		if (sec->floorstat&2) *florz = (*florz)+scale(sec->floorheinum,j,i);
 	}
@@ -10361,6 +11672,8 @@ void setfirstwall(short sectnum, short newfirstwall)
 
 	for(i=startwall;i<endwall;i++)
 		if (wall[i].nextwall >= 0) wall[wall[i].nextwall].nextwall = i;
+
+	invalidatemapgeometry();
 }
 
 
@@ -10418,7 +11731,7 @@ void drawline256(int x1, int y1, int x2, int y2, unsigned char col)
 		plc = y1+mulscale12((2047-x1)&4095,inc);
 		i = ((x1+2048)>>12); daend = ((x2+2048)>>12);
 
-		begindrawing();	//{{{
+		beginviewdrawing();	//{{{
 		for(;i<daend;i++)
 		{
 			j = (plc>>12);
@@ -10426,7 +11739,7 @@ void drawline256(int x1, int y1, int x2, int y2, unsigned char col)
 				drawpixel((void*)(frameplace+ylookup[j]+i),col);
 			plc += inc;
 		}
-		enddrawing();	//}}}
+		endviewdrawing();	//}}}
 	}
 	else
 	{
@@ -10441,7 +11754,7 @@ void drawline256(int x1, int y1, int x2, int y2, unsigned char col)
 		plc = x1+mulscale12((2047-y1)&4095,inc);
 		i = ((y1+2048)>>12); daend = ((y2+2048)>>12);
 
-		begindrawing();	//{{{
+		beginviewdrawing();	//{{{
 		p = ylookup[i]+frameplace;
 		for(;i<daend;i++)
 		{
@@ -10450,7 +11763,7 @@ void drawline256(int x1, int y1, int x2, int y2, unsigned char col)
 				drawpixel((void*)(j+p),col);
 			plc += inc; p += ylookup[1];
 		}
-		enddrawing();	//}}}
+		endviewdrawing();	//}}}
 	}
 }
 
@@ -11215,6 +12528,7 @@ static int screencapture_tga(char *filename, char inverseit)
 			// 24bit
 			inversebuf = kmalloc(xdim*ydim*3);
 			if (inversebuf) {
+				polymost_flushbatch();
 				glfunc.glReadPixels(0,0,xdim,ydim,GL_RGB,GL_UNSIGNED_BYTE,inversebuf);
 				j = xdim*ydim*3;
 				for (i=0; i<j; i+=3) {
@@ -11369,6 +12683,7 @@ static int screencapture_pcx(char *filename, char inverseit)
 			// 24bit
 			inversebuf = kmalloc(xdim*ydim*3);
 			if (inversebuf) {
+				polymost_flushbatch();
 				glfunc.glReadPixels(0,0,xdim,ydim,GL_RGB,GL_UNSIGNED_BYTE,inversebuf);
 				for (i=ydim-1; i>=0; i--) {
 					writepcxline(inversebuf+i*xdim*3,   xdim, 3, fil);
@@ -11438,6 +12753,9 @@ int setrendermode(int renderer)
 		renderer = 3;
 	}
 
+		//Polymost reads tiles without needtile(), so must not see placeholders
+	if (renderer > 0) finishtiles();
+
 	rendmode = renderer;
 
 	return 0;
@@ -11512,6 +12830,8 @@ void setpolymost2dview(void)
 {
 	if (rendmode < 3) return;
 
+	polymost_flushbatch();
+
 	if (gloy1 != -1) {
 		glfunc.glViewport(0,0,xres,yres);
 	}
@@ -1,7 +1,8 @@
 #ifndef ENGINE_PRIV_H
 #define ENGINE_PRIV_H
 
-#define MAXCLIPNUM 1024
+#include "a.h"
+
 #define MAXPERMS 1024
 #define MAXTILEFILES 256
 #define MAXYSAVES ((MAXXDIM*MAXSPRITES)>>7)
@@ -12,23 +13,25 @@
 extern unsigned char pow2char[8];
 extern int pow2long[32];
 
-extern short thesector[MAXWALLSB], thewall[MAXWALLSB];
-extern short bunchfirst[MAXWALLSB], bunchlast[MAXWALLSB];
-extern short maskwall[MAXWALLSB], maskwallcnt;
-extern spritetype *tspriteptr[MAXSPRITESONSCREEN];
-extern int xdimen, xdimenrecip, halfxdimen, xdimenscale, xdimscale, ydimen, ydimenscale;
-extern intptr_t frameoffset;
-extern int globalposx, globalposy, globalposz, globalhoriz;
-extern short globalang, globalcursectnum;
-extern int globalpal, cosglobalang, singlobalang;
-extern int cosviewingrangeglobalang, sinviewingrangeglobalang;
-extern int globalvisibility;
-extern int asm1, asm2, asm4;
-extern intptr_t asm3;
-extern int globalshade;
-extern short globalpicnum;
-extern int globalx1, globaly2;
-extern int globalorientation;
+extern RENDERTLS short thesector[MAXWALLSB], thewall[MAXWALLSB];
+extern RENDERTLS short bunchfirst[MAXWALLSB], bunchlast[MAXWALLSB];
+extern RENDERTLS short maskwall[MAXWALLSB], maskwallcnt;
+extern RENDERTLS spritetype *tspriteptr[MAXSPRITESONSCREEN];
+extern RENDERTLS int xdimen, xdimenrecip, halfxdimen, xdimenscale, xdimscale, ydimen, ydimenscale;
+extern RENDERTLS intptr_t frameoffset;
+extern RENDERTLS int globalposx, globalposy, globalposz;
+extern RENDERTLS int globalhoriz;
+extern RENDERTLS short globalang, globalcursectnum;
+extern RENDERTLS int globalpal;
+extern RENDERTLS int cosglobalang, singlobalang;
+extern RENDERTLS int cosviewingrangeglobalang, sinviewingrangeglobalang;
+extern RENDERTLS int globalvisibility;
+extern RENDERTLS int asm1, asm2, asm4;
+extern RENDERTLS intptr_t asm3;
+extern RENDERTLS int globalshade;
+extern RENDERTLS short globalpicnum;
+extern RENDERTLS int globalx1, globaly2;
+extern RENDERTLS int globalorientation;
 
 extern short searchit;
 extern int searchx, searchy;
@@ -40,16 +43,16 @@ extern int curbrightness, gammabrightness;
 extern float curgamma;
 extern unsigned char britable[16][256];
 extern unsigned char picsiz[MAXTILES];
-extern int lastx[MAXYDIM];
+extern RENDERTLS int lastx[MAXYDIM];
 extern unsigned char *transluc;
-extern short sectorborder[256], sectorbordercnt;
+extern RENDERTLS short sectorborder[256], sectorbordercnt;
 extern int qsetmode;
 extern int hitallsprites;
 
-extern int xb1[MAXWALLSB];
-extern int rx1[MAXWALLSB], ry1[MAXWALLSB];
-extern short p2[MAXWALLSB];
-extern short numscans, numhits, numbunches;
+extern RENDERTLS int xb1[MAXWALLSB];
+extern RENDERTLS int rx1[MAXWALLSB], ry1[MAXWALLSB];
+extern RENDERTLS short p2[MAXWALLSB];
+extern RENDERTLS short numscans, numhits, numbunches;
 
 #if USE_OPENGL
 extern palette_t palookupfog[MAXPALOOKUPS];
@@ -59,6 +62,11 @@ int wallmost(short *mostbuf, int w, int sectnum, unsigned char dastat);
 int wallfront(int l1, int l2);
 int animateoffs(short tilenum, short fakevar);
 
+	// Set by drawrooms() from the map's PVS, if any. See pvsforview().
+extern RENDERTLS const unsigned char *pvsview;
+const unsigned char *pvsforview(void);
+#define pvsviewsees(s) (!pvsview || (pvsview[(s)>>3]&pow2char[(s)&7]))
+
 
 #if defined(__WATCOMC__) && USE_ASM
 
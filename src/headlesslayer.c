@@ -0,0 +1,643 @@
+// Headless interface layer
+// for the Build Engine
+// by Jonathon Fowler (jf@jonof.id.au)
+//
+// Renders into a plain memory frame buffer with no window, display or
+// input devices, for running the software renderer on servers and in
+// automated benchmarks. Finished frames are available through
+// headless_getframe(), and screencapture() works as usual.
+
+#ifdef _WIN32
+# define WIN32_LEAN_AND_MEAN
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#include "build.h"
+#include "headlesslayer.h"
+#include "pragmas.h"
+#include "a.h"
+#include "osd.h"
+
+int startwin_open(void) { return 0; }
+int startwin_close(void) { return 0; }
+int startwin_puts(const char *UNUSED(s)) { return 0; }
+int startwin_idle(void *UNUSED(s)) { return 0; }
+int startwin_settitle(const char *UNUSED(s)) { return 0; }
+
+int   _buildargc = 1;
+const char **_buildargv = NULL;
+
+char quitevent=0, appactive=1;
+
+static char apptitle[256] = "Build Engine";
+
+// video
+static unsigned char *frame, *shownframe;
+static unsigned char shownpalette[256*3];
+static unsigned int framecount;
+int xres=-1, yres=-1, bpp=0, fullscreen=0, imageSize;
+RENDERTLS int bytesperline;
+RENDERTLS intptr_t frameplace=0;
+char modechange=1;
+char offscreenrendering=0;
+char videomodereset = 0;
+
+// input
+int inputdevices=0;
+char keystatus[256];
+int keyfifo[KEYFIFOSIZ];
+unsigned char keyasciififo[KEYFIFOSIZ];
+int keyfifoplc, keyfifoend;
+int keyasciififoplc, keyasciififoend;
+int mousex=0,mousey=0,mouseb=0;
+int joyaxis[1], joyb=0;
+char joynumaxes=0, joynumbuttons=0;
+
+void (*keypresscallback)(int,int) = 0;
+void (*mousepresscallback)(int,int) = 0;
+void (*joypresscallback)(int,int) = 0;
+
+static void shutdownvideo(void);
+
+int wm_msgbox(const char *name, const char *fmt, ...)
+{
+	va_list va;
+
+	if (!name) {
+		name = apptitle;
+	}
+
+	Bprintf("%s: ", name);
+	va_start(va,fmt);
+	Bvfprintf(stdout, fmt, va);
+	va_end(va);
+	Bprintf("\n");
+
+	return 1;
+}
+
+int wm_ynbox(const char *name, const char *fmt, ...)
+{
+	va_list va;
+
+	if (!name) {
+		name = apptitle;
+	}
+
+	Bprintf("%s: ", name);
+	va_start(va,fmt);
+	Bvfprintf(stdout, fmt, va);
+	va_end(va);
+	Bprintf("\n   (assuming 'No')\n");
+
+	return 0;
+}
+
+int wm_filechooser(const char *UNUSED(initialdir), const char *UNUSED(initialfile), const char *UNUSED(type),
+	int UNUSED(foropen), char **UNUSED(choice))
+{
+	return -1;
+}
+
+int wm_idle(void *UNUSED(ptr))
+{
+	return 0;
+}
+
+void wm_setapptitle(const char *name)
+{
+	if (name) {
+		Bstrncpy(apptitle, name, sizeof(apptitle)-1);
+		apptitle[ sizeof(apptitle)-1 ] = 0;
+	}
+}
+
+void wm_setwindowtitle(const char *UNUSED(name))
+{
+}
+
+
+//
+//
+// ---------------------------------------
+//
+// System
+//
+// ---------------------------------------
+//
+//
+
+int main(int argc, char *argv[])
+{
+	int r;
+
+	_buildargc = argc;
+	_buildargv = (const char **)argv;
+
+	baselayer_init();
+
+	r = app_main(_buildargc, (char const * const*)_buildargv);
+
+	return r;
+}
+
+
+//
+// initsystem() -- init systems
+//
+int initsystem(void)
+{
+	buildputs("Headless system interface\n");
+
+	atexit(uninitsystem);
+
+	return 0;
+}
+
+
+//
+// uninitsystem() -- uninit systems
+//
+void uninitsystem(void)
+{
+	uninitinput();
+	uninittimer();
+
+	shutdownvideo();
+}
+
+
+//
+// initputs() -- prints a string to the intitialization window
+//
+void initputs(const char *UNUSED(str))
+{
+}
+
+
+//
+// debugprintf() -- prints a debug string to stderr
+//
+void debugprintf(const char *f, ...)
+{
+#ifdef DEBUGGINGAIDS
+	va_list va;
+
+	va_start(va,f);
+	Bvfprintf(stderr, f, va);
+	va_end(va);
+#endif
+}
+
+
+//
+//
+// ---------------------------------------
+//
+// All things Input
+//
+// ---------------------------------------
+//
+//
+
+// There are no input devices, so everything reads as released.
+
+int initinput(void)
+{
+	inputdevices = 0;
+	return 0;
+}
+
+void uninitinput(void)
+{
+}
+
+const char *getkeyname(int num)
+{
+	if ((unsigned)num >= 256) return NULL;
+	return "";
+}
+
+const char *getjoyname(int UNUSED(what), int UNUSED(num))
+{
+	return NULL;
+}
+
+unsigned char bgetchar(void)
+{
+	unsigned char c;
+	if (keyasciififoplc == keyasciififoend) return 0;
+	c = keyasciififo[keyasciififoplc];
+	keyasciififoplc = ((keyasciififoplc+1)&(KEYFIFOSIZ-1));
+	return c;
+}
+
+int bkbhit(void)
+{
+	return (keyasciififoplc != keyasciififoend);
+}
+
+void bflushchars(void)
+{
+	keyasciififoplc = keyasciififoend = 0;
+}
+
+void setkeypresscallback(void (*callback)(int, int)) { keypresscallback = callback; }
+void setmousepresscallback(void (*callback)(int, int)) { mousepresscallback = callback; }
+void setjoypresscallback(void (*callback)(int, int)) { joypresscallback = callback; }
+
+int initmouse(void) { return 0; }
+void uninitmouse(void) { }
+void grabmouse(int UNUSED(a)) { }
+void readmousexy(int *x, int *y) { *x = *y = 0; }
+void readmousebstatus(int *b) { *b = 0; }
+void releaseallbuttons(void) { }
+
+
+//
+//
+// ---------------------------------------
+//
+// All things Timer
+// Ken did this
+//
+// ---------------------------------------
+//
+//
+
+static uint64_t timerfreq=0;
+static uint64_t timerstart=0;
+static unsigned int timerlastsample=0;
+static unsigned int timerticspersec=0;
+static void (*usertimercallback)(void) = NULL;
+
+// Reads a monotonic clock in microseconds.
+static uint64_t readclock(void)
+{
+#ifdef _WIN32
+	static uint64_t freq = 0;
+	uint64_t t;
+
+	if (!freq) QueryPerformanceFrequency((LARGE_INTEGER*)&freq);
+	QueryPerformanceCounter((LARGE_INTEGER*)&t);
+	return (t / freq) * 1000000 + (t % freq) * 1000000 / freq;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+//
+// inittimer() -- initialise timer
+//
+int inittimer(int tickspersecond)
+{
+	if (timerfreq) return 0;    // already installed
+
+	buildputs("Initialising timer\n");
+
+	timerfreq = 1000000;
+	timerstart = readclock();
+	timerticspersec = tickspersecond;
+	timerlastsample = 0;
+
+	usertimercallback = NULL;
+
+	return 0;
+}
+
+//
+// uninittimer() -- shut down timer
+//
+void uninittimer(void)
+{
+	if (!timerfreq) return;
+
+	timerfreq=0;
+}
+
+//
+// sampletimer() -- update totalclock
+//
+void sampletimer(void)
+{
+	int n;
+
+	if (!timerfreq) return;
+
+	n = (int)((readclock() - timerstart) * timerticspersec / timerfreq) - timerlastsample;
+	if (n>0) {
+		totalclock += n;
+		timerlastsample += n;
+	}
+
+	if (usertimercallback) for (; n>0; n--) usertimercallback();
+}
+
+//
+// getticks() -- returns a millisecond ticks count
+//
+unsigned int getticks(void)
+{
+	return (unsigned int)(readclock() / 1000);
+}
+
+//
+// getusecticks() -- returns a microsecond ticks count
+//
+unsigned int getusecticks(void)
+{
+	return (unsigned int)readclock();
+}
+
+
+//
+// gettimerfreq() -- returns the number of ticks per second the timer is configured to generate
+//
+int gettimerfreq(void)
+{
+	return timerticspersec;
+}
+
+
+//
+// installusertimercallback() -- set up a callback function to be called when the timer is fired
+//
+void (*installusertimercallback(void (*callback)(void)))(void)
+{
+	void (*oldtimercallback)(void);
+
+	oldtimercallback = usertimercallback;
+	usertimercallback = callback;
+
+	return oldtimercallback;
+}
+
+
+
+//
+//
+// ---------------------------------------
+//
+// All things Video
+//
+// ---------------------------------------
+//
+//
+
+
+//
+// getvalidmodes() -- figure out what video modes are available
+//
+static char modeschecked=0;
+void getvalidmodes(void)
+{
+	static int defaultres[][2] = {
+		{1920,1200},{1920,1080},{1600,1200},{1680,1050},{1600,900},{1400,1050},{1440,900},{1366,768},
+		{1280,1024},{1280,960},{1280,800},{1280,720},{1152,864},{1024,768},{800,600},{640,480},
+		{640,400},{512,384},{480,360},{400,300},{320,240},{320,200},{0,0}
+	};
+	int i, f;
+
+	if (modeschecked) return;
+
+	// There is no display to limit things, so offer every conventional
+	// size, and checkvideomode() accepts any other.
+	validmodecnt=0;
+	for (f=0; f<2; f++) {
+		for (i=0; defaultres[i][0] && validmodecnt<MAXVALIDMODES; i++) {
+			if (defaultres[i][0] > MAXXDIM || defaultres[i][1] > MAXYDIM) continue;
+			validmode[validmodecnt].xdim=defaultres[i][0];
+			validmode[validmodecnt].ydim=defaultres[i][1];
+			validmode[validmodecnt].bpp=8;
+			validmode[validmodecnt].fs=f;
+			validmodecnt++;
+		}
+	}
+
+	modeschecked=1;
+}
+
+
+//
+// checkvideomode() -- makes sure the video mode passed is legal
+//
+int checkvideomode(int *x, int *y, int c, int fs, int UNUSED(forced))
+{
+	int i;
+
+	getvalidmodes();
+
+	if (c != 8) return -1;
+
+	if (*x < 320) *x = 320;
+	if (*y < 200) *y = 200;
+	if (*x > MAXXDIM) *x = MAXXDIM;
+	if (*y > MAXYDIM) *y = MAXYDIM;
+
+	for (i=0; i<validmodecnt; i++) {
+		if (validmode[i].fs != (fs&1)) continue;
+		if (validmode[i].xdim == *x && validmode[i].ydim == *y) return i;
+	}
+
+	return 0x7fffffffl;
+}
+
+
+static void shutdownvideo(void)
+{
+	if (frame) {
+		free(frame);
+		frame = NULL;
+	}
+	if (shownframe) {
+		free(shownframe);
+		shownframe = NULL;
+	}
+	frameplace = 0;
+	framecount = 0;
+}
+
+//
+// setvideomode() -- set the size of the frame buffer
+//
+int setvideomode(int x, int y, int c, int fs)
+{
+	int i, j, pitch;
+
+	if ((fs == fullscreen) && (x == xres) && (y == yres) && (c == bpp) &&
+		!videomodereset) {
+		OSD_ResizeDisplay(xres,yres);
+		return 0;
+	}
+
+	if (checkvideomode(&x,&y,c,fs,0) < 0) return -1;
+
+	shutdownvideo();
+
+	buildprintf("Setting video mode %dx%d (%d-bpp headless)\n", x,y,c);
+
+	// Round up to a multiple of 4.
+	pitch = (((x|1) + 4) & ~3);
+
+	frame = (unsigned char *) calloc(pitch, y);
+	shownframe = (unsigned char *) malloc(pitch * y);
+	if (!frame || !shownframe) {
+		buildputs("Unable to allocate framebuffer\n");
+		shutdownvideo();
+		return -1;
+	}
+
+	frameplace = (intptr_t) frame;
+	bytesperline = pitch;
+	imageSize = bytesperline * y;
+	numpages = 1;
+
+	setvlinebpl(bytesperline);
+	for (i = j = 0; i <= y; i++) {
+		ylookup[i] = j;
+		j += bytesperline;
+	}
+
+	xres = x;
+	yres = y;
+	bpp = c;
+	fullscreen = fs;
+	modechange = 1;
+	videomodereset = 0;
+	OSD_ResizeDisplay(xres,yres);
+
+	setpalettefade(palfadergb.r, palfadergb.g, palfadergb.b, palfadedelta);
+
+	return 0;
+}
+
+
+//
+// resetvideomode() -- resets the video system
+//
+void resetvideomode(void)
+{
+	videomodereset = 1;
+	modeschecked = 0;
+}
+
+
+//
+// begindrawing() -- locks the framebuffer for drawing
+//
+void begindrawing(void)
+{
+}
+
+
+//
+// enddrawing() -- unlocks the framebuffer
+//
+void enddrawing(void)
+{
+}
+
+
+//
+// showframe() -- keeps a copy of the finished frame
+//
+void showframe(void)
+{
+	int i;
+
+	if (!frame) return;
+
+	memcpy(shownframe, frame, imageSize);
+	for (i=0; i<256; i++) {
+		shownpalette[i*3+0] = curpalettefaded[i].r;
+		shownpalette[i*3+1] = curpalettefaded[i].g;
+		shownpalette[i*3+2] = curpalettefaded[i].b;
+	}
+	framecount++;
+}
+
+
+//
+// headless_getframe() -- returns the last frame passed to showframe()
+//
+const unsigned char *headless_getframe(int *width, int *height, int *pitch, unsigned char *palette)
+{
+	if (!framecount) return NULL;
+
+	if (width) *width = xres;
+	if (height) *height = yres;
+	if (pitch) *pitch = bytesperline;
+	if (palette) memcpy(palette, shownpalette, sizeof(shownpalette));
+
+	return shownframe;
+}
+
+unsigned int headless_getframecount(void)
+{
+	return framecount;
+}
+
+
+//
+// setpalette() -- set palette values
+//
+int setpalette(int UNUSED(start), int UNUSED(num), unsigned char * UNUSED(dapal))
+{
+	return 0;
+}
+
+//
+// setgamma
+//
+int setgamma(float UNUSED(gamma))
+{
+	return 0;
+}
+
+
+#if USE_OPENGL
+//
+// loadgldriver -- there is no OpenGL without a display
+//
+int loadgldriver(const char *UNUSED(soname))
+{
+	return -1;
+}
+
+int unloadgldriver(void)
+{
+	return 0;
+}
+
+void *getglprocaddress(const char *UNUSED(name), int UNUSED(ext))
+{
+	return NULL;
+}
+#endif
+
+
+//
+//
+// ---------------------------------------
+//
+// Miscellany
+//
+// ---------------------------------------
+//
+//
+
+
+//
+// handleevents() -- there are no events, so just keeps the timer going
+//
+int handleevents(void)
+{
+	sampletimer();
+
+	return 0;
+}
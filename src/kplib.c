@@ -95,8 +95,20 @@ static __inline int filelength (int h)
 #define _inline inline
 #endif
 
-static int bytesperline, xres, yres, globxoffs, globyoffs;
-static INT_PTR frameplace;
+	//Storage class for decoder state, so that each thread decoding an image
+	//has its own. The x86 assembly addresses some of it directly, so it
+	//stays shared (and kprender() single-threaded) when that is in use.
+#if (defined(_MSC_VER) || defined(__WATCOMC__)) && !(USE_ASM && (defined(__WATCOMC__) || defined(_M_IX86)))
+#define KPTLS __declspec(thread)
+#elif defined(__GNUC__) && !(USE_ASM && defined(__i386__))
+#define KPTLS __thread
+#else
+#define KPTLS
+#define KPNOTLS
+#endif
+
+static KPTLS int bytesperline, xres, yres, globxoffs, globyoffs;
+static KPTLS INT_PTR frameplace;
 
 static const int pow2mask[32] =
 {
@@ -123,9 +135,25 @@ static const int pow2long[32] =
 
 	//Hack for peekbits,getbits,suckbits (to prevent lots of duplicate code)
 	//   0: PNG: do 12-byte chunk_header removal hack
-	// !=0: ZIP: use 64K buffer (olinbuf)
-static int zipfilmode;
+	// !=0: ZIP: use the stream's own input buffer (kzfs->inf->inbuf)
+static KPTLS int zipfilmode;
+
+#define KZINBUFSIZ 16384
+#define LOGQHUFSIZ0 11
+#define LOGQHUFSIZ1 8
+	//Everything *flate needs to carry on where it left off, so that any
+	//number of compressed streams can be read from in turn.
 typedef struct
+{
+	unsigned char slidebuf[32768]; //The last 32K of uncompressed data
+	unsigned char inbuf[KZINBUFSIZ]; //Compressed data FIFO
+	int bitpos, gslidew, gslider;
+	int ibuf0[288], nbuf0[32], ibuf1[32], nbuf1[32]; //Huffman tables of the current block
+	int qhuf0[1<<LOGQHUFSIZ0], qhuf1[1<<LOGQHUFSIZ1]; //Lookup tables from qhufgencode()
+} kzinflatestate;
+
+typedef struct kzfilestate kzfile;
+struct kzfilestate
 {
 	FILE *fil;   //0:no file open, !=0:open file (either stand-alone or zip)
 	int comptyp; //0:raw data (can be ZIP or stand-alone), 8:PKZIP LZ77 *flate
@@ -139,8 +167,10 @@ typedef struct
 	int i;       //For stand-alone/ZIP comptyp#0, this is like "uncomptell"
 					  //For ZIP comptyp#8&btype==0 "<64K store", this saves i state
 	int bfinal;  //LZ77 decompression state (for later calls)
-} kzfilestate;
-static kzfilestate kzfs;
+	kzinflatestate *inf; //comptyp#8 only
+};
+static KPTLS kzfile *kzfs;    //The stream being read from
+static kzfile *kzcur;   //The one opened by kzopen()
 
 //Initialized tables (can't be in union)
 //jpg:                png:
@@ -154,8 +184,8 @@ static kzfilestate kzfs;
 //   pow2mask     128*
 //   dcflagor      64
 
-int palcol[256], paleng, bakcol, numhufblocks, zlibcompflags;
-signed char coltype, filtype, bitdepth;
+KPTLS int palcol[256], paleng, bakcol, numhufblocks, zlibcompflags;
+KPTLS signed char coltype, filtype, bitdepth;
 
 //============================ KPNGILIB begins ===============================
 
@@ -170,23 +200,20 @@ signed char coltype, filtype, bitdepth;
 //   * Some useless ancillary chunks, like: gAMA(gamma) & pHYs(aspect ratio)
 
 	//.PNG specific variables:
-static int bakr = 0x80, bakg = 0x80, bakb = 0x80; //this used to be public...
-static int gslidew = 0, gslider = 0, xm, xmn[4], xr0, xr1, xplc, yplc;
-static INT_PTR nfplace;
-static int clen[320], cclen[19], bitpos, filt, xsiz, ysiz;
-static int xsizbpl, ixsiz, ixoff, iyoff, ixstp, iystp, intlac, nbpl, trnsrgb;
+static KPTLS int bakr = 0x80, bakg = 0x80, bakb = 0x80; //this used to be public...
+static KPTLS int xm, xmn[4], xr0, xr1, xplc, yplc;
+static KPTLS INT_PTR nfplace;
+static KPTLS int clen[320], cclen[19], bitpos, filt, xsiz, ysiz;
+static KPTLS int xsizbpl, ixsiz, ixoff, iyoff, ixstp, iystp, intlac, nbpl, trnsrgb;
 static int ccind[19] = {16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
-static int hxbit[59][2], ibuf0[288], nbuf0[32], ibuf1[32], nbuf1[32];
-static const unsigned char *filptr;
-static unsigned char slidebuf[32768], opixbuf0[4], opixbuf1[4];
-static unsigned char pnginited = 0, olinbuf[65536]; //WARNING:max xres is: 65536/bpp-1
-static int gotcmov = -2, abstab10[1024];
+static KPTLS int hxbit[59][2], ibuf0[288], nbuf0[32], ibuf1[32], nbuf1[32];
+static KPTLS const unsigned char *filptr;
+static KPTLS unsigned char slidebuf[32768], opixbuf0[4], opixbuf1[4];
+static KPTLS unsigned char pnginited = 0, olinbuf[65536]; //WARNING:max xres is: 65536/bpp-1
+static KPTLS int gotcmov = -2, abstab10[1024];
 
 	//Variables to speed up dynamic Huffman decoding:
-#define LOGQHUFSIZ0 9
-#define LOGQHUFSIZ1 6
-static int qhufval0[1<<LOGQHUFSIZ0], qhufval1[1<<LOGQHUFSIZ1];
-static unsigned char qhufbit0[1<<LOGQHUFSIZ0], qhufbit1[1<<LOGQHUFSIZ1];
+static KPTLS int qhuf0[1<<LOGQHUFSIZ0], qhuf1[1<<LOGQHUFSIZ1];
 
 #if defined(__WATCOMC__) && USE_ASM
 
@@ -405,8 +432,8 @@ static int getcputype ()
 	return(i);
 }
 
-static unsigned char fakebuf[8], *nfilptr;
-static int nbitpos;
+static KPTLS unsigned char fakebuf[8], *nfilptr;
+static KPTLS int nbitpos;
 static void suckbitsnextblock ()
 {
 	int n;
@@ -435,11 +462,11 @@ static void suckbitsnextblock ()
 	else
 	{
 			//NOTE: should only read bytes inside compsize, not 64K!!! :/
-		*(int *)&olinbuf[0] = *(int *)&olinbuf[sizeof(olinbuf)-4];
-		n = min((unsigned)(kzfs.compleng-kzfs.comptell),sizeof(olinbuf)-4);
-		fread(&olinbuf[4],n,1,kzfs.fil);
-		kzfs.comptell += n;
-		bitpos -= ((sizeof(olinbuf)-4)<<3);
+		*(int *)&kzfs->inf->inbuf[0] = *(int *)&kzfs->inf->inbuf[KZINBUFSIZ-4];
+		n = min(kzfs->compleng-kzfs->comptell,KZINBUFSIZ-4);
+		fread(&kzfs->inf->inbuf[4],n,1,kzfs->fil);
+		kzfs->comptell += n;
+		bitpos -= ((KZINBUFSIZ-4)<<3);
 	}
 }
 
@@ -466,47 +493,55 @@ static int hufgetsym (int *hitab, int *hbmax)
 //   return(hitab[hbmax[n]+v]);
 //}
 
-static void qhufgencode (int *hitab, int *hbmax, int *qhval, unsigned char *qhbit, int numbits)
-{
-	int i, j, k, n, r;
+	//Builds a table to decode Huffman symbols with one look at the next
+	//numbits bits of input. Each entry holds:
+	//   bits 0-3: bits used (0: code is longer than numbits; use hufgetsym)
+	//   bits 4-5: symbols decoded (1 or 2)
+	//   bits 6-14: first symbol
+	//  bits 16-23: second symbol; only when pairs!=0 and both are literals
+static void qhufgencode (int *hitab, int *hbmax, int *qhent, int numbits, int pairs)
+{
+	int i, k, n, r, v;
+
+		//Codes are read LSB first, so an n-bit code c fills every entry
+		//whose low n bits are the bit reverse of c.
+	memset(qhent,0,sizeof(qhent[0])<<numbits);
+	i = 0;
+	for(n=1;n<=numbits;n++,i<<=1)
+		for(k=hbmax[n-1];k<hbmax[n];k++,i++)
+		{
+			v = n+(1<<4)+(hitab[k]<<6);
+			for(r=bitrev(i,n);r<=pow2mask[numbits];r+=(1<<n)) qhent[r] = v;
+		}
 
-		//r is the bit reverse of i. Ex: if: i = 1011100111, r = 1110011101
-	i = r = 0;
-	for(n=1;n<=numbits;n++)
-		for(k=hbmax[n-1];k<hbmax[n];k++)
-			for(j=i+pow2mask[numbits-n];i<=j;i++)
-			{
-				r = bitrev(i,numbits);
-				qhval[r] = hitab[k];
-				qhbit[r] = (unsigned char)n;
-			}
-	for(j=pow2mask[numbits];i<=j;i++)
+	if (!pairs) return;
+
+		//Where a literal leaves room for a whole second one, decode both.
+		//Going downwards, qhent[r>>n] is still a single symbol entry.
+	for(r=pow2mask[numbits];r>=0;r--)
 	{
-		r = bitrev(i,numbits);
+		v = qhent[r]; n = (v&15);
+		if ((!n) || (v >= (256<<6)) || (n >= numbits)) continue;
+		k = qhent[r>>n];
+		if ((!(k&15)) || ((k&15) > numbits-n) || (k >= (256<<6))) continue;
+		qhent[r] = n+(k&15)+(2<<4)+(v&(511<<6))+((k>>6)<<16);
+	}
+}
 
-		//k = 0;
-		//for(n=0;n<numbits;n++)
-		//   k = (k<<1) + ((r>>n)&1) + hbmax[n]-hbmax[n+1];
-		//
-		//n = numbits;
-		//k = hbmax[n]-r;
-		//
-		//j = peekbits(LOGQHUFSIZ); i = qhufval[j]; j = qhufbit[j];
-		//
-		//i = j = 0;
-		//do
-		//{
-		//   i = (i<<1)+getbits(1)+nbuf0[j]-nbuf0[j+1]; j++;
-		//} while (i >= 0);
-		//i = ibuf0[nbuf0[j]+i];
-		//qhval[r] = k;
+	//Copies an LZ77 match of leng bytes, dist bytes back, to uncompressed
+	//offset w of the 32K window.
+static _inline void slidecopy (unsigned char *sbuf, int w, int leng, int dist)
+{
+	unsigned char *d, *s;
 
-		qhbit[r] = 0; //n-32;
+	if ((((w&32767)+leng) <= 32768) && ((((w-dist)&32767)+leng) <= 32768))
+	{
+		d = &sbuf[w&32767]; s = &sbuf[(w-dist)&32767];
+		if (dist >= leng) { memcpy(d,s,leng); return; }
+		do { *d++ = *s++; } while (--leng);
+		return;
 	}
-
-	//   //hufgetsym_skipb related code:
-	//for(k=n=0;n<numbits;n++) k = (k<<1)+hbmax[n]-hbmax[n+1];
-	//return(k);
+	for(;leng;leng--,w++) sbuf[w&32767] = sbuf[(w-dist)&32767];
 }
 
 	//inbuf[inum] : Bit length of each symbol
@@ -853,7 +888,7 @@ static inline void pal8hlineasm (int x, int xr1, INT_PTR p, int ixstp)
 	//    /f3: 3333333...
 	//    /f4: 4444444...
 	//    /f5: 0142321...
-static int filter1st, filterest;
+static KPTLS int filter1st, filterest;
 static void putbuf (const unsigned char *buf, int leng)
 {
 	int i, x;
@@ -1210,11 +1245,11 @@ static int kpngrend (const char *kfilebuf, int kfilength,
 
 		hufgencode(clen,hlit,ibuf0,nbuf0);
 		//qhuf0v = //hufgetsym_skipb related code
-		qhufgencode(ibuf0,nbuf0,qhufval0,qhufbit0,LOGQHUFSIZ0);
+		qhufgencode(ibuf0,nbuf0,qhuf0,LOGQHUFSIZ0,1);
 
 		hufgencode(&clen[hlit],hdist,ibuf1,nbuf1);
 		//qhuf1v = //hufgetsym_skipb related code
-		qhufgencode(ibuf1,nbuf1,qhufval1,qhufbit1,LOGQHUFSIZ1);
+		qhufgencode(ibuf1,nbuf1,qhuf1,LOGQHUFSIZ1,0);
 
 		while (1)
 		{
@@ -1224,20 +1259,30 @@ static int kpngrend (const char *kfilebuf, int kfilength,
 				if ((yplc >= yres) && (intlac < 2)) goto kpngrend_goodret;
 			}
 
-			k = peekbits(LOGQHUFSIZ0);
-			if (qhufbit0[k]) { i = qhufval0[k]; suckbits((int)qhufbit0[k]); } else i = hufgetsym(ibuf0,nbuf0);
+			k = qhuf0[peekbits(LOGQHUFSIZ0)];
+			if (k&15)
+			{
+				suckbits(k&15); i = ((k>>6)&511);
+				if (k&32) //Two literals
+				{
+					slidebuf[(slidew++)&32767] = (unsigned char)i;
+					slidebuf[(slidew++)&32767] = (unsigned char)(k>>16);
+					continue;
+				}
+			}
+			else i = hufgetsym(ibuf0,nbuf0);
 			//else i = hufgetsym_skipb(ibuf0,nbuf0,LOGQHUFSIZ0,qhuf0v); //hufgetsym_skipb related code
 
 			if (i < 256) { slidebuf[(slidew++)&32767] = (unsigned char)i; continue; }
 			if (i == 256) break;
 			i = getbits(hxbit[i+30-257][0]) + hxbit[i+30-257][1];
 
-			k = peekbits(LOGQHUFSIZ1);
-			if (qhufbit1[k]) { j = qhufval1[k]; suckbits((int)qhufbit1[k]); } else j = hufgetsym(ibuf1,nbuf1);
+			k = qhuf1[peekbits(LOGQHUFSIZ1)];
+			if (k&15) { j = (k>>6); suckbits(k&15); } else j = hufgetsym(ibuf1,nbuf1);
 			//else j = hufgetsym_skipb(ibuf1,nbuf1,LOGQHUFSIZ1,qhuf1v); //hufgetsym_skipb related code
 
 			j = getbits(hxbit[j][0]) + hxbit[j][1];
-			i += slidew; do { slidebuf[slidew&32767] = slidebuf[(slidew-j)&32767]; slidew++; } while (slidew < i);
+			slidecopy(slidebuf,slidew,i,j); slidew += i;
 		}
 	} while (!bfinal);
 
@@ -1265,18 +1310,18 @@ kpngrend_goodret:;
 	//   All non 32-bit color drawing was removed
 	//   "Motion" JPG code was removed
 	//   A lot of parameters were added to kpeg() for library usage
-static int kpeginited = 0;
-static int clipxdim, clipydim;
-
-static int hufmaxatbit[8][20], hufvalatbit[8][20], hufcnt[8];
-static unsigned char hufnumatbit[8][20], huftable[8][256];
-static int hufquickval[8][1024], hufquickbits[8][1024], hufquickcnt[8];
-static int quantab[4][64], dct[12][64], lastdc[4], unzig[64], zigit[64]; //dct:10=MAX (says spec);+2 for hacks
-static unsigned char gnumcomponents, dcflagor[64];
-static int gcompid[4], gcomphsamp[4], gcompvsamp[4], gcompquantab[4], gcomphsampshift[4], gcompvsampshift[4];
-static int lnumcomponents, lcompid[4], lcompdc[4], lcompac[4], lcomphsamp[4], lcompvsamp[4], lcompquantab[4];
-static int lcomphvsamp0, lcomphsampshift0, lcompvsampshift0;
-static int colclip[1024], colclipup8[1024], colclipup16[1024];
+static KPTLS int kpeginited = 0;
+static KPTLS int clipxdim, clipydim;
+
+static KPTLS int hufmaxatbit[8][20], hufvalatbit[8][20], hufcnt[8];
+static KPTLS unsigned char hufnumatbit[8][20], huftable[8][256];
+static KPTLS int hufquickval[8][1024], hufquickbits[8][1024], hufquickcnt[8];
+static KPTLS int quantab[4][64], dct[12][64], lastdc[4], unzig[64], zigit[64]; //dct:10=MAX (says spec);+2 for hacks
+static KPTLS unsigned char gnumcomponents, dcflagor[64];
+static KPTLS int gcompid[4], gcomphsamp[4], gcompvsamp[4], gcompquantab[4], gcomphsampshift[4], gcompvsampshift[4];
+static KPTLS int lnumcomponents, lcompid[4], lcompdc[4], lcompac[4], lcomphsamp[4], lcompvsamp[4], lcompquantab[4];
+static KPTLS int lcomphvsamp0, lcomphsampshift0, lcompvsampshift0;
+static KPTLS int colclip[1024], colclipup8[1024], colclipup16[1024];
 static unsigned char pow2char[8] = {1,2,4,8,16,32,64,128};
 
 #if defined(__WATCOMC__) && USE_ASM
@@ -1347,7 +1392,7 @@ static inline int mulshr32 (int a, int b)
 
 static int cosqr16[8] =    //cosqr16[i] = ((cos(PI*i/16)*sqrt(2))<<24);
   {23726566,23270667,21920489,19727919,16777216,13181774,9079764,4628823};
-static int crmul[4096], cbmul[4096];
+static KPTLS int crmul[4096], cbmul[4096];
 
 static void initkpeg ()
 {
@@ -1947,8 +1992,8 @@ kpegrend_break2:;
 //==============================  KPEGILIB ends ==============================
 //================================ GIF begins ================================
 
-static unsigned char suffix[4100], filbuffer[768], tempstack[4096];
-static int prefix[4100];
+static KPTLS unsigned char suffix[4100], filbuffer[768], tempstack[4096];
+static KPTLS int prefix[4100];
 
 static int kgifrend (const char *kfilebuf, int kfilelength,
 	INT_PTR daframeplace, int dabytesperline, int daxres, int dayres,
@@ -2663,6 +2708,16 @@ int kprender (const char *buf, int leng, INT_PTR frameptr, int bpl,
 	return(-1);
 }
 
+	//Returns !=0 if kprender() may be called from several threads at once
+int kpthreadsafe ()
+{
+#ifdef KPNOTLS
+	return(0);
+#else
+	return(1);
+#endif
+}
+
 //==================== External picture interface ends =======================
 
 	//Brute-force case-insensitive, slash-insensitive, * and ? wildcard matcher
@@ -2845,54 +2900,58 @@ int kzaddstack (const char *zipnam)
 	return(0);
 }
 
-int kzopen (const char *filnam)
+kzfile *kzhopen (const char *filnam)
 {
 	FILE *fil;
+	kzfile *f;
 	int zipseek;
 	char tempbuf[46+260], *zipnam;
 
-	//kzfs.fil = 0;
+	f = (kzfile *)calloc(1,sizeof(kzfile)); if (!f) return(0);
 	if (filnam[0] != '|')
 	{
-		kzfs.fil = fopen(filnam,"rb");
-		if (kzfs.fil)
+		f->fil = fopen(filnam,"rb");
+		if (f->fil)
 		{
-			kzfs.comptyp = 0;
-			kzfs.seek0 = 0;
-			kzfs.leng = filelength(_fileno(kzfs.fil));
-			kzfs.pos = 0;
-			kzfs.i = 0;
-			return(1);
+			f->comptyp = 0;
+			f->seek0 = 0;
+			f->leng = filelength(_fileno(f->fil));
+			f->pos = 0;
+			f->i = 0;
+			return(f);
 		}
 	}
 	if (kzcheckhash(filnam,&zipnam,&zipseek))
 	{
-		fil = fopen(zipnam,"rb"); if (!fil) return(0);
+		fil = fopen(zipnam,"rb"); if (!fil) { free(f); return(0); }
 		fseek(fil,zipseek,SEEK_SET);
 		fread(tempbuf,30,1,fil);
-		if (*(int *)&tempbuf[0] != LSWAPIB(0x04034b50)) { fclose(fil); return(0); }
+		if (*(int *)&tempbuf[0] != LSWAPIB(0x04034b50)) { fclose(fil); free(f); return(0); }
 		fseek(fil,SSWAPIB(*(short *)&tempbuf[26])+SSWAPIB(*(short *)&tempbuf[28]),SEEK_CUR);
 
-		kzfs.fil = fil;
-		kzfs.comptyp = SSWAPIB(*(short *)&tempbuf[8]);
-		kzfs.seek0 = ftell(fil);
-		kzfs.leng = LSWAPIB(*(int *)&tempbuf[22]);
-		kzfs.pos = 0;
-		switch(kzfs.comptyp) //Compression method
+		f->fil = fil;
+		f->comptyp = SSWAPIB(*(short *)&tempbuf[8]);
+		f->seek0 = ftell(fil);
+		f->leng = LSWAPIB(*(int *)&tempbuf[22]);
+		f->pos = 0;
+		switch(f->comptyp) //Compression method
 		{
-			case 0: kzfs.i = 0; return(1);
+			case 0: f->i = 0; return(f);
 			case 8:
+				f->inf = (kzinflatestate *)malloc(sizeof(kzinflatestate));
+				if (!f->inf) break;
 				if (!pnginited) { pnginited = 1; initpngtables(); }
-				kzfs.comptell = 0;
-				kzfs.compleng = LSWAPIB(*(int *)&tempbuf[18]);
+				f->comptell = 0;
+				f->compleng = LSWAPIB(*(int *)&tempbuf[18]);
 
 					//WARNING: No file in ZIP can be > 2GB-32K bytes
-				gslidew = 0x7fffffff; //Force reload at beginning
+				f->inf->gslidew = 0x7fffffff; //Force reload at beginning
 
-				return(1);
-			default: fclose(kzfs.fil); kzfs.fil = 0; return(0);
+				return(f);
 		}
+		fclose(fil);
 	}
+	free(f);
 	return(0);
 }
 
@@ -3040,79 +3099,83 @@ int kzfindfile (char *filnam)
 
 // --------------------------------------------------------------------------
 
-static char *gzbufptr;
+static KPTLS char *gzbufptr;
 static void putbuf4zip (const unsigned char *buf, int uncomp0, int uncomp1)
 {
 	int i0, i1;
 		//              uncomp0 ... uncomp1
-		//  &gzbufptr[kzfs.pos] ... &gzbufptr[kzfs.endpos];
-	i0 = max(uncomp0,kzfs.pos);
-	i1 = min(uncomp1,kzfs.endpos);
+		//  &gzbufptr[kzfs->pos] ... &gzbufptr[kzfs->endpos];
+	i0 = max(uncomp0,kzfs->pos);
+	i1 = min(uncomp1,kzfs->endpos);
 	if (i0 < i1) memcpy(&gzbufptr[i0],&buf[i0-uncomp0],i1-i0);
 }
 
 	//returns number of bytes copied
-int kzread (void *buffer, int leng)
+int kzhread (kzfile *f, void *buffer, int leng)
 {
+	kzinflatestate *inf;
 	int i, j, k, bfinal, btype, hlit, hdist;
 
-	if ((!kzfs.fil) || (leng <= 0)) return(0);
+	if ((!f) || (!f->fil) || (leng <= 0)) return(0);
+	if (!pnginited) { pnginited = 1; initpngtables(); } //tables are per thread; f may be read elsewhere
+	kzfs = f; inf = f->inf;
 
-	if (kzfs.comptyp == 0)
+	if (kzfs->comptyp == 0)
 	{
-		if (kzfs.pos != kzfs.i) //Seek only when position changes
-			fseek(kzfs.fil,kzfs.seek0+kzfs.pos,SEEK_SET);
-		i = min(kzfs.leng-kzfs.pos,leng);
-		fread(buffer,i,1,kzfs.fil);
-		kzfs.i += i; //kzfs.i is a local copy of ftell(kzfs.fil);
+		if (kzfs->pos != kzfs->i) //Seek only when position changes
+			fseek(kzfs->fil,kzfs->seek0+kzfs->pos,SEEK_SET);
+		i = min(kzfs->leng-kzfs->pos,leng);
+		fread(buffer,i,1,kzfs->fil);
+		kzfs->i += i; //kzfs->i is a local copy of ftell(kzfs->fil);
 	}
-	else if (kzfs.comptyp == 8)
+	else if (kzfs->comptyp == 8)
 	{
 		zipfilmode = 1;
+		bitpos = inf->bitpos; filptr = &inf->inbuf[KZINBUFSIZ-4];
 
 			//Initialize for putbuf4zip
-		gzbufptr = (char *)buffer; gzbufptr = &gzbufptr[-kzfs.pos];
-		kzfs.endpos = min(kzfs.pos+leng,kzfs.leng);
-		if (kzfs.endpos == kzfs.pos) return(0); //Guard against reading 0 length
+		gzbufptr = (char *)buffer; gzbufptr = &gzbufptr[-kzfs->pos];
+		kzfs->endpos = min(kzfs->pos+leng,kzfs->leng);
+		if (kzfs->endpos == kzfs->pos) return(0); //Guard against reading 0 length
 
-		if (kzfs.pos < gslidew-32768) // Must go back to start :(
+		if (kzfs->pos < inf->gslidew-32768) // Must go back to start :(
 		{
-			if (kzfs.comptell) fseek(kzfs.fil,kzfs.seek0,SEEK_SET);
+			if (kzfs->comptell) fseek(kzfs->fil,kzfs->seek0,SEEK_SET);
 
-			gslidew = 0; gslider = 16384;
-			kzfs.jmpplc = 0;
+			inf->gslidew = 0; inf->gslider = 16384;
+			kzfs->jmpplc = 0;
 
 				//Initialize for suckbits/peekbits/getbits
-			kzfs.comptell = min((unsigned)kzfs.compleng,sizeof(olinbuf));
-			fread(&olinbuf[0],kzfs.comptell,1,kzfs.fil);
+			kzfs->comptell = min(kzfs->compleng,KZINBUFSIZ);
+			fread(&inf->inbuf[0],kzfs->comptell,1,kzfs->fil);
 				//Make it re-load when there are < 32 bits left in FIFO
-			bitpos = -(((int)sizeof(olinbuf)-4)<<3);
-				//Identity: filptr + (bitpos>>3) = &olinbuf[0]
-			filptr = &olinbuf[-(bitpos>>3)];
+			bitpos = -((KZINBUFSIZ-4)<<3);
+				//Identity: filptr + (bitpos>>3) = &inf->inbuf[0]
+			filptr = &inf->inbuf[-(bitpos>>3)];
 		}
 		else
 		{
-			i = max(gslidew-32768,0); j = gslider-16384;
+			i = max(inf->gslidew-32768,0); j = inf->gslider-16384;
 
 				//HACK: Don't unzip anything until you have to...
 				//   (keeps file pointer as low as possible)
-			if (kzfs.endpos <= gslidew) j = kzfs.endpos;
+			if (kzfs->endpos <= inf->gslidew) j = kzfs->endpos;
 
 				//write uncompoffs on slidebuf from: i to j
 			if (!((i^j)&32768))
-				putbuf4zip(&slidebuf[i&32767],i,j);
+				putbuf4zip(&inf->slidebuf[i&32767],i,j);
 			else
 			{
-				putbuf4zip(&slidebuf[i&32767],i,j&~32767);
-				putbuf4zip(slidebuf,j&~32767,j);
+				putbuf4zip(&inf->slidebuf[i&32767],i,j&~32767);
+				putbuf4zip(inf->slidebuf,j&~32767,j);
 			}
 
 				//HACK: Don't unzip anything until you have to...
 				//   (keeps file pointer as low as possible)
-			if (kzfs.endpos <= gslidew) goto retkzread;
+			if (kzfs->endpos <= inf->gslidew) goto retkzread;
 		}
 
-		switch (kzfs.jmpplc)
+		switch (kzfs->jmpplc)
 		{
 			case 0: goto kzreadplc0;
 			case 1: goto kzreadplc1;
@@ -3128,20 +3191,20 @@ kzreadplc0:;
 				//Display Huffman block offsets&lengths of input file - for debugging only!
 			{
 			static int ouncomppos = 0, ocomppos = 0;
-			if (kzfs.comptell == sizeof(olinbuf)) i = 0;
-			else if (kzfs.comptell < kzfs.compleng) i = kzfs.comptell-(sizeof(olinbuf)-4);
-			else i = kzfs.comptell-(kzfs.comptell%(sizeof(olinbuf)-4));
-			i += ((char *)&filptr[bitpos>>3])-((char *)(&olinbuf[0]));
+			if (kzfs->comptell == KZINBUFSIZ) i = 0;
+			else if (kzfs->comptell < kzfs->compleng) i = kzfs->comptell-(KZINBUFSIZ-4);
+			else i = kzfs->comptell-(kzfs->comptell%(KZINBUFSIZ-4));
+			i += ((char *)&filptr[bitpos>>3])-((char *)(&inf->inbuf[0]));
 			i = (i<<3)+(bitpos&7)-3;
-			if (gslidew) printf(" ULng:0x%08x CLng:0x%08x.%x",gslidew-ouncomppos,(i-ocomppos)>>3,((i-ocomppos)&7)<<1);
-			printf("\ntype:%d, Uoff:0x%08x Coff:0x%08x.%x",btype,gslidew,i>>3,(i&7)<<1);
+			if (inf->gslidew) printf(" ULng:0x%08x CLng:0x%08x.%x",inf->gslidew-ouncomppos,(i-ocomppos)>>3,((i-ocomppos)&7)<<1);
+			printf("\ntype:%d, Uoff:0x%08x Coff:0x%08x.%x",btype,inf->gslidew,i>>3,(i&7)<<1);
 			if (bfinal)
 			{
-				printf(" ULng:0x%08x CLng:0x%08x.%x",kzfs.leng-gslidew,((kzfs.compleng<<3)-i)>>3,(((kzfs.compleng<<3)-i)&7)<<1);
-				printf("\n        Uoff:0x%08x Coff:0x%08x.0",kzfs.leng,kzfs.compleng);
+				printf(" ULng:0x%08x CLng:0x%08x.%x",kzfs->leng-inf->gslidew,((kzfs->compleng<<3)-i)>>3,(((kzfs->compleng<<3)-i)&7)<<1);
+				printf("\n        Uoff:0x%08x Coff:0x%08x.0",kzfs->leng,kzfs->compleng);
 				ouncomppos = ocomppos = 0;
 			}
-			else { ouncomppos = gslidew; ocomppos = i; }
+			else { ouncomppos = inf->gslidew; ocomppos = i; }
 			}
 #endif
 
@@ -3152,17 +3215,17 @@ kzreadplc0:;
 				i = getbits(16); if ((getbits(16)^i) != 0xffff) return(-1);
 				for(;i;i--)
 				{
-					if (gslidew >= gslider)
+					if (inf->gslidew >= inf->gslider)
 					{
-						putbuf4zip(&slidebuf[(gslider-16384)&32767],gslider-16384,gslider); gslider += 16384;
-						if (gslider-16384 >= kzfs.endpos)
+						putbuf4zip(&inf->slidebuf[(inf->gslider-16384)&32767],inf->gslider-16384,inf->gslider); inf->gslider += 16384;
+						if (inf->gslider-16384 >= kzfs->endpos)
 						{
-							kzfs.jmpplc = 1; kzfs.i = i; kzfs.bfinal = bfinal;
+							kzfs->jmpplc = 1; kzfs->i = i; kzfs->bfinal = bfinal;
 							goto retkzread;
-kzreadplc1:;         i = kzfs.i; bfinal = kzfs.bfinal;
+kzreadplc1:;         i = kzfs->i; bfinal = kzfs->bfinal;
 						}
 					}
-					slidebuf[(gslidew++)&32767] = (char)getbits(8);
+					inf->slidebuf[(inf->gslidew++)&32767] = (char)getbits(8);
 				}
 				continue;
 			}
@@ -3182,12 +3245,12 @@ kzreadplc1:;         i = kzfs.i; bfinal = kzfs.bfinal;
 				hlit = getbits(5)+257; hdist = getbits(5)+1; j = getbits(4)+4;
 				for(i=0;i<j;i++) cclen[ccind[i]] = getbits(3);
 				for(;i<19;i++) cclen[ccind[i]] = 0;
-				hufgencode(cclen,19,ibuf0,nbuf0);
+				hufgencode(cclen,19,inf->ibuf0,inf->nbuf0);
 
 				j = 0; k = hlit+hdist;
 				while (j < k)
 				{
-					i = hufgetsym(ibuf0,nbuf0);
+					i = hufgetsym(inf->ibuf0,inf->nbuf0);
 					if (i < 16) { clen[j++] = i; continue; }
 					if (i == 16)
 						{ for(i=getbits(2)+3;i;i--) { clen[j] = clen[j-1]; j++; } }
@@ -3199,86 +3262,123 @@ kzreadplc1:;         i = kzfs.i; bfinal = kzfs.bfinal;
 				}
 			}
 
-			hufgencode(clen,hlit,ibuf0,nbuf0);
-			qhufgencode(ibuf0,nbuf0,qhufval0,qhufbit0,LOGQHUFSIZ0);
+			hufgencode(clen,hlit,inf->ibuf0,inf->nbuf0);
+			qhufgencode(inf->ibuf0,inf->nbuf0,inf->qhuf0,LOGQHUFSIZ0,1);
 
-			hufgencode(&clen[hlit],hdist,ibuf1,nbuf1);
-			qhufgencode(ibuf1,nbuf1,qhufval1,qhufbit1,LOGQHUFSIZ1);
+			hufgencode(&clen[hlit],hdist,inf->ibuf1,inf->nbuf1);
+			qhufgencode(inf->ibuf1,inf->nbuf1,inf->qhuf1,LOGQHUFSIZ1,0);
 
 			while (1)
 			{
-				if (gslidew >= gslider)
+				if (inf->gslidew >= inf->gslider)
 				{
-					putbuf4zip(&slidebuf[(gslider-16384)&32767],gslider-16384,gslider); gslider += 16384;
-					if (gslider-16384 >= kzfs.endpos)
+					putbuf4zip(&inf->slidebuf[(inf->gslider-16384)&32767],inf->gslider-16384,inf->gslider); inf->gslider += 16384;
+					if (inf->gslider-16384 >= kzfs->endpos)
 					{
-						kzfs.jmpplc = 2; kzfs.bfinal = bfinal; goto retkzread;
-kzreadplc2:;      bfinal = kzfs.bfinal;
+						kzfs->jmpplc = 2; kzfs->bfinal = bfinal; goto retkzread;
+kzreadplc2:;      bfinal = kzfs->bfinal;
 					}
 				}
 
-				k = peekbits(LOGQHUFSIZ0);
-				if (qhufbit0[k]) { i = qhufval0[k]; suckbits((int)qhufbit0[k]); }
-				else i = hufgetsym(ibuf0,nbuf0);
+				k = inf->qhuf0[peekbits(LOGQHUFSIZ0)];
+				if (k&15)
+				{
+					suckbits(k&15); i = ((k>>6)&511);
+					if (k&32) //Two literals
+					{
+						inf->slidebuf[(inf->gslidew++)&32767] = (char)i;
+						inf->slidebuf[(inf->gslidew++)&32767] = (char)(k>>16);
+						continue;
+					}
+				}
+				else i = hufgetsym(inf->ibuf0,inf->nbuf0);
 
-				if (i < 256) { slidebuf[(gslidew++)&32767] = (char)i; continue; }
+				if (i < 256) { inf->slidebuf[(inf->gslidew++)&32767] = (char)i; continue; }
 				if (i == 256) break;
 				i = getbits(hxbit[i+30-257][0]) + hxbit[i+30-257][1];
 
-				k = peekbits(LOGQHUFSIZ1);
-				if (qhufbit1[k]) { j = qhufval1[k]; suckbits((int)qhufbit1[k]); }
-				else j = hufgetsym(ibuf1,nbuf1);
+				k = inf->qhuf1[peekbits(LOGQHUFSIZ1)];
+				if (k&15) { j = (k>>6); suckbits(k&15); }
+				else j = hufgetsym(inf->ibuf1,inf->nbuf1);
 
 				j = getbits(hxbit[j][0]) + hxbit[j][1];
-				for(;i;i--,gslidew++) slidebuf[gslidew&32767] = slidebuf[(gslidew-j)&32767];
+				slidecopy(inf->slidebuf,inf->gslidew,i,j); inf->gslidew += i;
 			}
 		} while (!bfinal);
 
-		gslider -= 16384;
-		if (!((gslider^gslidew)&32768))
-			putbuf4zip(&slidebuf[gslider&32767],gslider,gslidew);
+		inf->gslider -= 16384;
+		if (!((inf->gslider^inf->gslidew)&32768))
+			putbuf4zip(&inf->slidebuf[inf->gslider&32767],inf->gslider,inf->gslidew);
 		else
 		{
-			putbuf4zip(&slidebuf[gslider&32767],gslider,gslidew&~32767);
-			putbuf4zip(slidebuf,gslidew&~32767,gslidew);
+			putbuf4zip(&inf->slidebuf[inf->gslider&32767],inf->gslider,inf->gslidew&~32767);
+			putbuf4zip(inf->slidebuf,inf->gslidew&~32767,inf->gslidew);
 		}
-kzreadplc3:; kzfs.jmpplc = 3;
+kzreadplc3:; kzfs->jmpplc = 3;
 	}
 
 retkzread:;
-	i = kzfs.pos;
-	kzfs.pos += leng; if (kzfs.pos > kzfs.leng) kzfs.pos = kzfs.leng;
-	return(kzfs.pos-i);
+	if (inf) inf->bitpos = bitpos;
+	i = kzfs->pos;
+	kzfs->pos += leng; if (kzfs->pos > kzfs->leng) kzfs->pos = kzfs->leng;
+	return(kzfs->pos-i);
 }
 
-int kzfilelength ()
+int kzhfilelength (kzfile *f)
 {
-	if (!kzfs.fil) return(0);
-	return(kzfs.leng);
+	if ((!f) || (!f->fil)) return(0);
+	return(f->leng);
 }
 
-	//WARNING: kzseek(<-32768,SEEK_CUR); or:
-	//         kzseek(0,SEEK_END);       can make next kzread very slow!!!
-int kzseek (int offset, int whence)
+	//WARNING: kzhseek(<-32768,SEEK_CUR); or:
+	//         kzhseek(0,SEEK_END);       can make next kzhread very slow!!!
+int kzhseek (kzfile *f, int offset, int whence)
 {
-	if (!kzfs.fil) return(-1);
+	if ((!f) || (!f->fil)) return(-1);
 	switch (whence)
 	{
-		case SEEK_CUR: kzfs.pos += offset; break;
-		case SEEK_END: kzfs.pos = kzfs.leng+offset; break;
-		case SEEK_SET: default: kzfs.pos = offset;
+		case SEEK_CUR: f->pos += offset; break;
+		case SEEK_END: f->pos = f->leng+offset; break;
+		case SEEK_SET: default: f->pos = offset;
 	}
-	if (kzfs.pos < 0) kzfs.pos = 0;
-	if (kzfs.pos > kzfs.leng) kzfs.pos = kzfs.leng;
-	return(kzfs.pos);
+	if (f->pos < 0) f->pos = 0;
+	if (f->pos > f->leng) f->pos = f->leng;
+	return(f->pos);
+}
+
+int kzhtell (kzfile *f)
+{
+	if ((!f) || (!f->fil)) return(-1);
+	return(f->pos);
+}
+
+void kzhclose (kzfile *f)
+{
+	if (!f) return;
+	if (f->fil) fclose(f->fil);
+	if (f->inf) free(f->inf);
+	if (kzfs == f) kzfs = 0;
+	free(f);
 }
 
-int kztell ()
+	//The original interface, which reads from one file at a time:
+void kzclose ()
 {
-	if (!kzfs.fil) return(-1);
-	return(kzfs.pos);
+	if (kzcur) { kzhclose(kzcur); kzcur = 0; }
 }
 
+int kzopen (const char *filnam)
+{
+	kzclose();
+	kzcur = kzhopen(filnam);
+	return(kzcur != 0);
+}
+
+int kzread (void *buffer, int leng) { return(kzhread(kzcur,buffer,leng)); }
+int kzfilelength () { return(kzhfilelength(kzcur)); }
+int kzseek (int offset, int whence) { return(kzhseek(kzcur,offset,whence)); }
+int kztell () { return(kzhtell(kzcur)); }
+
 int kzgetc ()
 {
 	char ch;
@@ -3288,13 +3388,8 @@ int kzgetc ()
 
 int kzeof ()
 {
-	if (!kzfs.fil) return(-1);
-	return(kzfs.pos >= kzfs.leng);
-}
-
-void kzclose ()
-{
-	if (kzfs.fil) { fclose(kzfs.fil); kzfs.fil = 0; }
+	if (!kzcur) return(-1);
+	return(kzcur->pos >= kzcur->leng);
 }
 
 //====================== ZIP decompression code ends =========================
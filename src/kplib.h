@@ -3,6 +3,7 @@ extern void kpzload (const char *, intptr_t *, int *, int *, int *);
 	//Low-level PNG/JPG functions:
 extern void kpgetdim (void *, int, int *, int *);
 extern int kprender (void *, int, void *, int, int, int, int, int);
+extern int kpthreadsafe (void); //!=0 if kprender() may run in several threads at once
 
 	//ZIP functions:
 extern int kzaddstack (const char *);
@@ -16,6 +17,17 @@ extern int kzgetc (void);
 extern int kzeof (void);
 extern void kzclose (void);
 
+	//ZIP functions for reading more than one file at a time. Each file
+	//opened keeps its own decompression state, so reads can be mixed
+	//freely between them:
+typedef struct kzfilestate kzfile;
+extern kzfile *kzhopen (const char *);
+extern int kzhread (kzfile *, void *, int);
+extern int kzhfilelength (kzfile *);
+extern int kzhseek (kzfile *, int, int);
+extern int kzhtell (kzfile *);
+extern void kzhclose (kzfile *);
+
 extern void kzfindfilestart (const char *); //pass wildcard string
 extern int kzfindfile (char *); //you alloc buf, returns 1:found,0:~found
 
@@ -780,6 +780,7 @@ static int md2draw (md2model *m, spritetype *tspr, int method)
 
 	draw.texture0 = ptmh->glpic;
 	draw.texture1 = 0;
+	draw.palookup = 0;
 	draw.alphacut = 0.32;
 	draw.colour.r = pc[0];
 	draw.colour.g = pc[1];
@@ -1072,6 +1073,7 @@ static int md3draw (md3model *m, spritetype *tspr, int method)
 //------------
 
 	draw.texture1 = 0;
+	draw.palookup = 0;
 	draw.alphacut = 0.32;
 	draw.colour.r = pc[0];
 	draw.colour.g = pc[1];
@@ -1850,6 +1852,8 @@ int voxdraw (voxmodel *m, spritetype *tspr, int method)
 	//updateanimation((md2model *)m,tspr);
 	if ((tspr->cstat&48)==32) return 0;
 
+	polymost_flushbatch();	// the depth and culling state changes here
+
 	m0.x = m->scale;
 	m0.y = m->scale;
 	m0.z = m->scale;
@@ -1941,6 +1945,7 @@ int voxdraw (voxmodel *m, spritetype *tspr, int method)
 
 	draw.texture0 = m->texid[globalpal];
 	draw.texture1 = 0;
+	draw.palookup = 0;
 	draw.alphacut = 0.32;
 	draw.colour.r = pc[0];
 	draw.colour.g = pc[1];
@@ -2085,6 +2090,8 @@ int mddraw (spritetype *tspr, int method)
 	mdanim_t *anim;
 	mdmodel *vm;
 
+	polymost_flushbatch();	// the depth and culling state changes here
+
 	if (maxmodelverts > allocmodelverts)
 	{
 		point3d *vl = (point3d *)realloc(vertlist,sizeof(point3d)*maxmodelverts);
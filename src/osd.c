@@ -5,6 +5,7 @@
 #include "build.h"
 #include "osd.h"
 #include "baselayer.h"
+#include "profile.h"
 
 extern int getclosestcol(int r, int g, int b);	// engine.c
 
@@ -49,6 +50,9 @@ static int  osdhead=0; 			// topmost visible line number
 static char osdinited=0;		// text buffer initialised?
 static int  osdkey=0x45;		// numlock shows the osd
 static int  keytime=0;
+#if USE_PROFILER
+static char osdprofile=0;		// profiler overlay visible?
+#endif
 
 // command prompt editing
 #define EDITLENGTH 511
@@ -243,6 +247,76 @@ static int osdcmd_echo(const osdfuncparm_t *parm)
 	return OSDCMD_OK;
 }
 
+#if USE_PROFILER
+static const char profileheader[] = "stage (ms)     last    avg    p50    p95    max calls";
+
+static int formatprofilerow(char *buf, int stage)
+{
+	profilestat st;
+
+	if (profile_getstat(stage, &st)) return -1;
+	Bsprintf(buf, "%-12.12s %6.2f %6.2f %6.2f %6.2f %6.2f %5u", st.name,
+		st.last/1000.0, st.avg/1000.0, st.p50/1000.0, st.p95/1000.0, st.max/1000.0, st.calls);
+	return 0;
+}
+
+static void drawprofile(void)
+{
+	char buf[80];
+	int i, x, y;
+
+	if (white < 0) findwhite();
+
+	x = max(0, osdcols - (int)strlen(profileheader));
+	y = osdvisible ? osdrows+2 : 0;
+	drawosdstr(x, y, (char *)profileheader, strlen(profileheader), 2, 0);
+	for (i = 0; i < profile_numstages(); i++) {
+		if (formatprofilerow(buf, i)) break;
+		drawosdstr(x, y+1+i, buf, strlen(buf), i ? 1 : 0, 0);
+	}
+}
+
+static int osdcmd_profile(const osdfuncparm_t *parm)
+{
+	char buf[80];
+	const char *filename;
+	int i;
+
+	if (parm->numparms == 0) {
+		if (!profileactive) {
+			OSD_Printf("The profiler is off\n");
+			return OSDCMD_OK;
+		}
+		OSD_Printf("%s\n", profileheader);
+		for (i = 0; i < profile_numstages(); i++) {
+			if (formatprofilerow(buf, i)) break;
+			OSD_Printf("%s\n", buf);
+		}
+		return OSDCMD_OK;
+	}
+
+	if (!Bstrcasecmp(parm->parms[0], "on")) {
+		profile_setactive(1);
+	} else if (!Bstrcasecmp(parm->parms[0], "off")) {
+		profile_setactive(0);
+		osdprofile = 0;
+	} else if (!Bstrcasecmp(parm->parms[0], "overlay")) {
+		osdprofile = !osdprofile;
+		if (osdprofile) profile_setactive(1);
+	} else if (!Bstrcasecmp(parm->parms[0], "reset")) {
+		profile_reset();
+	} else if (!Bstrcasecmp(parm->parms[0], "dump")) {
+		filename = parm->numparms > 1 ? parm->parms[1] : "profile.csv";
+		i = profile_dumpcsv(filename);
+		if (i < 0) OSD_Printf("Could not write %s\n", filename);
+		else OSD_Printf("Wrote %d frames to %s\n", i, filename);
+	} else {
+		return OSDCMD_SHOWHELP;
+	}
+	return OSDCMD_OK;
+}
+#endif
+
 
 ////////////////////////////
 
@@ -281,6 +355,9 @@ void OSD_Init(void)
 	OSD_RegisterFunction("osdrows","osdrows: sets the number of visible lines of the OSD",osdcmd_osdvars);
 	OSD_RegisterFunction("clear","clear: clear the OSD",osdcmd_clear);
 	OSD_RegisterFunction("echo","echo: write text to the OSD",osdcmd_echo);
+#if USE_PROFILER
+	OSD_RegisterFunction("profile","profile [on|off|overlay|reset|dump file.csv]: times the stages of each frame",osdcmd_profile);
+#endif
 }
 
 
@@ -849,7 +926,16 @@ void OSD_Draw(void)
 	unsigned topoffs;
 	int row, lines, x, len;
 
-	if (!osdvisible || !osdinited) return;
+	if (!osdinited) return;
+
+#if USE_PROFILER
+	if (osdprofile) {
+		begindrawing();
+		drawprofile();
+		enddrawing();
+	}
+#endif
+	if (!osdvisible) return;
 
 	topoffs = osdhead * osdcols;
 	row = osdrows-1;
@@ -83,7 +83,7 @@ Low priority:
 #endif
 extern char textfont[2048], smalltextfont[2048];
 
-int rendmode = 0;
+RENDERTLS int rendmode = 0;
 int usemodels=1, usehightile=1, usegoodalpha=0;
 
 #include <math.h> //<-important!
@@ -136,15 +136,25 @@ int glusetexcompr = 1;
 int gltexcomprquality = 0;	// 0 = fast, 1 = slow and pretty, 2 = very slow and pretty
 int gltexfiltermode = 5;   // GL_LINEAR_MIPMAP_LINEAR
 int glusetexcache = 1;
+int gltexcachesize = 0;	// megabytes the texture cache may take up, 0 = no limit
+int glusepalettelookup = 0;	// 1 = ART tiles are kept as palette indices and coloured by the shader
+int glbatchdraws = 1;	// 1 = consecutive drawpoly() polygons sharing state go to GL together
 int glmultisample = 0, glnvmultisamplehint = 0;
 int gltexmaxsize = 0;      // 0 means autodetection on first run
 int gltexmiplevel = 0;		// discards this many mipmap levels
+int gltexthreads = -1;	// threads decoding and compressing textures: 0 = none, <0 = one per processor
 static int lastglpolygonmode = 0;
 int glpolygonmode = 0;     // 0:GL_FILL,1:GL_LINE,2:GL_POINT,3:clear+GL_FILL
 
 static GLuint texttexture = 0;
 static GLuint nulltexture = 0;
 
+	// Textures for colouring ART tiles of palette indices (glusepalettelookup)
+static GLuint palettetexture = 0;	// 256x1 RGBA of curpalette
+static int palettetexturedirty = 1;
+static GLuint palookuptexture[MAXPALOOKUPS];	// 256 x numpalookups indices, one row per shade
+static unsigned char palookuptexturedirty[MAXPALOOKUPS];
+
 #define SHADERDEV 1
 static struct {
 	GLuint vao;					// Vertex array object.
@@ -160,6 +170,11 @@ static struct {
 	GLint uniform_colour;		// Colour (vec4)
 	GLint uniform_fogcolour;    // Fog colour   (vec4)
 	GLint uniform_fogdensity;   // Fog density  (float)
+	GLint uniform_usepalette;   // !0 if the base texture holds palette indices (int)
+	GLint uniform_palookup;     // Palette lookup table (sampler2D)
+	GLint uniform_palette;      // Palette colours (sampler2D)
+	GLint uniform_shade;        // Palette lookup rows for the shade wanted and for none (vec2)
+	GLint uniform_fullbright;   // First colour to leave unshaded (float)
 } polymostglsl;
 
 static struct {
@@ -177,11 +192,29 @@ static struct {
 		// 0 = texture is mask, render vertex colour/bgcolour.
 		// 1 = texture is image, blend with bgcolour.
 		// 2 = draw solid colour.
+		// 3 = texture is palette indices, blend with bgcolour.
+	GLint uniform_palette;      // Palette colours for mode 3 (sampler2D)
 } polymostauxglsl;
 
 static GLuint elementindexbuffer = 0;
 static GLuint elementindexbuffersize = 0;
 
+	// Polygons from drawpoly() waiting to be drawn in one call (glbatchdraws)
+#define BATCHMAXVERTS 65536	// what GLushort indexes can address
+static struct polymostdrawpolycall batchdraw;	// the state they share
+static int batchblend;
+static struct polymostvboitem *batchvbo = NULL;
+static GLushort *batchindexes = NULL;
+static int batchvbocount = 0, batchvboalloc = 0;
+static int batchindexcount = 0, batchindexalloc = 0;
+static GLuint batchindexbuffer = 0;
+
+static struct {
+	int drawcalls;		// glDrawElements calls of every kind
+	int polydrawcalls;	// of which carried drawpoly() polygons
+	int polys;			// polygons drawpoly() produced
+} drawcounts, lastdrawcounts;
+
 const GLfloat gidentitymat[4][4] = {
 	{1.f, 0.f, 0.f, 0.f},
 	{0.f, 1.f, 0.f, 0.f},
@@ -365,15 +398,105 @@ void polymost_texinvalidateall ()
 
 	iter = PTIterNew();
 	while ((pth = PTIterNext(iter)) != 0) {
-		if (pth->pic[PTHPIC_BASE]) {
+		// palette index textures are coloured when drawn, so keep
+		if (pth->pic[PTHPIC_BASE] && !(pth->pic[PTHPIC_BASE]->flags & PTH_INDEXED)) {
 			pth->pic[PTHPIC_BASE]->flags |= PTH_DIRTY;
 		}
 	}
 	PTIterFree(iter);
 	clearskins();
+	palettetexturedirty = 1;
 	//buildprintf("gltexinvalidateall()\n");
 }
 
+	//Rebuild the palette lookup texture of a palette the next time it's drawn with
+void polymost_palookupinvalidate (int palnum)
+{
+	palookuptexturedirty[palnum] = 1;
+}
+
+	//Releases every ART tile so they reload in the form glusepalettelookup asks for
+static void polymost_texreleaseart (void)
+{
+	PTIter iter;
+	PTHead * pth;
+	int i;
+
+	iter = PTIterNew();
+	while ((pth = PTIterNext(iter)) != 0) {
+		if (pth->flags & PTH_HIGHTILE) continue;
+		for (i = 0; i < PTHPIC_SIZE; i++) {
+			if (pth->pic[i] && pth->pic[i]->glpic) {
+				glfunc.glDeleteTextures(1, &pth->pic[i]->glpic);
+				pth->pic[i]->glpic = 0;
+			}
+		}
+	}
+	PTIterFree(iter);
+}
+
+	//Brings the palette texture up to date with curpalette
+static GLuint polymost_getpalettetexture (void)
+{
+	coltype pal[256];
+	int i;
+
+	if (palettetexture && !palettetexturedirty) {
+		return palettetexture;
+	}
+
+	for (i = 0; i < 256; i++) {
+		if (gammabrightness) {
+			pal[i].r = curpalette[i].r;
+			pal[i].g = curpalette[i].g;
+			pal[i].b = curpalette[i].b;
+		} else {
+			pal[i].r = britable[curbrightness][ curpalette[i].r ];
+			pal[i].g = britable[curbrightness][ curpalette[i].g ];
+			pal[i].b = britable[curbrightness][ curpalette[i].b ];
+		}
+		pal[i].a = 255;
+	}
+
+	if (!palettetexture) {
+		glfunc.glGenTextures(1, &palettetexture);
+	}
+	glfunc.glBindTexture(GL_TEXTURE_2D, palettetexture);
+	glfunc.glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 256, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, (const GLvoid *) pal);
+	glfunc.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glfunc.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	palettetexturedirty = 0;
+
+	return palettetexture;
+}
+
+	//Brings the palette lookup texture of a palette up to date with palookup[]
+static GLuint polymost_getpalookuptexture (int palnum)
+{
+	GLint c = glinfo.clamptoedge ? GL_CLAMP_TO_EDGE : GL_CLAMP;
+
+	if (!palookup[palnum]) {
+		palnum = 0;
+	}
+	if (palookuptexture[palnum] && !palookuptexturedirty[palnum]) {
+		return palookuptexture[palnum];
+	}
+
+	if (!palookuptexture[palnum]) {
+		glfunc.glGenTextures(1, &palookuptexture[palnum]);
+	}
+	glfunc.glBindTexture(GL_TEXTURE_2D, palookuptexture[palnum]);
+	glfunc.glTexImage2D(GL_TEXTURE_2D, 0, GLINDEXINTFMT, 256, numpalookups, 0, GLINDEXFMT,
+		GL_UNSIGNED_BYTE, (const GLvoid *) palookup[palnum]);
+	glfunc.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glfunc.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glfunc.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, c);
+	glfunc.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, c);
+	palookuptexturedirty[palnum] = 0;
+
+	return palookuptexture[palnum];
+}
+
 
 void gltexapplyprops (void)
 {
@@ -392,7 +515,8 @@ void gltexapplyprops (void)
 	iter = PTIterNew();
 	while ((pth = PTIterNext(iter)) != 0) {
 		for (i = 0; i < PTHPIC_SIZE; i++) {
-			if (pth->pic[i] == 0 || pth->pic[i]->glpic == 0) {
+			if (pth->pic[i] == 0 || pth->pic[i]->glpic == 0 ||
+					(pth->pic[i]->flags & PTH_INDEXED)) {
 				continue;
 			}
 			glfunc.glBindTexture(GL_TEXTURE_2D,pth->pic[i]->glpic);
@@ -482,6 +606,13 @@ void polymost_glreset ()
 		elementindexbuffer = 0;
 	}
 
+	// anything still batched may refer to textures about to go
+	batchvbocount = batchindexcount = 0;
+	if (batchindexbuffer) {
+		glfunc.glDeleteBuffers(1, &batchindexbuffer);
+		batchindexbuffer = 0;
+	}
+
 #if (USE_OPENGL == USE_GL3)
 	if (polymostglsl.vao) {
 		glfunc.glDeleteVertexArrays(1, &polymostglsl.vao);
@@ -525,6 +656,17 @@ void polymost_glreset ()
 		glfunc.glDeleteTextures(1, &nulltexture);
 		nulltexture = 0;
 	}
+
+	if (palettetexture) {
+		glfunc.glDeleteTextures(1, &palettetexture);
+		palettetexture = 0;
+	}
+	for (i = 0; i < MAXPALOOKUPS; i++) {
+		if (palookuptexture[i]) {
+			glfunc.glDeleteTextures(1, &palookuptexture[i]);
+			palookuptexture[i] = 0;
+		}
+	}
 }
 
 static GLint polymost_get_attrib(GLuint program, const GLchar *name)
@@ -634,6 +776,11 @@ static void polymost_loadshaders(void)
 		polymostglsl.uniform_colour      = polymost_get_uniform(polymostglsl.program, "u_colour");
 		polymostglsl.uniform_fogcolour   = polymost_get_uniform(polymostglsl.program, "u_fogcolour");
 		polymostglsl.uniform_fogdensity  = polymost_get_uniform(polymostglsl.program, "u_fogdensity");
+		polymostglsl.uniform_usepalette  = polymost_get_uniform(polymostglsl.program, "u_usepalette");
+		polymostglsl.uniform_palookup    = polymost_get_uniform(polymostglsl.program, "u_palookup");
+		polymostglsl.uniform_palette     = polymost_get_uniform(polymostglsl.program, "u_palette");
+		polymostglsl.uniform_shade       = polymost_get_uniform(polymostglsl.program, "u_shade");
+		polymostglsl.uniform_fullbright  = polymost_get_uniform(polymostglsl.program, "u_fullbright");
 
 #if (USE_OPENGL == USE_GL3)
 		glfunc.glGenVertexArrays(1, &polymostglsl.vao);
@@ -645,6 +792,8 @@ static void polymost_loadshaders(void)
 		glfunc.glUseProgram(polymostglsl.program);
 		glfunc.glUniform1i(polymostglsl.uniform_texture, 0);		//GL_TEXTURE0
 		glfunc.glUniform1i(polymostglsl.uniform_glowtexture, 1);	//GL_TEXTURE1
+		glfunc.glUniform1i(polymostglsl.uniform_palookup, 2);		//GL_TEXTURE2
+		glfunc.glUniform1i(polymostglsl.uniform_palette, 3);		//GL_TEXTURE3
 
 		// Generate a buffer object for vertex/colour elements.
 		glfunc.glGenBuffers(1, &polymostglsl.elementbuffer);
@@ -682,6 +831,7 @@ static void polymost_loadshaders(void)
 		polymostauxglsl.uniform_colour   = polymost_get_uniform(polymostauxglsl.program, "u_colour");
 		polymostauxglsl.uniform_bgcolour = polymost_get_uniform(polymostauxglsl.program, "u_bgcolour");
 		polymostauxglsl.uniform_mode     = polymost_get_uniform(polymostauxglsl.program, "u_mode");
+		polymostauxglsl.uniform_palette  = polymost_get_uniform(polymostauxglsl.program, "u_palette");
 
 #if (USE_OPENGL == USE_GL3)
 		glfunc.glGenVertexArrays(1, &polymostauxglsl.vao);
@@ -692,6 +842,7 @@ static void polymost_loadshaders(void)
 
 		glfunc.glUseProgram(polymostauxglsl.program);
 		glfunc.glUniform1i(polymostauxglsl.uniform_texture, 0);	//GL_TEXTURE0
+		glfunc.glUniform1i(polymostauxglsl.uniform_palette, 1);	//GL_TEXTURE1
 
 		// Generate a buffer object for vertex/colour elements and pre-allocate its memory.
 		glfunc.glGenBuffers(1, &polymostauxglsl.elementbuffer);
@@ -704,6 +855,9 @@ static void polymost_loadshaders(void)
 	// initial set of ascending indices, the way drawpoly() will generate points.
 	glfunc.glGenBuffers(1, &elementindexbuffer);
 	checkindexbuffer(MINVBOINDEXES);
+
+	// And one for the indexes of batched polygons.
+	glfunc.glGenBuffers(1, &batchindexbuffer);
 }
 
 // one-time initialisation of OpenGL for polymost
@@ -733,6 +887,8 @@ void resizeglcheck ()
 {
 	float m[4][4];
 
+	polymost_flushbatch();
+
 	if (glredbluemode < lastglredbluemode) {
 		glox1 = -1;
 		glfunc.glColorMask(1,1,1,1);
@@ -777,6 +933,7 @@ void polymost_aftershowframe(void)
 
 void polymost_setview(void)
 {
+	polymost_flushbatch();
 	memset(gdrawroomsprojmat,0,sizeof(gdrawroomsprojmat));
 	gdrawroomsprojmat[0][0] = (float)ydimen; gdrawroomsprojmat[0][2] = 1.0;
 	gdrawroomsprojmat[1][1] = (float)xdimen; gdrawroomsprojmat[1][2] = 1.0;
@@ -798,11 +955,13 @@ void polymost_setview(void)
 	gorthoprojmat[3][1] = 1.0;
 }
 
-void polymost_drawpoly_glcall(GLenum mode, struct polymostdrawpolycall *draw)
+	// indexes, if given, are uploaded into draw->indexbuffer first
+static void polymost_submitpoly(GLenum mode, struct polymostdrawpolycall *draw, const GLushort *indexes)
 {
 #ifdef DEBUGGINGAIDS
 	polymostcallcounts.drawpoly_glcall++;
 #endif
+	drawcounts.drawcalls++;
 
 	glfunc.glUseProgram(polymostglsl.program);
 
@@ -823,6 +982,9 @@ void polymost_drawpoly_glcall(GLenum mode, struct polymostdrawpolycall *draw)
 
 	if (draw->indexbuffer > 0) {
 		glfunc.glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, draw->indexbuffer);
+		if (indexes) {
+			glfunc.glBufferData(GL_ELEMENT_ARRAY_BUFFER, draw->indexcount * sizeof(GLushort), indexes, GL_STREAM_DRAW);
+		}
 	} else {
 		glfunc.glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementindexbuffer);
 		checkindexbuffer(draw->indexcount);
@@ -839,6 +1001,19 @@ void polymost_drawpoly_glcall(GLenum mode, struct polymostdrawpolycall *draw)
 	glfunc.glActiveTexture(GL_TEXTURE1);
 	glfunc.glBindTexture(GL_TEXTURE_2D, draw->texture1 ? draw->texture1 : nulltexture);
 
+	glfunc.glUniform1i(polymostglsl.uniform_usepalette, draw->palookup != 0);
+	if (draw->palookup) {
+		glfunc.glActiveTexture(GL_TEXTURE2);
+		glfunc.glBindTexture(GL_TEXTURE_2D, draw->palookup);
+
+		glfunc.glActiveTexture(GL_TEXTURE3);
+		glfunc.glBindTexture(GL_TEXTURE_2D, polymost_getpalettetexture());
+
+		glfunc.glUniform2f(polymostglsl.uniform_shade,
+			((float)draw->shade + 0.5f) / (float)numpalookups, 0.5f / (float)numpalookups);
+		glfunc.glUniform1f(polymostglsl.uniform_fullbright, (float)draw->fullbright);
+	}
+
 	glfunc.glUniform1f(polymostglsl.uniform_alphacut, draw->alphacut);
 
 	glfunc.glUniform4f(
@@ -867,11 +1042,113 @@ void polymost_drawpoly_glcall(GLenum mode, struct polymostdrawpolycall *draw)
 #endif
 }
 
+void polymost_drawpoly_glcall(GLenum mode, struct polymostdrawpolycall *draw)
+{
+	polymost_flushbatch();
+	polymost_submitpoly(mode, draw, NULL);
+}
+
+	// Draws the polygons batched so far. Anything changing GL state
+	// outside polymost_drawpoly_glcall() must call this first.
+void polymost_flushbatch(void)
+{
+	if (!batchvbocount) return;
+
+	if (batchblend) glfunc.glEnable(GL_BLEND);
+	else glfunc.glDisable(GL_BLEND);
+	glfunc.glDepthMask(GL_TRUE);
+
+	batchdraw.indexbuffer = batchindexbuffer;
+	batchdraw.indexcount = batchindexcount;
+	batchdraw.elementbuffer = 0;
+	batchdraw.elementcount = batchvbocount;
+	batchdraw.elementvbo = batchvbo;
+	drawcounts.polydrawcalls++;
+	polymost_submitpoly(GL_TRIANGLES, &batchdraw, batchindexes);
+
+	batchvbocount = batchindexcount = 0;
+}
+
+	// Whether a polygon can join those batched so far
+static int polymost_batchmatches(const struct polymostdrawpolycall *draw, int blend)
+{
+	const struct polymostdrawpolycall *b = &batchdraw;
+
+	if (draw->texture0 != b->texture0 || draw->texture1 != b->texture1 ||
+			draw->palookup != b->palookup || blend != batchblend) return 0;
+	if (draw->palookup && (draw->shade != b->shade || draw->fullbright != b->fullbright)) return 0;
+	if (draw->alphacut != b->alphacut || draw->fogdensity != b->fogdensity) return 0;
+	if (draw->colour.r != b->colour.r || draw->colour.g != b->colour.g ||
+			draw->colour.b != b->colour.b || draw->colour.a != b->colour.a) return 0;
+	if (draw->fogcolour.r != b->fogcolour.r || draw->fogcolour.g != b->fogcolour.g ||
+			draw->fogcolour.b != b->fogcolour.b || draw->fogcolour.a != b->fogcolour.a) return 0;
+	return draw->modelview == b->modelview && draw->projection == b->projection;
+}
+
+	// Queues a drawpoly() triangle fan, drawing what's queued first if the
+	// state differs. Order is kept, since walls are drawn with GL_ALWAYS depth.
+static void polymost_batchpoly(struct polymostdrawpolycall *draw, int blend)
+{
+	int i, n = draw->elementcount;
+	struct polymostvboitem *newvbo;
+	GLushort *newindexes;
+
+	drawcounts.polys++;
+
+	if (glbatchdraws && batchvbocount > 0 && (batchvbocount + n > BATCHMAXVERTS ||
+			!polymost_batchmatches(draw, blend))) {
+		polymost_flushbatch();
+	}
+
+	if (glbatchdraws && batchvbocount + n > batchvboalloc) {
+		newvbo = (struct polymostvboitem *) realloc(batchvbo, max(batchvboalloc * 2, 256) * sizeof(struct polymostvboitem));
+		if (newvbo) {
+			batchvbo = newvbo;
+			batchvboalloc = max(batchvboalloc * 2, 256);
+		}
+	}
+	if (glbatchdraws && batchindexcount + (n-2)*3 > batchindexalloc) {
+		newindexes = (GLushort *) realloc(batchindexes, max(batchindexalloc * 2, 768) * sizeof(GLushort));
+		if (newindexes) {
+			batchindexes = newindexes;
+			batchindexalloc = max(batchindexalloc * 2, 768);
+		}
+	}
+
+	// without batching, or room to batch, draw the fan on its own
+	if (!glbatchdraws || batchvbocount + n > batchvboalloc ||
+			batchindexcount + (n-2)*3 > batchindexalloc) {
+		polymost_flushbatch();
+		if (blend) glfunc.glEnable(GL_BLEND);
+		else glfunc.glDisable(GL_BLEND);
+		glfunc.glDepthMask(GL_TRUE);
+		drawcounts.polydrawcalls++;
+		polymost_drawpoly_glcall(GL_TRIANGLE_FAN, draw);
+		return;
+	}
+
+	if (batchvbocount == 0) {
+		batchdraw = *draw;
+		batchblend = blend;
+	}
+
+	// the fan becomes triangles sharing its first vertex
+	memcpy(&batchvbo[batchvbocount], draw->elementvbo, n * sizeof(struct polymostvboitem));
+	for (i = 1; i < n-1; i++) {
+		batchindexes[batchindexcount++] = batchvbocount;
+		batchindexes[batchindexcount++] = batchvbocount + i;
+		batchindexes[batchindexcount++] = batchvbocount + i + 1;
+	}
+	batchvbocount += n;
+}
+
 static void polymost_drawaux_glcall(GLenum mode, struct polymostdrawauxcall *draw)
 {
 #ifdef DEBUGGINGAIDS
 	polymostcallcounts.drawaux_glcall++;
 #endif
+	polymost_flushbatch();
+	drawcounts.drawcalls++;
 
 	glfunc.glUseProgram(polymostauxglsl.program);
 
@@ -970,7 +1247,10 @@ static void polymost_palfade(void)
 void polymost_nextpage(void)
 {
 #if USE_OPENGL
+	polymost_flushbatch();	// before polymost_palfade() changes the GL state
 	polymost_palfade();
+	lastdrawcounts = drawcounts;
+	memset(&drawcounts, 0, sizeof(drawcounts));
 #endif
 
 #ifdef DEBUGGINGAIDS
@@ -1096,7 +1376,7 @@ void drawpoly (double *dpx, double *dpy, int n, int method)
 	{
 		float hackscx, hackscy;
 		unsigned short ptflags = 0;
-		int picidx = PTHPIC_BASE;
+		int picidx = PTHPIC_BASE, blend;
 		PTHead * pth = 0;
 		struct polymostdrawpolycall draw;
 		struct polymostvboitem vboitem[MINVBOINDEXES];
@@ -1109,12 +1389,16 @@ void drawpoly (double *dpx, double *dpy, int n, int method)
 
 		// Base texture.
 		draw.texture0 = 0;
+		draw.palookup = 0;
 		if (pth) {
 			if (drawingskybox) {
 				picidx = drawingskybox - 1;
 			}
 			if (pth->pic[picidx]) {
 				draw.texture0 = pth->pic[picidx]->glpic;
+				if (pth->pic[picidx]->flags & PTH_INDEXED) {
+					draw.palookup = polymost_getpalookuptexture(globalpal);
+				}
 			}
 		}
 
@@ -1127,7 +1411,7 @@ void drawpoly (double *dpx, double *dpy, int n, int method)
 		}
 
 		if (!(method & (METH_MASKED | METH_TRANS))) {
-			glfunc.glDisable(GL_BLEND);
+			blend = 0;
 			draw.alphacut = 0.f;
 		} else {
 			float alphac = 0.32;
@@ -1137,7 +1421,7 @@ void drawpoly (double *dpx, double *dpy, int n, int method)
 			if (usegoodalpha) alphac = 0.0;
 			if (!waloff[globalpicnum]) alphac = 0.0;	// invalid textures ignore the alpha cutoff settings
 
-			glfunc.glEnable(GL_BLEND);
+			blend = 1;
 			draw.alphacut = alphac;
 		}
 
@@ -1175,6 +1459,12 @@ void drawpoly (double *dpx, double *dpy, int n, int method)
 			case METH_TRANS:   draw.colour.a = 0.66; break;
 			case METH_INTRANS: draw.colour.a = 0.33; break;
 		}
+		if (draw.palookup) {
+			// the palette lookup does the shading
+			draw.colour.r = draw.colour.g = draw.colour.b = 1.0;
+			draw.shade = min(max(globalshade,0),numpalookups-1);
+			draw.fullbright = (method & METH_LAYERS) ? polymosttexfullbright : 256;
+		}
 		// tinting happens only to hightile textures, and only if the texture we're
 		// rendering isn't for the same palette as what we asked for
 		if (pth && (pth->flags & PTH_HIGHTILE) && (globalpal != pth->repldef->palnum)) {
@@ -1318,8 +1608,7 @@ void drawpoly (double *dpx, double *dpy, int n, int method)
 				draw.indexcount = nn;
 				draw.elementcount = nn;
 
-				glfunc.glDepthMask(GL_TRUE);
-				polymost_drawpoly_glcall(GL_TRIANGLE_FAN, &draw);
+				polymost_batchpoly(&draw, blend);
 			}
 		}
 		else if (n > 0)
@@ -1339,8 +1628,7 @@ void drawpoly (double *dpx, double *dpy, int n, int method)
 			draw.indexcount = n;
 			draw.elementcount = n;
 
-			glfunc.glDepthMask(GL_TRUE);
-			polymost_drawpoly_glcall(GL_TRIANGLE_FAN, &draw);
+			polymost_batchpoly(&draw, blend);
 		}
 
 		return;
@@ -2904,6 +3192,7 @@ static void polymost_scansector (int sectnum)
 	int xs, ys, x1, y1, x2, y2;
 
 	if (sectnum < 0) return;
+	if (!pvsviewsees(sectnum)) return;
 	if (automapping) show2dsector[sectnum>>3] |= pow2char[sectnum&7];
 
 	sectorborder[0] = sectnum, sectorbordercnt = 1;
@@ -3175,6 +3464,7 @@ void polymost_drawrooms ()
 		updatesector(globalposx,globalposy,&globalcursectnum);
 		if (globalcursectnum < 0) globalcursectnum = i;
 	}
+	pvsview = pvsforview();
 
 	polymost_scansector(globalcursectnum);
 
@@ -3224,6 +3514,7 @@ void polymost_drawrooms ()
 #if USE_OPENGL
 	if (rendmode == 3)
 	{
+		polymost_flushbatch();
 		glfunc.glDepthFunc(GL_LEQUAL); //NEVER,LESS,(,L)EQUAL,GREATER,(NOT,G)EQUAL,ALWAYS
 
 		//glfunc.glPolygonOffset(0,0);
@@ -3811,6 +4102,7 @@ void polymost_dorotatesprite (int sx, int sy, int z, short a, short picnum,
 			tspr.owner = uniqid+MAXSPRITES;
 			globalorientation = (dastat&1)+((dastat&32)<<4)+((dastat&4)<<1);
 
+			polymost_flushbatch();
 			if ((dastat&10) == 2) glfunc.glViewport(windowx1,yres-(windowy2+1),windowx2-windowx1+1,windowy2-windowy1+1);
 			else { glfunc.glViewport(0,0,xdim,ydim); glox1 = -1; } //Force fullscreen (glox1=-1 forces it to restore)
 
@@ -3860,6 +4152,7 @@ void polymost_dorotatesprite (int sx, int sy, int z, short a, short picnum,
 #if USE_OPENGL
 	if (rendmode == 3)
 	{
+		polymost_flushbatch();
 		glfunc.glViewport(0,0,xdim,ydim); glox1 = -1; //Force fullscreen (glox1=-1 forces it to restore)
 		glfunc.glDisable(GL_DEPTH_TEST);
 	}
@@ -4181,6 +4474,8 @@ void polymost_fillpolygon (int npoints)
 	unsigned short ptflags = 0;
 	struct polymostdrawpolycall draw;
 
+	polymost_flushbatch();
+
 	globalx1 = mulscale16(globalx1,xyaspect);
 	globaly2 = mulscale16(globaly2,xyaspect);
 	gux = ((double)asm1)*(1.0/4294967296.0);
@@ -4203,9 +4498,13 @@ void polymost_fillpolygon (int npoints)
 	if (usehightile) ptflags |= PTH_HIGHTILE;
 
 	draw.texture0 = 0;
+	draw.palookup = 0;
 	pth = PT_GetHead(globalpicnum, globalpal, ptflags, 0);
 	if (pth && pth->pic[PTHPIC_BASE]) {
 		draw.texture0 = pth->pic[ PTHPIC_BASE ]->glpic;
+		if (pth->pic[PTHPIC_BASE]->flags & PTH_INDEXED) {
+			draw.palookup = polymost_getpalookuptexture(globalpal);
+		}
 	}
 	draw.texture1 = nulltexture;
 	draw.alphacut = 0.f;
@@ -4219,6 +4518,11 @@ void polymost_fillpolygon (int npoints)
 		case 2: draw.colour.a = 0.66; glfunc.glEnable(GL_BLEND); break;
 		case 3: draw.colour.a = 0.33; glfunc.glEnable(GL_BLEND); break;
 	}
+	if (draw.palookup) {
+		draw.colour.r = draw.colour.g = draw.colour.b = 1.0;
+		draw.shade = min(max(globalshade,0),numpalookups-1);
+		draw.fullbright = 256;
+	}
 	if (pth && (pth->flags & PTH_HIGHTILE) && (globalpal != pth->repldef->palnum)) {
 		// apply tinting for replaced textures
 		draw.colour.r *= (float)hictinting[globalpal].r / 255.0;
@@ -4284,6 +4588,11 @@ int polymost_drawtilescreen (int tilex, int tiley, int wallnum, int dimen)
 	if (pth) {
 		if (pth->pic[PTHPIC_BASE]) {
 			draw.texture0 = pth->pic[PTHPIC_BASE]->glpic;
+			if (pth->pic[PTHPIC_BASE]->flags & PTH_INDEXED) {
+				draw.mode = 3;	// Tile of palette indices.
+				glfunc.glActiveTexture(GL_TEXTURE1);
+				glfunc.glBindTexture(GL_TEXTURE_2D, polymost_getpalettetexture());
+			}
 		}
 	}
 
@@ -4628,6 +4937,11 @@ int polymost_precache_run(int* done, int* total)
 	return PTDoPrime(done, total);
 }
 
+int polymost_texcache_fill(void)
+{
+	return PTFillCache();
+}
+
 #ifdef DEBUGGINGAIDS
 // because I'm lazy
 static int osdcmd_debugdumptexturedefs(const osdfuncparm_t * UNUSED(parm))
@@ -4763,6 +5077,22 @@ static int osdcmd_forcetexcacherebuild(const osdfuncparm_t *UNUSED(parm))
 	return OSDCMD_OK;
 }
 
+static int osdcmd_texcachecompact(const osdfuncparm_t *UNUSED(parm))
+{
+	if (PTCacheCompact()) {
+		buildprintf("Compressed texture cache could not be compacted.\n");
+	}
+	return OSDCMD_OK;
+}
+
+static int osdcmd_gldrawstats(const osdfuncparm_t *UNUSED(parm))
+{
+	buildprintf("Last frame: %d draw calls, %d of them drawing the %d polygons from drawpoly (batching %s)\n",
+		lastdrawcounts.drawcalls, lastdrawcounts.polydrawcalls, lastdrawcounts.polys,
+		glbatchdraws ? "on" : "off");
+	return OSDCMD_OK;
+}
+
 #endif //USE_OPENGL
 
 static int osdcmd_polymostvars(const osdfuncparm_t *parm)
@@ -4809,6 +5139,11 @@ static int osdcmd_polymostvars(const osdfuncparm_t *parm)
 		else gltexmiplevel = val;
 		return OSDCMD_OK;
 	}
+	else if (!Bstrcasecmp(parm->name, "gltexthreads")) {
+		if (showval) { buildprintf("gltexthreads is %d\n", gltexthreads); }
+		else gltexthreads = max(-1,val);
+		return OSDCMD_OK;
+	}
 	else if (!Bstrcasecmp(parm->name, "usegoodalpha")) {
 		if (showval) { buildprintf("usegoodalpha is %d\n", usegoodalpha); }
 		else usegoodalpha = (val != 0);
@@ -4824,6 +5159,27 @@ static int osdcmd_polymostvars(const osdfuncparm_t *parm)
 		else glusetexcache = (val != 0);
 		return OSDCMD_OK;
 	}
+	else if (!Bstrcasecmp(parm->name, "gltexcachesize")) {
+		if (showval) { buildprintf("gltexcachesize is %d\n", gltexcachesize); }
+		else gltexcachesize = max(0,val);
+		return OSDCMD_OK;
+	}
+	else if (!Bstrcasecmp(parm->name, "glbatchdraws")) {
+		if (showval) { buildprintf("glbatchdraws is %d\n", glbatchdraws); }
+		else {
+			polymost_flushbatch();
+			glbatchdraws = (val != 0);
+		}
+		return OSDCMD_OK;
+	}
+	else if (!Bstrcasecmp(parm->name, "glusepalettelookup")) {
+		if (showval) { buildprintf("glusepalettelookup is %d\n", glusepalettelookup); }
+		else if (glusepalettelookup != (val != 0)) {
+			glusepalettelookup = (val != 0);
+			polymost_texreleaseart();
+		}
+		return OSDCMD_OK;
+	}
 	else if (!Bstrcasecmp(parm->name, "glmultisample")) {
 		if (showval) { buildprintf("glmultisample is %d\n", glmultisample); }
 		else glmultisample = max(0,val);
@@ -4865,13 +5221,19 @@ void polymost_initosdfuncs(void)
 	OSD_RegisterFunction("gltextureanisotropy", "gltextureanisotropy: changes the OpenGL texture anisotropy setting", osdcmd_gltextureanisotropy);
 	OSD_RegisterFunction("gltexturemaxsize","gltexturemaxsize: changes the maximum OpenGL texture size limit",osdcmd_polymostvars);
 	OSD_RegisterFunction("gltexturemiplevel","gltexturemiplevel: changes the highest OpenGL mipmap level used",osdcmd_polymostvars);
+	OSD_RegisterFunction("gltexthreads","gltexthreads: number of threads decoding and compressing textures (0 = off, -1 = one per processor)",osdcmd_polymostvars);
 	OSD_RegisterFunction("usegoodalpha","usegoodalpha: enable/disable better looking OpenGL alpha hack",osdcmd_polymostvars);
 	OSD_RegisterFunction("glpolygonmode","glpolygonmode: debugging feature. 0 = normal, 1 = edges, 2 = points, 3 = clear each frame",osdcmd_polymostvars);
 	OSD_RegisterFunction("glusetexcache","glusetexcache: enable/disable OpenGL compressed texture cache",osdcmd_polymostvars);
+	OSD_RegisterFunction("gltexcachesize","gltexcachesize: megabytes the compressed texture cache may use before the least recently used textures are dropped (0 = no limit)",osdcmd_polymostvars);
+	OSD_RegisterFunction("glbatchdraws","glbatchdraws: enable/disable drawing consecutive polygons that share a texture and state in one call",osdcmd_polymostvars);
+	OSD_RegisterFunction("gldrawstats","gldrawstats: reports how many draw calls the last frame took",osdcmd_gldrawstats);
+	OSD_RegisterFunction("glusepalettelookup","glusepalettelookup: enable/disable keeping ART tiles as palette indices and colouring them in the shader (unfiltered)",osdcmd_polymostvars);
 	OSD_RegisterFunction("glmultisample","glmultisample: sets the number of samples used for antialiasing (0 = off)",osdcmd_polymostvars);
 	OSD_RegisterFunction("glnvmultisamplehint","glnvmultisamplehint: enable/disable Nvidia multisampling hinting",osdcmd_polymostvars);
 	OSD_RegisterFunction("polymosttexverbosity","polymosttexverbosity: sets the level of chatter during texture loading. 0 = none, 1 = errors (default), 2 = all",osdcmd_polymostvars);
 	OSD_RegisterFunction("forcetexcacherebuild","forcetexcacherebuild: invalidates the compressed texture cache", osdcmd_forcetexcacherebuild);
+	OSD_RegisterFunction("texcachecompact","texcachecompact: reclaims the space held by old textures in the compressed texture cache", osdcmd_texcachecompact);
 #ifdef SHADERDEV
 	OSD_RegisterFunction("debugreloadshaders","debugreloadshaders: reloads the OpenGL shaders",osdcmd_debugreloadshaders);
 #endif
@@ -20,6 +20,11 @@ uniform vec4 u_colour;
 uniform float u_alphacut;
 uniform vec4 u_fogcolour;
 uniform float u_fogdensity;
+uniform int u_usepalette;
+uniform sampler2D u_palookup;
+uniform sampler2D u_palette;
+uniform mediump vec2 u_shade;
+uniform mediump float u_fullbright;
 
 varying mediump vec2 v_texcoord;
 
@@ -31,13 +36,34 @@ vec4 applyfog(vec4 inputcolour) {
     return mix(inputcolour, u_fogcolour, amount);
 }
 
+vec4 palettecolour(mediump float index) {
+    return vec4(texture2D(u_palette, vec2((index + 0.5) / 256.0, 0.5)).rgb, 1.0);
+}
+
 void main(void)
 {
     vec4 texcolour;
     vec4 glowcolour;
 
-    texcolour = texture2D(u_texture, v_texcoord);
-    glowcolour = texture2D(u_glowtexture, v_texcoord);
+    if (u_usepalette != 0) {
+        // The texture holds palette indices: 255 is transparent, and the
+        // rest go through the palette lookup row for the shade.
+        mediump float index = floor(texture2D(u_texture, v_texcoord).r * 255.0 + 0.5);
+        mediump float colour;
+
+        if (index > 254.5) {
+            texcolour = vec4(0.0);
+            glowcolour = vec4(0.0);
+        } else {
+            colour = floor(texture2D(u_palookup, vec2((index + 0.5) / 256.0, u_shade.x)).r * 255.0 + 0.5);
+            texcolour = palettecolour(colour);
+            colour = floor(texture2D(u_palookup, vec2((index + 0.5) / 256.0, u_shade.y)).r * 255.0 + 0.5);
+            glowcolour = (colour > u_fullbright - 0.5) ? palettecolour(colour) : vec4(0.0);
+        }
+    } else {
+        texcolour = texture2D(u_texture, v_texcoord);
+        glowcolour = texture2D(u_glowtexture, v_texcoord);
+    }
 
     if (texcolour.a < u_alphacut) {
         discard;
@@ -4,7 +4,7 @@
 
 #define PI 3.14159265358979323
 
-extern int rendmode;
+extern RENDERTLS int rendmode;
 extern float gtang;
 extern double dxb1[MAXWALLSB], dxb2[MAXWALLSB];
 
@@ -54,9 +54,20 @@ struct glfiltermodes {
 #define numglfiltermodes 6
 extern struct glfiltermodes glfiltermodes[numglfiltermodes];
 
+// Formats of the single-channel textures holding palette indices.
+#if (USE_OPENGL == USE_GL3)
+#  define GLINDEXINTFMT GL_R8
+#  define GLINDEXFMT    GL_RED
+#else
+#  define GLINDEXINTFMT GL_LUMINANCE
+#  define GLINDEXFMT    GL_LUMINANCE
+#endif
+
 extern int gltexcomprquality;	// 0 = fast, 1 = slow and pretty, 2 = very slow and pretty
 extern int gltexmaxsize;	// 0 means autodetection on first run
 extern int gltexmiplevel;	// discards this many mipmap levels
+extern int gltexthreads;	// threads decoding and compressing textures: 0 = none, <0 = one per processor
+extern int glbatchdraws;	// 1 = consecutive drawpoly() polygons sharing state go to GL together
 
 extern const GLfloat gidentitymat[4][4];
 extern GLfloat gdrawroomsprojmat[4][4];      // Proj. matrix for drawrooms() calls.
@@ -75,6 +86,9 @@ struct polymostvboitem {
 struct polymostdrawpolycall {
     GLuint texture0;
     GLuint texture1;
+    GLuint palookup;        // Palette lookup texture if texture0 holds palette indices, else 0.
+    GLint shade;            // Row of the palette lookup to colour texture0 with.
+    GLint fullbright;       // First colour to leave unshaded, or 256 for none.
     GLfloat alphacut;
     coltypef colour;
     coltypef fogcolour;
@@ -108,10 +122,12 @@ struct polymostdrawauxcall {
 };
 
 void polymost_drawpoly_glcall(GLenum mode, struct polymostdrawpolycall *draw);
+void polymost_flushbatch(void);
 
 int polymost_texmayhavealpha (int dapicnum, int dapalnum);
 void polymost_texinvalidate (int dapicnum, int dapalnum, int dameth);
 void polymost_texinvalidateall (void);
+void polymost_palookupinvalidate (int palnum);
 void polymost_glinit(void);
 int polymost_printext256(int xpos, int ypos, short col, short backcol, const char *name, char fontsize);
 int polymost_drawline256(int x1, int y1, int x2, int y2, unsigned char col);
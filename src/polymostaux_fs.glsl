@@ -19,6 +19,7 @@ uniform sampler2D u_texture;
 uniform vec4 u_colour;
 uniform vec4 u_bgcolour;
 uniform int u_mode;
+uniform sampler2D u_palette;
 
 varying mediump vec2 v_texcoord;
 
@@ -37,5 +38,10 @@ void main(void)
     } else if (u_mode == 2) {
         // Foreground colour.
         o_fragcolour = u_colour;
+    } else if (u_mode == 3) {
+        // Tile screen, palette indices.
+        mediump float index = floor(texture2D(u_texture, v_texcoord).r * 255.0 + 0.5);
+        pixel = texture2D(u_palette, vec2((index + 0.5) / 256.0, 0.5));
+        o_fragcolour = (index > 254.5) ? u_bgcolour : vec4(pixel.rgb, 1.0);
     }
 }
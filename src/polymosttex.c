@@ -14,6 +14,7 @@
 #include "polymosttex_priv.h"
 #include "polymosttexcache.h"
 #include "polymosttexcompress.h"
+#include "threadpool.h"
 
 /** a texture hash entry */
 struct PTHash_typ {
@@ -58,10 +59,55 @@ struct PTTexture_typ {
 };
 typedef struct PTTexture_typ PTTexture;
 
+#define PTMAXMIPS 32
+
+/** a texture's mipmap levels, built and waiting to be sent to GL */
+struct PTMipChain_typ {
+	GLint intexfmt;
+	GLenum rawfmt;
+	int compress;
+	int hasalpha;
+	int ownsdata;	// !0 if the level data is ours to free, 0 if a PTCacheTile holds it
+	int comprtime;	// milliseconds spent compressing
+	int nummips;
+	PTCacheTileMip mip[PTMAXMIPS];	// the levels GL receives, largest first
+};
+typedef struct PTMipChain_typ PTMipChain;
+
+#define PTCOMPRESSBANDROWS 64	// must be a multiple of 4
+
+/** a band of rows of a mipmap level to compress */
+struct PTMComprBand_typ {
+	unsigned char *pic;
+	int sizx, sizy;
+	unsigned char *out;
+	int compress;
+};
+typedef struct PTMComprBand_typ PTMComprBand;
+
+/** a texture file being loaded. Everything up to the upload to GL can
+    be done away from the GL thread, which is how priming decodes them. */
+struct PTMLoad_typ {
+	const char *filename;
+	PTMHead *ptmh;	// null once finished with
+	int flags;
+	int effects;
+	int writetocache;
+	int err;
+	PTTexture tex;	// the sizes of the decoded picture
+	PTCacheTile *tdef;
+	PTMipChain chain;
+};
+typedef struct PTMLoad_typ PTMLoad;
+
 static int primecnt   = 0;	// expected number of textures to load during priming
 static int primedone  = 0;	// running total of how many textures have been primed
 static int primepos   = 0;	// the position in pthashhead where we are up to in priming
 
+#define PRIMELOADSMAX 64
+static PTMLoad primeloads[PRIMELOADSMAX];	// files decoded ahead of a priming cycle
+static int numprimeloads = 0;
+
 int polymosttexverbosity = 1;	// 0 = none, 1 = errors, 2 = all
 int polymosttexfullbright = 256;	// first index of the fullbright palette entries
 
@@ -81,6 +127,10 @@ static const char *compressfourcc[] = {
 static void ptm_fixtransparency(PTTexture * tex, int clamped);
 static void ptm_applyeffects(PTTexture * tex, int effects);
 static void ptm_mipscale(PTTexture * tex);
+static void ptm_bakemipmaps(PTMipChain * chain, unsigned short flags, PTTexture * tex, PTCacheTile * tdef, int usepool);
+static void ptm_sendmipmaps(PTMHead * ptm, PTMipChain * chain);
+static void ptm_freemipmaps(PTMipChain * chain);
+static void ptm_freeload(PTMLoad * ld);
 static void ptm_uploadtexture(PTMHead * ptm, unsigned short flags, PTTexture * tex, PTCacheTile * tdef);
 
 
@@ -245,6 +295,8 @@ incompatible:
 				   tdef->filename, tdef->effects, tdef->flags, compressfourcc[compress]);
 	}
 
+	detect_texture_size();
+
 	if (ptmh->glpic == 0) {
 		glfunc.glGenTextures(1, &ptmh->glpic);
 	}
@@ -284,57 +336,68 @@ incompatible:
 
 
 /**
- * Loads a texture file into OpenGL
+ * Prepares to load a texture file
+ * @param ld the load to initialise
  * @param filename the texture filename
  * @param ptmh the PTMHead structure to receive the texture details
  * @param flags PTH_* flags to tune the load process
  * @param effects HICEFFECT_* effects to apply
- * @return 0 on success, <0 on error
+ * @return !0 if the texture cache holds the texture already
  */
-int PTM_LoadTextureFile(const char* filename, PTMHead* ptmh, int flags, int effects)
+static int ptm_initload(PTMLoad * ld, const char* filename, PTMHead* ptmh, int flags, int effects)
 {
-	PTTexture tex;
-	int filh, picdatalen;
-	int x, y;
-	char * picdata = 0;
-	PTCacheTile * tdef = 0;
-	int writetocache = 0, iscached = 0;
+	int iscached = 0;
+
+	memset(ld, 0, sizeof(PTMLoad));
+	ld->filename = filename;
+	ld->ptmh = ptmh;
+	ld->flags = flags;
+	ld->effects = effects;
 
 	if (!(flags & PTH_NOCOMPRESS) && glusetexcache && glusetexcompr) {
+		// the cache ignores tiles whose source file has changed since
 		iscached = PTCacheHasTile(filename, effects, (flags & PTH_CLAMPED));
 
-		// if the texture exists in the cache but the original file is newer,
-		// ignore what's in the cache and overwrite it
-		/*if (iscached && filemtime(filename) > filemtime(cacheitem)) {
-			iscached = 0;
-		}*/
-
 		if (!iscached) {
-			writetocache = 1;
+			ld->writetocache = 1;
 		}
 	}
 
-	if (iscached) {
-		if (ptm_loadcachedtexturefile(filename, ptmh, flags, effects) == 0) {
-			return 0;
-		}
-	}
+	return iscached;
+}
+
+/**
+ * Reads and decodes a texture file, and builds its mipmaps. This makes no
+ * GL calls, so any thread may do it once detect_texture_size() has run.
+ * @param ld the load, which receives the error code in ld->err
+ * @param usepool !0 to compress on the thread pool (from the GL thread only)
+ */
+static void ptm_decodeload(PTMLoad * ld, int usepool)
+{
+	PTTexture tex;
+	int filh, picdatalen;
+	int y;
+	char * picdata = 0;
 
-	filh = kopen4load((char *) filename, 0);
+	filh = kopen4load((char *) ld->filename, 0);
 	if (filh < 0) {
-		return -1;
+		ld->err = -1;
+		return;
 	}
 	picdatalen = kfilelength(filh);
 
 	picdata = (char *) malloc(picdatalen);
 	if (!picdata) {
 		kclose(filh);
-		return -2;
+		ld->err = -2;
+		return;
 	}
 
 	if (kread(filh, picdata, picdatalen) != picdatalen) {
 		kclose(filh);
-		return -3;
+		free(picdata);
+		ld->err = -3;
+		return;
 	}
 
 	kclose(filh);
@@ -342,10 +405,11 @@ int PTM_LoadTextureFile(const char* filename, PTMHead* ptmh, int flags, int effe
 	kpgetdim(picdata, picdatalen, (int *) &tex.tsizx, (int *) &tex.tsizy);
 	if (tex.tsizx == 0 || tex.tsizy == 0) {
 		free(picdata);
-		return -4;
+		ld->err = -4;
+		return;
 	}
 
-	if (!glinfo.texnpot || writetocache) {
+	if (!glinfo.texnpot || ld->writetocache) {
 		for (tex.sizx = 1; tex.sizx < tex.tsizx; tex.sizx += tex.sizx) ;
 		for (tex.sizy = 1; tex.sizy < tex.tsizy; tex.sizy += tex.sizy) ;
 	} else {
@@ -355,27 +419,25 @@ int PTM_LoadTextureFile(const char* filename, PTMHead* ptmh, int flags, int effe
 
 	tex.pic = (coltype *) malloc(tex.sizx * tex.sizy * sizeof(coltype));
 	if (!tex.pic) {
-		return -2;
+		free(picdata);
+		ld->err = -2;
+		return;
 	}
 	memset(tex.pic, 0, tex.sizx * tex.sizy * sizeof(coltype));
 
 	if (kprender(picdata, picdatalen, tex.pic, tex.sizx * sizeof(coltype), tex.sizx, tex.sizy, 0, 0)) {
 		free(picdata);
 		free(tex.pic);
-		return -5;
+		ld->err = -5;
+		return;
 	}
 
 	free(picdata);
 	picdata = 0;
 
-	ptm_applyeffects(&tex, effects);	// updates tex.hasalpha
-
-	ptmh->flags = 0;
-	if (tex.hasalpha) {
-		ptmh->flags |= PTH_HASALPHA;
-	}
+	ptm_applyeffects(&tex, ld->effects);	// updates tex.hasalpha
 
-	if (! (flags & PTH_CLAMPED) || (flags & PTH_SKYBOX)) { //Duplicate texture pixels (wrapping tricks for non power of 2 texture sizes)
+	if (! (ld->flags & PTH_CLAMPED) || (ld->flags & PTH_SKYBOX)) { //Duplicate texture pixels (wrapping tricks for non power of 2 texture sizes)
 		if (tex.sizx > tex.tsizx) {	//Copy left to right
 			coltype * lptr = tex.pic;
 			for (y = 0; y < tex.tsizy; y++, lptr += tex.sizx) {
@@ -396,12 +458,10 @@ int PTM_LoadTextureFile(const char* filename, PTMHead* ptmh, int flags, int effe
 		tex.rawfmt = GL_RGBA;
 	}
 
-	ptmh->tsizx = tex.tsizx;
-	ptmh->tsizy = tex.tsizy;
-	ptmh->sizx  = tex.sizx;
-	ptmh->sizy  = tex.sizy;
+	ld->tex = tex;
+	ld->tex.pic = 0;
 
-	if (writetocache) {
+	if (ld->writetocache) {
 		int nmips = 0;
 		while (max(1, (tex.sizx >> nmips)) > 1 ||
 			   max(1, (tex.sizy >> nmips)) > 1) {
@@ -409,33 +469,119 @@ int PTM_LoadTextureFile(const char* filename, PTMHead* ptmh, int flags, int effe
 		}
 		nmips++;
 
-		tdef = PTCacheAllocNewTile(nmips);
-		tdef->filename = strdup(filename);
-		tdef->effects = effects;
-		tdef->flags = (flags | ptmh->flags) & (PTH_CLAMPED | PTH_HASALPHA);
+		ld->tdef = PTCacheAllocNewTile(nmips);
+		ld->tdef->filename = strdup(ld->filename);
+		ld->tdef->effects = ld->effects;
+		ld->tdef->flags = (ld->flags | (tex.hasalpha ? PTH_HASALPHA : 0)) & (PTH_CLAMPED | PTH_HASALPHA);
 	}
 
-	ptm_uploadtexture(ptmh, flags, &tex, tdef);
+	ptm_bakemipmaps(&ld->chain, ld->flags, &tex, ld->tdef, usepool);
+
+	free(tex.pic);
+}
+
+/**
+ * Sends a decoded texture file to GL and the texture cache, and releases
+ * what the load holds
+ * @param ld the load
+ * @return 0 on success, <0 on error
+ */
+static int ptm_finishload(PTMLoad * ld)
+{
+	PTMHead * ptmh = ld->ptmh;
+	int err = ld->err;
+
+	if (!err) {
+		ptmh->tsizx = ld->tex.tsizx;
+		ptmh->tsizy = ld->tex.tsizy;
+		ptmh->sizx  = ld->tex.sizx;
+		ptmh->sizy  = ld->tex.sizy;
 
-	if (writetocache) {
-		if (polymosttexverbosity >= 2) {
-			buildprintf("PolymostTex: writing %s (effects %d, flags %d) to cache\n",
-					   tdef->filename, tdef->effects, tdef->flags);
+		ptm_sendmipmaps(ptmh, &ld->chain);
+
+		if (ld->tdef) {
+			if (polymosttexverbosity >= 2) {
+				buildprintf("PolymostTex: writing %s (effects %d, flags %d) to cache\n",
+						   ld->tdef->filename, ld->tdef->effects, ld->tdef->flags);
+			}
+			PTCacheWriteTile(ld->tdef);
 		}
-		PTCacheWriteTile(tdef);
-		PTCacheFreeTile(tdef);
-		tdef = 0;
 	}
 
+	ptm_freeload(ld);
 
-	if (tex.pic) {
-		free(tex.pic);
-		tex.pic = 0;
+	return err;
+}
+
+/**
+ * Releases what a load holds
+ * @param ld the load
+ */
+static void ptm_freeload(PTMLoad * ld)
+{
+	ptm_freemipmaps(&ld->chain);
+	if (ld->tdef) {
+		PTCacheFreeTile(ld->tdef);
+		ld->tdef = 0;
 	}
+	ld->ptmh = 0;
+}
+
+/**
+ * Decodes a file queued for priming. Run by the thread pool.
+ */
+static void ptm_decodeprimeload(void *arg, int index)
+{
+	ptm_decodeload(&((PTMLoad *) arg)[index], 0);
+}
+
+/**
+ * Finds a file decoded ahead of time for priming
+ * @return the load, or null if the file was not decoded ahead
+ */
+static PTMLoad * ptm_findprimeload(const char* filename, PTMHead* ptmh, int flags, int effects)
+{
+	int i;
 
+	for (i = 0; i < numprimeloads; i++) {
+		PTMLoad * ld = &primeloads[i];
+		if (ld->ptmh == ptmh && ld->flags == flags && ld->effects == effects &&
+				!strcmp(ld->filename, filename)) {
+			return ld;
+		}
+	}
 	return 0;
 }
 
+/**
+ * Loads a texture file into OpenGL
+ * @param filename the texture filename
+ * @param ptmh the PTMHead structure to receive the texture details
+ * @param flags PTH_* flags to tune the load process
+ * @param effects HICEFFECT_* effects to apply
+ * @return 0 on success, <0 on error
+ */
+int PTM_LoadTextureFile(const char* filename, PTMHead* ptmh, int flags, int effects)
+{
+	PTMLoad ld, * primed;
+
+	primed = ptm_findprimeload(filename, ptmh, flags, effects);
+	if (primed) {
+		return ptm_finishload(primed);
+	}
+
+	if (ptm_initload(&ld, filename, ptmh, flags, effects)) {
+		if (ptm_loadcachedtexturefile(filename, ptmh, flags, effects) == 0) {
+			return 0;
+		}
+	}
+
+	detect_texture_size();
+	ptm_decodeload(&ld, 1);
+
+	return ptm_finishload(&ld);
+}
+
 /**
  * Returns a string describing the error returned by PTM_LoadTextureFile
  * @param err the error code
@@ -565,6 +711,7 @@ static void pt_unload(PTHash * pth)
 }
 
 static int pt_load_art(PTHead * pth);
+static int pt_load_artindexed(PTHead * pth);
 static int pt_load_hightile(PTHead * pth);
 static void pt_load_applyparameters(PTHead * pth);
 
@@ -599,7 +746,11 @@ static int pt_load(PTHash * pth)
 		return pt_load(pth->deferto);
 	}
 
-	if (pt_load_art(&pth->head)) {
+	if (glusepalettelookup) {
+		if (pt_load_artindexed(&pth->head)) {
+			return 1;
+		}
+	} else if (pt_load_art(&pth->head)) {
 		return 1;
 	}
 
@@ -751,6 +902,140 @@ static int pt_load_art(PTHead * pth)
 	return 1;
 }
 
+/**
+ * Load an ART tile into an OpenGL texture of palette indices. The shader
+ * looks up the palette, shade and colour, so one texture serves every palette.
+ * @param pth the header to populate
+ * @return !0 on success
+ */
+static int pt_load_artindexed(PTHead * pth)
+{
+	PTMHead * ptmh;
+	unsigned char * pic, * wpptr;
+	int tsizx, tsizy, sizx, sizy;
+	int x, y, x2, y2;
+	int hasalpha = 0;
+	PTMIdent id;
+
+	tsizx = tilesizx[pth->picnum];
+	tsizy = tilesizy[pth->picnum];
+	if (!glinfo.texnpot) {
+		for (sizx = 1; sizx < tsizx; sizx += sizx) ;
+		for (sizy = 1; sizy < tsizy; sizy += sizy) ;
+	} else if ((tsizx | tsizy) == 0) {
+		sizx = sizy = 1;
+	} else {
+		sizx = tsizx;
+		sizy = tsizy;
+	}
+
+	pth->scalex = 1.0;
+	pth->scaley = 1.0;
+	pth->flags &= ~(PTH_HASALPHA | PTH_SKYBOX);
+	pth->flags |= (PTH_NOCOMPRESS | PTH_NOMIPLEVEL);
+
+	PTM_InitIdent(&id, pth);
+	id.layer = PTHPIC_BASE;
+	id.palnum = 0;
+	id.flags |= PTH_INDEXED;
+	ptmh = PTM_GetHead(&id);
+	pth->pic[PTHPIC_BASE] = ptmh;
+	pth->pic[PTHPIC_GLOW] = 0;	// the shader picks out fullbright colours itself
+
+	if (ptmh->glpic != 0 && (ptmh->flags & PTH_DIRTY) == 0) {
+		return 1;	// loaded already for another palette
+	}
+
+	if (!waloff[pth->picnum]) {
+		loadtile(pth->picnum);
+	}
+
+	pic = (unsigned char *) malloc(sizx * sizy);
+	if (!pic) {
+		return 0;
+	}
+
+	if (!waloff[pth->picnum]) {
+		// Force invalid textures to draw something - a transparent texture
+		// This allows the Z-buffer to be updated for mirrors (which are invalidated textures)
+		memset(pic, 255, sizx * sizy);
+		tsizx = tsizy = 1;
+		hasalpha = 1;
+	} else {
+		for (y = 0; y < sizy; y++) {
+			y2 = (y < tsizy) ? y : y - tsizy;
+			wpptr = &pic[y * sizx];
+			for (x = 0; x < sizx; x++, wpptr++) {
+				if ((pth->flags & PTH_CLAMPED) && (x >= tsizx || y >= tsizy)) {
+					*wpptr = 255;
+					continue;
+				}
+				x2 = (x < tsizx) ? x : x - tsizx;
+				*wpptr = *(unsigned char *)(waloff[pth->picnum] + x2 * tsizy + y2);
+				if (*wpptr == 255) {
+					hasalpha = 1;
+				}
+			}
+		}
+	}
+
+	if (ptmh->glpic == 0) {
+		glfunc.glGenTextures(1, &ptmh->glpic);
+	}
+	glfunc.glBindTexture(GL_TEXTURE_2D, ptmh->glpic);
+	glfunc.glTexImage2D(GL_TEXTURE_2D, 0, GLINDEXINTFMT, sizx, sizy, 0, GLINDEXFMT,
+		GL_UNSIGNED_BYTE, (const GLvoid *) pic);
+	free(pic);
+
+	ptmh->flags = PTH_INDEXED | (hasalpha ? PTH_HASALPHA : 0);
+	ptmh->tsizx = tsizx;
+	ptmh->tsizy = tsizy;
+	ptmh->sizx  = sizx;
+	ptmh->sizy  = sizy;
+	pt_load_applyparameters(pth);
+
+	return 1;
+}
+
+/**
+ * Checks a header has a Hightile replacement to load, and sets its flags up for it
+ * @param pth the header
+ * @return the HICEFFECT_* effects to load the replacement with, or -1 if there is none
+ */
+static int pt_prepare_hightile(PTHead * pth)
+{
+	if (!pth->repldef) {
+		return -1;
+	} else if ((pth->flags & PTH_SKYBOX) && (pth->repldef->skybox == 0 || pth->repldef->skybox->ignore)) {
+		return -1;
+	} else if (pth->repldef->ignore) {
+		return -1;
+	}
+
+	pth->flags &= ~(PTH_NOCOMPRESS | PTH_HASALPHA);
+	if (pth->repldef->flags & HIC_NOCOMPRESS) {
+		pth->flags |= PTH_NOCOMPRESS;
+	}
+
+	return (pth->palnum != pth->repldef->palnum) ? hictinting[pth->palnum].f : 0;
+}
+
+/**
+ * Gives the file holding one of the textures of a Hightile replacement
+ * @param pth the header
+ * @param texture a skybox face, or a PTHPIC_* index
+ * @return the filename, or null if there is none
+ */
+static const char * pt_hightile_filename(PTHead * pth, int texture)
+{
+	if (pth->flags & PTH_SKYBOX) {
+		return (texture < 6) ? pth->repldef->skybox->face[texture] : 0;
+	}
+
+	// future developments may use the other indices
+	return (texture == PTHPIC_BASE) ? pth->repldef->filename : 0;
+}
+
 /**
  * Load a Hightile texture into an OpenGL texture
  * @param pth the header to populate
@@ -760,46 +1045,18 @@ static int pt_load_art(PTHead * pth)
 static int pt_load_hightile(PTHead * pth)
 {
 	const char *filename = 0;
-	int hasalpha = 0;
 	int effects = 0;
 	int err = 0;
 	int texture = 0, loaded[PTHPIC_SIZE] = { 0,0,0,0,0,0, };
     PTMIdent id;
 
-	if (!pth->repldef) {
-		return 0;
-	} else if ((pth->flags & PTH_SKYBOX) && (pth->repldef->skybox == 0 || pth->repldef->skybox->ignore)) {
-		return 0;
-	} else if (pth->repldef->ignore) {
+	effects = pt_prepare_hightile(pth);
+	if (effects < 0) {
 		return 0;
 	}
 
-	effects = (pth->palnum != pth->repldef->palnum) ? hictinting[pth->palnum].f : 0;
-
-	pth->flags &= ~(PTH_NOCOMPRESS | PTH_HASALPHA);
-	if (pth->repldef->flags & HIC_NOCOMPRESS) {
-		pth->flags |= PTH_NOCOMPRESS;
-	}
-
 	for (texture = 0; texture < PTHPIC_SIZE; texture++) {
-		if (pth->flags & PTH_SKYBOX) {
-			if (texture >= 6) {
-				texture = PTHPIC_SIZE;
-				continue;
-			}
-			filename = pth->repldef->skybox->face[texture];
-		} else {
-			switch (texture) {
-				case PTHPIC_BASE:
-					filename = pth->repldef->filename;
-					break;
-				default:
-					// future developments may use the other indices
-					texture = PTHPIC_SIZE;
-					continue;
-			}
-		}
-
+		filename = pt_hightile_filename(pth, texture);
 		if (!filename) {
 			continue;
 		}
@@ -856,19 +1113,25 @@ static void pt_load_applyparameters(PTHead * pth)
 
 		glfunc.glBindTexture(GL_TEXTURE_2D, pth->pic[i]->glpic);
 
-		if (gltexfiltermode < 0) {
-			gltexfiltermode = 0;
-		} else if (gltexfiltermode >= (int)numglfiltermodes) {
-			gltexfiltermode = numglfiltermodes-1;
-		}
-		glfunc.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, glfiltermodes[gltexfiltermode].mag);
-		glfunc.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, glfiltermodes[gltexfiltermode].min);
+		if (pth->pic[i]->flags & PTH_INDEXED) {
+			// palette indices can't be blended between
+			glfunc.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glfunc.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		} else {
+			if (gltexfiltermode < 0) {
+				gltexfiltermode = 0;
+			} else if (gltexfiltermode >= (int)numglfiltermodes) {
+				gltexfiltermode = numglfiltermodes-1;
+			}
+			glfunc.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, glfiltermodes[gltexfiltermode].mag);
+			glfunc.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, glfiltermodes[gltexfiltermode].min);
 
-		if (glinfo.maxanisotropy > 1.0) {
-			if (glanisotropy <= 0 || glanisotropy > glinfo.maxanisotropy) {
-				glanisotropy = (int)glinfo.maxanisotropy;
+			if (glinfo.maxanisotropy > 1.0) {
+				if (glanisotropy <= 0 || glanisotropy > glinfo.maxanisotropy) {
+					glanisotropy = (int)glinfo.maxanisotropy;
+				}
+				glfunc.glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, glanisotropy);
 			}
-			glfunc.glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, glanisotropy);
 		}
 
 		if (! (pth->flags & PTH_CLAMPED)) {
@@ -1105,61 +1368,73 @@ static void ptm_mipscale(PTTexture * tex)
 
 
 /**
- * Sends texture data to GL
- * @param ptm the texture management header
+ * Compresses one band of rows of a mipmap. Run by the thread pool.
+ */
+static void ptm_compressband(void *arg, int index)
+{
+	PTMComprBand * band = &((PTMComprBand *) arg)[index];
+
+	ptcompress_compress(band->pic, band->sizx, band->sizy, band->out, band->compress);
+}
+
+/**
+ * Builds the mipmaps of a texture, compressing them if appropriate. This
+ * makes no GL calls, so any thread may do it once detect_texture_size() has run.
+ * @param chain receives the mipmaps
  * @param flags extra flags to modify how the texture is uploaded
- * @param tex the texture to upload
+ * @param tex the texture, which is left holding the smallest mipmap
  * @param tdef the polymosttexcache definition to receive compressed mipmaps, or null
+ * @param usepool !0 to spread the compression over the thread pool, which
+ *   only the GL thread may do
  */
-static void ptm_uploadtexture(PTMHead * ptm, unsigned short flags, PTTexture * tex, PTCacheTile * tdef)
+static void ptm_bakemipmaps(PTMipChain * chain, unsigned short flags, PTTexture * tex, PTCacheTile * tdef, int usepool)
 {
-	int i;
 	GLint mipmap;
-	GLint intexfmt;
-	int compress = PTCOMPRESS_NONE;
-	unsigned char * comprdata = 0;
-	int tdefmip = 0, comprsize = 0;
+	PTCacheTileMip level[PTMAXMIPS];
+	unsigned char * comprdata[PTMAXMIPS];
+	PTMComprBand * bands;
+	int numlevels = 0, numskipped = 0, numbands = 0;
+	int i, y, skip;
 	int starttime;
 
-	detect_texture_size();
+	memset(chain, 0, sizeof(PTMipChain));
 
 #if USE_OPENGL == USE_GLES2
 	// GLES permits BGRA as an internal format.
-    intexfmt = tex->rawfmt;
+    chain->intexfmt = tex->rawfmt;
 #else
-    intexfmt = GL_RGBA;
+    chain->intexfmt = GL_RGBA;
 #endif
+	chain->rawfmt = tex->rawfmt;
+	chain->hasalpha = tex->hasalpha;
+
 	if (!(flags & PTH_NOCOMPRESS) && glusetexcompr) {
 #if GL_EXT_texture_compression_dxt1 || GL_EXT_texture_compression_s3tc
-		if (!compress && !tex->hasalpha && glinfo.texcomprdxt1) {
-			intexfmt = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
-			compress = PTCOMPRESS_DXT1;
+		if (!chain->compress && !tex->hasalpha && glinfo.texcomprdxt1) {
+			chain->intexfmt = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+			chain->compress = PTCOMPRESS_DXT1;
 		}
 #endif
 #if GL_OES_compressed_ETC1_RGB8_texture
-		if (!compress && !tex->hasalpha && glinfo.texcompretc1) {
-			intexfmt = GL_ETC1_RGB8_OES;
-			compress = PTCOMPRESS_ETC1;
+		if (!chain->compress && !tex->hasalpha && glinfo.texcompretc1) {
+			chain->intexfmt = GL_ETC1_RGB8_OES;
+			chain->compress = PTCOMPRESS_ETC1;
 		}
 #endif
 #if GL_EXT_texture_compression_s3tc
-		if (!compress && tex->hasalpha && glinfo.texcomprdxt5) {
-			intexfmt = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
-			compress = PTCOMPRESS_DXT5;
+		if (!chain->compress && tex->hasalpha && glinfo.texcomprdxt5) {
+			chain->intexfmt = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+			chain->compress = PTCOMPRESS_DXT5;
 		}
 #endif
 	}
 
-	if (compress && tdef) {
-		tdef->format = intexfmt;
+	if (chain->compress && tdef) {
+		tdef->format = chain->intexfmt;
 		tdef->tsizx  = tex->tsizx;
 		tdef->tsizy  = tex->tsizy;
 	}
-
-	if (ptm->glpic == 0) {
-		glfunc.glGenTextures(1, &ptm->glpic);
-	}
-	glfunc.glBindTexture(GL_TEXTURE_2D, ptm->glpic);
+	chain->ownsdata = !(chain->compress && tdef);
 
 	ptm_fixtransparency(tex, (flags & PTH_CLAMPED));
 
@@ -1176,117 +1451,154 @@ static void ptm_uploadtexture(PTMHead * ptm, unsigned short flags, PTTexture * t
 		mipmap++;
 	}
 
-	for ( ;
-	     mipmap > 0 && (tex->sizx > 1 || tex->sizy > 1);
-	     mipmap--) {
-		if (compress && tdef) {
-			comprsize = ptcompress_getstorage(tex->sizx, tex->sizy, compress);
-			comprdata = (unsigned char *) malloc(comprsize);
-
-			starttime = getticks();
-			ptcompress_compress(tex->pic, tex->sizx, tex->sizy, comprdata, compress);
-			if (polymosttexverbosity >= 2) {
-				buildprintf("PolymostTex: ptcompress_compress (%dx%d, %s) took %f sec\n",
-					   tex->sizx, tex->sizy, compressfourcc[compress],
-					   (float)(getticks() - starttime) / 1000.f);
+	// collect every level first, so that compressing them can be done all at
+	// once. The levels GL won't get this time are only wanted by the cache.
+	while (1) {
+		skip = (mipmap > 0 && (tex->sizx > 1 || tex->sizy > 1));
+		if (!skip || (chain->compress && tdef)) {
+			level[numlevels].sizx = tex->sizx;
+			level[numlevels].sizy = tex->sizy;
+			level[numlevels].length = tex->sizx * tex->sizy * sizeof(coltype);
+			level[numlevels].data = (unsigned char *) malloc(level[numlevels].length);
+			memcpy(level[numlevels].data, tex->pic, level[numlevels].length);
+			numlevels++;
+			if (skip) {
+				numskipped++;
 			}
-
-			tdef->mipmap[tdefmip].sizx = tex->sizx;
-			tdef->mipmap[tdefmip].sizy = tex->sizy;
-			tdef->mipmap[tdefmip].length = comprsize;
-			tdef->mipmap[tdefmip].data = comprdata;
-			tdefmip++;
-
-			comprdata = 0;
 		}
 
+		if (skip) {
+			mipmap--;
+		} else if (tex->sizx <= 1 && tex->sizy <= 1) {
+			break;
+		}
 		ptm_mipscale(tex);
 		ptm_fixtransparency(tex, (flags & PTH_CLAMPED));
 	}
 
-	if (compress) {
-		comprsize = ptcompress_getstorage(tex->sizx, tex->sizy, compress);
-		comprdata = (unsigned char *) malloc(comprsize);
+	if (chain->compress) {
+		// every PTCOMPRESSBANDROWS rows of a level compress independently
+		// of the rest, which is how the work is shared out
+		for (i = 0; i < numlevels; i++) {
+			numbands += (level[i].sizy + PTCOMPRESSBANDROWS - 1) / PTCOMPRESSBANDROWS;
+		}
+		bands = (PTMComprBand *) malloc(numbands * sizeof(PTMComprBand));
+
+		numbands = 0;
+		for (i = 0; i < numlevels; i++) {
+			comprdata[i] = (unsigned char *) malloc(ptcompress_getstorage(level[i].sizx, level[i].sizy, chain->compress));
+			for (y = 0; y < level[i].sizy; y += PTCOMPRESSBANDROWS) {
+				bands[numbands].pic = &level[i].data[y * level[i].sizx * sizeof(coltype)];
+				bands[numbands].sizx = level[i].sizx;
+				bands[numbands].sizy = min(PTCOMPRESSBANDROWS, level[i].sizy - y);
+				bands[numbands].out = &comprdata[i][ptcompress_getstorage(level[i].sizx, y, chain->compress)];
+				bands[numbands].compress = chain->compress;
+				numbands++;
+			}
+		}
 
 		starttime = getticks();
-		ptcompress_compress(tex->pic, tex->sizx, tex->sizy, comprdata, compress);
-		if (polymosttexverbosity >= 2) {
-			buildprintf("PolymostTex: ptcompress_compress (%dx%d, %s) took %f sec\n",
-				   tex->sizx, tex->sizy, compressfourcc[compress],
-				   (float)(getticks() - starttime) / 1000.f);
+		if (usepool && numbands > 1 && (gltexthreads < 0 || gltexthreads > 1) &&
+				threadpool_init(gltexthreads) > 1) {
+			threadpool_run(ptm_compressband, bands, numbands);
+		} else {
+			for (i = 0; i < numbands; i++) {
+				ptm_compressband(bands, i);
+			}
 		}
+		chain->comprtime = getticks() - starttime;
 
-		if (tdef) {
-			tdef->mipmap[tdefmip].sizx = tex->sizx;
-			tdef->mipmap[tdefmip].sizy = tex->sizy;
-			tdef->mipmap[tdefmip].length = comprsize;
-			tdef->mipmap[tdefmip].data = comprdata;
-			tdefmip++;
-		}
+		free(bands);
 
-		glfunc.glCompressedTexImage2D(GL_TEXTURE_2D, 0,
-			intexfmt, tex->sizx, tex->sizy, 0,
-			comprsize, (const GLvoid *) comprdata);
+		for (i = 0; i < numlevels; i++) {
+			free(level[i].data);
+			level[i].data = comprdata[i];
+			level[i].length = ptcompress_getstorage(level[i].sizx, level[i].sizy, chain->compress);
+		}
 
 		if (tdef) {
-			// we need to retain each mipmap for the tdef struct, so
-			// force each mipmap to be allocated afresh in the loop below
-			comprdata = 0;
+			for (i = 0; i < numlevels; i++) {
+				tdef->mipmap[i] = level[i];
+			}
 		}
-	} else {
-		glfunc.glTexImage2D(GL_TEXTURE_2D, 0,
-			intexfmt, tex->sizx, tex->sizy, 0, tex->rawfmt,
-			GL_UNSIGNED_BYTE, (const GLvoid *) tex->pic);
 	}
 
-	for (mipmap = 1; tex->sizx > 1 || tex->sizy > 1; mipmap++) {
-		ptm_mipscale(tex);
-		ptm_fixtransparency(tex, (flags & PTH_CLAMPED));
+	for (i = numskipped; i < numlevels; i++) {
+		chain->mip[chain->nummips++] = level[i];
+	}
+}
 
-		if (compress) {
-			comprsize = ptcompress_getstorage(tex->sizx, tex->sizy, compress);
-			if (tdef) {
-				comprdata = (unsigned char *) malloc(comprsize);
-			}
+/**
+ * Sends baked mipmaps to GL
+ * @param ptm the texture management header
+ * @param chain the mipmaps, which are released afterwards
+ */
+static void ptm_sendmipmaps(PTMHead * ptm, PTMipChain * chain)
+{
+	PTCacheTileMip * level;
+	GLint mipmap;
 
-			starttime = getticks();
-			ptcompress_compress(tex->pic, tex->sizx, tex->sizy, comprdata, compress);
-			if (polymosttexverbosity >= 2) {
-				buildprintf("PolymostTex: ptcompress_compress (%dx%d, %s) took %f sec\n",
-					   tex->sizx, tex->sizy, compressfourcc[compress],
-					   (float)(getticks() - starttime) / 1000.f);
-			}
+	if (chain->compress && polymosttexverbosity >= 2) {
+		buildprintf("PolymostTex: ptcompress_compress (%dx%d, %s) took %f sec\n",
+			   chain->mip[0].sizx, chain->mip[0].sizy, compressfourcc[chain->compress],
+			   (float)chain->comprtime / 1000.f);
+	}
 
-			if (tdef) {
-				tdef->mipmap[tdefmip].sizx = tex->sizx;
-				tdef->mipmap[tdefmip].sizy = tex->sizy;
-				tdef->mipmap[tdefmip].length = comprsize;
-				tdef->mipmap[tdefmip].data = comprdata;
-				tdefmip++;
-			}
+	if (ptm->glpic == 0) {
+		glfunc.glGenTextures(1, &ptm->glpic);
+	}
+	glfunc.glBindTexture(GL_TEXTURE_2D, ptm->glpic);
 
+	for (mipmap = 0; mipmap < chain->nummips; mipmap++) {
+		level = &chain->mip[mipmap];
+		if (chain->compress) {
 			glfunc.glCompressedTexImage2D(GL_TEXTURE_2D, mipmap,
-						intexfmt, tex->sizx, tex->sizy, 0,
-						comprsize, (const GLvoid *) comprdata);
-
-			if (tdef) {
-				// we need to retain each mipmap for the tdef struct, so
-				// force each mipmap to be allocated afresh in this loop
-				comprdata = 0;
-			}
+						chain->intexfmt, level->sizx, level->sizy, 0,
+						level->length, (const GLvoid *) level->data);
 		} else {
 			glfunc.glTexImage2D(GL_TEXTURE_2D, mipmap,
-				intexfmt, tex->sizx, tex->sizy, 0, tex->rawfmt,
-				GL_UNSIGNED_BYTE, (const GLvoid *) tex->pic);
+				chain->intexfmt, level->sizx, level->sizy, 0, chain->rawfmt,
+				GL_UNSIGNED_BYTE, (const GLvoid *) level->data);
 		}
 	}
 
 	ptm->flags = 0;
-	ptm->flags |= (tex->hasalpha ? PTH_HASALPHA : 0);
+	ptm->flags |= (chain->hasalpha ? PTH_HASALPHA : 0);
 
-	if (comprdata) {
-		free(comprdata);
+	ptm_freemipmaps(chain);
+}
+
+/**
+ * Releases the mipmaps of a chain, unless a PTCacheTile holds them
+ * @param chain the mipmaps
+ */
+static void ptm_freemipmaps(PTMipChain * chain)
+{
+	int i;
+
+	if (chain->ownsdata) {
+		for (i = 0; i < chain->nummips; i++) {
+			free(chain->mip[i].data);
+		}
 	}
+	chain->nummips = 0;
+}
+
+/**
+ * Sends texture data to GL
+ * @param ptm the texture management header
+ * @param flags extra flags to modify how the texture is uploaded
+ * @param tex the texture to upload
+ * @param tdef the polymosttexcache definition to receive compressed mipmaps, or null
+ */
+static void ptm_uploadtexture(PTMHead * ptm, unsigned short flags, PTTexture * tex, PTCacheTile * tdef)
+{
+	PTMipChain chain;
+
+	detect_texture_size();
+
+	ptm_bakemipmaps(&chain, flags, tex, tdef, 1);
+	ptm_sendmipmaps(ptm, &chain);
 }
 
 
@@ -1327,6 +1639,86 @@ void PTMarkPrime(int picnum, int palnum, unsigned short flags)
 	}
 }
 
+/**
+ * Queues the files of a Hightile replacement to be decoded ahead of priming
+ * @param pth the header
+ */
+static void pt_queueprimeloads(PTHead * pth)
+{
+	const char *filename;
+	int effects, texture;
+	PTMIdent id;
+	PTMHead * ptmh;
+
+	if (pth->pic[PTHPIC_BASE] &&
+		pth->pic[PTHPIC_BASE]->glpic != 0 &&
+		(pth->pic[PTHPIC_BASE]->flags & PTH_DIRTY) == 0) {
+		return;	// loaded
+	}
+
+	effects = pt_prepare_hightile(pth);
+	if (effects < 0) {
+		return;
+	}
+
+	for (texture = 0; texture < PTHPIC_SIZE && numprimeloads < PRIMELOADSMAX; texture++) {
+		filename = pt_hightile_filename(pth, texture);
+		if (!filename) {
+			continue;
+		}
+
+		PTM_InitIdent(&id, pth);
+		id.layer = texture;
+		ptmh = PTM_GetHead(&id);
+
+		if (ptm_initload(&primeloads[numprimeloads], filename, ptmh, pth->flags, effects)) {
+			continue;	// in the texture cache, which loads quickly enough
+		}
+		numprimeloads++;
+	}
+}
+
+/**
+ * Decodes on the thread pool the Hightile files that priming will want
+ * from the hash chains starting at primepos
+ * @return the hash chain position to prime up to
+ */
+static int pt_decodeprimeloads(void)
+{
+	PTHash * pth;
+	int pos, numthreads, numprimed = 0;
+
+	numthreads = threadpool_init(gltexthreads);
+	if (numthreads < 2) {
+		return primepos + 1;
+	}
+
+	detect_texture_size();
+
+	// stop after a handful of files per worker, or once enough textures
+	// are in hand that the caller's progress display keeps moving
+	for (pos = primepos; pos < PTHASHHEADSIZ; pos++) {
+		if (numprimeloads >= min(numthreads * 2, PRIMELOADSMAX) || numprimed >= PRIMELOADSMAX) {
+			break;
+		}
+		for (pth = pthashhead[pos]; pth; pth = pth->next) {
+			if (pth->primecnt == 0) {
+				continue;
+			}
+			numprimed++;
+			if (pth->head.flags & PTH_HIGHTILE) {
+				pt_queueprimeloads(&pth->head);
+			}
+		}
+	}
+
+	if (numprimeloads > 0) {
+		threadpool_run(ptm_decodeprimeload, primeloads, numprimeloads);
+	}
+
+	return pos;
+}
+
 /**
  * Runs a cycle of the priming process. Call until nonzero is returned.
  * @param done receives the number of textures primed so far
@@ -1336,6 +1728,7 @@ void PTMarkPrime(int picnum, int palnum, unsigned short flags)
 int PTDoPrime(int* done, int* total)
 {
 	PTHash * pth;
+	int endpos, i;
 
 	if (primepos >= PTHASHHEADSIZ) {
 		// done
@@ -1357,22 +1750,159 @@ int PTDoPrime(int* done, int* total)
 		}
 	}
 
-	pth = pthashhead[primepos];
-	while (pth) {
-		if (pth->primecnt > 0) {
-			primedone++;
-			pt_load(pth);
+	endpos = primepos + 1;
+	if ((gltexthreads < 0 || gltexthreads > 1) && kpthreadsafe()) {
+		endpos = pt_decodeprimeloads();
+	}
+
+	for (; primepos < endpos; primepos++) {
+		pth = pthashhead[primepos];
+		while (pth) {
+			if (pth->primecnt > 0) {
+				primedone++;
+				pt_load(pth);
+			}
+			pth = pth->next;
 		}
-		pth = pth->next;
 	}
 
+	// anything decoded but not wanted after all
+	for (i = 0; i < numprimeloads; i++) {
+		ptm_freeload(&primeloads[i]);
+	}
+	numprimeloads = 0;
+
 	*done = primedone;
 	*total = primecnt;
-	primepos++;
 
 	return (primepos < PTHASHHEADSIZ);
 }
 
+/**
+ * Queues a file to be compressed into the texture cache, unless it is
+ * there already or queued
+ * @param filename the texture filename
+ * @param flags PTH_CLAMPED and PTH_SKYBOX
+ */
+static void pt_queuefillload(const char * filename, int flags)
+{
+	int i;
+
+	for (i = 0; i < numprimeloads; i++) {
+		if (primeloads[i].flags == flags && !strcmp(primeloads[i].filename, filename)) {
+			return;
+		}
+	}
+	if (!ptm_initload(&primeloads[numprimeloads], filename, 0, flags, 0)) {
+		numprimeloads++;
+	}
+}
+
+/**
+ * Compresses the queued files and writes them to the texture cache
+ * @param numthreads the number of workers to decode with
+ * @return the number of textures written
+ */
+static int pt_fillcachebatch(int numthreads)
+{
+	PTMLoad * ld;
+	int i, numwritten = 0;
+
+	if (numthreads > 1) {
+		threadpool_run(ptm_decodeprimeload, primeloads, numprimeloads);
+	} else {
+		for (i = 0; i < numprimeloads; i++) {
+			ptm_decodeload(&primeloads[i], 0);
+		}
+	}
+
+	for (i = 0; i < numprimeloads; i++) {
+		ld = &primeloads[i];
+		if (ld->err) {
+			if (polymosttexverbosity >= 1) {
+				buildprintf("PolymostTex: %s %s\n", ld->filename,
+						   PTM_GetLoadTextureFileErrorString(ld->err));
+			}
+		} else if (ld->tdef && ld->chain.compress) {
+			PTCacheWriteTile(ld->tdef);
+			numwritten++;
+		}
+		ptm_freeload(ld);
+	}
+	numprimeloads = 0;
+
+	return numwritten;
+}
+
+/**
+ * Compresses every Hightile replacement defined into the texture cache,
+ * without needing GL. Which of clamped or repeating a game will want is
+ * only known when drawing, so both are made. Palette-tinted versions are
+ * left to be made when first used.
+ * @return the number of textures added to the cache
+ */
+int PTFillCache(void)
+{
+	baselayer_glinfo glinfobak = glinfo;
+	int gltexmaxsizebak = gltexmaxsize;
+	int picnum, face, clamped, numthreads = 0, numadded = 0;
+	int starttime = getticks();
+	hicreplctyp * hr;
+
+	if (!glusetexcache || !glusetexcompr) {
+		buildprintf("PolymostTex: texture caching and compression must be enabled to fill the cache\n");
+		return 0;
+	}
+
+	if (!glinfo.loaded) {
+		// with no GL to ask, assume what this build usually gets
+#if USE_OPENGL == USE_GLES2
+		glinfo.texcompretc1 = 1;
+#else
+		glinfo.texcomprdxt1 = glinfo.texcomprdxt5 = 1;
+		glinfo.bgra = 1;
+#endif
+	}
+	detect_texture_size();
+
+	if ((gltexthreads < 0 || gltexthreads > 1) && kpthreadsafe()) {
+		numthreads = threadpool_init(gltexthreads);
+	}
+
+	numprimeloads = 0;
+	for (picnum = 0; picnum < MAXTILES; picnum++) {
+		for (hr = hicreplc[picnum]; hr; hr = hr->next) {
+			if (hr->ignore || (hr->flags & HIC_NOCOMPRESS)) {
+				continue;
+			}
+			for (clamped = 0; clamped <= PTH_CLAMPED; clamped += PTH_CLAMPED) {
+				if (numprimeloads > PRIMELOADSMAX - 7) {
+					numadded += pt_fillcachebatch(numthreads);
+				}
+				if (hr->filename) {
+					pt_queuefillload(hr->filename, clamped);
+				}
+				if (hr->skybox && !hr->skybox->ignore) {
+					for (face = 0; face < 6; face++) {
+						if (hr->skybox->face[face]) {
+							pt_queuefillload(hr->skybox->face[face], PTH_SKYBOX | clamped);
+						}
+					}
+				}
+			}
+		}
+	}
+	numadded += pt_fillcachebatch(numthreads);
+
+	glinfo = glinfobak;
+	gltexmaxsize = gltexmaxsizebak;
+
+	buildprintf("PolymostTex: added %d textures to the cache in %.1f sec\n",
+			   numadded, (float)(getticks() - starttime) / 1000.f);
+
+	return numadded;
+}
+
 /**
  * Resets the texture hash but leaves the headers in memory
  */
@@ -15,6 +15,7 @@ enum {
 	PTH_HASALPHA = 8,		// NOTE: only seen in PTMHead.flags, not in PTHead.flags
 	PTH_NOCOMPRESS = 16,	// prevents texture compression from being used
 	PTH_NOMIPLEVEL = 32,	// prevents gltexmiplevel from being applied
+	PTH_INDEXED = 64,		// NOTE: only seen in PTMHead.flags, the texture holds palette indices
 	PTH_DIRTY = 128,		// NOTE: only seen in PTMHead.flags, not in PTHead.flags
 };
 
@@ -101,6 +102,13 @@ void PTMarkPrime(int picnum, int palnum, unsigned short flags);
  */
 int PTDoPrime(int* done, int* total);
 
+/**
+ * Compresses every Hightile replacement defined into the texture cache,
+ * without needing GL
+ * @return the number of textures added to the cache
+ */
+int PTFillCache(void);
+
 /**
  * Resets the texture hash but leaves the headers in memory
  */
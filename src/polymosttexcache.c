@@ -5,26 +5,22 @@
 #include "polymosttexcache.h"
 #include "baselayer.h"
 #include "glbuild.h"
+#include "cache1d.h"
 #include "hightile_priv.h"
 #include "polymosttex_priv.h"
 
 /*
- PolymostTex Cache file formats
-
- INDEX (texture.cacheindex):
-   signature  "PolymostTexIndx"
-   version    CACHEVER
-   ENTRIES...
-     filename  char[BMAX_PATH]
-     effects   int32
-     flags     int32		PTH_CLAMPED
-     offset    int32		Offset from the start of the STORAGE file
-     mtime     int32		When kplib can return mtimes from ZIPs, this will be used to spot stale entries
-
- STORAGE (texture.cache):
-   signature  "PolymostTexStor"
-   version    CACHEVER
-   ENTRIES...
+ PolymostTex Cache file format
+
+ texture.cache:
+   HEADER
+     signature  "PolymostTexCach"
+     version    CACHEVER
+     dirofs     int32		Offset of the DIRECTORY from the start of the file, or 0 if none
+     dirnum     int32		The number of RECORDS
+     dirlength  int32		The length of the DIRECTORY, NAMES included
+     generation int32		Counts the sessions that have written to the file
+   TILES...
      tsizx     int32		Unpadded dimensions
      tsizy     int32
      flags     int32		PTH_CLAMPED | PTH_HASALPHA
@@ -35,317 +31,893 @@
        sizy    int32
        length  int32
        data    char[length]
+   DIRECTORY
+     RECORDS...		Sorted by hash, then effects, then flags
+       hash      int32		djb2 hash of the filename
+       effects   int32
+       flags     int32		PTH_CLAMPED
+       offset    int32		Offset of the TILE from the start of the file
+       length    int32		The length of the TILE
+       name      int32		Offset of the filename from the start of NAMES
+       srcsize   int32		The length of the source file when the tile was made
+       srcmtime  int32		Its modification time, or 0 if it came from a group or ZIP
+       lastuse   int32		The generation that last loaded or wrote the tile
+     NAMES...
+       filename  char[]		Nul terminated
 
  All multibyte values are little-endian.
+
+ The file is mapped into memory when loaded and tiles are handed out straight
+ from the mapping. Tiles made while running are appended, and a fresh
+ DIRECTORY follows them when the cache is unloaded. The HEADER is updated
+ last, so until then the old DIRECTORY stays in charge. Once a quarter of the
+ file is superseded tiles and old directories, the live tiles are copied to
+ a new file instead.
+
+ If gltexcachesize sets a budget, the tiles least recently used are dropped
+ until the rest fit, and the file is compacted whenever it outgrows it.
  */
 
-struct PTCacheIndex_typ {
-	char * filename;
+struct PTCacheEntry_typ {
+	unsigned int hash;
 	int effects;
 	int flags;
-	off_t offset;
-	struct PTCacheIndex_typ * next;
+	int offset;
+	int length;
+	int srcsize;
+	int srcmtime;
+	int lastuse;
+	const char * filename;
+};
+typedef struct PTCacheEntry_typ PTCacheEntry;
+
+#define PTCACHEHEADERSIZ 32
+#define PTCACHERECORDSIZ 36
+
+enum {
+	DIRSTATE_UNCHECKED = 0,
+	DIRSTATE_CURRENT,
+	DIRSTATE_STALE,		// the source changed, or a newer tile replaced it
 };
-typedef struct PTCacheIndex_typ PTCacheIndex;
-#define PTCACHEHASHSIZ 512
-static PTCacheIndex * cachehead[PTCACHEHASHSIZ];	// will be initialized 0 by .bss segment
+#define DIRSTATE_USED 0x80	// or'd in once the tile is loaded
 
-static const char * CACHEINDEXFILE = "texture.cacheindex";
 static const char * CACHESTORAGEFILE = "texture.cache";
-static const int CACHEVER = 0;
+static const char * CACHECOMPACTFILE = "texture.cache.tmp";
+static const char * OLDCACHEINDEXFILE = "texture.cacheindex";	// left behind by the first version
+static const int CACHEVER = 3;
 
 static int cachedisabled = 0, cachereplace = 0;
-
-static unsigned int gethashhead(const char * filename)
+static int cachefullwarned = 0;
+
+// the file as it was when loaded, which is its directory and the tiles before it
+static unsigned char * cachemap = 0;
+static int cachemaplen = 0;
+static int cachemapped = 0;		// 0 if cachemap is a copy on the heap
+static const unsigned char * cachedir = 0;
+static int cachedirnum = 0;
+static const char * cachenames = 0;
+static int cachenameslen = 0;
+static unsigned char * cachedirstate = 0;	// DIRSTATE_* for each record
+static int cachedirofs = 0;
+static int cachegeneration = 0;		// this session's generation
+static int cacheused = 0;		// !0 if any record has DIRSTATE_USED
+
+// tiles written since loading, sorted like the directory
+static PTCacheEntry * cacheadded = 0;
+static int cacheaddednum = 0, cacheaddedmax = 0;
+
+static int cachedirty = 0;	// !0 if the directory needs writing out
+
+static unsigned int gethash(const char * filename)
 {
-	// implements the djb2 hash, constrained to the hash table size
+	// implements the djb2 hash
 	// http://www.cse.yorku.ca/~oz/hash.html
-	unsigned long hash = 5381;
+	unsigned int hash = 5381;
 	int c;
 
-    while ((c = (unsigned char)*filename++)) {
+	while ((c = (unsigned char)*filename++)) {
 		hash = ((hash << 5) + hash) ^ c; /* hash * 33 ^ c */
 	}
 
-    return hash & (PTCACHEHASHSIZ-1);
+	return hash;
+}
+
+static int getle32(const unsigned char * p)
+{
+	return (int) ((unsigned int) p[0] | ((unsigned int) p[1] << 8) |
+		((unsigned int) p[2] << 16) | ((unsigned int) p[3] << 24));
+}
+
+static void putle32(unsigned char * p, int v)
+{
+	p[0] = (unsigned char) v;
+	p[1] = (unsigned char) (v >> 8);
+	p[2] = (unsigned char) (v >> 16);
+	p[3] = (unsigned char) (v >> 24);
 }
 
 /**
- * Adds an item to the cachehead hash.
- * @param filename
- * @param effects
- * @param flags
- * @param offset
+ * Compares a key against an entry in directory order
+ * @return <0, 0, or >0 as the key sorts before, with, or after the entry
  */
-static void ptcache_addhash(const char * filename, int effects, int flags, off_t offset)
+static int ptcache_cmpkey(unsigned int hash, int effects, int flags, const PTCacheEntry * ent)
 {
-	unsigned int hash = gethashhead(filename);
+	if (hash != ent->hash) {
+		return hash < ent->hash ? -1 : 1;
+	}
+	if (effects != ent->effects) {
+		return effects < ent->effects ? -1 : 1;
+	}
+	if (flags != ent->flags) {
+		return flags < ent->flags ? -1 : 1;
+	}
+	return 0;
+}
 
-	// to reduce memory fragmentation we tack the filename onto the end of the block
-	PTCacheIndex * pci = (PTCacheIndex *) malloc(sizeof(PTCacheIndex) + strlen(filename) + 1);
+static int ptcache_cmpentries(const void * a, const void * b)
+{
+	const PTCacheEntry * ea = (const PTCacheEntry *) a;
+	const PTCacheEntry * eb = (const PTCacheEntry *) b;
+	int c;
 
-	pci->filename = (char *) pci + sizeof(PTCacheIndex);
-	strcpy(pci->filename, filename);
-	pci->effects = effects;
-	pci->flags   = flags & (PTH_CLAMPED);
-	pci->offset  = offset;
-	pci->next = cachehead[hash];
+	c = ptcache_cmpkey(ea->hash, ea->effects, ea->flags, eb);
+	if (c) {
+		return c;
+	}
+	return strcmp(ea->filename, eb->filename);
+}
 
-	cachehead[hash] = pci;
+/**
+ * Decodes a record of the mapped directory
+ * @param i the record number
+ * @param ent receives the record
+ */
+static void ptcache_getrecord(int i, PTCacheEntry * ent)
+{
+	const unsigned char * rec = cachedir + i * PTCACHERECORDSIZ;
+	int name;
+
+	ent->hash     = (unsigned int) getle32(rec);
+	ent->effects  = getle32(rec + 4);
+	ent->flags    = getle32(rec + 8);
+	ent->offset   = getle32(rec + 12);
+	ent->length   = getle32(rec + 16);
+	name          = getle32(rec + 20);
+	ent->srcsize  = getle32(rec + 24);
+	ent->srcmtime = getle32(rec + 28);
+	ent->lastuse  = getle32(rec + 32);
+
+	// the names end in a nul, so any offset inside them gives a string
+	ent->filename = (name >= 0 && name < cachenameslen) ? cachenames + name : "";
 }
 
 /**
- * Locates an item in the cachehead hash.
- * @param filename
- * @param effects
- * @param flags
- * @return the PTCacheIndex item, or null
+ * Locates a record in the mapped directory
+ * @return the record number, or -1
  */
-static PTCacheIndex * ptcache_findhash(const char * filename, int effects, int flags)
+static int ptcache_findmapped(const char * filename, unsigned int hash, int effects, int flags)
 {
-	PTCacheIndex * pci;
+	PTCacheEntry ent;
+	int lo = 0, hi = cachedirnum, mid;
+
+	// find the first record not before the key, then check those sharing it
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		ptcache_getrecord(mid, &ent);
+		if (ptcache_cmpkey(hash, effects, flags, &ent) > 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
 
-	pci = cachehead[ gethashhead(filename) ];
-	if (!pci) {
-		return 0;
+	for (; lo < cachedirnum; lo++) {
+		ptcache_getrecord(lo, &ent);
+		if (ptcache_cmpkey(hash, effects, flags, &ent)) {
+			break;
+		}
+		if (strcmp(ent.filename, filename) == 0) {
+			return lo;
+		}
 	}
 
-	flags &= PTH_CLAMPED;
+	return -1;
+}
+
+/**
+ * Locates an entry among those written since loading
+ * @param insertat receives where the entry would go if it isn't there
+ * @return the entry number, or -1
+ */
+static int ptcache_findadded(const char * filename, unsigned int hash, int effects, int flags, int * insertat)
+{
+	int lo = 0, hi = cacheaddednum, mid;
 
-	while (pci) {
-		if (effects == pci->effects &&
-		    flags == pci->flags &&
-		    strcmp(pci->filename, filename) == 0) {
-			return pci;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		if (ptcache_cmpkey(hash, effects, flags, &cacheadded[mid]) > 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
-		pci = pci->next;
 	}
 
+	*insertat = lo;
+	for (; lo < cacheaddednum; lo++) {
+		if (ptcache_cmpkey(hash, effects, flags, &cacheadded[lo])) {
+			break;
+		}
+		if (strcmp(cacheadded[lo].filename, filename) == 0) {
+			return lo;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Finds the length and modification time of a texture's source file.
+ * Files inside groups and ZIPs have no time of their own, so get 0.
+ * @return 0 on success, -1 if the file can't be found
+ */
+static int ptcache_sourcestat(const char * filename, int * size, int * mtime)
+{
+	struct stat st;
+	char * where = 0;
+	int fil, err;
+
+	if (findfrompath(filename, &where) == 0) {
+		err = Bstat(where, &st);
+		free(where);
+		if (!err && (st.st_mode & BS_IFREG)) {
+			*size = (int) st.st_size;
+			*mtime = (int) st.st_mtime;
+			return 0;
+		}
+	}
+
+	fil = kopen4load(filename, 0);
+	if (fil < 0) {
+		return -1;
+	}
+	*size = kfilelength(fil);
+	*mtime = 0;
+	kclose(fil);
+
 	return 0;
 }
 
 /**
- * Loads the cache index file into memory
+ * Checks that a mapped record's source file hasn't changed since the tile
+ * was made. Each record is only checked the once.
+ * @return !0 if the tile is current
  */
-void PTCacheLoadIndex(void)
+static int ptcache_checkcurrent(int i, const PTCacheEntry * ent)
 {
-	FILE * fh = 0;
-	int8_t sig[16];
-	const int8_t indexsig[16] = { 'P','o','l','y','m','o','s','t','T','e','x','I','n','d','x',CACHEVER };
-	const int8_t storagesig[16] = { 'P','o','l','y','m','o','s','t','T','e','x','S','t','o','r',CACHEVER };
+	int size, mtime;
 
-	int8_t filename[BMAX_PATH+1];
-	int32_t effects;
-	int32_t flags;
-	int32_t offset;
-	int32_t mtime;
-	PTCacheIndex * pci;
+	if ((cachedirstate[i] & ~DIRSTATE_USED) == DIRSTATE_UNCHECKED) {
+		if (ptcache_sourcestat(ent->filename, &size, &mtime) == 0 &&
+		    size == ent->srcsize && mtime == ent->srcmtime) {
+			cachedirstate[i] = DIRSTATE_CURRENT;
+		} else {
+			cachedirstate[i] = DIRSTATE_STALE;
+			cachedirty = 1;
+		}
+	}
 
-	int total = 0, dups = 0;
-	int haveindex = 0, havestore = 0;
+	return (cachedirstate[i] & ~DIRSTATE_USED) == DIRSTATE_CURRENT;
+}
 
-	memset(filename, 0, sizeof(filename));
+/**
+ * Finds the current entry for a tile
+ * @param ent receives the entry
+ * @param ismapped receives the record number if the tile lies within the mapping, or -1
+ * @return !0 if found
+ */
+static int ptcache_find(const char * filename, int effects, int flags, PTCacheEntry * ent, int * ismapped)
+{
+	unsigned int hash = gethash(filename);
+	int i, insertat;
 
-	// first, check the cache storage file's signature.
-	// we open for reading and writing to test permission
-	fh = fopen(CACHESTORAGEFILE, "r+b");
-	if (fh) {
-		havestore = 1;
+	flags &= PTH_CLAMPED;
 
-		if (fread(sig, 16, 1, fh) != 1 || memcmp(sig, storagesig, 16)) {
-			cachereplace = 1;
-		}
-		fclose(fh);
-	} else {
-		if (errno == ENOENT) {
-			// file doesn't exist, which is fine
-			;
-		} else {
-			buildprintf("PolymostTexCache: error opening %s, texture cache disabled\n", CACHESTORAGEFILE);
-			cachedisabled = 1;
-			return;
+	i = ptcache_findadded(filename, hash, effects, flags, &insertat);
+	if (i >= 0) {
+		*ent = cacheadded[i];
+		*ismapped = -1;
+		return 1;
+	}
+
+	i = ptcache_findmapped(filename, hash, effects, flags);
+	if (i >= 0) {
+		ptcache_getrecord(i, ent);
+		if (ptcache_checkcurrent(i, ent)) {
+			*ismapped = i;
+			return 1;
 		}
 	}
 
-	// next, check the index
-	fh = fopen(CACHEINDEXFILE, "r+b");
-	if (fh) {
-		haveindex = 1;
+	return 0;
+}
 
-		if (fread(sig, 16, 1, fh) != 1 || memcmp(sig, indexsig, 16)) {
-			cachereplace = 1;
+/**
+ * Releases the mapping and the directory within
+ */
+static void ptcache_unmap(void)
+{
+	if (cachemapped) {
+		Bunmapfile(cachemap, cachemaplen, 0);
+	} else if (cachemap) {
+		free(cachemap);
+	}
+	cachemap = 0;
+	cachemaplen = 0;
+	cachemapped = 0;
+
+	cachedir = 0;
+	cachedirofs = 0;
+	cachedirnum = 0;
+	cachenames = 0;
+	cachenameslen = 0;
+	cacheused = 0;
+
+	if (cachedirstate) {
+		free(cachedirstate);
+	}
+	cachedirstate = 0;
+}
+
+/**
+ * Forgets everything loaded or written, without touching the file
+ */
+static void ptcache_discard(void)
+{
+	int i;
+
+	ptcache_unmap();
+
+	for (i = 0; i < cacheaddednum; i++) {
+		free((char *) cacheadded[i].filename);
+	}
+	if (cacheadded) {
+		free(cacheadded);
+	}
+	cacheadded = 0;
+	cacheaddednum = cacheaddedmax = 0;
+
+	cachedirty = 0;
+}
+
+static int ptcache_writeheader(FILE * fh, int dirofs, int dirnum, int dirlength, int generation)
+{
+	unsigned char header[PTCACHEHEADERSIZ];
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, "PolymostTexCach", 15);
+	header[15] = (unsigned char) CACHEVER;
+	putle32(&header[16], dirofs);
+	putle32(&header[20], dirnum);
+	putle32(&header[24], dirlength);
+	putle32(&header[28], generation);
+
+	return fwrite(header, sizeof(header), 1, fh) != 1;
+}
+
+/**
+ * Writes a directory at the end of a cache file, then points the header at it
+ * @param ents the entries, in directory order
+ * @return 0 on success
+ */
+static int ptcache_writedir(FILE * fh, const PTCacheEntry * ents, int num)
+{
+	unsigned char rec[PTCACHERECORDSIZ];
+	long dirofs, dirlen;
+	int i, name = 0, len;
+
+	fseek(fh, 0, SEEK_END);
+	dirofs = ftell(fh);
+
+	// the header holds the directory's offset and length in 32 bits
+	for (i = 0, dirlen = 0; i < num; i++) {
+		dirlen += PTCACHERECORDSIZ + strlen(ents[i].filename) + 1;
+	}
+	if (dirofs < 0 || dirlen > INT_MAX - dirofs) {
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		putle32(&rec[0],  (int) ents[i].hash);
+		putle32(&rec[4],  ents[i].effects);
+		putle32(&rec[8],  ents[i].flags);
+		putle32(&rec[12], ents[i].offset);
+		putle32(&rec[16], ents[i].length);
+		putle32(&rec[20], name);
+		putle32(&rec[24], ents[i].srcsize);
+		putle32(&rec[28], ents[i].srcmtime);
+		putle32(&rec[32], ents[i].lastuse);
+		if (fwrite(rec, sizeof(rec), 1, fh) != 1) {
+			return -1;
 		}
-	} else {
-		if (errno == ENOENT) {
-			// file doesn't exist, which is fine
-			return;
-		} else {
-			buildprintf("PolymostTexCache: error opening %s, texture cache disabled\n", CACHEINDEXFILE);
-			cachedisabled = 1;
-			return;
+		name += strlen(ents[i].filename) + 1;
+	}
+	for (i = 0; i < num; i++) {
+		len = strlen(ents[i].filename) + 1;
+		if (fwrite(ents[i].filename, len, 1, fh) != 1) {
+			return -1;
 		}
 	}
 
-	// if we're missing either the index or the store, but not both at the same
-	// time, the cache is broken and should be replaced
-	if ((!haveindex || !havestore) && !(!haveindex && !havestore)) {
-		cachereplace = 1;
+	if (fseek(fh, 0, SEEK_SET) ||
+	    ptcache_writeheader(fh, (int) dirofs, num, num * PTCACHERECORDSIZ + name, cachegeneration)) {
+		return -1;
 	}
 
-	if (cachereplace) {
-		buildprintf("PolymostTexCache: texture cache will be replaced\n");
-		if (fh) {
-			fclose(fh);
-		}
-		return;
+	return 0;
+}
+
+/**
+ * Copies the live tiles into a new file, which then replaces the cache.
+ * The mapping is released along the way.
+ * @param ents the live entries, in directory order
+ * @return 0 on success
+ */
+static int ptcache_compact(const PTCacheEntry * ents, int num)
+{
+	PTCacheEntry * moved;
+	FILE * in, * out;
+	unsigned char * buf = 0;
+	int i, buflen = 0;
+	long offset = PTCACHEHEADERSIZ;
+
+	moved = (PTCacheEntry *) malloc((num + 1) * sizeof(PTCacheEntry));
+	in = fopen(CACHESTORAGEFILE, "rb");
+	out = fopen(CACHECOMPACTFILE, "wb");
+	if (!moved || !in || !out || ptcache_writeheader(out, 0, 0, 0, cachegeneration)) {
+		goto fail;
 	}
 
-	// now that the index is sitting at the first entry, load everything
-	while (!feof(fh)) {
-		if (fread(filename, BMAX_PATH, 1, fh) != 1 && feof(fh)) {
-			break;
+	for (i = 0; i < num; i++) {
+		moved[i] = ents[i];
+		if (ents[i].length > buflen) {
+			unsigned char * newbuf = (unsigned char *) realloc(buf, ents[i].length);
+			if (!newbuf) {
+				goto fail;
+			}
+			buf = newbuf;
+			buflen = ents[i].length;
 		}
-		if (fread(&effects, 4,         1, fh) != 1 ||
-		    fread(&flags,   4,         1, fh) != 1 ||
-		    fread(&offset,  4,         1, fh) != 1 ||
-		    fread(&mtime,   4,         1, fh) != 1) {
-			// truncated entry, so throw the whole cache away
-			buildprintf("PolymostTexCache: corrupt texture cache index detected, cache will be replaced\n");
-			cachereplace = 1;
-			PTCacheUnloadIndex();
-			break;
+		if (fseek(in, ents[i].offset, SEEK_SET) ||
+		    fread(buf, ents[i].length, 1, in) != 1 ||
+		    fwrite(buf, ents[i].length, 1, out) != 1) {
+			goto fail;
 		}
+		moved[i].offset = (int) offset;
+		offset += ents[i].length;
+	}
 
-		effects = B_LITTLE32(effects);
-		flags   = B_LITTLE32(flags);
-		offset  = B_LITTLE32(offset);
-		mtime   = B_LITTLE32(mtime);
+	if (ptcache_writedir(out, moved, num)) {
+		goto fail;
+	}
 
-		pci = ptcache_findhash((char *) filename, (int) effects, (int) flags);
-		if (pci) {
-			// superseding an old hash entry
-			pci->offset = (off_t) offset;
-			dups++;
-		} else {
-			ptcache_addhash((char *) filename, (int) effects, (int) flags, (off_t) offset);
+	fclose(in);
+	in = 0;
+	if (fclose(out)) {
+		out = 0;
+		goto fail;
+	}
+	out = 0;
+	free(moved);
+	free(buf);
+
+	// the file can't be replaced while it's still mapped on some systems
+	ptcache_unmap();
+	if (rename(CACHECOMPACTFILE, CACHESTORAGEFILE)) {
+		remove(CACHESTORAGEFILE);
+		if (rename(CACHECOMPACTFILE, CACHESTORAGEFILE)) {
+			buildprintf("PolymostTexCache: error replacing %s, texture cache lost\n", CACHESTORAGEFILE);
+			return 0;
 		}
-		total++;
 	}
 
-	fclose(fh);
+	return 0;
+fail:
+	if (in) fclose(in);
+	if (out) fclose(out);
+	remove(CACHECOMPACTFILE);
+	if (moved) free(moved);
+	if (buf) free(buf);
+	return -1;
+}
+
+/**
+ * Orders entries for eviction, least recently used first, then largest first
+ */
+static int ptcache_cmpeviction(const void * a, const void * b)
+{
+	const PTCacheEntry * ea = *(const PTCacheEntry **) a;
+	const PTCacheEntry * eb = *(const PTCacheEntry **) b;
 
-	buildprintf("PolymostTexCache: cache index loaded (%d entries, %d old entries skipped)\n", total, dups);
+	if (ea->lastuse != eb->lastuse) {
+		return ea->lastuse < eb->lastuse ? -1 : 1;
+	}
+	if (ea->length != eb->length) {
+		return ea->length > eb->length ? -1 : 1;
+	}
+	return 0;
 }
 
 /**
- * Unloads the cache index from memory
+ * Drops the least recently used entries until the file they'd make fits
+ * the budget
+ * @param ents the entries, which keep their order
+ * @param live the length of all their tiles, updated to suit
+ * @return the number of entries kept
  */
-void PTCacheUnloadIndex(void)
+static int ptcache_evict(PTCacheEntry * ents, int num, long * live, long budget)
 {
-	PTCacheIndex * pci, * next;
-	int i;
+	PTCacheEntry ** order;
+	long size = PTCACHEHEADERSIZ + *live;
+	int i, kept, evicted = 0;
+
+	for (i = 0; i < num; i++) {
+		size += PTCACHERECORDSIZ + strlen(ents[i].filename) + 1;
+	}
+	if (size <= budget) {
+		return num;
+	}
 
-	for (i = 0; i < PTCACHEHASHSIZ; i++) {
-		pci = cachehead[i];
-		while (pci) {
-			next = pci->next;
-			// we needn't free pci->filename since it was alloced with pci
-			free(pci);
-			pci = next;
+	order = (PTCacheEntry **) malloc((num + 1) * sizeof(PTCacheEntry *));
+	if (!order) {
+		return num;
+	}
+	for (i = 0; i < num; i++) {
+		order[i] = &ents[i];
+	}
+	qsort(order, num, sizeof(PTCacheEntry *), ptcache_cmpeviction);
+
+	for (i = 0; i < num && size > budget; i++) {
+		size -= order[i]->length + PTCACHERECORDSIZ + strlen(order[i]->filename) + 1;
+		*live -= order[i]->length;
+		order[i]->length = -1;	// no tile is that short, so it marks the evicted
+		evicted++;
+	}
+	free(order);
+
+	for (i = kept = 0; i < num; i++) {
+		if (ents[i].length >= 0) {
+			ents[kept++] = ents[i];
 		}
-		cachehead[i] = 0;
 	}
 
-	buildprintf("PolymostTexCache: cache index unloaded\n");
+	buildprintf("PolymostTexCache: dropped %d textures to fit within %d MB\n", evicted, gltexcachesize);
+	return kept;
 }
 
 /**
- * Does the task of loading a tile from the cache
- * @param offset the starting offset
- * @return a PTCacheTile entry fully completed
+ * Marks the records of tiles loaded this session with its generation,
+ * in place in the current directory
+ * @return 0 on success
  */
-static PTCacheTile * ptcache_load(off_t offset)
+static int ptcache_writeuse(FILE * fh)
 {
-	int32_t tsizx, tsizy;
-	int32_t sizx, sizy;
-	int32_t flags;
-	int32_t format;
-	int32_t nmipmaps, i;
-	int32_t length;
+	unsigned char gen[4];
+	int i;
 
-	PTCacheTile * tdef = 0;
+	putle32(gen, cachegeneration);
+	for (i = 0; i < cachedirnum; i++) {
+		if (!(cachedirstate[i] & DIRSTATE_USED)) {
+			continue;
+		}
+		if (fseek(fh, cachedirofs + i * PTCACHERECORDSIZ + 32, SEEK_SET) ||
+		    fwrite(gen, 4, 1, fh) != 1) {
+			return -1;
+		}
+	}
+
+	if (fseek(fh, 28, SEEK_SET) || fwrite(gen, 4, 1, fh) != 1) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Brings the file up to date. A directory of every live tile is written,
+ * dropping tiles to fit the budget, and the file is compacted if it has
+ * gathered too much dead weight or outgrown the budget. The mapping is
+ * released if it is.
+ * @param compact !0 to compact the file regardless
+ */
+static void ptcache_flush(int compact)
+{
+	PTCacheEntry * ents;
 	FILE * fh;
+	int i, num = 0;
+	long filelen, live = 0, budget;
 
-	if (cachereplace) {
-		// cache is in a broken state, so don't try loading
-		return 0;
+	if (cachedisabled || cachereplace || !(cachedirty || cacheused || compact)) {
+		return;
 	}
 
-	fh = fopen(CACHESTORAGEFILE, "rb");
+	fh = fopen(CACHESTORAGEFILE, "r+b");
 	if (!fh) {
-		cachedisabled = 1;
+		if (cachedirty) {
+			buildprintf("PolymostTexCache: error opening %s, new textures not saved\n", CACHESTORAGEFILE);
+		}
+		cachedirty = cacheused = 0;
+		return;
+	}
+	fseek(fh, 0, SEEK_END);
+	filelen = ftell(fh);
+	// worked out in 64 bits, then held to the 2GB the file can reach
+	budget = (long) min((int64_t) gltexcachesize << 20, (int64_t) INT_MAX);
+
+	if (!cachedirty && !compact && (budget <= 0 || filelen <= budget)) {
+		// nothing but which tiles were used has changed
+		if (ptcache_writeuse(fh)) {
+			buildprintf("PolymostTexCache: error writing to %s\n", CACHESTORAGEFILE);
+		}
+		fclose(fh);
+		cacheused = 0;
+		return;
+	}
+
+	ents = (PTCacheEntry *) malloc((cachedirnum + cacheaddednum + 1) * sizeof(PTCacheEntry));
+	if (!ents) {
+		fclose(fh);
+		return;
+	}
+	for (i = 0; i < cachedirnum; i++) {
+		if ((cachedirstate[i] & ~DIRSTATE_USED) != DIRSTATE_STALE) {
+			ptcache_getrecord(i, &ents[num]);
+			if (cachedirstate[i] & DIRSTATE_USED) {
+				ents[num].lastuse = cachegeneration;
+			}
+			num++;
+		}
+	}
+	for (i = 0; i < cacheaddednum; i++) {
+		ents[num++] = cacheadded[i];
+	}
+	qsort(ents, num, sizeof(PTCacheEntry), ptcache_cmpentries);
+
+	for (i = 0; i < num; i++) {
+		live += ents[i].length;
+	}
+	if (budget > 0) {
+		num = ptcache_evict(ents, num, &live, budget);
+	}
+
+	if (compact || (filelen - PTCACHEHEADERSIZ - live) * 4 > filelen ||
+	    (budget > 0 && filelen > budget)) {
+		fclose(fh);
+		fh = 0;
+		if (ptcache_compact(ents, num) == 0) {
+			buildprintf("PolymostTexCache: compacted texture cache from %ld to %ld bytes\n",
+				filelen, (long) PTCACHEHEADERSIZ + live);
+		} else {
+			buildprintf("PolymostTexCache: error compacting %s\n", CACHESTORAGEFILE);
+			fh = fopen(CACHESTORAGEFILE, "r+b");
+		}
+	}
+
+	if (fh) {
+		if (ptcache_writedir(fh, ents, num)) {
+			buildprintf("PolymostTexCache: error writing to cache, new textures not saved\n");
+		}
+		fclose(fh);
+	}
+
+	free(ents);
+	cachedirty = cacheused = 0;
+}
+
+/**
+ * Maps the cache file into memory, directory and all
+ */
+void PTCacheLoadIndex(void)
+{
+	FILE * fh;
+	unsigned char header[PTCACHEHEADERSIZ];
+	int dirofs, dirnum, dirlength, fd;
+	long filelen;
+
+	ptcache_discard();
+	cachegeneration = 1;
+
+	// we open for reading and writing to test permission
+	fh = fopen(CACHESTORAGEFILE, "r+b");
+	if (!fh) {
+		if (errno == ENOENT) {
+			// file doesn't exist, which is fine
+			return;
+		}
 		buildprintf("PolymostTexCache: error opening %s, texture cache disabled\n", CACHESTORAGEFILE);
-		return 0;
+		cachedisabled = 1;
+		return;
+	}
+
+	if (fread(header, sizeof(header), 1, fh) != 1 ||
+	    memcmp(header, "PolymostTexCach", 15) || header[15] != CACHEVER) {
+		fclose(fh);
+		buildprintf("PolymostTexCache: texture cache will be replaced\n");
+		cachereplace = 1;
+		return;
 	}
+	fseek(fh, 0, SEEK_END);
+	filelen = ftell(fh);
+	fclose(fh);
 
-	fseek(fh, offset, SEEK_SET);
+	dirofs    = getle32(&header[16]);
+	dirnum    = getle32(&header[20]);
+	dirlength = getle32(&header[24]);
+	cachegeneration = getle32(&header[28]) + 1;
 
-	if (fread(&tsizx, 4, 1, fh) != 1 ||
-	    fread(&tsizy, 4, 1, fh) != 1 ||
-	    fread(&flags, 4, 1, fh) != 1 ||
-	    fread(&format, 4, 1, fh) != 1 ||
-	    fread(&nmipmaps, 4, 1, fh) != 1) {
-		// truncated entry, so throw the whole cache away
-		goto fail;
+	if (dirofs == 0) {
+		// nothing has been unloaded since the file was begun
+		return;
+	}
+	if (dirofs < PTCACHEHEADERSIZ || dirofs > filelen ||
+	    dirlength < 0 || dirlength > filelen - dirofs ||
+	    dirnum < 0 || dirnum > dirlength / PTCACHERECORDSIZ) {
+		goto corrupt;
+	}
+
+	fd = Bopen(CACHESTORAGEFILE, BO_BINARY|BO_RDONLY, BS_IREAD);
+	if (fd >= 0) {
+		cachemaplen = dirofs + dirlength;
+		cachemap = (unsigned char *) Bmapfile(fd, cachemaplen, 0);
+		if (cachemap) {
+			cachemapped = 1;
+		} else {
+			// no mapping to be had, so make do with a copy
+			cachemap = (unsigned char *) malloc(cachemaplen);
+			if (cachemap && Bread(fd, cachemap, cachemaplen) != cachemaplen) {
+				free(cachemap);
+				cachemap = 0;
+			}
+		}
+		Bclose(fd);
+	}
+	if (!cachemap) {
+		buildprintf("PolymostTexCache: error reading %s, texture cache disabled\n", CACHESTORAGEFILE);
+		cachemaplen = 0;
+		cachedisabled = 1;
+		return;
+	}
+
+	cachedir = cachemap + dirofs;
+	cachedirofs = dirofs;
+	cachedirnum = dirnum;
+	cachenames = (const char *) cachedir + dirnum * PTCACHERECORDSIZ;
+	cachenameslen = dirlength - dirnum * PTCACHERECORDSIZ;
+	if (cachenameslen > 0 && cachenames[cachenameslen - 1] != 0) {
+		goto corrupt;
 	}
 
-	tsizx = B_LITTLE32(tsizx);
-	tsizy = B_LITTLE32(tsizy);
-	flags = B_LITTLE32(flags);
-	format = B_LITTLE32(format);
-	nmipmaps = B_LITTLE32(nmipmaps);
+	cachedirstate = (unsigned char *) calloc(dirnum + 1, 1);
+	if (!cachedirstate) {
+		ptcache_unmap();
+		cachedisabled = 1;
+		return;
+	}
+
+	buildprintf("PolymostTexCache: cache loaded (%d entries)\n", dirnum);
+	return;
+
+corrupt:
+	buildprintf("PolymostTexCache: corrupt texture cache detected, cache will be replaced\n");
+	ptcache_unmap();
+	cachereplace = 1;
+}
+
+/**
+ * Writes out the directory of any tiles added, then releases the cache
+ */
+void PTCacheUnloadIndex(void)
+{
+	ptcache_flush(0);
+	ptcache_discard();
+
+	buildprintf("PolymostTexCache: cache unloaded\n");
+}
+
+/**
+ * Builds a PTCacheTile over a tile's bytes, with the mipmap data pointing
+ * into them
+ * @param p the tile
+ * @param length the length of the tile
+ * @return the PTCacheTile, or 0 if the tile is malformed
+ */
+static PTCacheTile * ptcache_parsetile(const unsigned char * p, int length)
+{
+	const unsigned char * end = p + length;
+	PTCacheTile * tdef;
+	int nmipmaps, i;
+
+	if (length < 20) {
+		return 0;
+	}
+	nmipmaps = getle32(&p[16]);
+	if (nmipmaps < 1 || nmipmaps > (length - 20) / 12) {
+		return 0;
+	}
 
 	tdef = PTCacheAllocNewTile(nmipmaps);
-	tdef->tsizx = tsizx;
-	tdef->tsizy = tsizy;
-	tdef->flags = flags;
-	tdef->format = format;
+	tdef->tsizx  = getle32(&p[0]);
+	tdef->tsizy  = getle32(&p[4]);
+	tdef->flags  = getle32(&p[8]);
+	tdef->format = getle32(&p[12]);
+	p += 20;
 
 	for (i = 0; i < nmipmaps; i++) {
-		if (fread(&sizx, 4, 1, fh) != 1 ||
-		    fread(&sizy, 4, 1, fh) != 1 ||
-		    fread(&length, 4, 1, fh) != 1) {
-			// truncated entry, so throw the whole cache away
+		if (end - p < 12) {
 			goto fail;
 		}
+		tdef->mipmap[i].sizx   = getle32(&p[0]);
+		tdef->mipmap[i].sizy   = getle32(&p[4]);
+		tdef->mipmap[i].length = getle32(&p[8]);
+		p += 12;
 
-		sizx = B_LITTLE32(sizx);
-		sizy = B_LITTLE32(sizy);
-		length = B_LITTLE32(length);
-
-		tdef->mipmap[i].sizx = sizx;
-		tdef->mipmap[i].sizy = sizy;
-		tdef->mipmap[i].length = length;
-		tdef->mipmap[i].data = (unsigned char *) malloc(length);
-
-		if (fread(tdef->mipmap[i].data, length, 1, fh) != 1) {
-			// truncated data
+		if (tdef->mipmap[i].length < 0 || tdef->mipmap[i].length > end - p) {
 			goto fail;
 		}
+		tdef->mipmap[i].data = (unsigned char *) p;
+		p += tdef->mipmap[i].length;
 	}
 
-	fclose(fh);
-
 	return tdef;
 fail:
-	cachereplace = 1;
-	buildprintf("PolymostTexCache: corrupt texture cache detected, cache will be replaced\n");
-	PTCacheUnloadIndex();
+	// the mipmap data isn't ours, so PTCacheFreeTile won't do
+	free(tdef);
+	return 0;
+}
+
+/**
+ * Reads a tile written since loading from the cache file
+ * @param ent the tile's entry
+ * @return a PTCacheTile entry fully completed, or 0
+ */
+static PTCacheTile * ptcache_readtile(const PTCacheEntry * ent)
+{
+	PTCacheTile * tdef = 0;
+	unsigned char * buf;
+	const unsigned char * data;
+	FILE * fh;
+	int i;
+
+	fh = fopen(CACHESTORAGEFILE, "rb");
+	if (!fh) {
+		cachedisabled = 1;
+		buildprintf("PolymostTexCache: error opening %s, texture cache disabled\n", CACHESTORAGEFILE);
+		return 0;
+	}
+
+	buf = (unsigned char *) malloc(ent->length);
+	if (buf && fseek(fh, ent->offset, SEEK_SET) == 0 && fread(buf, ent->length, 1, fh) == 1) {
+		tdef = ptcache_parsetile(buf, ent->length);
+	}
 	fclose(fh);
-	if (tdef) {
-		PTCacheFreeTile(tdef);
+
+	// give the tile copies of its own, since buf goes away
+	for (i = 0; tdef && i < tdef->nummipmaps; i++) {
+		data = tdef->mipmap[i].data;
+		tdef->mipmap[i].data = (unsigned char *) malloc(tdef->mipmap[i].length + 1);
+		if (!tdef->mipmap[i].data) {
+			for (; i < tdef->nummipmaps; i++) {
+				tdef->mipmap[i].data = 0;
+			}
+			PTCacheFreeTile(tdef);
+			tdef = 0;
+			break;
+		}
+		memcpy(tdef->mipmap[i].data, data, tdef->mipmap[i].length);
 	}
-	return 0;
+
+	if (buf) {
+		free(buf);
+	}
+	return tdef;
 }
 
 /**
@@ -357,23 +929,44 @@ fail:
  */
 PTCacheTile * PTCacheLoadTile(const char * filename, int effects, int flags)
 {
-	PTCacheIndex * pci;
-	PTCacheTile * tdef;
+	PTCacheEntry ent;
+	PTCacheTile * tdef = 0;
+	int ismapped;
 
-	if (cachedisabled) {
+	if (cachedisabled || cachereplace) {
 		return 0;
 	}
 
-	pci = ptcache_findhash(filename, effects, flags);
-	if (!pci) {
+	if (!ptcache_find(filename, effects, flags, &ent, &ismapped)) {
 		return 0;
 	}
 
-	tdef = ptcache_load(pci->offset);
-	if (tdef) {
-		tdef->filename = strdup(filename);
-		tdef->effects  = effects;
+	if (ismapped >= 0) {
+		if (ent.offset >= PTCACHEHEADERSIZ && ent.length >= 0 &&
+		    ent.offset <= cachemaplen - ent.length) {
+			tdef = ptcache_parsetile(cachemap + ent.offset, ent.length);
+		}
+		if (tdef) {
+			tdef->mapped = 1;
+			cachedirstate[ismapped] |= DIRSTATE_USED;
+			cacheused = 1;
+		}
+	} else {
+		tdef = ptcache_readtile(&ent);
+	}
+
+	if (!tdef) {
+		if (!cachedisabled) {
+			// throw the whole cache away
+			buildprintf("PolymostTexCache: corrupt texture cache detected, cache will be replaced\n");
+			ptcache_discard();
+			cachereplace = 1;
+		}
+		return 0;
 	}
+
+	tdef->filename = strdup(filename);
+	tdef->effects  = effects;
 	return tdef;
 }
 
@@ -386,11 +979,14 @@ PTCacheTile * PTCacheLoadTile(const char * filename, int effects, int flags)
  */
 int PTCacheHasTile(const char * filename, int effects, int flags)
 {
-	if (cachedisabled) {
+	PTCacheEntry ent;
+	int ismapped;
+
+	if (cachedisabled || cachereplace) {
 		return 0;
 	}
 
-	return (ptcache_findhash(filename, effects, flags) != 0);
+	return ptcache_find(filename, effects, flags, &ent, &ismapped);
 }
 
 /**
@@ -404,7 +1000,7 @@ void PTCacheFreeTile(PTCacheTile * tdef)
 	if (tdef->filename) {
 		free(tdef->filename);
 	}
-	for (i = 0; i < tdef->nummipmaps; i++) {
+	for (i = 0; !tdef->mapped && i < tdef->nummipmaps; i++) {
 		if (tdef->mipmap[i].data) {
 			free(tdef->mipmap[i].data);
 		}
@@ -439,23 +1035,22 @@ PTCacheTile * PTCacheAllocNewTile(int nummipmaps)
 int PTCacheWriteTile(PTCacheTile * tdef)
 {
 	long i;
-	PTCacheIndex * pci;
+	PTCacheEntry ent;
+	int insertat;
 
 	FILE * fh;
-	off_t offset;
-	char createmode[] = "ab";
+	long offset, tilelen;
 
 	if (cachedisabled) {
 		return 0;
 	}
 
 	if (cachereplace) {
-		createmode[0] = 'w';
+		fh = fopen(CACHESTORAGEFILE, "wb");
 		cachereplace = 0;
+	} else {
+		fh = fopen(CACHESTORAGEFILE, "ab");
 	}
-
-	// 1. write the tile data to the storage file
-	fh = fopen(CACHESTORAGEFILE, createmode);
 	if (!fh) {
 		cachedisabled = 1;
 		buildprintf("PolymostTexCache: error opening %s, texture cache disabled\n", CACHESTORAGEFILE);
@@ -471,12 +1066,25 @@ int PTCacheWriteTile(PTCacheTile * tdef)
 
 	if (offset == 0) {
 		// new file
-		const int8_t storagesig[16] = { 'P','o','l','y','m','o','s','t','T','e','x','S','t','o','r',CACHEVER };
-		if (fwrite(storagesig, 16, 1, fh) != 1) {
+		if (ptcache_writeheader(fh, 0, 0, 0, cachegeneration)) {
 			goto fail;
 		}
+		offset = PTCACHEHEADERSIZ;
+		remove(OLDCACHEINDEXFILE);
+	}
 
-		offset = 16;
+	// the directory holds offsets and lengths in 32 bits, so the file
+	// mustn't grow past 2GB
+	for (i = 0, tilelen = 20; i < tdef->nummipmaps; i++) {
+		tilelen += 12 + tdef->mipmap[i].length;
+	}
+	if (offset < 0 || tilelen > INT_MAX - offset) {
+		fclose(fh);
+		if (!cachefullwarned) {
+			buildprintf("PolymostTexCache: %s is full, new textures not saved\n", CACHESTORAGEFILE);
+			cachefullwarned = 1;
+		}
+		return 0;
 	}
 
 	{
@@ -519,56 +1127,55 @@ int PTCacheWriteTile(PTCacheTile * tdef)
 		}
 	}
 
-	fclose(fh);
+	memset(&ent, 0, sizeof(ent));
+	ent.hash    = gethash(tdef->filename);
+	ent.effects = tdef->effects;
+	ent.flags   = tdef->flags & (PTH_CLAMPED);	// we don't want the informational flags in the directory
+	ent.offset  = (int) offset;
+	ent.length  = (int) (ftell(fh) - offset);
+	ent.lastuse = cachegeneration;
 
-	// 2. append to the index
-	fh = fopen(CACHEINDEXFILE, createmode);
-	if (!fh) {
-		cachedisabled = 1;
-		buildprintf("PolymostTexCache: error opening %s, texture cache disabled\n", CACHEINDEXFILE);
-		return 0;
+	if (fclose(fh)) {
+		fh = 0;
+		goto fail;
 	}
 
-	fseek(fh, 0, SEEK_END);
-	if (ftell(fh) == 0) {
-		// new file
-		const int8_t indexsig[16] = { 'P','o','l','y','m','o','s','t','T','e','x','I','n','d','x',CACHEVER };
-		if (fwrite(indexsig, 16, 1, fh) != 1) {
-			goto fail;
-		}
+	if (ptcache_sourcestat(tdef->filename, &ent.srcsize, &ent.srcmtime)) {
+		ent.srcsize = ent.srcmtime = -1;
 	}
 
-	{
-		int8_t filename[BMAX_PATH];
-		int32_t effects, offsett, flags, mtime;
-
-		memset(filename, 0, sizeof(filename));
-		strncpy((char *) filename, tdef->filename, sizeof(filename));
-		effects = B_LITTLE32(tdef->effects);
-		flags   = tdef->flags & (PTH_CLAMPED);	// we don't want the informational flags in the index
-		flags   = B_LITTLE32(flags);
-		offsett = B_LITTLE32(offset);
-		mtime = 0;
-
-		if (fwrite(filename, sizeof(filename), 1, fh) != 1 ||
-		    fwrite(&effects, 4, 1, fh) != 1 ||
-		    fwrite(&flags, 4, 1, fh) != 1 ||
-		    fwrite(&offsett, 4, 1, fh) != 1 ||
-		    fwrite(&mtime, 4, 1, fh) != 1) {
-			goto fail;
-		}
+	// stow the entry in memory until the directory is written
+	i = ptcache_findmapped(tdef->filename, ent.hash, ent.effects, ent.flags);
+	if (i >= 0) {
+		// superseding a mapped tile
+		cachedirstate[i] = DIRSTATE_STALE;
 	}
 
-	fclose(fh);
-
-	// stow the data into the index in memory
-	pci = ptcache_findhash(tdef->filename, tdef->effects, tdef->flags);
-	if (pci) {
-		// superseding an old hash entry
-		pci->offset = offset;
+	i = ptcache_findadded(tdef->filename, ent.hash, ent.effects, ent.flags, &insertat);
+	if (i >= 0) {
+		// superseding a tile written earlier
+		ent.filename = cacheadded[i].filename;
+		cacheadded[i] = ent;
 	} else {
-		ptcache_addhash(tdef->filename, tdef->effects, tdef->flags, offset);
+		if (cacheaddednum == cacheaddedmax) {
+			int newmax = cacheaddedmax ? cacheaddedmax * 2 : 64;
+			PTCacheEntry * newadded = (PTCacheEntry *) realloc(cacheadded, newmax * sizeof(PTCacheEntry));
+			if (!newadded) {
+				return 0;
+			}
+			cacheadded = newadded;
+			cacheaddedmax = newmax;
+		}
+		ent.filename = strdup(tdef->filename);
+		if (!ent.filename) {
+			return 0;
+		}
+		memmove(&cacheadded[insertat + 1], &cacheadded[insertat],
+			(cacheaddednum - insertat) * sizeof(PTCacheEntry));
+		cacheadded[insertat] = ent;
+		cacheaddednum++;
 	}
+	cachedirty = 1;
 
 	return 1;
 fail:
@@ -578,14 +1185,34 @@ fail:
 	return 0;
 }
 
+/**
+ * Compacts the cache file now, rather than when the cache is unloaded
+ * @return 0 on success
+ */
+int PTCacheCompact(void)
+{
+	int generation = cachegeneration;
+
+	if (cachedisabled || cachereplace) {
+		return -1;
+	}
+
+	ptcache_flush(1);
+	PTCacheLoadIndex();
+	cachegeneration = generation;
+
+	return (cachedisabled || cachereplace) ? -1 : 0;
+}
+
 /**
 * Forces the cache to be rebuilt.
  */
 void PTCacheForceRebuild(void)
 {
-	PTCacheUnloadIndex();
+	ptcache_discard();
 	cachedisabled = 0;
 	cachereplace = 1;
+	cachefullwarned = 0;
 }
 
 #endif //USE_OPENGL
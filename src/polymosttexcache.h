@@ -26,17 +26,18 @@ struct PTCacheTile_typ {
 	int format;	// OpenGL format code
 	int tsizx, tsizy;
 	int nummipmaps;
+	int mapped;	// !0 if the mipmap data lies in the cache's mapping, so isn't freed
 	PTCacheTileMip mipmap[1];
 };
 typedef struct PTCacheTile_typ PTCacheTile;
 
 /**
- * Loads the cache index file into memory
+ * Maps the cache file into memory, directory and all
  */
 void PTCacheLoadIndex(void);
 
 /**
- * Unloads the cache index from memory
+ * Writes out the directory of any tiles added, then releases the cache
  */
 void PTCacheUnloadIndex(void);
 
@@ -79,6 +80,12 @@ PTCacheTile * PTCacheAllocNewTile(int nummipmaps);
  */
 int PTCacheWriteTile(PTCacheTile * tdef);
 
+/**
+ * Compacts the cache file now, rather than when the cache is unloaded
+ * @return 0 on success
+ */
+int PTCacheCompact(void);
+
 /**
  * Forces the cache to be rebuilt.
  */
@@ -45,11 +45,9 @@ static void compressetc1(uint8_t *bgra, int width, int height, uint8_t *out)
 	uint8_t block[4][4][4];
 	int x, y, s, t, xyoff, stride;
 
-	static int initonce = 0;
-	if (!initonce) {
-		rg_etc1::pack_etc1_block_init();
-		initonce = 1;
-	}
+	// Initialised by whichever thread gets here first, the others waiting.
+	static const bool initonce = (rg_etc1::pack_etc1_block_init(), true);
+	(void)initonce;
 
 	switch (gltexcomprquality) {
 		case 2: params.m_quality = rg_etc1::cHighQuality; break;
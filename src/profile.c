@@ -0,0 +1,207 @@
+// Frame stage profiler
+// for the Build Engine
+// by Jonathon Fowler (jf@jonof.id.au)
+
+#include "compat.h"
+#include "baselayer.h"
+#include "profile.h"
+
+#if USE_PROFILER
+
+#ifdef _MSC_VER
+# include <intrin.h>
+# define atomicadd(p,v) _InterlockedExchangeAdd((volatile long *)(p), (long)(v))
+# define atomictake(p) ((unsigned int)_InterlockedExchange((volatile long *)(p), 0))
+#else
+# define atomicadd(p,v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+# define atomictake(p) __atomic_exchange_n((p), 0, __ATOMIC_RELAXED)
+#endif
+
+volatile int profileactive = 0;
+
+	// Index 0 is the whole frame, named "total", and stage n is kept
+	// at index n+1.
+static const char *stagenames[PROFILE_MAXSTAGES] = {
+	"total", "scansector", "drawalls", "drawmasks", "drawsprite", "rotatesprite", "showframe",
+};
+static int numstages = 1 + PROFILE_ENGINESTAGES;
+
+	// The frame being timed. Added to from any thread.
+static volatile unsigned int frametime[PROFILE_MAXSTAGES], framecalls[PROFILE_MAXSTAGES];
+
+	// The last PROFILE_FRAMES frames, and a histogram of each stage over them.
+static unsigned int history[PROFILE_FRAMES][PROFILE_MAXSTAGES];
+static unsigned int lastcalls[PROFILE_MAXSTAGES];
+static unsigned short buckets[PROFILE_MAXSTAGES][PROFILE_BUCKETS];
+static int histhead = 0, histcount = 0;
+
+static int framestarted = 0;
+static unsigned int lastframeend;
+
+	// Times under 8us get a bucket each, and after that each doubling
+	// is split four ways.
+static int bucketof(unsigned int usecs)
+{
+	int o, b;
+
+	if (usecs < 8) return (int)usecs;
+	for (o = 3; (usecs >> o) > 1; o++) ;
+	b = 8 + ((o-3)<<2) + ((usecs >> (o-2)) & 3);
+	return min(b, PROFILE_BUCKETS-1);
+}
+
+static unsigned int bucketstart(int b)
+{
+	if (b < 8) return (unsigned int)b;
+	return (unsigned int)(4 + ((b-8)&3)) << (((b-8)>>2) + 1);
+}
+
+static unsigned int percentile(int stage, int pc)
+{
+	int b, want, seen = 0;
+
+	want = max(1, (histcount * pc + 99) / 100);
+	for (b = 0; b < PROFILE_BUCKETS-1; b++) {
+		seen += buckets[stage][b];
+		if (seen >= want) break;
+	}
+	if (b < 8) return bucketstart(b);
+	return (bucketstart(b) + bucketstart(b+1)) >> 1;
+}
+
+int profile_addstage(const char *name)
+{
+	int i;
+
+	if (numstages >= PROFILE_MAXSTAGES) return -1;
+
+		// The history holds nothing for it yet.
+	for (i = 0; i < PROFILE_FRAMES; i++) history[i][numstages] = 0;
+	memset(buckets[numstages], 0, sizeof(buckets[numstages]));
+	buckets[numstages][0] = (unsigned short)histcount;
+	frametime[numstages] = framecalls[numstages] = lastcalls[numstages] = 0;
+
+	stagenames[numstages] = name;
+	return (numstages++) - 1;
+}
+
+void profile_add(int stage, unsigned int usecs)
+{
+	stage++;
+	if (stage < 1 || stage >= numstages) return;
+	atomicadd(&frametime[stage], usecs);
+	atomicadd(&framecalls[stage], 1);
+}
+
+void profile_endframe(void)
+{
+	unsigned int now, *row;
+	int i;
+
+	if (!profileactive) return;
+
+	now = getusecticks();
+	if (!framestarted) {
+			// Whatever was timed before now belongs to no whole frame.
+		for (i = 1; i < numstages; i++) {
+			atomictake(&frametime[i]);
+			atomictake(&framecalls[i]);
+		}
+		framestarted = 1;
+		lastframeend = now;
+		return;
+	}
+
+	row = history[histhead];
+	if (histcount == PROFILE_FRAMES) {
+		for (i = 0; i < numstages; i++) buckets[i][bucketof(row[i])]--;
+	} else {
+		histcount++;
+	}
+
+	row[0] = now - lastframeend;
+	lastcalls[0] = 1;
+	for (i = 1; i < numstages; i++) {
+		row[i] = atomictake(&frametime[i]);
+		lastcalls[i] = atomictake(&framecalls[i]);
+	}
+	for (i = 0; i < numstages; i++) buckets[i][bucketof(row[i])]++;
+
+	histhead = (histhead + 1) % PROFILE_FRAMES;
+	lastframeend = now;
+}
+
+void profile_setactive(int on)
+{
+	profileactive = (on != 0);
+	framestarted = 0;
+}
+
+void profile_reset(void)
+{
+	int i;
+
+	memset(history, 0, sizeof(history));
+	memset(buckets, 0, sizeof(buckets));
+	memset(lastcalls, 0, sizeof(lastcalls));
+	for (i = 1; i < numstages; i++) {
+		atomictake(&frametime[i]);
+		atomictake(&framecalls[i]);
+	}
+	histhead = histcount = 0;
+	framestarted = 0;
+}
+
+int profile_numstages(void)
+{
+	return numstages;
+}
+
+int profile_getstat(int stage, profilestat *st)
+{
+	unsigned int sum = 0, mx = 0, v;
+	int i;
+
+	if (stage < 0 || stage >= numstages || histcount == 0) return -1;
+
+	for (i = 0; i < histcount; i++) {
+		v = history[i][stage];
+		sum += v;
+		if (v > mx) mx = v;
+	}
+
+	st->name = stagenames[stage];
+	st->last = history[(histhead + PROFILE_FRAMES - 1) % PROFILE_FRAMES][stage];
+	st->avg = sum / histcount;
+	st->p50 = percentile(stage, 50);
+	st->p95 = percentile(stage, 95);
+	st->max = mx;
+	st->calls = lastcalls[stage];
+	return 0;
+}
+
+int profile_dumpcsv(const char *filename)
+{
+	BFILE *fp;
+	int i, j, row;
+
+	fp = Bfopen(filename, "w");
+	if (!fp) return -1;
+
+	Bfprintf(fp, "frame");
+	for (j = 0; j < numstages; j++) Bfprintf(fp, ",%s_us", stagenames[j]);
+	Bfprintf(fp, "\n");
+
+	row = (histhead + PROFILE_FRAMES - histcount) % PROFILE_FRAMES;
+	for (i = 0; i < histcount; i++) {
+		Bfprintf(fp, "%d", i);
+		for (j = 0; j < numstages; j++) Bfprintf(fp, ",%u", history[row][j]);
+		Bfprintf(fp, "\n");
+		row = (row + 1) % PROFILE_FRAMES;
+	}
+
+	Bfclose(fp);
+	return histcount;
+}
+
+#endif	// USE_PROFILER
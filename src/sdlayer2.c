@@ -75,8 +75,9 @@ static SDL_Texture *sdl_texture;	// For non-GL 8-bit mode output.
 static SDL_Surface *sdl_surface;	// For non-GL 8-bit mode output.
 #endif
 static unsigned char *frame;
-int xres=-1, yres=-1, bpp=0, fullscreen=0, bytesperline, imageSize;
-intptr_t frameplace=0;
+int xres=-1, yres=-1, bpp=0, fullscreen=0, imageSize;
+RENDERTLS int bytesperline;
+RENDERTLS intptr_t frameplace=0;
 char modechange=1;
 char offscreenrendering=0;
 char videomodereset = 0;
@@ -702,7 +703,9 @@ unsigned int getticks(void)
 //
 unsigned int getusecticks(void)
 {
-	return (unsigned int)SDL_GetTicks() * 1000;
+	Uint64 c = SDL_GetPerformanceCounter(), f = SDL_GetPerformanceFrequency();
+
+	return (unsigned int)((c / f) * 1000000 + (c % f) * 1000000 / f);
 }
 
 
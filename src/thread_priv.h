@@ -0,0 +1,60 @@
+// Threads, mutexes and condition variables
+// for the Build Engine
+// by Jonathon Fowler (jf@jonof.id.au)
+
+#ifndef THREAD_PRIV_H
+#define THREAD_PRIV_H
+
+#ifdef _WIN32
+# ifndef WIN32_LEAN_AND_MEAN
+#  define WIN32_LEAN_AND_MEAN
+# endif
+# ifndef _WIN32_WINNT
+#  define _WIN32_WINNT 0x0600
+# endif
+# include <windows.h>
+
+typedef HANDLE thread_type;
+typedef SRWLOCK mutex_type;
+typedef CONDITION_VARIABLE cond_type;
+# define MUTEX_INITIALIZER SRWLOCK_INIT
+# define COND_INITIALIZER CONDITION_VARIABLE_INIT
+# define mutex_init(m) InitializeSRWLock(m)
+# define mutex_destroy(m)
+# define mutex_lock(m) AcquireSRWLockExclusive(m)
+# define mutex_unlock(m) ReleaseSRWLockExclusive(m)
+# define cond_init(c) InitializeConditionVariable(c)
+# define cond_destroy(c)
+# define cond_wait(c,m) SleepConditionVariableSRW(c,m,INFINITE,0)
+# define cond_signal(c) WakeConditionVariable(c)
+# define cond_broadcast(c) WakeAllConditionVariable(c)
+
+	// THREAD_FUNC(name, param) declares a thread's entry point. It returns 0.
+# define THREAD_FUNC(name,param) DWORD WINAPI name(LPVOID param)
+	// Both return 0 on success.
+# define thread_create(t,func) ((*(t) = CreateThread(NULL, 0, func, NULL, 0, NULL)) == NULL)
+# define thread_join(t) (WaitForSingleObject(t, INFINITE), !CloseHandle(t))
+#else
+# include <pthread.h>
+
+typedef pthread_t thread_type;
+typedef pthread_mutex_t mutex_type;
+typedef pthread_cond_t cond_type;
+# define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+# define COND_INITIALIZER PTHREAD_COND_INITIALIZER
+# define mutex_init(m) pthread_mutex_init(m,NULL)
+# define mutex_destroy(m) pthread_mutex_destroy(m)
+# define mutex_lock(m) pthread_mutex_lock(m)
+# define mutex_unlock(m) pthread_mutex_unlock(m)
+# define cond_init(c) pthread_cond_init(c,NULL)
+# define cond_destroy(c) pthread_cond_destroy(c)
+# define cond_wait(c,m) pthread_cond_wait(c,m)
+# define cond_signal(c) pthread_cond_signal(c)
+# define cond_broadcast(c) pthread_cond_broadcast(c)
+
+# define THREAD_FUNC(name,param) void *name(void *param)
+# define thread_create(t,func) pthread_create(t, NULL, func, NULL)
+# define thread_join(t) pthread_join(t, NULL)
+#endif
+
+#endif // THREAD_PRIV_H
@@ -0,0 +1,166 @@
+// Worker thread pool
+// for the Build Engine
+// by Jonathon Fowler (jf@jonof.id.au)
+
+#include "thread_priv.h"
+#include "compat.h"
+#include "threadpool.h"
+#include "build.h"
+
+#define MAXPOOLTHREADS 64
+
+static thread_type threads[MAXPOOLTHREADS];
+static int numthreads = 0;
+
+static mutex_type lock;
+static mutex_type callerlock = MUTEX_INITIALIZER;	// held by whoever is starting, stopping or running the pool
+static cond_type workcond, donecond;
+
+	// The job being run. Guarded by 'lock'.
+static threadpool_func jobfunc;
+static void *jobarg;
+static int jobcount, jobnext, jobdone;
+static unsigned int jobgeneration;
+static int quitting;
+
+static void runjobs(void)
+{
+	threadpool_func func;
+	void *arg;
+	int index;
+
+	// Entered and left holding 'lock'.
+	while (jobnext < jobcount) {
+		func = jobfunc;
+		arg = jobarg;
+		index = jobnext++;
+
+		mutex_unlock(&lock);
+		func(arg, index);
+		mutex_lock(&lock);
+
+		if (++jobdone == jobcount) {
+			cond_broadcast(&donecond);
+		}
+	}
+}
+
+static THREAD_FUNC(workerthread, UNUSED(param))
+{
+	unsigned int seengeneration = 0;
+
+	mutex_lock(&lock);
+	while (1) {
+		while (!quitting && seengeneration == jobgeneration) {
+			cond_wait(&workcond, &lock);
+		}
+		if (quitting) break;
+
+		seengeneration = jobgeneration;
+		runjobs();
+	}
+	mutex_unlock(&lock);
+
+	return 0;
+}
+
+static void stoppool(void)
+{
+	int i;
+
+	if (numthreads == 0) return;
+
+	mutex_lock(&lock);
+	quitting = 1;
+	cond_broadcast(&workcond);
+	mutex_unlock(&lock);
+
+	for (i = 0; i < numthreads; i++) {
+		thread_join(threads[i]);
+	}
+	numthreads = 0;
+
+	cond_destroy(&donecond);
+	cond_destroy(&workcond);
+	mutex_destroy(&lock);
+}
+
+int threadpool_init(int num)
+{
+	int i;
+
+	if (num <= 0) num = Bgetsyscpucount();
+	num = max(1, min(MAXPOOLTHREADS, num));
+
+	mutex_lock(&callerlock);
+	if (numthreads == num) {
+		mutex_unlock(&callerlock);
+		return num;
+	}
+	stoppool();
+
+	mutex_init(&lock);
+	cond_init(&workcond);
+	cond_init(&donecond);
+	quitting = 0;
+	jobcount = jobnext = jobdone = 0;
+
+	for (i = 0; i < num; i++) {
+		if (thread_create(&threads[i], workerthread)) break;
+		numthreads++;
+	}
+
+	if (numthreads < num) {
+		buildprintf("threadpool_init(): could only start %d of %d threads\n", numthreads, num);
+	}
+	if (numthreads == 0) {
+		cond_destroy(&donecond);
+		cond_destroy(&workcond);
+		mutex_destroy(&lock);
+	}
+	i = numthreads;
+	mutex_unlock(&callerlock);
+
+	return i;
+}
+
+void threadpool_uninit(void)
+{
+	mutex_lock(&callerlock);
+	stoppool();
+	mutex_unlock(&callerlock);
+}
+
+int threadpool_size(void)
+{
+	return numthreads;
+}
+
+int threadpool_run(threadpool_func func, void *arg, int count)
+{
+	if (count <= 0) return 0;
+
+	mutex_lock(&callerlock);
+	if (numthreads == 0) {
+		mutex_unlock(&callerlock);
+		return -1;
+	}
+
+	mutex_lock(&lock);
+	jobfunc = func;
+	jobarg = arg;
+	jobcount = count;
+	jobnext = 0;
+	jobdone = 0;
+	jobgeneration++;
+	cond_broadcast(&workcond);
+
+	while (jobdone < jobcount) {
+		cond_wait(&donecond, &lock);
+	}
+	jobcount = jobnext = jobdone = 0;
+	mutex_unlock(&lock);
+	mutex_unlock(&callerlock);
+
+	return 0;
+}
@@ -0,0 +1,186 @@
+// Background tile loading
+// for the Build Engine
+// by Jonathon Fowler (jf@jonof.id.au)
+//
+// One thread reads tiles from the ART files while the game runs. The
+// engine queues tiles as it finds them missing, then collects the
+// finished ones and copies them into the cache itself, since the cache
+// belongs to the engine's thread.
+
+#include "thread_priv.h"
+#include "compat.h"
+#include "build.h"
+#include "cache1d.h"
+#include "tilestream.h"
+
+#define MAXSTREAMREQS 256	// must be a power of two
+
+typedef struct {
+	int tilenume, offset, leng;
+	char filename[BMAX_PATH];
+	void *data;
+} streamreq;
+
+	// The queue is a ring: entries from 'tail' to 'readdone' are finished,
+	// and those from 'readdone' to 'head' are waiting for the thread,
+	// which works on the one at 'readdone'. Guarded by 'lock'.
+static streamreq queue[MAXSTREAMREQS];
+static unsigned int head, readdone, tail;
+static int quitting;
+
+static mutex_type lock;
+static cond_type workcond, donecond;
+static thread_type thread;
+static int running = 0;
+
+	// The file being read from. Only the thread touches these.
+static int fil = -1;
+static char filname[BMAX_PATH];
+
+static void readtile(streamreq *req)
+{
+	req->data = NULL;
+
+	if ((fil < 0) || Bstrcmp(filname, req->filename)) {
+		if (fil >= 0) kclose(fil);
+		Bstrcpy(filname, req->filename);
+		fil = kopen4load(filname, 0);
+		if (fil < 0) return;
+	}
+
+	if (klseek(fil, req->offset, BSEEK_SET) != req->offset) return;
+	req->data = Bmalloc(req->leng);
+	if (!req->data) return;
+	if (kread(fil, req->data, req->leng) != req->leng) {
+		Bfree(req->data);
+		req->data = NULL;
+	}
+}
+
+static THREAD_FUNC(streamthread, UNUSED(param))
+{
+	streamreq req;
+
+	mutex_lock(&lock);
+	while (1) {
+		while (!quitting && readdone == head) {
+			cond_wait(&workcond, &lock);
+		}
+		if (quitting) break;
+
+		req = queue[readdone & (MAXSTREAMREQS-1)];
+		mutex_unlock(&lock);
+		readtile(&req);
+		mutex_lock(&lock);
+
+		queue[readdone & (MAXSTREAMREQS-1)].data = req.data;
+		readdone++;
+		cond_broadcast(&donecond);
+	}
+	mutex_unlock(&lock);
+
+	return 0;
+}
+
+int tilestream_start(void)
+{
+	if (running) return 0;
+
+	mutex_init(&lock);
+	cond_init(&workcond);
+	cond_init(&donecond);
+	head = readdone = tail = 0;
+	quitting = 0;
+
+	if (thread_create(&thread, streamthread)) {
+		buildprintf("tilestream_start(): could not start the loading thread\n");
+		cond_destroy(&donecond);
+		cond_destroy(&workcond);
+		mutex_destroy(&lock);
+		return -1;
+	}
+	running = 1;
+	return 0;
+}
+
+void tilestream_stop(void)
+{
+	if (!running) return;
+
+	mutex_lock(&lock);
+	quitting = 1;
+	cond_broadcast(&workcond);
+	mutex_unlock(&lock);
+	thread_join(thread);
+	running = 0;
+
+	for (; tail != readdone; tail++) {
+		Bfree(queue[tail & (MAXSTREAMREQS-1)].data);
+	}
+	head = readdone = tail = 0;
+
+	if (fil >= 0) kclose(fil);
+	fil = -1;
+
+	cond_destroy(&donecond);
+	cond_destroy(&workcond);
+	mutex_destroy(&lock);
+}
+
+int tilestream_request(int tilenume, const char *filename, int offset, int leng)
+{
+	streamreq *req;
+
+	if (!running) return -1;
+
+	mutex_lock(&lock);
+	if (head - tail >= MAXSTREAMREQS) {
+		mutex_unlock(&lock);
+		return -1;
+	}
+
+	req = &queue[head & (MAXSTREAMREQS-1)];
+	req->tilenume = tilenume;
+	req->offset = offset;
+	req->leng = leng;
+	Bstrncpy(req->filename, filename, BMAX_PATH-1);
+	req->filename[BMAX_PATH-1] = 0;
+	req->data = NULL;
+	head++;
+	cond_signal(&workcond);
+	mutex_unlock(&lock);
+
+	return 0;
+}
+
+int tilestream_collect(void **data, int *leng)
+{
+	streamreq *req;
+	int tilenume = -1;
+
+	if (!running) return -1;
+
+	mutex_lock(&lock);
+	if (tail != readdone) {
+		req = &queue[tail & (MAXSTREAMREQS-1)];
+		tilenume = req->tilenume;
+		*data = req->data;
+		*leng = req->leng;
+		req->data = NULL;
+		tail++;
+	}
+	mutex_unlock(&lock);
+
+	return tilenume;
+}
+
+void tilestream_wait(void)
+{
+	if (!running) return;
+
+	mutex_lock(&lock);
+	while (readdone != head) {
+		cond_wait(&donecond, &lock);
+	}
+	mutex_unlock(&lock);
+}
@@ -0,0 +1,51 @@
+// Background tile loading
+// for the Build Engine
+// by Jonathon Fowler (jf@jonof.id.au)
+
+#ifndef TILESTREAM_H
+#define TILESTREAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Starts the loading thread if it isn't running.
+ * @return 0 on success, -1 if the thread could not be started
+ */
+int tilestream_start(void);
+
+/**
+ * Stops the loading thread, throwing away everything queued or finished.
+ */
+void tilestream_stop(void);
+
+/**
+ * Queues a tile to be read. Tiles are finished in the order queued.
+ * @param tilenume passed back by tilestream_collect()
+ * @param filename the ART file holding the tile
+ * @param offset where the tile's pixels start in the file
+ * @param leng the number of bytes to read
+ * @return 0 if queued, -1 if the queue is full or the thread isn't running
+ */
+int tilestream_request(int tilenume, const char *filename, int offset, int leng);
+
+/**
+ * Takes the next finished tile.
+ * @param data receives the pixels, to be freed with Bfree(), or NULL if
+ *   the tile could not be read
+ * @param leng receives the size of the data
+ * @return the tile number, or -1 if nothing is finished
+ */
+int tilestream_collect(void **data, int *leng);
+
+/**
+ * Waits until every queued tile has been read.
+ */
+void tilestream_wait(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TILESTREAM_H
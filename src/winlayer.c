@@ -108,8 +108,9 @@ static void shutdownvideo(void);
 
 // video
 static int desktopxdim=0,desktopydim=0,desktopbpp=0, desktopmodeset=0;
-int xres=-1, yres=-1, fullscreen=0, bpp=0, bytesperline=0, imageSize=0;
-intptr_t frameplace=0;
+int xres=-1, yres=-1, fullscreen=0, bpp=0, imageSize=0;
+RENDERTLS int bytesperline=0;
+RENDERTLS intptr_t frameplace=0;
 static int windowposx, windowposy;
 static unsigned modeschecked=0;
 unsigned maxrefreshfreq=60;
@@ -1,90 +1,257 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <dirent.h>
-#include <sys/stat.h>
+// Lists the contents of a Polymost texture cache (texture.cache)
+// for the Build Engine
+//
+// The file format is described in src/polymosttexcache.c.
+
 #include "compat.h"
 
 #define GL_COMPRESSED_RGB_S3TC_DXT1_EXT   0x83F0
 #define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT  0x83F1
 #define GL_COMPRESSED_RGBA_S3TC_DXT3_EXT  0x83F2
 #define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT  0x83F3
+#define GL_ETC1_RGB8_OES                  0x8D64
+
+#define CACHEVER 3
+#define HEADERSIZ 32
+#define RECORDSIZ 36
+
+	// As in src/polymosttex_priv.h, which needs GL to include
+#define PTH_CLAMPED 1
+#define PTH_HASALPHA 8
+
+static int getle32(const unsigned char *p)
+{
+	return (int)((unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+		((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24));
+}
+
+static const char *formatname(int format)
+{
+	switch (format) {
+		case GL_COMPRESSED_RGB_S3TC_DXT1_EXT: return "RGB DXT1";
+		case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT: return "RGBA DXT1";
+		case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT: return "RGBA DXT3";
+		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT: return "RGBA DXT5";
+		case GL_ETC1_RGB8_OES: return "RGB ETC1";
+		default: return "Unknown";
+	}
+}
 
 typedef struct {
-	char magic[8];	// 'Polymost'
-	long xdim, ydim;	// of image, unpadded
-	long flags;		// 1 = !2^x, 2 = has alpha, 4 = lzw compressed
-} texcacheheader;
-typedef struct {
-	long size;
-	long format;
-	long xdim, ydim;	// of mipmap (possibly padded)
-	long border, depth;
-} texcachepicture;
+	int offset, length;
+} extent;
 
-int main(int argc, char **argv)
+static int cmpextents(const void *a, const void *b)
+{
+	const extent *ea = (const extent *)a, *eb = (const extent *)b;
+	return (ea->offset > eb->offset) - (ea->offset < eb->offset);
+}
+
+	// Compares an entry's source file against the one in the current
+	// directory, if it's there. Those in groups or ZIPs can't be checked.
+static const char *sourcestate(const char *filename, int srcsize, int srcmtime)
 {
-	DIR *dir;
-	struct dirent *dirent;
 	struct stat st;
-	FILE *fp;
-	texcacheheader head;
-	texcachepicture mip;
-	
-	dir = opendir(".");
-	while ((dirent = readdir(dir))) {
-		if (stat(dirent->d_name, &st)) {
-			printf("%s: failed to stat\n", dirent->d_name);
-			continue;
-		}
-		if (!(st.st_mode&S_IFREG)) {
-			printf("%s: not a regular file\n", dirent->d_name);
-			continue;
-		}
-		
-		fp = fopen(dirent->d_name,"rb");
-		if (!fp) {
-			printf("%s: failed to open\n", dirent->d_name);
+
+	if (Bstat(filename, &st) < 0 || !(st.st_mode & BS_IFREG)) return "?";
+	if ((int)st.st_size != srcsize || (int)st.st_mtime != srcmtime) return "stale";
+	return "current";
+}
+
+static void usage(void)
+{
+	printf("cacheinfo [list|stats] [texture.cache]\n");
+	printf("   list   shows every texture held in a Polymost texture cache (the default)\n");
+	printf("   stats  shows how much of the file could be reclaimed by compacting it\n");
+}
+
+	// Prints one line per texture.
+static void listentries(FILE *fp, const unsigned char *dir, int dirnum, int dirofs,
+	const char *names, int nameslen, int generation)
+{
+	unsigned char tilehead[20];
+	const unsigned char *rec;
+	const char *filename;
+	char flagstr[3];
+	int offset, length, name, flags, i;
+
+	for (i = 0; i < dirnum; i++) {
+		rec = &dir[i * RECORDSIZ];
+		offset = getle32(&rec[12]);
+		length = getle32(&rec[16]);
+		name = getle32(&rec[20]);
+		filename = (name >= 0 && name < nameslen) ? names + name : "";
+
+		if (offset < HEADERSIZ || length < 20 || offset > dirofs - length ||
+		    fseek(fp, offset, SEEK_SET) || fread(tilehead, sizeof(tilehead), 1, fp) != 1) {
+			printf("%s: bad tile\n", filename);
 			continue;
 		}
-		
-		if (fread(&head, sizeof(head), 1, fp) != 1) {
-			fclose(fp);
-			printf("%s: failed to read header\n", dirent->d_name);
-			continue;
+
+		flags = getle32(&tilehead[8]);
+		flagstr[0] = (flags & PTH_CLAMPED) ? 'C' : '-';
+		flagstr[1] = (flags & PTH_HASALPHA) ? 'A' : '-';
+		flagstr[2] = 0;
+
+		printf("%s: effects=%d flags=%s size=%dx%d format=%s mipmaps=%d bytes=%d lastuse=%d source=%s\n",
+			filename, getle32(&rec[4]), flagstr, getle32(&tilehead[0]), getle32(&tilehead[4]),
+			formatname(getle32(&tilehead[12])), getle32(&tilehead[16]), length,
+			generation - getle32(&rec[32]),
+			sourcestate(filename, getle32(&rec[24]), getle32(&rec[28])));
+	}
+}
+
+	// Works out where the dead weight in the file lies.
+static void showstats(const unsigned char *dir, int dirnum, int dirofs, int dirlength,
+	const char *names, int nameslen, int generation, long filelen)
+{
+	const unsigned char *rec;
+	const char *filename;
+	extent *tiles;
+	long live = 0, holebytes = 0, largesthole = 0, stalebytes = 0, tail;
+	long agebytes[4] = { 0, 0, 0, 0 };
+	int holes = 0, stale = 0, age, name, i, end;
+	int agecount[4] = { 0, 0, 0, 0 };
+	static const char *agenames[4] = { "this session or last", "2 to 4 sessions ago", "5 to 15 sessions ago", "16 or more sessions ago" };
+
+	tiles = (extent *)malloc((dirnum + 1) * sizeof(extent));
+	if (!tiles) {
+		printf("out of memory\n");
+		return;
+	}
+
+	for (i = 0; i < dirnum; i++) {
+		rec = &dir[i * RECORDSIZ];
+		tiles[i].offset = getle32(&rec[12]);
+		tiles[i].length = getle32(&rec[16]);
+		live += tiles[i].length;
+
+		name = getle32(&rec[20]);
+		filename = (name >= 0 && name < nameslen) ? names + name : "";
+		if (!strcmp(sourcestate(filename, getle32(&rec[24]), getle32(&rec[28])), "stale")) {
+			stale++;
+			stalebytes += tiles[i].length;
 		}
-		head.xdim = B_LITTLE32(head.xdim);
-		head.ydim = B_LITTLE32(head.ydim);
-		head.flags = B_LITTLE32(head.flags);
-		if (fread(&mip, sizeof(mip), 1, fp) != 1) {
-			fclose(fp);
-			printf("%s: failed to read mipmap header\n", dirent->d_name);
-			continue;
+
+		age = generation - getle32(&rec[32]);
+		age = (age <= 1) ? 0 : (age <= 4) ? 1 : (age <= 15) ? 2 : 3;
+		agecount[age]++;
+		agebytes[age] += tiles[i].length;
+	}
+
+		// Anything between the header and the directory not covered by a
+		// live tile is a superseded tile or an old directory.
+	qsort(tiles, dirnum, sizeof(extent), cmpextents);
+	end = HEADERSIZ;
+	for (i = 0; i <= dirnum; i++) {
+		int start = (i < dirnum) ? tiles[i].offset : dirofs;
+		if (start > end) {
+			holes++;
+			holebytes += start - end;
+			if (start - end > largesthole) largesthole = start - end;
 		}
-		mip.format = B_LITTLE32(mip.format);
+		if (i < dirnum && tiles[i].offset + tiles[i].length > end) end = tiles[i].offset + tiles[i].length;
+	}
+	free(tiles);
+
+		// Anything after the directory was appended by a session that
+		// never got to write its own.
+	tail = filelen - dirofs - dirlength;
+
+	printf("File size:           %ld bytes\n", filelen);
+	printf("Live textures:       %d, %ld bytes\n", dirnum, live);
+	printf("Directory:           %d bytes\n", dirlength);
+	printf("Holes:               %d, %ld bytes, the largest %ld bytes\n", holes, holebytes, largesthole);
+	printf("Unlisted at the end: %ld bytes\n", tail);
+	printf("Reclaimable:         %ld bytes (%.1f%% of the file)\n", holebytes + tail,
+		filelen ? 100.0 * (holebytes + tail) / filelen : 0.0);
+	printf("Stale sources:       %d textures, %ld bytes more once they are remade\n", stale, stalebytes);
+	printf("Last used:\n");
+	for (i = 0; i < 4; i++) {
+		printf("   %-24s %d textures, %ld bytes\n", agenames[i], agecount[i], agebytes[i]);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *cachefile = "texture.cache";
+	unsigned char header[HEADERSIZ], *dir;
+	const char *names;
+	int dirofs, dirnum, dirlength, nameslen, generation;
+	int stats = 0, argi = 1;
+	long filelen;
+	FILE *fp;
+
+	if (argi < argc && !strcmp(argv[argi], "stats")) { stats = 1; argi++; }
+	else if (argi < argc && !strcmp(argv[argi], "list")) argi++;
+	if (argi < argc) cachefile = argv[argi++];
+	if (argi < argc) {
+		usage();
+		return 0;
+	}
+
+	fp = fopen(cachefile, "rb");
+	if (!fp) {
+		printf("%s: failed to open\n", cachefile);
+		return 1;
+	}
+	fseek(fp, 0, SEEK_END);
+	filelen = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if (fread(header, sizeof(header), 1, fp) != 1 || memcmp(header, "PolymostTexCach", 15)) {
 		fclose(fp);
-		if (memcmp(head.magic, "Polymost", 8)) {
-			printf("%s: bad signature\n", dirent->d_name);
-			continue;
-		}
-		else {
-			char *format;
-			char flags[4] = "", flagsc = 0;
-			switch (mip.format) {
-				case GL_COMPRESSED_RGB_S3TC_DXT1_EXT: format = "RGB DXT1"; break;
-				case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT: format = "RGBA DXT1"; break;
-				case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT: format = "RGBA DXT3"; break;
-				case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT: format = "RGBA DXT5"; break;
-				default: format = "Unknown"; break;
-			}
-			if (head.flags&1) flags[flagsc++] = '2';
-			if (head.flags&2) flags[flagsc++] = 'A';
-			if (head.flags&4) flags[flagsc++] = 'L';
-			flags[flagsc++] = 0;
-			
-			printf("%s: flags=%s format=%s\n", dirent->d_name, flags, format);
-		}
+		printf("%s: bad signature\n", cachefile);
+		return 1;
+	}
+	if (header[15] != CACHEVER) {
+		fclose(fp);
+		printf("%s: version %d, but version %d was expected\n", cachefile, header[15], CACHEVER);
+		return 1;
 	}
-	closedir(dir);
-	
+
+	dirofs = getle32(&header[16]);
+	dirnum = getle32(&header[20]);
+	dirlength = getle32(&header[24]);
+	generation = getle32(&header[28]);
+	if (dirofs == 0) {
+		fclose(fp);
+		printf("%s: no directory has been written yet\n", cachefile);
+		return 0;
+	}
+	if (dirofs < HEADERSIZ || dirofs > filelen || dirlength < 0 || dirlength > filelen - dirofs ||
+	    dirnum < 0 || dirnum > dirlength / RECORDSIZ) {
+		fclose(fp);
+		printf("%s: bad directory\n", cachefile);
+		return 1;
+	}
+
+	dir = (unsigned char *)malloc(dirlength + 1);
+	if (!dir) {
+		fclose(fp);
+		printf("%s: out of memory\n", cachefile);
+		return 1;
+	}
+	fseek(fp, dirofs, SEEK_SET);
+	if (fread(dir, dirlength, 1, fp) != 1 && dirlength > 0) {
+		free(dir);
+		fclose(fp);
+		printf("%s: failed to read directory\n", cachefile);
+		return 1;
+	}
+	dir[dirlength] = 0;
+	names = (const char *)dir + dirnum * RECORDSIZ;
+	nameslen = dirlength - dirnum * RECORDSIZ;
+
+	if (stats) {
+		showstats(dir, dirnum, dirofs, dirlength, names, nameslen, generation, filelen);
+	} else {
+		listentries(fp, dir, dirnum, dirofs, names, nameslen, generation);
+		printf("%d textures in %ld bytes\n", dirnum, filelen);
+	}
+
+	free(dir);
+	fclose(fp);
+
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,388 @@
+// Builds the potentially visible set file (.pvs) for a Build map
+// for the Build Engine
+//
+// For every sector, a row of one bit per sector, set for each sector that
+// could be seen from somewhere inside it. A sector can see another if a
+// straight line from the one to the other passes only through red walls.
+// Heights are ignored and every red wall counts as open, masked or not,
+// so a set may hold sectors that can't really be seen but never misses
+// one that can. The engine loads the file when it sits next to the map it
+// was made from, and ignores it if the map has since changed.
+//
+// File format, all little endian:
+//   char sig[8]          "BuildPVS"
+//   int version          PVSVER
+//   int numsectors, numwalls
+//   unsigned int mapcrc  CRC-32 of the whole .map file
+//   numsectors rows of (numsectors+7)/8 bytes
+
+#include "compat.h"
+#include "crc32.h"
+
+#include <math.h>
+
+#define PVSVER 1
+#define MAXSTEPS (1<<20)	// portals to try from one sector before settling for mightsee
+#define EPSILON 0.5			// how near a line, in map units, counts as on it
+
+typedef struct {
+	double x1, y1, x2, y2;
+} seg;
+
+static int numsectors, numwalls;
+static short *wallptr, *wallnum;
+static int *wallx, *wally;
+static short *point2, *nextwall, *nextsector;
+
+	// Rows of sector bits are kept in ints while working, for speed
+#define SETBIT(row,n) ((row)[(n)>>5] |= 1u<<((n)&31))
+#define TESTBIT(row,n) ((row)[(n)>>5] & (1u<<((n)&31)))
+
+static int rowwords;
+static unsigned int *vis, *mightsee, *mightstack;	// mightsee has a row for each red wall,
+static unsigned char *onstack;						// mightstack one for each level of flow()
+static int steps;
+
+static int getle32(const unsigned char *p)
+{
+	return (int)((unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+		((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24));
+}
+
+static short getle16(const unsigned char *p)
+{
+	return (short)((unsigned short)p[0] | ((unsigned short)p[1] << 8));
+}
+
+static void putle32(unsigned char *p, int v)
+{
+	p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16); p[3] = (unsigned char)(v >> 24);
+}
+
+static void usage(void)
+{
+	printf("pvsbuild <file.map> [file.pvs]\n");
+	printf("   Works out which sectors of a map can see which, for the engine to\n");
+	printf("   use in cansee() and drawrooms(). The output goes next to the map\n");
+	printf("   with a .pvs extension unless it is named.\n");
+}
+
+static void wallseg(int w, seg *s)
+{
+	s->x1 = wallx[w]; s->y1 = wally[w];
+	s->x2 = wallx[point2[w]]; s->y2 = wally[point2[w]];
+}
+
+	// Positive on a sector's own side of its walls, scaled to map units.
+static double side(double x, double y, double ax, double ay, double bx, double by)
+{
+	double dx = bx - ax, dy = by - ay, len = sqrt(dx*dx + dy*dy);
+	if (len == 0.0) return 0.0;
+	return (dx*(y - ay) - dy*(x - ax)) / len;
+}
+
+	// Trims s to the part where sgn*side() is at least -EPSILON.
+	// Returns 0 if nothing is left.
+static int clipseg(seg *s, double ax, double ay, double bx, double by, double sgn)
+{
+	double d1, d2, t;
+
+	d1 = sgn*side(s->x1, s->y1, ax, ay, bx, by) + EPSILON;
+	d2 = sgn*side(s->x2, s->y2, ax, ay, bx, by) + EPSILON;
+	if (d1 < 0.0 && d2 < 0.0) return 0;
+	if (d1 >= 0.0 && d2 >= 0.0) return 1;
+
+	t = d1 / (d1 - d2);
+	if (d1 < 0.0) {
+		s->x1 += (s->x2 - s->x1) * t;
+		s->y1 += (s->y2 - s->y1) * t;
+	} else {
+		s->x2 = s->x1 + (s->x2 - s->x1) * t;
+		s->y2 = s->y1 + (s->y2 - s->y1) * t;
+	}
+	return 1;
+}
+
+	// Trims q to what a line through both src and pass could reach. Such a
+	// line keeps to the far side of each line joining an end of src to an
+	// end of pass with src and pass on opposite sides of it.
+static int clipseparators(seg *q, const seg *src, const seg *pass)
+{
+	double sx[2], sy[2], px[2], py[2], ds, dp, sgn;
+	int i, j;
+
+	sx[0] = src->x1; sy[0] = src->y1; sx[1] = src->x2; sy[1] = src->y2;
+	px[0] = pass->x1; py[0] = pass->y1; px[1] = pass->x2; py[1] = pass->y2;
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+			if (fabs(sx[i] - px[j]) + fabs(sy[i] - py[j]) < EPSILON) continue;
+
+			ds = side(sx[i^1], sy[i^1], sx[i], sy[i], px[j], py[j]);
+			dp = side(px[j^1], py[j^1], sx[i], sy[i], px[j], py[j]);
+			if (fabs(ds) < EPSILON && fabs(dp) < EPSILON) continue;
+			if (ds > EPSILON && dp > EPSILON) continue;
+			if (ds < -EPSILON && dp < -EPSILON) continue;
+
+			if (dp > EPSILON) sgn = 1.0;
+			else if (dp < -EPSILON) sgn = -1.0;
+			else sgn = (ds > 0.0) ? -1.0 : 1.0;
+
+			if (!clipseg(q, sx[i], sy[i], px[j], py[j], sgn)) return 0;
+		}
+	}
+	return 1;
+}
+
+	// A rough first pass for each red wall: the sectors reached through red
+	// walls each partly beyond it and passable by some line through it and
+	// the wall before. Every wall is followed at most once, so it is quick
+	// but lets through more than flow() does.
+static void basevis(int srcwall, short *queue, unsigned char *seen)
+{
+	unsigned int *might = &mightsee[srcwall * rowwords];
+	seg src, pass, q;
+	int head = 0, tail = 0, p, w, n, endwall;
+
+	wallseg(srcwall, &src);
+	Bmemset(seen, 0, numwalls);
+	seen[srcwall] = 1;
+	queue[tail++] = srcwall;
+	while (head < tail) {
+		p = queue[head++];
+		n = nextsector[p];
+		SETBIT(might, n);
+		wallseg(p, &pass);
+
+		endwall = wallptr[n] + wallnum[n];
+		for (w = wallptr[n]; w < endwall; w++) {
+			if (nextsector[w] < 0 || seen[w]) continue;
+			if (nextwall[w] >= 0 && seen[nextwall[w]]) continue;
+
+			wallseg(w, &q);
+			if (!clipseg(&q, src.x1, src.y1, src.x2, src.y2, -1.0)) continue;
+			if (!clipseg(&q, pass.x1, pass.y1, pass.x2, pass.y2, -1.0)) continue;
+			if (p != srcwall && !clipseparators(&q, &src, &pass)) continue;
+
+			seen[w] = 1;
+			queue[tail++] = w;
+		}
+	}
+}
+
+	// Sector sectnum has been entered through pass, part of wall passwall,
+	// by lines that left the source sector through src. Only sectors in
+	// the mightsee row of every wall passed so far can still turn up.
+static void flow(const seg *src, const seg *pass, int passwall, int sectnum, int depth)
+{
+	const unsigned int *might = &mightstack[depth * rowwords];
+	unsigned int *nextmight = &mightstack[(depth+1) * rowwords];
+	const unsigned int *wallmight;
+	unsigned int more;
+	seg q;
+	int w, endwall, i;
+
+	SETBIT(vis, sectnum);
+	if (++steps > MAXSTEPS) return;
+
+	onstack[passwall] = 1;
+	endwall = wallptr[sectnum] + wallnum[sectnum];
+	for (w = wallptr[sectnum]; w < endwall; w++) {
+		if (nextsector[w] < 0) continue;
+		if (onstack[w] || (nextwall[w] >= 0 && onstack[nextwall[w]])) continue;
+
+			// Don't bother if nothing beyond would be new
+		wallmight = &mightsee[w * rowwords];
+		for (i = 0, more = 0; i < rowwords; i++) more |= might[i] & wallmight[i] & ~vis[i];
+		if (!more) continue;
+
+		wallseg(w, &q);
+		if (!clipseg(&q, src->x1, src->y1, src->x2, src->y2, -1.0)) continue;
+		if (!clipseg(&q, pass->x1, pass->y1, pass->x2, pass->y2, -1.0)) continue;
+		if (!clipseparators(&q, src, pass)) continue;
+
+		for (i = 0; i < rowwords; i++) nextmight[i] = might[i] & wallmight[i];
+
+		flow(src, &q, w, nextsector[w], depth+1);
+		if (steps > MAXSTEPS) break;
+	}
+	onstack[passwall] = 0;
+}
+
+static int loadmap(const unsigned char *map, int maplen)
+{
+	const unsigned char *p;
+	int i, version;
+
+	if (maplen < 22) return -1;
+	version = getle32(&map[0]);
+	if (version != 7 && version != 8) {
+		printf("map version %d, but version 7 or 8 was expected\n", version);
+		return -1;
+	}
+
+	numsectors = getle16(&map[20]);
+	if (numsectors <= 0 || maplen < 22 + numsectors*40 + 2) return -1;
+	wallptr = (short *)malloc(numsectors * sizeof(short));
+	wallnum = (short *)malloc(numsectors * sizeof(short));
+	if (!wallptr || !wallnum) return -1;
+	for (i = 0, p = &map[22]; i < numsectors; i++, p += 40) {
+		wallptr[i] = getle16(&p[0]);
+		wallnum[i] = getle16(&p[2]);
+	}
+
+	numwalls = getle16(p); p += 2;
+	if (numwalls <= 0 || p + numwalls*32 > map + maplen) return -1;
+	wallx = (int *)malloc(numwalls * sizeof(int));
+	wally = (int *)malloc(numwalls * sizeof(int));
+	point2 = (short *)malloc(numwalls * sizeof(short));
+	nextwall = (short *)malloc(numwalls * sizeof(short));
+	nextsector = (short *)malloc(numwalls * sizeof(short));
+	if (!wallx || !wally || !point2 || !nextwall || !nextsector) return -1;
+	for (i = 0; i < numwalls; i++, p += 32) {
+		wallx[i] = getle32(&p[0]);
+		wally[i] = getle32(&p[4]);
+		point2[i] = getle16(&p[8]);
+		nextwall[i] = getle16(&p[10]);
+		nextsector[i] = getle16(&p[12]);
+		if (point2[i] < 0 || point2[i] >= numwalls) return -1;
+		if (nextsector[i] >= numsectors || nextwall[i] >= numwalls) return -1;
+	}
+	for (i = 0; i < numsectors; i++) {
+		if (wallptr[i] < 0 || wallnum[i] < 0 || wallptr[i] + wallnum[i] > numwalls) return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char pvsfile[BMAX_PATH+4], *dot;
+	unsigned char *map, *row, *seen, header[24];
+	unsigned int *pvs;
+	short *queue;
+	long maplen;
+	int s, w, t, i, endwall, gaveup = 0, total = 0;
+	seg src;
+	FILE *fp;
+
+	if (argc < 2 || argc > 3) {
+		usage();
+		return 0;
+	}
+
+	if (argc == 3) {
+		Bstrncpy(pvsfile, argv[2], BMAX_PATH);
+		pvsfile[BMAX_PATH] = 0;
+	} else {
+		Bstrncpy(pvsfile, argv[1], BMAX_PATH);
+		pvsfile[BMAX_PATH] = 0;
+		dot = Bstrrchr(pvsfile, '.');
+		if (!dot || Bstrchr(dot, '/') || Bstrchr(dot, '\\')) dot = pvsfile + strlen(pvsfile);
+		strcpy(dot, ".pvs");
+	}
+
+	fp = fopen(argv[1], "rb");
+	if (!fp) {
+		printf("%s: failed to open\n", argv[1]);
+		return 1;
+	}
+	fseek(fp, 0, SEEK_END);
+	maplen = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	map = (unsigned char *)malloc(maplen + 1);
+	if (!map || fread(map, maplen, 1, fp) != 1) {
+		fclose(fp);
+		printf("%s: failed to read\n", argv[1]);
+		return 1;
+	}
+	fclose(fp);
+
+	if (loadmap(map, (int)maplen)) {
+		printf("%s: bad map\n", argv[1]);
+		return 1;
+	}
+
+	rowwords = (numsectors+31)>>5;
+	pvs = (unsigned int *)calloc(numsectors, rowwords * sizeof(int));
+	row = (unsigned char *)malloc(rowwords * sizeof(int));
+	onstack = (unsigned char *)calloc(numwalls, 1);
+	mightsee = (unsigned int *)calloc(numwalls, rowwords * sizeof(int));
+	mightstack = (unsigned int *)malloc((numwalls+2) * rowwords * sizeof(int));
+	seen = (unsigned char *)malloc(numwalls);
+	queue = (short *)malloc(numwalls * sizeof(short));
+	if (!pvs || !row || !onstack || !mightsee || !mightstack || !seen || !queue) {
+		printf("out of memory\n");
+		return 1;
+	}
+
+	for (w = 0; w < numwalls; w++) {
+		if (nextsector[w] >= 0) basevis(w, queue, seen);
+	}
+
+	for (s = 0; s < numsectors; s++) {
+		vis = &pvs[s * rowwords];
+		SETBIT(vis, s);
+		steps = 0;
+
+		endwall = wallptr[s] + wallnum[s];
+		for (w = wallptr[s]; w < endwall && steps <= MAXSTEPS; w++) {
+			if (nextsector[w] < 0) continue;
+			wallseg(w, &src);
+			Bmemcpy(mightstack, &mightsee[w * rowwords], rowwords * sizeof(int));
+			flow(&src, &src, w, nextsector[w], 0);
+		}
+		if (steps > MAXSTEPS) {
+			for (w = wallptr[s]; w < endwall; w++) {
+				if (nextsector[w] < 0) continue;
+				for (i = 0; i < rowwords; i++) vis[i] |= mightsee[w * rowwords + i];
+			}
+			gaveup++;
+		}
+	}
+
+		// Seeing is mutual, which covers the odd line the flow misses by
+		// starting from the other end.
+	for (s = 0; s < numsectors; s++) {
+		for (t = s+1; t < numsectors; t++) {
+			if (TESTBIT(&pvs[s * rowwords], t)) SETBIT(&pvs[t * rowwords], s);
+			else if (TESTBIT(&pvs[t * rowwords], s)) SETBIT(&pvs[s * rowwords], t);
+		}
+	}
+	for (s = 0; s < numsectors; s++) {
+		for (t = 0; t < numsectors; t++) {
+			if (TESTBIT(&pvs[s * rowwords], t)) total++;
+		}
+	}
+
+	initcrc32table();
+	Bmemcpy(header, "BuildPVS", 8);
+	putle32(&header[8], PVSVER);
+	putle32(&header[12], numsectors);
+	putle32(&header[16], numwalls);
+	putle32(&header[20], (int)crc32once(map, (unsigned int)maplen));
+
+	fp = fopen(pvsfile, "wb");
+	if (!fp) {
+		printf("%s: failed to create\n", pvsfile);
+		return 1;
+	}
+	i = (fwrite(header, sizeof(header), 1, fp) == 1);
+	for (s = 0; s < numsectors && i; s++) {
+		for (t = 0; t < rowwords; t++) putle32(&row[t*4], (int)pvs[s * rowwords + t]);
+		i = (fwrite(row, (numsectors+7)>>3, 1, fp) == 1);
+	}
+	if (!i) {
+		fclose(fp);
+		printf("%s: failed to write\n", pvsfile);
+		return 1;
+	}
+	fclose(fp);
+
+	printf("%s: %d sectors, each seeing %.1f on average", pvsfile, numsectors, (double)total / numsectors);
+	if (gaveup) printf(", %d too complex to work out exactly", gaveup);
+	printf("\n");
+
+	return 0;
+}